@@ -11,19 +11,24 @@
 #include "carmcmc.hpp"
 #include "carpack.hpp"
 #include "kfilter.hpp"
+#include "steps.hpp"
+#include "samplers.hpp"
 #include <armadillo>
+#include <chrono>
+#include <thread>
 #include <boost/math/distributions/normal.hpp>
 #include <boost/math/special_functions/binomial.hpp>
 #include <boost/math/distributions/chi_squared.hpp>
 
 // Global random number generator object, instantiated in random.cpp
-extern boost::random::mt19937 rng;
+extern thread_local boost::random::mt19937 rng;
 
 // Files containing simulated CAR(1) and CAR(5) time series, used for testing
 std::string car1file("data/car1_test.dat");
 std::string car5file("data/car5_test.dat");
 std::string zcarfile("data/zcar5_test.dat");
 std::string carmafile("data/carma_test.dat");
+std::string zcarmafile("data/zcarma5_test.dat");
 
 // Compute the autocorrelation function of a series
 arma::vec autocorr(arma::vec& y, int maxlag) {
@@ -44,6 +49,59 @@ arma::vec autocorr(arma::vec& y, int maxlag) {
     return acorr / ssqr;
 }
 
+// Estimate the effective number of independent samples in a Markov chain, summing the autocorrelations until they
+// first become negative
+double effective_sample_size(arma::vec chain) {
+    chain -= arma::mean(chain);
+    int maxlag = std::min(1000, (int)chain.n_elem / 2);
+    arma::vec acorr = autocorr(chain, maxlag);
+    double tau = 1.0;
+    for (int lag=0; lag<maxlag; lag++) {
+        if (acorr(lag) < 0.0) {
+            break;
+        }
+        tau += 2.0 * acorr(lag);
+    }
+    return chain.n_elem / tau;
+}
+
+// AR roots and moving average coefficients of the ZCARMA(5) process used to simulate carmafile
+arma::cx_vec zcarma5_roots() {
+    double qpo_width[3] = {0.01, 0.01, 0.002};
+    double qpo_cent[2] = {0.2, 0.02};
+    int p = 5;
+	arma::cx_vec ar_roots(p);
+    for (int i=0; i<p/2; i++) {
+        double real_part = -2.0 * arma::datum::pi * qpo_width[i];
+        double imag_part = 2.0 * arma::datum::pi * qpo_cent[i];
+        ar_roots(2*i) = std::complex<double> (real_part, imag_part);
+        ar_roots(2*i+1) = std::complex<double> (real_part, -imag_part);
+    }
+    ar_roots(p-1) = std::complex<double> (-2.0 * arma::datum::pi * qpo_width[p/2], 0.0);
+    return ar_roots;
+}
+
+arma::vec zcarma5_ma_coefs() {
+    int p = 5;
+    double kappa = 0.5;
+    arma::vec ma_coefs(p);
+	ma_coefs(0) = 1.0;
+	for (int i=1; i<p; i++) {
+		ma_coefs(i) = boost::math::binomial_coefficient<double>(p-1, i) / pow(kappa,i);
+	}
+    return ma_coefs;
+}
+
+// Read the time values, measured values, and measurement errors of a simulated light curve
+void load_light_curve(std::string datafile, std::vector<double>& time, std::vector<double>& y,
+                      std::vector<double>& yerr) {
+    arma::mat data;
+    data.load(datafile, arma::raw_ascii);
+    time = arma::conv_to<std::vector<double> >::from(data.col(0));
+    y = arma::conv_to<std::vector<double> >::from(data.col(1));
+    yerr = arma::conv_to<std::vector<double> >::from(data.col(2));
+}
+
 /*******************************************************************
                         TESTS FOR CAR1 CLASS
  *******************************************************************/
@@ -52,6 +110,53 @@ TEST_CASE("startup/rng_seed", "Set the seed for the random number generator for
     rng.seed(123456);
 }
 
+TEST_CASE("startup/random_streams", "Make sure the random number streams are reproducible and can be checkpointed.") {
+    RandomStreams streams(2468);
+    // a stream does not depend on which other streams exist
+    RandomStreams other_streams(2468);
+    other_streams.Stream(5);
+    arma::vec draws(100), other_draws(100);
+    for (int i=0; i<100; i++) {
+        draws(i) = streams.Stream(3).normal();
+        other_draws(i) = other_streams.Stream(3).normal();
+    }
+    REQUIRE(arma::all(draws == other_draws));
+    // different streams are different
+    REQUIRE(streams.Stream(4).uniform() != other_streams.Stream(5).uniform());
+    
+    // recovering the saved state reproduces the later draws of every stream
+    streams.SaveSeed("test_seeds.txt");
+    double draw3 = streams.Stream(3).uniform();
+    double draw4 = streams.Stream(4).uniform();
+    RandomStreams recovered_streams(0);
+    recovered_streams.RecoverSeed("test_seeds.txt");
+    REQUIRE(recovered_streams.size() == 2);
+    REQUIRE(recovered_streams.Stream(3).uniform() == draw3);
+    REQUIRE(recovered_streams.Stream(4).uniform() == draw4);
+    std::remove("test_seeds.txt");
+}
+
+TEST_CASE("startup/thread_rng", "Make sure threads started at the same time get different random number streams.") {
+    int nthreads = 4;
+    std::vector<std::vector<double> > draws(nthreads, std::vector<double>(10));
+    std::vector<std::thread> threads;
+    for (int k=0; k<nthreads; k++) {
+        threads.push_back(std::thread([&draws, k]() {
+            for (int i=0; i<10; i++) {
+                draws[k][i] = RandGen.uniform();
+            }
+        }));
+    }
+    for (int k=0; k<nthreads; k++) {
+        threads[k].join();
+    }
+    for (int k=1; k<nthreads; k++) {
+        for (int j=0; j<k; j++) {
+            REQUIRE(draws[k] != draws[j]);
+        }
+    }
+}
+
 TEST_CASE("KalmanFilter/constructor", "Make sure constructor sorts the time vector and removes duplicates.") {
     std::cout << "Testing KalmanFilter1..." << std::endl;
     int ny = 100;
@@ -186,6 +291,68 @@ TEST_CASE("KalmanFilterp/constructor", "Make sure constructor sorts the time vec
     REQUIRE(frac_diff < 1e-8);
 }
 
+TEST_CASE("TimeSeriesData/shared", "Make sure the time series data are validated once and shared by the parameters and filters") {
+    std::cout << "Testing TimeSeriesData..." << std::endl;
+    int ny = 100;
+    arma::vec time0 = arma::linspace<arma::vec>(0.0, 100.0, ny);
+    arma::vec y0 = arma::randn<arma::vec>(ny);
+    arma::vec ysig = 0.1 * arma::ones<arma::vec>(ny);
+    
+    // swap two elements and duplicate another so the data must be sorted and cleaned
+    arma::vec time = time0;
+    arma::vec y = y0;
+    time(43) = time0(12);
+    y(43) = y0(12);
+    time(12) = time0(43);
+    y(12) = y0(43);
+    time(60) = time0(59);
+    
+    TimeSeriesData data(time, y, ysig);
+    REQUIRE(data.size() == ny - 1);
+    REQUIRE(data.dt().n_elem == ny - 2);
+    REQUIRE(data.dt().min() > 0.0);
+    REQUIRE(data.time()(12) == time0(12));
+    REQUIRE(data.y()(12) == y0(12));
+    REQUIRE(arma::norm(data.yerr_sqr() - 0.01) < 1e-12);
+    
+    // mismatched lengths, non-finite values, and negative errors are rejected
+    arma::vec yshort = y.rows(0, ny-2);
+    REQUIRE_THROWS(TimeSeriesData(time, yshort, ysig));
+    arma::vec ybad = y;
+    ybad(5) = arma::datum::nan;
+    REQUIRE_THROWS(TimeSeriesData(time, ybad, ysig));
+    arma::vec ysig_bad = ysig;
+    ysig_bad(5) = -1.0;
+    REQUIRE_THROWS(TimeSeriesData(time, y, ysig_bad));
+    
+    // all of the parameter objects and their Kalman Filters share a single copy of the data
+    arma::mat carma_data;
+    carma_data.load(carmafile, arma::raw_ascii);
+    std::vector<double> tvec = arma::conv_to<std::vector<double> >::from(carma_data.col(0));
+    std::vector<double> yvec = arma::conv_to<std::vector<double> >::from(carma_data.col(1));
+    std::vector<double> yerrvec = arma::conv_to<std::vector<double> >::from(carma_data.col(2));
+    std::shared_ptr<const TimeSeriesData> shared_data = std::make_shared<const TimeSeriesData>(tvec, yvec, yerrvec);
+    
+    int p = 5;
+    CARp car5_cold(true, "CAR(5) - 1", shared_data, p);
+    CARp car5_hot(true, "CAR(5) - 2", shared_data, p, 10.0);
+    CARp car5_copy(true, "CAR(5) - 3", tvec, yvec, yerrvec, p);
+    REQUIRE(car5_cold.GetData() == shared_data);
+    REQUIRE(car5_hot.GetData() == shared_data);
+    REQUIRE(car5_cold.GetKalmanPtr()->GetData() == shared_data);
+    REQUIRE(car5_hot.GetKalmanPtr()->GetData() == shared_data);
+    
+    // the likelihood does not depend on whether the data are shared, and evaluating it does not change the data
+    arma::vec theta = car5_cold.StartingValue();
+    double logdens_shared = car5_cold.LogDensity(theta);
+    double logdens_copy = car5_copy.LogDensity(theta);
+    REQUIRE(std::abs(logdens_shared - logdens_copy) < 1e-8 * std::abs(logdens_copy));
+    REQUIRE(arma::all(shared_data->y() == carma_data.col(1)));
+    REQUIRE(arma::all(shared_data->yerr() == carma_data.col(2)));
+    arma::vec ycent = car5_cold.GetKalmanPtr()->GetTimeSeries();
+    REQUIRE(std::abs(ycent(0) - (carma_data(0,1) - theta(2))) < 1e-10);
+}
+
 TEST_CASE("KalmanFilter1/Filter", "Test the Kalman Filter for a CAR(1) process") {
     std::cout << "Testing KalmanFilter1.Filter()..." << std::endl;
 
@@ -502,6 +669,409 @@ TEST_CASE("KalmanFilterp/Filter", "Test the Kalman Filter for a CARMA(5,4) proce
     REQUIRE(max_asqr_cdf < 0.99); // test fails if probability of max(ACF) < 1%
 }
 
+TEST_CASE("KalmanFilterP/Filter", "Make sure the fixed-size Kalman Filter agrees with KalmanFilterp") {
+    std::cout << "Testing KalmanFilterP<5>.Filter()..." << std::endl;
+    
+    arma::mat zcarma_data;
+    zcarma_data.load(carmafile, arma::raw_ascii);
+    
+    arma::vec time = zcarma_data.col(0);
+    arma::vec y = zcarma_data.col(1);
+    arma::vec yerr = zcarma_data.col(2);
+    
+    arma::cx_vec ar_roots = zcarma5_roots();
+    arma::vec ma_coefs = zcarma5_ma_coefs();
+    
+    KalmanFilterp Kfilter(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    KalmanFilterP<5> KfilterP(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    Kfilter.Filter();
+    KfilterP.Filter();
+    
+    double max_frac_diff = arma::max(arma::abs(KfilterP.var - Kfilter.var) / Kfilter.var);
+    REQUIRE(max_frac_diff < 1e-10);
+    double max_diff = arma::max(arma::abs(KfilterP.mean - Kfilter.mean) / arma::sqrt(Kfilter.var));
+    REQUIRE(max_diff < 1e-10);
+    
+    // interpolation uses the dynamic filter, so it should give the same answer
+    std::pair<double, double> kpredict = Kfilter.Predict(166.0);
+    std::pair<double, double> kpredictP = KfilterP.Predict(166.0);
+    REQUIRE(std::abs(kpredictP.first - kpredict.first) < 1e-10 * sqrt(kpredict.second));
+    REQUIRE(std::abs(kpredictP.second - kpredict.second) < 1e-10 * kpredict.second);
+    
+    // make sure the CARMA parameter classes dispatch to the fixed-size filter
+    std::vector<double> time_ = arma::conv_to<std::vector<double> >::from(time);
+    std::vector<double> y_ = arma::conv_to<std::vector<double> >::from(y);
+    std::vector<double> yerr_ = arma::conv_to<std::vector<double> >::from(yerr);
+    CARMA carma_process(true, "CARMA(5,4)", time_, y_, yerr_, 5, 4);
+    REQUIRE(std::dynamic_pointer_cast<KalmanFilterP<5> >(carma_process.GetKalmanPtr()));
+    CARp car12_process(true, "CAR(12)", time_, y_, yerr_, 12);
+    REQUIRE(!std::dynamic_pointer_cast<KalmanFilterP<5> >(car12_process.GetKalmanPtr()));
+    REQUIRE(std::dynamic_pointer_cast<KalmanFilterp>(car12_process.GetKalmanPtr()));
+}
+
+TEST_CASE("KalmanFilterpReal/Filter", "Make sure the real-arithmetic Kalman Filter agrees with KalmanFilterp") {
+    std::cout << "Testing KalmanFilterpReal.Filter()..." << std::endl;
+    
+    arma::mat zcarma_data;
+    zcarma_data.load(carmafile, arma::raw_ascii);
+    
+    arma::vec time = zcarma_data.col(0);
+    arma::vec y = zcarma_data.col(1);
+    arma::vec yerr = zcarma_data.col(2);
+    int ny = y.n_elem;
+    
+    arma::cx_vec ar_roots = zcarma5_roots();
+    arma::vec ma_coefs = zcarma5_ma_coefs();
+    
+    KalmanFilterp Kfilter(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    KalmanFilterpReal KfilterReal(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    Kfilter.Filter();
+    KfilterReal.Filter();
+    
+    double loglik = 0.0, loglik_real = 0.0;
+    for (int i=0; i<ny; i++) {
+        loglik += -0.5 * log(Kfilter.var(i)) - 0.5 * pow(y(i) - Kfilter.mean(i), 2) / Kfilter.var(i);
+        loglik_real += -0.5 * log(KfilterReal.var(i)) - 0.5 * pow(y(i) - KfilterReal.mean(i), 2) / KfilterReal.var(i);
+    }
+    REQUIRE(std::abs(loglik_real - loglik) < 1e-10 * std::abs(loglik));
+    
+    // real roots need not come first in the conjugate pair ordering
+    arma::cx_vec shuffled_roots(5);
+    shuffled_roots(0) = ar_roots(4);
+    shuffled_roots(1) = ar_roots(1);
+    shuffled_roots(2) = ar_roots(2);
+    shuffled_roots(3) = ar_roots(0);
+    shuffled_roots(4) = ar_roots(3);
+    KfilterReal.SetOmega(shuffled_roots);
+    KfilterReal.Filter();
+    double loglik_shuffled = 0.0;
+    for (int i=0; i<ny; i++) {
+        loglik_shuffled += -0.5 * log(KfilterReal.var(i)) -
+            0.5 * pow(y(i) - KfilterReal.mean(i), 2) / KfilterReal.var(i);
+    }
+    REQUIRE(std::abs(loglik_shuffled - loglik) < 1e-10 * std::abs(loglik));
+    
+    // make sure the log-posterior does not depend on the choice of Kalman Filter
+    std::vector<double> time_ = arma::conv_to<std::vector<double> >::from(time);
+    std::vector<double> y_ = arma::conv_to<std::vector<double> >::from(y);
+    std::vector<double> yerr_ = arma::conv_to<std::vector<double> >::from(yerr);
+    CARMA carma_process(true, "CARMA(5,4)", time_, y_, yerr_, 5, 4);
+    arma::vec theta = carma_process.StartingValue();
+    double logpost = carma_process.LogDensity(theta);
+    carma_process.SetRealFilter(true);
+    double logpost_real = carma_process.LogDensity(theta);
+    REQUIRE(std::abs(logpost_real - logpost) < 1e-10 * std::abs(logpost));
+}
+
+TEST_CASE("KalmanFilter/LogLikelihood", "Make sure the single-pass log-likelihood agrees with the Kalman mean and variance") {
+    std::cout << "Testing KalmanFilter.LogLikelihood()..." << std::endl;
+
+    arma::mat car1_data;
+    car1_data.load(car1file, arma::raw_ascii);
+    arma::vec time = car1_data.col(0);
+    arma::vec y = car1_data.col(1);
+    arma::vec yerr = car1_data.col(2);
+    int ny = y.n_elem;
+
+    double omega = 1.0 / 100.0;
+    double sigsqr = 2.3 * 2.3 * 2.0 * omega;
+    KalmanFilter1 Kfilter1(time, y, yerr, sigsqr, omega);
+    Kfilter1.Filter();
+    double loglik1_expected = 0.0;
+    for (int i=0; i<ny; i++) {
+        loglik1_expected += -0.5 * log(Kfilter1.var(i)) - 0.5 * pow(y(i) - Kfilter1.mean(i), 2) / Kfilter1.var(i);
+    }
+    // the log-likelihood pass should not write to the Kalman mean and variance arrays
+    Kfilter1.mean.fill(arma::datum::nan);
+    double loglik1 = Kfilter1.LogLikelihood();
+    REQUIRE(std::abs(loglik1 - loglik1_expected) < 1e-10 * std::abs(loglik1_expected));
+    REQUIRE(Kfilter1.mean.has_nan());
+
+    arma::mat zcarma_data;
+    zcarma_data.load(carmafile, arma::raw_ascii);
+    time = zcarma_data.col(0);
+    y = zcarma_data.col(1);
+    yerr = zcarma_data.col(2);
+    ny = y.n_elem;
+
+    arma::cx_vec ar_roots = zcarma5_roots();
+    arma::vec ma_coefs = zcarma5_ma_coefs();
+    KalmanFilterp Kfilter(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    Kfilter.Filter();
+    double loglik_expected = 0.0;
+    for (int i=0; i<ny; i++) {
+        loglik_expected += -0.5 * log(Kfilter.var(i)) - 0.5 * pow(y(i) - Kfilter.mean(i), 2) / Kfilter.var(i);
+    }
+    Kfilter.mean.fill(arma::datum::nan);
+    double loglik = Kfilter.LogLikelihood();
+    REQUIRE(std::abs(loglik - loglik_expected) < 1e-10 * std::abs(loglik_expected));
+    REQUIRE(Kfilter.mean.has_nan());
+
+    // the stored Kalman mean and variance should be for the current parameter value, not the last one proposed
+    std::vector<double> time_ = arma::conv_to<std::vector<double> >::from(time);
+    std::vector<double> y_ = arma::conv_to<std::vector<double> >::from(y);
+    std::vector<double> yerr_ = arma::conv_to<std::vector<double> >::from(yerr);
+    CARMA carma_process(true, "CARMA(5,4)", time_, y_, yerr_, 5, 4);
+    arma::vec theta = carma_process.StartingValue();
+    carma_process.Save(theta);
+    arma::vec kvar = carma_process.GetKalmanVar();
+    arma::vec theta_prop = theta;
+    theta_prop(1) *= 1.1;
+    carma_process.LogDensity(theta_prop);
+    REQUIRE(arma::max(arma::abs(carma_process.GetKalmanVar() - kvar)) < 1e-10 * arma::max(kvar));
+}
+
+// Run the Kalman Filter one point at a time, and count the steady-state updates in each run of data points, where
+// run_start[r] is the index of the first data point of run r
+std::vector<unsigned int> count_steady_state_updates(KalmanFilterp& Kfilter, std::vector<unsigned int> run_start) {
+    std::vector<unsigned int> nsteady(run_start.size(), 0);
+    Kfilter.Reset();
+    unsigned int irun = 0;
+    for (unsigned int i=1; i<Kfilter.mean.n_elem; i++) {
+        while ((irun + 1 < run_start.size()) && (i >= run_start[irun+1])) {
+            irun++;
+        }
+        unsigned int nsteady_before = Kfilter.GetSteadyStateUpdates();
+        Kfilter.Update();
+        nsteady[irun] += Kfilter.GetSteadyStateUpdates() - nsteady_before;
+    }
+    return nsteady;
+}
+
+// Make sure the steady-state updates agree with the full updates, and that most of the data points in each run of
+// equal time steps and measurement errors used them
+void check_steady_state(arma::vec& time, arma::vec& y, arma::vec& yerr, std::vector<unsigned int> run_start,
+                        double tolerance) {
+    arma::cx_vec ar_roots = zcarma5_roots();
+    arma::vec ma_coefs = zcarma5_ma_coefs();
+    
+    KalmanFilterp Kfilter(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    KalmanFilterP<5> KfilterP(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    KalmanFilterpReal KfilterReal(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    
+    KalmanFilterp* filters[3] = {&Kfilter, &KfilterP, &KfilterReal};
+    for (int k=0; k<3; k++) {
+        filters[k]->SetSteadyStateTolerance(0.0);
+        double loglik_full = filters[k]->LogLikelihood();
+        REQUIRE(filters[k]->GetSteadyStateUpdates() == 0);
+        filters[k]->Filter();
+        arma::vec kmean_full = filters[k]->mean;
+        arma::vec kvar_full = filters[k]->var;
+        filters[k]->SetSteadyStateTolerance(tolerance);
+        double loglik = filters[k]->LogLikelihood();
+        REQUIRE(std::abs(loglik - loglik_full) < 1e-8 * std::abs(loglik_full));
+        filters[k]->Filter();
+        REQUIRE(arma::max(arma::abs(filters[k]->var - kvar_full)) < 1e-8 * arma::max(kvar_full));
+        REQUIRE(arma::max(arma::abs(filters[k]->mean - kmean_full)) < 1e-8 * arma::max(arma::abs(kmean_full)));
+        
+        std::vector<unsigned int> nsteady = count_steady_state_updates(*filters[k], run_start);
+        for (int r=0; r<run_start.size(); r++) {
+            unsigned int run_end = (r + 1 < run_start.size()) ? run_start[r+1] : time.n_elem;
+            REQUIRE(nsteady[r] > 0.8 * (run_end - run_start[r]));
+        }
+    }
+}
+
+TEST_CASE("KalmanFilter/steady_state", "Make sure the steady-state Kalman Filter updates agree with the full updates") {
+    std::cout << "Testing the steady-state Kalman Filter updates..." << std::endl;
+    
+    // regularly sampled time series with a gap and a change in the measurement errors
+    int ny = 3000;
+    arma::vec time = arma::linspace<arma::vec>(0.0, ny - 1.0, ny);
+    time.subvec(1000, ny-1) += 25.0;
+    arma::vec yerr(ny);
+    yerr.fill(0.1);
+    yerr.subvec(2000, ny-1).fill(0.2);
+    arma::vec y(ny);
+    for (int i=0; i<ny; i++) {
+        y(i) = RandGen.normal();
+    }
+    std::vector<unsigned int> run_start = {0, 1000, 2000};
+    check_steady_state(time, y, yerr, run_start, 1e-12);
+    
+    // now use time stamps like barycentric Julian dates with a non-integer cadence, so that the time steps differ in
+    // their last few bits. the rounding of the time steps changes the Kalman gain by about 1e-11 from one step to the
+    // next, so use a larger tolerance.
+    double t0 = 2455000.5;
+    double cadence = 1.0204337;
+    for (int i=0; i<ny; i++) {
+        time(i) = t0 + i * cadence;
+    }
+    yerr.fill(0.1);
+    run_start = {0};
+    check_steady_state(time, y, yerr, run_start, 1e-10);
+}
+
+TEST_CASE("KalmanFilter/ParallelLogLikelihood", "Make sure the parallel-in-time Kalman Filter agrees with the serial one") {
+    std::cout << "Testing KalmanFilter.ParallelLogLikelihood()..." << std::endl;
+    
+    arma::mat car1_data;
+    car1_data.load(car1file, arma::raw_ascii);
+    arma::vec time = car1_data.col(0);
+    arma::vec y = car1_data.col(1);
+    arma::vec yerr = car1_data.col(2);
+    
+    double omega = 1.0 / 100.0;
+    double sigsqr = 2.3 * 2.3 * 2.0 * omega;
+    KalmanFilter1 Kfilter1(time, y, yerr, sigsqr, omega);
+    Kfilter1.SetMinParallelChunk(100);
+    double loglik1 = Kfilter1.LogLikelihood();
+    double loglik1_parallel = Kfilter1.ParallelLogLikelihood(4);
+    REQUIRE(std::abs(loglik1_parallel - loglik1) < 1e-10 * std::abs(loglik1));
+    
+    arma::mat zcarma_data;
+    zcarma_data.load(carmafile, arma::raw_ascii);
+    time = zcarma_data.col(0);
+    y = zcarma_data.col(1);
+    yerr = zcarma_data.col(2);
+    
+    arma::cx_vec ar_roots = zcarma5_roots();
+    arma::vec ma_coefs = zcarma5_ma_coefs();
+    KalmanFilterp Kfilter(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    Kfilter.SetMinParallelChunk(100);
+    double loglik = Kfilter.LogLikelihood();
+    for (int nthreads=1; nthreads<=8; nthreads++) {
+        double loglik_parallel = Kfilter.ParallelLogLikelihood(nthreads);
+        REQUIRE(std::abs(loglik_parallel - loglik) < 1e-10 * std::abs(loglik));
+    }
+    REQUIRE(Kfilter.ParallelChunks(20) == 10); // 1000 data points with at least 100 per chunk
+    
+    // the CARMA model should give the same log-posterior with either Kalman Filter
+    std::vector<double> time_ = arma::conv_to<std::vector<double> >::from(time);
+    std::vector<double> y_ = arma::conv_to<std::vector<double> >::from(y);
+    std::vector<double> yerr_ = arma::conv_to<std::vector<double> >::from(yerr);
+    CARMA carma_process(true, "CARMA(5,4)", time_, y_, yerr_, 5, 4);
+    arma::vec theta = carma_process.StartingValue();
+    double logpost = carma_process.LogDensity(theta);
+    carma_process.SetFilterThreads(3);
+    double logpost_parallel = carma_process.LogDensity(theta);
+    REQUIRE(std::abs(logpost_parallel - logpost) < 1e-10 * std::abs(logpost));
+}
+
+TEST_CASE("KalmanFilter/ParallelLogLikelihood_timing", "Compare the parallel-in-time Kalman Filter with KalmanFilterP<5>") {
+    std::cout << "Timing KalmanFilter.ParallelLogLikelihood()..." << std::endl;
+    
+    // long, irregularly sampled time series, so that the serial filter cannot use its steady-state updates
+    int ny = 200000;
+    arma::vec time(ny);
+    time(0) = 0.0;
+    for (int i=1; i<ny; i++) {
+        time(i) = time(i-1) + 0.5 + RandGen.uniform();
+    }
+    arma::vec yerr(ny);
+    yerr.fill(0.1);
+    arma::vec y(ny);
+    for (int i=0; i<ny; i++) {
+        y(i) = RandGen.normal();
+    }
+    
+    arma::cx_vec ar_roots = zcarma5_roots();
+    arma::vec ma_coefs = zcarma5_ma_coefs();
+    KalmanFilterP<5> Kfilter(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double loglik = Kfilter.LogLikelihood();
+    double serial_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    unsigned int nthreads = std::max(std::thread::hardware_concurrency(), 2u);
+    start = std::chrono::steady_clock::now();
+    double loglik_parallel = Kfilter.ParallelLogLikelihood(nthreads);
+    double parallel_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    std::cout << "KalmanFilterP<5>::LogLikelihood(): " << serial_seconds << " seconds, ParallelLogLikelihood("
+        << nthreads << "): " << parallel_seconds << " seconds" << std::endl;
+    REQUIRE(std::abs(loglik_parallel - loglik) < 1e-8 * std::abs(loglik));
+}
+
+TEST_CASE("KalmanFilter/OnlineFilter", "Make sure the online Kalman Filter agrees with the batch Kalman Filter") {
+    std::cout << "Testing OnlineKalmanFilter..." << std::endl;
+    
+    arma::mat zcarma_data;
+    zcarma_data.load(carmafile, arma::raw_ascii);
+    arma::vec time = zcarma_data.col(0);
+    arma::vec y = zcarma_data.col(1);
+    arma::vec yerr = zcarma_data.col(2);
+    
+    arma::cx_vec ar_roots = zcarma5_roots();
+    arma::vec ma_coefs = zcarma5_ma_coefs();
+    KalmanFilterp Kfilter(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    double ymean = 0.3;
+    Kfilter.SetTimeSeriesMean(ymean);
+    Kfilter.SetMeasErrScale(1.2);
+    double loglik = Kfilter.LogLikelihood();
+    Kfilter.Filter();
+    arma::vec kmean = Kfilter.mean;
+    arma::vec kvar = Kfilter.var;
+    
+    // ingest the first half of the time series all at once, then add the rest one data point at a time
+    std::shared_ptr<const TimeSeriesData> data = Kfilter.GetData();
+    unsigned int ndata = data->size();
+    unsigned int nold = ndata / 2;
+    arma::vec time_old = data->time().rows(0, nold-1);
+    arma::vec y_old = data->y().rows(0, nold-1);
+    arma::vec yerr_old = data->yerr().rows(0, nold-1);
+    KalmanFilterp Kfilter_old(time_old, y_old, yerr_old, 1.0, ar_roots, ma_coefs);
+    Kfilter_old.SetTimeSeriesMean(ymean);
+    Kfilter_old.SetMeasErrScale(1.2);
+    OnlineKalmanFilter online_filter = Kfilter_old.MakeOnlineFilter();
+    REQUIRE(online_filter.size() == nold);
+    OnlineFilterState checkpoint = online_filter.Checkpoint();
+    
+    arma::vec online_mean(ndata - nold), online_var(ndata - nold), online_loglik(ndata - nold);
+    for (unsigned int i=nold; i<ndata; i++) {
+        OnlineFilterUpdate update = online_filter.Append(data->time()(i), data->y()(i), data->yerr()(i));
+        online_mean(i - nold) = update.mean;
+        online_var(i - nold) = update.var;
+        online_loglik(i - nold) = update.loglik;
+        CHECK(std::abs(update.mean - ymean - kmean(i)) < 1e-8 * std::sqrt(kvar(i)));
+        CHECK(std::abs(update.var - kvar(i)) < 1e-8 * kvar(i));
+    }
+    REQUIRE(online_filter.size() == ndata);
+    REQUIRE(std::abs(online_filter.GetLogLikelihood() - loglik) < 1e-10 * std::abs(loglik));
+    
+    // data points must be added in time order, and a rejected data point does not change the filter
+    OnlineFilterState final_state = online_filter.Checkpoint();
+    REQUIRE_THROWS_AS(online_filter.Append(data->time()(ndata-1), 0.0, 1.0), std::invalid_argument);
+    REQUIRE(online_filter.size() == ndata);
+    REQUIRE(online_filter.GetLogLikelihood() == final_state.loglik);
+    
+    // restoring the checkpoint and adding the same data gives the same results
+    online_filter.Restore(checkpoint);
+    REQUIRE(online_filter.size() == nold);
+    for (unsigned int i=nold; i<ndata; i++) {
+        OnlineFilterUpdate update = online_filter.Append(data->time()(i), data->y()(i), data->yerr()(i));
+        CHECK(update.mean == online_mean(i - nold));
+        CHECK(update.var == online_var(i - nold));
+        CHECK(update.loglik == online_loglik(i - nold));
+    }
+    REQUIRE(online_filter.GetLogLikelihood() == final_state.loglik);
+    
+    // forecasts agree with the batch Kalman Filter
+    double tforecast = data->time()(ndata-1) + 10.0;
+    std::pair<double, double> online_forecast = online_filter.Predict(tforecast);
+    std::pair<double, double> batch_forecast = Kfilter.Predict(tforecast);
+    CHECK(std::abs(online_forecast.first - ymean - batch_forecast.first) < 1e-8 * std::sqrt(batch_forecast.second));
+    CHECK(std::abs(online_forecast.second - batch_forecast.second) < 1e-8 * batch_forecast.second);
+    
+    // the CAR(1) and CARMA models give the same log-likelihood with the online Kalman Filter
+    std::vector<double> time1, y1, yerr1;
+    load_light_curve(car1file, time1, y1, yerr1);
+    CAR1 car1_process(true, "CAR(1)", time1, y1, yerr1);
+    arma::vec theta1 = car1_process.StartingValue();
+    double logpost1 = car1_process.LogDensity(theta1);
+    double online_logpost1 = car1_process.OnlineFilter(theta1).GetLogLikelihood() + car1_process.LogPrior(theta1);
+    CHECK(std::abs(online_logpost1 - logpost1) < 1e-10 * std::abs(logpost1));
+    
+    std::vector<double> time_ = arma::conv_to<std::vector<double> >::from(time);
+    std::vector<double> y_ = arma::conv_to<std::vector<double> >::from(y);
+    std::vector<double> yerr_ = arma::conv_to<std::vector<double> >::from(yerr);
+    CARMA carma_process(true, "CARMA(5,4)", time_, y_, yerr_, 5, 4);
+    arma::vec theta = carma_process.StartingValue();
+    double logpost = carma_process.LogDensity(theta);
+    double online_logpost = carma_process.OnlineFilter(theta).GetLogLikelihood() + carma_process.LogPrior(theta);
+    CHECK(std::abs(online_logpost - logpost) < 1e-10 * std::abs(logpost));
+}
+
 TEST_CASE("KalmanFilterp/Predict", "Test interpolation/extrapolation for a CARMA(5,4) process") {
     std::cout << "Testing KalmanFilterp.Predict()..." << std::endl;
 
@@ -648,6 +1218,86 @@ TEST_CASE("KalmanFilterp/Predict", "Test interpolation/extrapolation for a CARMA
     REQUIRE(frac_diff < 1e-6);
 }
 
+TEST_CASE("KalmanFilter/PredictBatch", "Make sure PredictBatch agrees with Predict for CAR(1) and CARMA(5,4) processes") {
+    std::cout << "Testing KalmanFilter.PredictBatch()..." << std::endl;
+    
+    // first test the CAR(1) filter
+    arma::mat car1_data;
+    car1_data.load(car1file, arma::raw_ascii);
+    
+    arma::vec time = car1_data.col(0);
+    arma::vec y = car1_data.col(1);
+    arma::vec yerr = car1_data.col(2);
+    int ny = y.n_elem;
+    
+    double tau = 100.0;
+    double sigmay = 2.3;
+    KalmanFilter1 Kfilter1(time, y, yerr, sigmay * sigmay * 2.0 / tau, 1.0 / tau);
+    
+    // unsorted mix of backcasting, interpolation, forecasting, and a time equal to a measured value
+    arma::vec tpredict(5);
+    tpredict(0) = time(ny/2) + 0.3 * (time(ny/2+1) - time(ny/2));
+    tpredict(1) = time(ny-1) + 0.14536 * tau;
+    tpredict(2) = time(0) - 0.0345 * tau;
+    tpredict(3) = time(ny/3);
+    tpredict(4) = time(10) + 0.7 * (time(11) - time(10));
+    
+    std::pair<arma::vec, arma::vec> kpredict = Kfilter1.KalmanFilter<double>::PredictBatch(tpredict);
+    for (int j=0; j<tpredict.n_elem; j++) {
+        std::pair<double, double> kpredict1 = Kfilter1.Predict(tpredict(j));
+        double frac_diff = std::abs(kpredict.first(j) - kpredict1.first) / std::abs(kpredict1.first);
+        REQUIRE(frac_diff < 1e-8);
+        frac_diff = std::abs(kpredict.second(j) - kpredict1.second) / std::abs(kpredict1.second);
+        REQUIRE(frac_diff < 1e-8);
+    }
+    
+    // now test the CARMA(5,4) filter
+    arma::mat zcarma_data;
+    zcarma_data.load(carmafile, arma::raw_ascii);
+    
+    time = zcarma_data.col(0);
+    y = zcarma_data.col(1);
+    yerr = zcarma_data.col(2);
+    ny = y.n_elem;
+    
+    double qpo_width[3] = {0.01, 0.01, 0.002};
+    double qpo_cent[2] = {0.2, 0.02};
+    int p = 5;
+    double kappa = 0.5;
+    
+	arma::cx_vec ar_roots(p);
+    for (int i=0; i<p/2; i++) {
+        double real_part = -2.0 * arma::datum::pi * qpo_width[i];
+        double imag_part = 2.0 * arma::datum::pi * qpo_cent[i];
+        ar_roots(2*i) = std::complex<double> (real_part, imag_part);
+        ar_roots(2*i+1) = std::complex<double> (real_part, -imag_part);
+    }
+    ar_roots(p-1) = std::complex<double> (-2.0 * arma::datum::pi * qpo_width[p/2], 0.0);
+    
+    arma::vec ma_coefs(p);
+	ma_coefs(0) = 1.0;
+	for (int i=1; i<p; i++) {
+		ma_coefs(i) = boost::math::binomial_coefficient<double>(p-1, i) / pow(kappa,i);
+	}
+    
+    KalmanFilterp Kfilter(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    
+    tpredict(0) = 166.0;
+    tpredict(1) = time(ny-1) + 0.05 * (time(ny-1) - time(0));
+    tpredict(2) = time(0) - 0.01 * (time(ny-1) - time(0));
+    tpredict(3) = time(ny/3);
+    tpredict(4) = time(10) + 0.7 * (time(11) - time(10));
+    
+    kpredict = Kfilter.KalmanFilter<arma::cx_vec>::PredictBatch(tpredict);
+    for (int j=0; j<tpredict.n_elem; j++) {
+        std::pair<double, double> kpredict1 = Kfilter.Predict(tpredict(j));
+        double frac_diff = std::abs(kpredict.first(j) - kpredict1.first) / std::abs(kpredict1.first);
+        REQUIRE(frac_diff < 1e-8);
+        frac_diff = std::abs(kpredict.second(j) - kpredict1.second) / std::abs(kpredict1.second);
+        REQUIRE(frac_diff < 1e-8);
+    }
+}
+
 TEST_CASE("KalmanFilter/Simulate", "Test Simulated time series for a CARMA(5,4) process.") {
     std::cout << "Testing KalmanFilterp.Simulate()..." << std::endl;
 
@@ -780,6 +1430,70 @@ TEST_CASE("KalmanFilter/Simulate", "Test Simulated time series for a CARMA(5,4)
     REQUIRE(max_asqr_cdf < 0.99); // test fails if probability of max(ACF) < 1%    
 }
 
+TEST_CASE("KalmanFilter/SimulateMany", "Test many simulated realizations of a CARMA(5,4) process from a single pass.") {
+    std::cout << "Testing KalmanFilterp.Simulate(time, nsim)..." << std::endl;
+    
+    arma::mat zcarma_data;
+    zcarma_data.load(carmafile, arma::raw_ascii);
+    
+    arma::vec time = zcarma_data.col(0);
+    arma::vec y = zcarma_data.col(1);
+    arma::vec yerr = zcarma_data.col(2);
+    int ny = y.n_elem;
+    
+    double qpo_width[3] = {0.01, 0.01, 0.002};
+    double qpo_cent[2] = {0.2, 0.02};
+    int p = 5;
+    double kappa = 0.5;
+    
+	arma::cx_vec ar_roots(p);
+    for (int i=0; i<p/2; i++) {
+        double real_part = -2.0 * arma::datum::pi * qpo_width[i];
+        double imag_part = 2.0 * arma::datum::pi * qpo_cent[i];
+        ar_roots(2*i) = std::complex<double> (real_part, imag_part);
+        ar_roots(2*i+1) = std::complex<double> (real_part, -imag_part);
+    }
+    ar_roots(p-1) = std::complex<double> (-2.0 * arma::datum::pi * qpo_width[p/2], 0.0);
+    
+    arma::vec ma_coefs(p);
+	ma_coefs(0) = 1.0;
+	for (int i=1; i<p; i++) {
+		ma_coefs(i) = boost::math::binomial_coefficient<double>(p-1, i) / pow(kappa,i);
+	}
+    
+    KalmanFilterp Kfilter(time, y, yerr, 1.0, ar_roots, ma_coefs);
+    
+    // simulate at a mix of backcasted, interpolated, and forecasted times
+    arma::vec tsim(4);
+    tsim(0) = time(ny-1) + 0.05 * (time(ny-1) - time(0));
+    tsim(1) = 166.0;
+    tsim(2) = time(0) - 0.01 * (time(ny-1) - time(0));
+    tsim(3) = time(ny/2) + 0.5 * (time(ny/2+1) - time(ny/2));
+    int nreal = 4000;
+    
+    arma::mat ysim = Kfilter.KalmanFilter<arma::cx_vec>::Simulate(tsim, nreal);
+    REQUIRE(ysim.n_rows == tsim.n_elem);
+    REQUIRE(ysim.n_cols == nreal);
+    
+    // the stored data should be untouched
+    arma::vec tdata = Kfilter.GetTime();
+    arma::vec ydata = Kfilter.GetTimeSeries();
+    REQUIRE(tdata.n_elem == ny);
+    REQUIRE(arma::accu(arma::abs(ydata - y)) == 0.0);
+    
+    // sample moments of the realizations should agree with the conditional mean and variance
+    std::pair<arma::vec, arma::vec> kpredict = Kfilter.KalmanFilter<arma::cx_vec>::PredictBatch(tsim);
+    boost::math::chi_squared chisqr(nreal - 1);
+    for (int j=0; j<tsim.n_elem; j++) {
+        arma::rowvec ysim_j = ysim.row(j);
+        double zscore = (arma::mean(ysim_j) - kpredict.first(j)) / sqrt(kpredict.second(j) / nreal);
+        REQUIRE(std::abs(zscore) < 4.0);
+        double chisqr_cdf = boost::math::cdf(chisqr, (nreal - 1) * arma::var(ysim_j) / kpredict.second(j));
+        REQUIRE(chisqr_cdf > 0.0005);
+        REQUIRE(chisqr_cdf < 0.9995);
+    }
+}
+
 TEST_CASE("CAR1/logpost_test", "Make sure the that CAR1.logpost_ == Car1.GetLogPost(theta) after running MCMC sampler") {
     std::cout << "Running CAR1/logpost_test..." << std::endl;
 
@@ -914,6 +1628,156 @@ TEST_CASE("CARMA/logpost_test", "Make sure the that CARMA.logpost_ == CARMA.GetL
     REQUIRE(logpost_neq_count == 0);
 }
 
+TEST_CASE("CARMA/bounded_logdensity", "Make sure the bounded likelihood mode only stops early for rejected proposals") {
+    std::cout << "Running CARMA/bounded_logdensity..." << std::endl;
+
+    int ny = 100;
+    arma::vec time = arma::linspace<arma::vec>(0.0, 100.0, ny);
+    arma::vec y = 2.0 + arma::randn<arma::vec>(ny);
+    arma::vec ysig = 0.01 * arma::ones(ny);
+    int p = 4;
+    int q = 1;
+
+    std::vector<double> time_ = arma::conv_to<std::vector<double> >::from(time);
+    std::vector<double> y_ = arma::conv_to<std::vector<double> >::from(y);
+    std::vector<double> ysig_ = arma::conv_to<std::vector<double> >::from(ysig);
+
+    CARMA carma_test(true, "CARMA(4,1)", time_, y_, ysig_, p, q, true);
+    carma_test.SetPrior(10.0 * arma::stddev(y));
+
+    // the bounded log-density is exact when it is above the threshold, and below the threshold otherwise
+    arma::vec theta = carma_test.StartingValue();
+    double logdens = carma_test.LogDensity(theta);
+    REQUIRE(std::abs(carma_test.BoundedLogDensity(theta, logdens - 1.0) - logdens) < 1e-10 * std::abs(logdens));
+    REQUIRE(carma_test.BoundedLogDensity(theta, logdens + 1.0) < logdens + 1.0);
+
+    // run the RAM sampler past the adaptive stage in bounded mode and make sure the saved log-posterior is correct
+    StudentProposal tUnit(8.0, 1.0);
+    arma::mat prop_covar(p+3+q,p+3+q);
+    prop_covar.eye();
+    int niter = 1000;
+    AdaptiveMetro RAM(carma_test, tUnit, prop_covar, 0.25, niter/2);
+    RAM.SetBoundedLikelihood(true);
+    carma_test.Save(theta);
+    int logpost_neq_count = 0;
+    for (int i=0; i<niter; i++) {
+        RAM.DoStep();
+        double logdens_stored = carma_test.GetLogDensity();
+        double logdens_computed = carma_test.LogDensity(carma_test.Value());
+        if (std::abs(logdens_computed - logdens_stored) > 1e-10) {
+            logpost_neq_count++;
+        }
+    }
+    REQUIRE(logpost_neq_count == 0);
+}
+
+// Return the number of elements of the analytic gradient of the log-posterior that disagree with a central finite
+// difference approximation
+template <class CarmaType>
+int CountGradientErrors(CarmaType& carma, arma::vec theta)
+{
+    arma::vec grad;
+    double logdens = carma.LogDensityGradient(theta, grad);
+    REQUIRE(std::abs(logdens - carma.LogDensity(theta)) < 1e-8 * std::abs(logdens));
+    int nbad = 0;
+    for (int k=0; k<theta.n_elem; k++) {
+        double step = 1e-6 * std::max(1.0, std::abs(theta(k)));
+        arma::vec theta_plus = theta;
+        arma::vec theta_minus = theta;
+        theta_plus(k) += step;
+        theta_minus(k) -= step;
+        double grad_numeric = (carma.LogDensity(theta_plus) - carma.LogDensity(theta_minus)) / (2.0 * step);
+        if (std::abs(grad(k) - grad_numeric) > 1e-4 * std::max(1.0, std::abs(grad_numeric))) {
+            std::cout << "Gradient element " << k << ": analytic " << grad(k) << ", numeric " << grad_numeric
+                << std::endl;
+            nbad++;
+        }
+    }
+    return nbad;
+}
+
+TEST_CASE("CARMA/logdensity_gradient", "Make sure the analytic gradient of the log-posterior agrees with finite differences") {
+    std::cout << "Running CARMA/logdensity_gradient..." << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    std::shared_ptr<const TimeSeriesData> data = std::make_shared<const TimeSeriesData>(time, y, yerr);
+    
+    CAR1 car1_test(true, "CAR(1)", data);
+    REQUIRE(CountGradientErrors(car1_test, car1_test.StartingValue()) == 0);
+    
+    CARp car5_test(true, "CAR(5)", data, 5);
+    REQUIRE(CountGradientErrors(car5_test, car5_test.StartingValue()) == 0);
+    car5_test.SetRealFilter(true);
+    REQUIRE(CountGradientErrors(car5_test, car5_test.StartingValue()) == 0);
+    
+    CARMA carma_test(true, "CARMA(5,3)", data, 5, 3);
+    REQUIRE(CountGradientErrors(carma_test, carma_test.StartingValue()) == 0);
+    
+    ZCARMA zcarma_test(true, "ZCARMA(4)", data, 4);
+    REQUIRE(CountGradientErrors(zcarma_test, zcarma_test.StartingValue()) == 0);
+    
+    // the derivatives of a repeated root stay finite
+    arma::vec quad_theta(2);
+    quad_theta(0) = 0.0;
+    quad_theta(1) = log(2.0);
+    arma::cx_mat droots;
+    arma::cx_vec roots = QuadraticRoots(quad_theta, 0, 2, droots);
+    REQUIRE(std::abs(roots(0) - roots(1)) < 1e-6);
+    REQUIRE(droots.is_finite());
+}
+
+// Return the largest fractional difference between LogDensityBatch and LogDensity for a set of parameter values
+// around the starting value, one of which violates the prior bounds
+template <class CarmaType>
+double BatchLogDensityError(CarmaType& carma)
+{
+    arma::vec theta0 = carma.StartingValue();
+    int ntheta = 9;
+    arma::mat thetas(theta0.n_elem, ntheta);
+    for (int k=0; k<ntheta; k++) {
+        thetas.col(k) = theta0;
+        thetas(0,k) *= 1.0 + 0.05 * k;
+        thetas(1,k) = 0.9 + 0.02 * k;
+        thetas(2,k) += 0.01 * k;
+    }
+    thetas(1,ntheta-1) = -1.0; // negative measurement error scaling parameter
+    
+    arma::vec logdens = carma.LogDensityBatch(thetas);
+    double max_error = 0.0;
+    for (int k=0; k<ntheta; k++) {
+        double expected = carma.LogDensity(thetas.col(k));
+        if (!arma::is_finite(expected)) {
+            if (arma::is_finite(logdens(k)) || (logdens(k) > 0.0)) {
+                return arma::datum::inf;
+            }
+            continue;
+        }
+        max_error = std::max(max_error, std::abs(logdens(k) - expected) / std::abs(expected));
+    }
+    return max_error;
+}
+
+TEST_CASE("CARMA/logdensity_batch", "Make sure the batched log-posterior agrees with the log-posterior for each value") {
+    std::cout << "Running CARMA/logdensity_batch..." << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    std::shared_ptr<const TimeSeriesData> data = std::make_shared<const TimeSeriesData>(time, y, yerr);
+    
+    CAR1 car1_test(true, "CAR(1)", data);
+    REQUIRE(BatchLogDensityError(car1_test) < 1e-10);
+    
+    CARp car5_test(true, "CAR(5)", data, 5);
+    REQUIRE(BatchLogDensityError(car5_test) < 1e-10);
+    
+    CARMA carma_test(true, "CARMA(5,3)", data, 5, 3);
+    REQUIRE(BatchLogDensityError(carma_test) < 1e-10);
+    
+    ZCARMA zcarma_test(true, "ZCARMA(4)", data, 4);
+    REQUIRE(BatchLogDensityError(zcarma_test) < 1e-10);
+}
+
 TEST_CASE("CAR1/logpost_test_mcmc", "Make sure log-posterior returned by MCMC sampler matches the value calculate directly") {
     std::cout << "Running CAR1/logpost_test_mcmc..." << std::endl;
 
@@ -1655,3 +2519,595 @@ TEST_CASE("CARMA/mcmc_sampler", "Test RunEnsembleCarSampler on CARMA(5,4) model"
         CHECK(std::abs(ma_zscore) < 3.0);
     }
 }
+
+TEST_CASE("CARMA/tempered_sampler_threads", "Make sure the parallel tempering results do not depend on the number of threads") {
+    std::cout << std::endl;
+    std::cout << "Running test of parallel tempering with multiple threads..." << std::endl << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    
+    int sample_size = 200;
+    int burnin = 100;
+    int nwalkers = 6;
+    std::vector<double> init;
+    
+    rng.seed(98765);
+    arma::arma_rng::set_seed(98765);
+    std::shared_ptr<CARp> mcmc_serial = RunCarmaSampler(sample_size, burnin, time, y, yerr, 3, 1, nwalkers, false, 1,
+                                                        init, 1);
+    rng.seed(98765);
+    arma::arma_rng::set_seed(98765);
+    std::shared_ptr<CARp> mcmc_threaded = RunCarmaSampler(sample_size, burnin, time, y, yerr, 3, 1, nwalkers, false,
+                                                          1, init, 4);
+    
+    std::vector<arma::vec> serial_sample = mcmc_serial->GetSamples();
+    std::vector<arma::vec> threaded_sample = mcmc_threaded->GetSamples();
+    REQUIRE(serial_sample.size() == threaded_sample.size());
+    int nequal = 0;
+    for (int i=0; i<serial_sample.size(); i++) {
+        if (arma::all(serial_sample[i] == threaded_sample[i])) {
+            nequal++;
+        }
+    }
+    REQUIRE(nequal == sample_size);
+}
+
+TEST_CASE("CARMA/ensemble_sampler", "Test the affine-invariant ensemble sampler and make sure it does not depend on the number of threads") {
+    std::cout << std::endl;
+    std::cout << "Running test of the ensemble sampler with multiple threads..." << std::endl << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    
+    int sample_size = 100;
+    int burnin = 200;
+    int p = 3, q = 1;
+    // too few walkers, so this is rounded up to twice the number of parameters
+    int nwalkers = 5;
+    int nwalkers_used = 2 * (p + q + 3);
+    std::vector<double> init;
+    
+    rng.seed(98765);
+    arma::arma_rng::set_seed(98765);
+    std::shared_ptr<CARp> mcmc_serial = RunCarmaSampler(sample_size, burnin, time, y, yerr, p, q, nwalkers, false, 1,
+                                                        init, 1, "", true);
+    rng.seed(98765);
+    arma::arma_rng::set_seed(98765);
+    std::shared_ptr<CARp> mcmc_threaded = RunCarmaSampler(sample_size, burnin, time, y, yerr, p, q, nwalkers, false,
+                                                          1, init, 3, "", true);
+    
+    // the samples for all of the walkers are returned
+    std::vector<arma::vec> serial_sample = mcmc_serial->GetSamples();
+    std::vector<arma::vec> threaded_sample = mcmc_threaded->GetSamples();
+    std::vector<double> logposts = mcmc_serial->GetLogLikes();
+    REQUIRE(serial_sample.size() == sample_size * nwalkers_used);
+    REQUIRE(threaded_sample.size() == serial_sample.size());
+    REQUIRE(logposts.size() == serial_sample.size());
+    
+    int nequal = 0;
+    int nlogpost_equal = 0;
+    for (int i=0; i<serial_sample.size(); i++) {
+        if (arma::all(serial_sample[i] == threaded_sample[i])) {
+            nequal++;
+        }
+        double frac_diff = std::abs(mcmc_serial->LogDensity(serial_sample[i]) - logposts[i]) / std::abs(logposts[i]);
+        if (frac_diff < 1e-8) {
+            nlogpost_equal++;
+        }
+    }
+    CHECK(nequal == serial_sample.size());
+    CHECK(nlogpost_equal == serial_sample.size());
+    
+    // make sure the walkers are moving
+    int nmoved = 0;
+    for (int i=nwalkers_used; i<serial_sample.size(); i++) {
+        if (arma::any(serial_sample[i] != serial_sample[i - nwalkers_used])) {
+            nmoved++;
+        }
+    }
+    double accept_rate = nmoved / double(serial_sample.size() - nwalkers_used);
+    std::cout << "Ensemble sampler acceptance rate: " << accept_rate << std::endl;
+    CHECK(accept_rate > 0.05);
+    CHECK(accept_rate < 0.95);
+}
+
+TEST_CASE("CARMA/survey_sampler", "Make sure the survey results do not depend on the number of threads") {
+    std::cout << std::endl;
+    std::cout << "Running test of survey mode..." << std::endl << std::endl;
+    
+    std::ofstream manifest("test_manifest.txt");
+    manifest << "# name file p q" << std::endl;
+    manifest << "survey_car1 " << car1file << " 1 0" << std::endl;
+    manifest << "survey_carma " << carmafile << " 3 1" << std::endl;
+    manifest << "survey_missing data/not_a_file.dat 2 0 100" << std::endl;
+    manifest.close();
+    
+    std::vector<SurveyObject> objects = ReadSurveyManifest("test_manifest.txt");
+    REQUIRE(objects.size() == 3);
+    arma::mat car1_data;
+    car1_data.load(car1file, arma::raw_ascii);
+    REQUIRE(objects[0].ndata == car1_data.n_rows);
+    REQUIRE(objects[1].p == 3);
+    REQUIRE(objects[1].q == 1);
+    REQUIRE(objects[2].ndata == 100);
+    
+    int sample_size = 100;
+    int burnin = 50;
+    int nwalkers = 4;
+    unsigned long seed = 12345;
+    
+    std::remove("survey_summary.txt");
+    int nsuccess = RunSurveySampler("test_manifest.txt", ".", sample_size, burnin, nwalkers, 1, seed);
+    REQUIRE(nsuccess == 2);
+    arma::mat car1_serial, carma_serial;
+    REQUIRE(car1_serial.load("survey_car1_samples.dat", arma::raw_ascii));
+    REQUIRE(carma_serial.load("survey_carma_samples.dat", arma::raw_ascii));
+    REQUIRE(car1_serial.n_rows == sample_size);
+    REQUIRE(carma_serial.n_rows == sample_size);
+    
+    nsuccess = RunSurveySampler("test_manifest.txt", ".", sample_size, burnin, nwalkers, 2, seed);
+    REQUIRE(nsuccess == 2);
+    arma::mat car1_threaded, carma_threaded;
+    REQUIRE(car1_threaded.load("survey_car1_samples.dat", arma::raw_ascii));
+    REQUIRE(carma_threaded.load("survey_carma_samples.dat", arma::raw_ascii));
+    REQUIRE(arma::all(arma::vectorise(car1_serial == car1_threaded)));
+    REQUIRE(arma::all(arma::vectorise(carma_serial == carma_threaded)));
+    
+    // each run appends one line per object to the summary, including the failures
+    std::ifstream summary("survey_summary.txt");
+    std::string line;
+    int nlines = 0, nfailed = 0;
+    while (std::getline(summary, line)) {
+        nlines++;
+        if (line.find("failed") != std::string::npos) {
+            nfailed++;
+        }
+    }
+    REQUIRE(nlines == 6);
+    REQUIRE(nfailed == 2);
+    
+    // bad arguments fail before any object is fit
+    REQUIRE_THROWS_AS(RunSurveySampler("test_manifest.txt", ".", 0, burnin, nwalkers, 1, seed), std::invalid_argument);
+    REQUIRE_THROWS_AS(RunSurveySampler("test_manifest.txt", "test_manifest.txt/output", sample_size, burnin, nwalkers,
+                                       1, seed), std::runtime_error);
+    
+    std::remove("test_manifest.txt");
+    std::remove("survey_summary.txt");
+    std::remove("survey_car1_samples.dat");
+    std::remove("survey_carma_samples.dat");
+}
+
+TEST_CASE("CARMA/find_mle", "Make sure the multi-start MLE does not depend on the number of threads and is a maximum") {
+    std::cout << std::endl;
+    std::cout << "Running test of the multi-start MLE..." << std::endl << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    int p = 3, q = 1;
+    int ntrials = 8;
+    
+    rng.seed(24680);
+    CarmaMLE mle_serial = FindMLE(time, y, yerr, p, q, ntrials, 1);
+    unsigned int next_serial = rng();
+    rng.seed(24680);
+    CarmaMLE mle_threaded = FindMLE(time, y, yerr, p, q, ntrials, 4);
+    unsigned int next_threaded = rng();
+    // the random numbers drawn by the caller afterward should not depend on the number of threads either
+    REQUIRE(next_serial == next_threaded);
+    REQUIRE(mle_serial.theta.size() == p + q + 3);
+    REQUIRE(mle_serial.theta == mle_threaded.theta);
+    REQUIRE(mle_serial.logdens == mle_threaded.logdens);
+    REQUIRE(arma::is_finite(mle_serial.logdens));
+    
+    // the maximum should be at least as high as the log-likelihood at the random starting values
+    CARMA carma_test(false, "CARMA(3,1)", time, y, yerr, p, q);
+    carma_test.SetMLE(true);
+    for (int i=0; i<10; i++) {
+        arma::vec theta = carma_test.StartingValue();
+        theta(1) = 1.0;
+        CHECK(carma_test.LogDensity(theta) <= mle_serial.logdens);
+    }
+    
+    // the Hessian should be symmetric
+    REQUIRE(mle_serial.hessian.size() == p + q + 3);
+    for (int i=0; i<p+q+3; i++) {
+        for (int j=0; j<i; j++) {
+            CHECK(mle_serial.hessian[i][j] == mle_serial.hessian[j][i]);
+        }
+    }
+    
+    CarmaMLE mle_car1 = FindMLE(time, y, yerr, 1, 0, ntrials, 2);
+    REQUIRE(mle_car1.theta.size() == 4);
+    REQUIRE(arma::is_finite(mle_car1.logdens));
+}
+
+TEST_CASE("CARMA/choose_order", "Make sure the order search does not depend on the number of threads and prunes orders") {
+    std::cout << std::endl;
+    std::cout << "Running test of the CARMA order search..." << std::endl << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    
+    std::vector<int> plist, qlist;
+    for (int p=1; p<=4; p++) {
+        for (int q=0; q<p; q++) {
+            plist.push_back(p);
+            qlist.push_back(q);
+        }
+    }
+    int norders = plist.size();
+    int ntrials = 15;
+    int min_prune_trials = 10;
+    double prune_delta = 10.0;
+    
+    rng.seed(13579);
+    CarmaOrderSearch serial = ChooseOrder(time, y, yerr, plist, qlist, ntrials, 1, prune_delta, min_prune_trials);
+    unsigned int next_serial = rng();
+    rng.seed(13579);
+    CarmaOrderSearch threaded = ChooseOrder(time, y, yerr, plist, qlist, ntrials, 4, prune_delta, min_prune_trials);
+    REQUIRE(rng() == next_serial);
+    REQUIRE(serial.aicc.size() == norders);
+    REQUIRE(serial.aicc == threaded.aicc);
+    REQUIRE(serial.ntrials == threaded.ntrials);
+    REQUIRE(serial.best_p == threaded.best_p);
+    REQUIRE(serial.best_q == threaded.best_q);
+    
+    int best = -1;
+    for (int k=0; k<norders; k++) {
+        if ((plist[k] == serial.best_p) && (qlist[k] == serial.best_q)) {
+            best = k;
+        }
+        CHECK(serial.ntrials[k] <= ntrials);
+        if (serial.ntrials[k] < ntrials) {
+            // pruned orders must have had enough starts and be clearly disfavoured
+            CHECK(serial.ntrials[k] >= min_prune_trials);
+            CHECK(serial.aicc[k] > *std::min_element(serial.aicc.begin(), serial.aicc.end()) + prune_delta);
+        }
+    }
+    REQUIRE(best >= 0);
+    REQUIRE(serial.aicc[best] == *std::min_element(serial.aicc.begin(), serial.aicc.end()));
+    REQUIRE(serial.ntrials[best] == ntrials);
+    REQUIRE(serial.best_mle.theta.size() == serial.best_p + serial.best_q + 3);
+    REQUIRE(serial.best_mle.hessian.size() == serial.best_mle.theta.size());
+    
+    // by default there is no pruning, so every order gets all of the random starts
+    rng.seed(13579);
+    CarmaOrderSearch unpruned = ChooseOrder(time, y, yerr, plist, qlist, ntrials, 4);
+    for (int k=0; k<norders; k++) {
+        CHECK(unpruned.ntrials[k] == ntrials);
+        CHECK(unpruned.aicc[k] <= serial.aicc[k]);
+    }
+    rng.seed(13579);
+    CarmaOrderSearch unpruned_serial = ChooseOrder(time, y, yerr, plist, qlist, ntrials, 1);
+    REQUIRE(unpruned_serial.aicc == unpruned.aicc);
+    REQUIRE(unpruned_serial.best_mle.theta == unpruned.best_mle.theta);
+}
+
+// Run NUTS on a CARMA(5,4) or ZCARMA(5) model for the time series in datafile, check it against the true AR
+// parameters, and report its effective samples per second next to RAM without tempering. The timings are only printed,
+// since wall-clock comparisons are not reliable enough on a loaded machine to be tested.
+void CheckNutsSampler(std::string datafile, bool do_zcarma)
+{
+    std::vector<double> time, y, yerr;
+    load_light_curve(datafile, time, y, yerr);
+    std::shared_ptr<const TimeSeriesData> data = std::make_shared<const TimeSeriesData>(time, y, yerr);
+    int p = 5;
+    int q = 4;
+    int nparams = do_zcarma ? p + 4 : p + q + 3;
+    
+    // True values of the AR parameters
+    arma::cx_vec ar_roots = zcarma5_roots();
+    arma::vec loga(p);
+    for (int i=0; i<p/2; i++) {
+        loga(2*i) = log(std::norm(ar_roots(2*i)));
+        loga(2*i+1) = log(-2.0 * ar_roots(2*i).real());
+    }
+    loga(p-1) = log(-ar_roots(p-1).real());
+    
+    double var = arma::var(data->y());
+    arma::mat covar(nparams, nparams, arma::fill::eye);
+    covar.diag() *= 0.01 * 0.01;
+    covar(0,0) = 2.0 * var * var / y.size();
+    covar(2,2) = var / y.size();
+    
+    int sample_size = 2000;
+    int burnin = 1000;
+    std::unique_ptr<CARp> carma;
+    if (do_zcarma) {
+        carma.reset(new ZCARMA(true, "ZCARMA(5) NUTS", data, p));
+    } else {
+        carma.reset(new CARMA(true, "CARMA(5,4) NUTS", data, p, q));
+    }
+    carma->SetPrior(10.0 * sqrt(var));
+    Sampler nuts_sampler(sample_size, burnin);
+    NUTS* nuts = new NUTS(*carma, covar, burnin);
+    nuts_sampler.AddStep(nuts);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    nuts_sampler.Run(arma::vec());
+    double nuts_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "NUTS average number of leapfrog steps: " << nuts->GetAverageLeapfrogs() << std::endl;
+    CHECK(std::abs(nuts->GetAcceptRate() - 0.8) < 0.1);
+    
+    std::vector<arma::vec> nuts_sample = carma->GetSamples();
+    arma::mat nuts_ar(nuts_sample.size(), p);
+    for (int i=0; i<nuts_sample.size(); i++) {
+        nuts_ar.row(i) = nuts_sample[i].subvec(3, p+2).t();
+    }
+    for (int j=0; j<p; j++) {
+        double ar_zscore = (arma::mean(nuts_ar.col(j)) - loga(j)) / arma::stddev(nuts_ar.col(j));
+        CHECK(std::abs(ar_zscore) < 3.0);
+    }
+    
+    // RAM without tempering on the same model, run for ten times as many iterations
+    std::unique_ptr<CARp> ram_carma;
+    if (do_zcarma) {
+        ram_carma.reset(new ZCARMA(true, "ZCARMA(5) RAM", data, p));
+    } else {
+        ram_carma.reset(new CARMA(true, "CARMA(5,4) RAM", data, p, q));
+    }
+    ram_carma->SetPrior(10.0 * sqrt(var));
+    Sampler ram_sampler(10 * sample_size, 10 * burnin);
+    StudentProposal ram_proposal(8.0, 1.0);
+    ram_sampler.AddStep(new AdaptiveMetro(*ram_carma, ram_proposal, covar, 0.25, 10 * burnin));
+    start = std::chrono::steady_clock::now();
+    ram_sampler.Run(arma::vec());
+    double ram_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<arma::vec> ram_sample = ram_carma->GetSamples();
+    arma::mat ram_ar(ram_sample.size(), p);
+    for (int i=0; i<ram_sample.size(); i++) {
+        ram_ar.row(i) = ram_sample[i].subvec(3, p+2).t();
+    }
+    
+    // compare the smallest number of effective samples over the AR parameters per evaluation of the posterior: each
+    // RAM iteration evaluates the log-posterior once, and each leapfrog step of NUTS evaluates its gradient once
+    double nuts_ess = arma::datum::inf, ram_ess = arma::datum::inf;
+    for (int j=0; j<p; j++) {
+        nuts_ess = std::min(nuts_ess, effective_sample_size(nuts_ar.col(j)));
+        ram_ess = std::min(ram_ess, effective_sample_size(ram_ar.col(j)));
+    }
+    double nuts_evaluations = nuts->GetAverageLeapfrogs() * (burnin + sample_size);
+    double ram_evaluations = 10.0 * (burnin + sample_size);
+    std::cout << datafile << ": effective samples per evaluation, NUTS: " << nuts_ess / nuts_evaluations << ", RAM: "
+        << ram_ess / ram_evaluations << std::endl;
+    std::cout << datafile << ": effective samples per second, NUTS: " << nuts_ess / nuts_seconds << ", RAM: "
+        << ram_ess / ram_seconds << std::endl;
+    CHECK(nuts_ess / nuts_evaluations > ram_ess / ram_evaluations);
+}
+
+TEST_CASE("CARMA/nuts_sampler", "Test the NUTS step on the CARMA(5,4) and ZCARMA(5) models") {
+    std::cout << std::endl;
+    std::cout << "Running test of NUTS sampler for CARMA(5,4) and ZCARMA(5) models..." << std::endl << std::endl;
+    
+    CheckNutsSampler(carmafile, false);
+    CheckNutsSampler(zcarmafile, true);
+}
+
+TEST_CASE("CARMA/trace_file", "Make sure the binary trace file contains the same samples as the sampler") {
+    std::cout << std::endl;
+    std::cout << "Running test of the binary trace file..." << std::endl << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    
+    int sample_size = 100;
+    int burnin = 50;
+    int p = 3, q = 1;
+    std::vector<double> init;
+    std::shared_ptr<CARp> mcmc_out = RunCarmaSampler(sample_size, burnin, time, y, yerr, p, q, 4, false, 1, init, 1,
+                                                     "test_trace.bin");
+    const arma::mat& sample_matrix = mcmc_out->GetSampleMatrix();
+    std::vector<arma::vec> samples = mcmc_out->GetSamples();
+    std::vector<double> logposts = mcmc_out->GetLogLikes();
+    REQUIRE(sample_matrix.n_rows == p + q + 3);
+    REQUIRE(sample_matrix.n_cols == sample_size);
+    REQUIRE(samples.size() == sample_size);
+    // the samples are the same when read through the Parameter base class
+    Parameter<arma::vec>& collector = *mcmc_out;
+    std::vector<arma::vec> base_samples = collector.GetSamples();
+    REQUIRE(base_samples.size() == sample_size);
+    
+    std::ifstream trace("test_trace.bin", std::ios::in | std::ios::binary);
+    char tag[8];
+    std::uint64_t ncols;
+    trace.read(tag, 8);
+    trace.read(reinterpret_cast<char*>(&ncols), sizeof(ncols));
+    REQUIRE(std::string(tag, 8) == "CARTRACE");
+    REQUIRE(ncols == p + q + 4);
+    arma::mat rows(ncols, sample_size);
+    trace.read(reinterpret_cast<char*>(rows.memptr()), rows.n_elem * sizeof(double));
+    REQUIRE(trace.gcount() == rows.n_elem * sizeof(double));
+    trace.peek();
+    REQUIRE(trace.eof());
+    
+    for (int i=0; i<sample_size; i++) {
+        CHECK(rows(0,i) == logposts[i]);
+        CHECK(arma::all(rows(arma::span(1,ncols-1),i) == samples[i]));
+        CHECK(arma::all(sample_matrix.col(i) == samples[i]));
+        CHECK(arma::all(base_samples[i] == samples[i]));
+    }
+    std::remove("test_trace.bin");
+}
+
+TEST_CASE("CARMA/spectral_bands", "Make sure the PSD and autocovariance percentiles agree with the CARMA model") {
+    std::cout << "Running CARMA/spectral_bands..." << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    
+    int p = 5;
+    int q = 3;
+    CARMA carma_test(true, "CARMA(5,3)", time, y, yerr, p, q);
+    arma::vec theta = carma_test.StartingValue();
+    arma::cx_vec ar_roots = carma_test.ARRoots(theta);
+    arma::vec ma_coefs = carma_test.ExtractMA(theta);
+    double sigsqr = carma_test.ExtractSigsqr(theta);
+    arma::vec ar_coefs = polycoefs(ar_roots);
+    
+    // the draws only differ in the standard deviation of the process, so the PSD and autocovariance function of
+    // draw i are (i + 1) times those of the first draw
+    int ndraws = 5;
+    arma::mat samples(theta.n_elem, ndraws);
+    for (int i=0; i<ndraws; i++) {
+        samples.col(i) = theta;
+        samples(0,i) = theta(0) * sqrt(i + 1.0);
+    }
+    std::vector<double> frequency = {1e-3, 1e-2, 0.1, 1.0, 10.0};
+    std::vector<double> lags = {0.0, 1.0, -10.0, 100.0};
+    std::vector<double> percentiles = {0.0, 50.0, 62.5, 100.0};
+    double scale[4] = {1.0, 3.0, 3.5, 5.0};
+    
+    CarmaSpectrum spectrum = CarmaSpectralBands(samples, p, q, frequency, lags, percentiles, 2);
+    REQUIRE(spectrum.psd.size() == percentiles.size());
+    REQUIRE(spectrum.acf.size() == percentiles.size());
+    
+    for (int k=0; k<frequency.size(); k++) {
+        std::complex<double> s(0.0, 2.0 * arma::datum::pi * frequency[k]);
+        std::complex<double> ar_poly(0.0, 0.0), ma_poly(0.0, 0.0);
+        for (int l=0; l<=p; l++) {
+            ar_poly = ar_poly * s + ar_coefs(l);
+        }
+        for (int l=q; l>=0; l--) {
+            ma_poly = ma_poly * s + ma_coefs(l);
+        }
+        double psd = sigsqr * std::norm(ma_poly) / std::norm(ar_poly);
+        for (int j=0; j<percentiles.size(); j++) {
+            CHECK(std::abs(spectrum.psd[j][k] / (scale[j] * psd) - 1.0) < 1e-8);
+        }
+    }
+    double var = carma_test.Variance(ar_roots, ma_coefs, sqrt(sigsqr));
+    REQUIRE(std::abs(var / (theta(0) * theta(0)) - 1.0) < 1e-8);
+    for (int k=0; k<lags.size(); k++) {
+        double acf = carma_test.Variance(ar_roots, ma_coefs, sqrt(sigsqr), std::abs(lags[k]));
+        for (int j=0; j<percentiles.size(); j++) {
+            CHECK(std::abs(spectrum.acf[j][k] - scale[j] * acf) < 1e-8 * scale[j] * var);
+        }
+    }
+    
+    // the wrong number of parameters is rejected
+    REQUIRE_THROWS(CarmaSpectralBands(samples, p, q + 1, frequency, lags, percentiles));
+}
+
+TEST_CASE("CARMA/transform_samples", "Make sure the batched transform of the samples agrees with the CARMA class") {
+    std::cout << "Running CARMA/transform_samples..." << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    
+    int p = 5;
+    int q = 2;
+    CARMA carma_test(true, "CARMA(5,2)", time, y, yerr, p, q);
+    int ndraws = 1000;
+    arma::mat samples(3 + p + q, ndraws);
+    for (int i=0; i<ndraws; i++) {
+        samples.col(i) = carma_test.StartingValue();
+    }
+    
+    CarmaPhysicalSamples physical = TransformCarmaSamples(samples, p, q, 3);
+    REQUIRE(physical.ar_roots.n_cols == ndraws);
+    REQUIRE(physical.ma_coefs.n_rows == q + 1);
+    for (int i=0; i<ndraws; i++) {
+        arma::vec theta = samples.col(i);
+        arma::cx_vec ar_roots = carma_test.ARRoots(theta);
+        arma::vec ma_coefs = carma_test.ExtractMA(theta);
+        REQUIRE(arma::all(physical.ar_roots.col(i) == ar_roots));
+        REQUIRE(arma::all(physical.ar_coefs.col(i) == polycoefs(ar_roots)));
+        REQUIRE(arma::all(physical.ma_coefs.col(i) == ma_coefs.head(q + 1)));
+        REQUIRE(std::abs(physical.sigma(i) / sqrt(carma_test.ExtractSigsqr(theta)) - 1.0) < 1e-10);
+        for (int k=0; k<p; k++) {
+            REQUIRE(physical.psd_width(k,i) > 0.0);
+            REQUIRE(std::abs(std::complex<double>(-physical.psd_width(k,i), physical.psd_centroid(k,i)) *
+                             2.0 * arma::datum::pi - std::complex<double>(ar_roots(k).real(),
+                                                                          std::abs(ar_roots(k).imag()))) < 1e-10);
+        }
+    }
+    
+    // the results do not depend on the number of threads
+    CarmaPhysicalSamples physical1 = TransformCarmaSamples(samples, p, q, 1);
+    REQUIRE(arma::all(arma::vectorise(physical1.ar_coefs == physical.ar_coefs)));
+    REQUIRE(arma::all(physical1.sigma == physical.sigma));
+}
+
+TEST_CASE("CARMA/smc_update", "Make sure the SMC update agrees with the posterior given all of the data") {
+    std::cout << std::endl;
+    std::cout << "Running test of the sequential Monte Carlo update..." << std::endl << std::endl;
+    
+    std::vector<double> time, y, yerr;
+    load_light_curve(carmafile, time, y, yerr);
+    
+    // fit the first 80% of the time series, and then add the rest in two batches
+    int ny = time.size();
+    int nold = 8 * ny / 10;
+    int nmid = 9 * ny / 10;
+    std::vector<double> time_old(time.begin(), time.begin() + nold), time_mid(time.begin(), time.begin() + nmid);
+    std::vector<double> y_old(y.begin(), y.begin() + nold), y_mid(y.begin(), y.begin() + nmid);
+    std::vector<double> yerr_old(yerr.begin(), yerr.begin() + nold), yerr_mid(yerr.begin(), yerr.begin() + nmid);
+    
+    int p = 3, q = 1;
+    int sample_size = 200;
+    int burnin = 500;
+    std::vector<double> init;
+    rng.seed(13579);
+    arma::arma_rng::set_seed(13579);
+    std::shared_ptr<CARp> mcmc_old = RunCarmaSampler(sample_size, burnin, time_old, y_old, yerr_old, p, q, 5, false, 1,
+                                                     init, 1);
+    
+    // the particles have the log-posteriors found by the MCMC sampler
+    CarmaParticles particles = MakeCarmaParticles(mcmc_old->GetSampleMatrix(), time_old, y_old, yerr_old, p, q, false, 3);
+    std::vector<double> logposts = mcmc_old->GetLogLikes();
+    REQUIRE(particles.theta.n_cols == sample_size);
+    REQUIRE(particles.ndata == nold);
+    REQUIRE(particles.last_time == time[nold - 1]);
+    for (int k=0; k<sample_size; k++) {
+        REQUIRE(std::abs(particles.logpost(k) - logposts[k]) / std::abs(logposts[k]) < 1e-8);
+        REQUIRE(particles.filter_states[k].ndata == nold);
+    }
+    
+    // without resampling the particles are only reweighted by the likelihood of the new data points
+    CARMA carma_mid(false, "CARMA(3,1)", time_mid, y_mid, yerr_mid, p, q);
+    carma_mid.SetPrior(particles.max_stdev);
+    CarmaParticles reweighted = UpdateCarmaParticles(particles, time_mid, y_mid, yerr_mid, p, q, false, 3, 10, 0.0);
+    REQUIRE(reweighted.ndata == nmid);
+    REQUIRE(arma::all(arma::vectorise(reweighted.theta == particles.theta)));
+    arma::vec weights = arma::exp(reweighted.log_weights);
+    CHECK(std::abs(arma::sum(weights) - 1.0) < 1e-10);
+    CHECK(std::abs(reweighted.ess - 1.0 / arma::sum(weights % weights)) < 1e-8);
+    for (int k=0; k<sample_size; k++) {
+        arma::vec theta = reweighted.theta.col(k);
+        double logpost = carma_mid.LogDensity(theta);
+        REQUIRE(std::abs(reweighted.logpost(k) - logpost) / std::abs(logpost) < 1e-8);
+        double log_weight = reweighted.logpost(k) - particles.logpost(k) + particles.log_weights(k) -
+            reweighted.log_evidence;
+        REQUIRE(std::abs(reweighted.log_weights(k) - log_weight) < 1e-6);
+    }
+    
+    // the reweighted particles can be updated again, and the log-evidence accumulates
+    CarmaParticles reweighted_all = UpdateCarmaParticles(reweighted, time, y, yerr, p, q, false, 2, 10, 0.0);
+    CarmaParticles reweighted_once = UpdateCarmaParticles(particles, time, y, yerr, p, q, false, 1, 10, 0.0);
+    CHECK(std::abs(reweighted_all.log_evidence - reweighted_once.log_evidence) < 1e-6);
+    CHECK(arma::max(arma::abs(reweighted_all.log_weights - reweighted_once.log_weights)) < 1e-6);
+    
+    // always move the particles. The moves use all of the data, and do not depend on the number of threads
+    CARMA carma_all(false, "CARMA(3,1)", time, y, yerr, p, q);
+    carma_all.SetPrior(particles.max_stdev);
+    rng.seed(24680);
+    CarmaParticles moved_serial = UpdateCarmaParticles(particles, time, y, yerr, p, q, false, 1, 10, 1.0);
+    rng.seed(24680);
+    CarmaParticles moved_threaded = UpdateCarmaParticles(particles, time, y, yerr, p, q, false, 3, 10, 1.0);
+    REQUIRE(arma::all(arma::vectorise(moved_serial.theta == moved_threaded.theta)));
+    REQUIRE(arma::all(moved_serial.logpost == moved_threaded.logpost));
+    CHECK(moved_serial.log_evidence == reweighted_once.log_evidence);
+    CHECK(arma::all(moved_serial.log_weights == moved_serial.log_weights(0)));
+    std::cout << "SMC effective sample size: " << moved_serial.ess << ", acceptance rate: "
+              << moved_serial.accept_rate << std::endl;
+    CHECK(moved_serial.accept_rate > 0.0);
+    for (int k=0; k<sample_size; k++) {
+        arma::vec theta = moved_serial.theta.col(k);
+        double logpost = carma_all.LogDensity(theta);
+        REQUIRE(std::abs(moved_serial.logpost(k) - logpost) / std::abs(logpost) < 1e-8);
+        REQUIRE(moved_serial.filter_states[k].ndata == ny);
+    }
+    
+    // the new data points must follow the old ones
+    REQUIRE_THROWS_AS(UpdateCarmaParticles(reweighted, time_old, y_old, yerr_old, p, q), std::invalid_argument);
+}
@@ -22,16 +22,346 @@
 
 using namespace boost::python;
 
-BOOST_PYTHON_FUNCTION_OVERLOADS(car1Overloads, RunCar1Sampler, 5, 7);
-BOOST_PYTHON_FUNCTION_OVERLOADS(carmaOverloads, RunCarmaSampler, 8, 11);
+/*
+ The samplers, optimizers and Kalman Filter methods release the Python GIL while they run, so that several light
+ curves can be fit concurrently from Python threads. This is safe because the C++ code does not touch any Python
+ objects once the arguments have been converted, and each thread draws from its own random number generator. The
+ Kalman Filter scratch space belongs to the filter object, so a single filter object should not be used from more
+ than one thread at a time.
+ */
+
+// Release the GIL for the lifetime of this object. It is reacquired when the object is destroyed, including when an
+// exception is thrown, so that the exception can be translated to Python.
+class ScopedGILRelease {
+public:
+    ScopedGILRelease() {
+        thread_state_ = PyEval_SaveThread();
+    }
+    ~ScopedGILRelease() {
+        PyEval_RestoreThread(thread_state_);
+    }
+private:
+    PyThreadState* thread_state_;
+};
+
+std::shared_ptr<CAR1>
+RunCar1SamplerNoGIL(int sample_size, int burnin, std::vector<double> time, std::vector<double> y,
+                    std::vector<double> yerr, int thin=1, const std::vector<double>& init = std::vector<double>(),
+                    std::string trace_file="")
+{
+    ScopedGILRelease release;
+    return RunCar1Sampler(sample_size, burnin, time, y, yerr, thin, init, trace_file);
+}
+
+std::shared_ptr<CARp>
+RunCarmaSamplerNoGIL(int sample_size, int burnin, std::vector<double> time, std::vector<double> y,
+                     std::vector<double> yerr, int p, int q, int nwalkers, bool do_zcarma=false,
+                     int thin=1, const std::vector<double>& init = std::vector<double>(), int nthreads=1,
+                     std::string trace_file="", bool ensemble=false)
+{
+    ScopedGILRelease release;
+    return RunCarmaSampler(sample_size, burnin, time, y, yerr, p, q, nwalkers, do_zcarma, thin, init, nthreads,
+                           trace_file, ensemble);
+}
+
+int RunSurveySamplerNoGIL(std::string manifest_file, std::string output_dir, int sample_size, int burnin,
+                          int nwalkers, int nthreads, unsigned long seed, int thin=1)
+{
+    ScopedGILRelease release;
+    return RunSurveySampler(manifest_file, output_dir, sample_size, burnin, nwalkers, nthreads, seed, thin);
+}
+
+CarmaMLE FindMLENoGIL(std::vector<double> time, std::vector<double> y, std::vector<double> yerr, int p, int q,
+                      int ntrials=100, int nthreads=1)
+{
+    ScopedGILRelease release;
+    return FindMLE(time, y, yerr, p, q, ntrials, nthreads);
+}
+
+CarmaOrderSearch ChooseOrderNoGIL(std::vector<double> time, std::vector<double> y, std::vector<double> yerr,
+                                  std::vector<int> plist, std::vector<int> qlist, int ntrials=100, int nthreads=1,
+                                  double prune_delta=arma::datum::inf, int min_prune_trials=10)
+{
+    ScopedGILRelease release;
+    return ChooseOrder(time, y, yerr, plist, qlist, ntrials, nthreads, prune_delta, min_prune_trials);
+}
+
+template <class FilterType>
+void FilterNoGIL(FilterType& kfilter)
+{
+    ScopedGILRelease release;
+    kfilter.Filter();
+}
+
+template <class FilterType>
+double ParallelLogLikelihoodNoGIL(FilterType& kfilter, unsigned int nthreads)
+{
+    ScopedGILRelease release;
+    return kfilter.ParallelLogLikelihood(nthreads);
+}
+
+template <class FilterType>
+std::pair<double, double> PredictNoGIL(FilterType& kfilter, double time)
+{
+    ScopedGILRelease release;
+    return kfilter.Predict(time);
+}
+
+template <class FilterType>
+std::pair<std::vector<double>, std::vector<double> > PredictBatchNoGIL(FilterType& kfilter, std::vector<double> time)
+{
+    ScopedGILRelease release;
+    return kfilter.PredictBatch(time);
+}
+
+template <class FilterType>
+OnlineKalmanFilter MakeOnlineFilterNoGIL(FilterType& kfilter)
+{
+    ScopedGILRelease release;
+    return kfilter.MakeOnlineFilter();
+}
+
+template <class FilterType>
+std::vector<double> SimulateNoGIL(FilterType& kfilter, std::vector<double> time)
+{
+    ScopedGILRelease release;
+    return kfilter.Simulate(time);
+}
+
+template <class FilterType>
+std::vector<std::vector<double> > SimulateBatchNoGIL(FilterType& kfilter, std::vector<double> time, int nsim)
+{
+    ScopedGILRelease release;
+    return kfilter.Simulate(time, nsim);
+}
+
+CarmaSpectrum CarmaSpectralBandsNoGIL(const arma::mat& samples, int p, int q, std::vector<double> frequency,
+                                      std::vector<double> lags, std::vector<double> percentiles, int nthreads=1)
+{
+    ScopedGILRelease release;
+    return CarmaSpectralBands(samples, p, q, frequency, lags, percentiles, nthreads);
+}
+
+// Copy a matrix with one column per MCMC draw to a new (ndraws, nrows) NumPy array
+template <class ElemType>
+object DrawsToArray(const arma::Mat<ElemType>& values, int numpy_type)
+{
+    npy_intp dims[2] = {(npy_intp)values.n_cols, (npy_intp)values.n_rows};
+    PyObject* array = PyArray_SimpleNew(2, dims, numpy_type);
+    if (array == NULL) {
+        throw_error_already_set();
+    }
+    std::copy(values.memptr(), values.memptr() + values.n_elem, (ElemType*)PyArray_DATA((PyArrayObject*)array));
+    return object(handle<>(array));
+}
+
+// Return a dictionary of the physical parameters of the CARMA model, one row per draw
+dict TransformCarmaSamplesNoGIL(const arma::mat& samples, int p, int q, int nthreads=1)
+{
+    CarmaPhysicalSamples physical;
+    {
+        ScopedGILRelease release;
+        physical = TransformCarmaSamples(samples, p, q, nthreads);
+    }
+    dict transformed;
+    transformed["ar_roots"] = DrawsToArray(physical.ar_roots, NPY_CDOUBLE);
+    transformed["ar_coefs"] = DrawsToArray(physical.ar_coefs, NPY_DOUBLE);
+    transformed["ma_coefs"] = DrawsToArray(physical.ma_coefs, NPY_DOUBLE);
+    transformed["sigma"] = DrawsToArray<double>(physical.sigma, NPY_DOUBLE);
+    transformed["psd_centroid"] = DrawsToArray(physical.psd_centroid, NPY_DOUBLE);
+    transformed["psd_width"] = DrawsToArray(physical.psd_width, NPY_DOUBLE);
+    return transformed;
+}
+
+CarmaParticles MakeCarmaParticlesNoGIL(const arma::mat& samples, std::vector<double> time, std::vector<double> y,
+                                       std::vector<double> yerr, int p, int q, bool do_zcarma=false, int nthreads=1)
+{
+    ScopedGILRelease release;
+    return MakeCarmaParticles(samples, time, y, yerr, p, q, do_zcarma, nthreads);
+}
+
+CarmaParticles UpdateCarmaParticlesNoGIL(const CarmaParticles& particles, std::vector<double> time,
+                                         std::vector<double> y, std::vector<double> yerr, int p, int q,
+                                         bool do_zcarma=false, int nthreads=1, int nmoves=10, double ess_fraction=0.5)
+{
+    ScopedGILRelease release;
+    return UpdateCarmaParticles(particles, time, y, yerr, p, q, do_zcarma, nthreads, nmoves, ess_fraction);
+}
+
+BOOST_PYTHON_FUNCTION_OVERLOADS(car1Overloads, RunCar1SamplerNoGIL, 5, 8);
+BOOST_PYTHON_FUNCTION_OVERLOADS(carmaOverloads, RunCarmaSamplerNoGIL, 8, 14);
+BOOST_PYTHON_FUNCTION_OVERLOADS(surveyOverloads, RunSurveySamplerNoGIL, 7, 8);
+BOOST_PYTHON_FUNCTION_OVERLOADS(mleOverloads, FindMLENoGIL, 5, 7);
+BOOST_PYTHON_FUNCTION_OVERLOADS(orderOverloads, ChooseOrderNoGIL, 5, 9);
+BOOST_PYTHON_FUNCTION_OVERLOADS(spectrumOverloads, CarmaSpectralBandsNoGIL, 6, 7);
+BOOST_PYTHON_FUNCTION_OVERLOADS(transformOverloads, TransformCarmaSamplesNoGIL, 3, 4);
+BOOST_PYTHON_FUNCTION_OVERLOADS(particlesOverloads, MakeCarmaParticlesNoGIL, 6, 8);
+BOOST_PYTHON_FUNCTION_OVERLOADS(updateOverloads, UpdateCarmaParticlesNoGIL, 6, 10);
+
+/*
+ NumPy interoperability. One-dimensional NumPy arrays are converted to std::vector arguments with a single copy of
+ their contiguous data, instead of being built up element by element as a vecD. The MCMC samples and the Kalman
+ Filter mean and variance are returned as read-only NumPy arrays that wrap the Armadillo memory of the C++ object
+ without copying it. These arrays hold a reference to the Python wrapper of the C++ object so that the memory stays
+ valid for as long as the arrays are in use.
+ */
+
+// Converts one-dimensional NumPy arrays to std::vector<ValueType>
+template <class ValueType, int NumpyType>
+struct VectorFromNumpy {
+    VectorFromNumpy() {
+        converter::registry::push_back(&convertible, &construct, type_id<std::vector<ValueType> >());
+    }
+    
+    static void* convertible(PyObject* obj) {
+        if (!PyArray_Check(obj) || (PyArray_NDIM((PyArrayObject*)obj) != 1) ||
+            !PyArray_CanCastSafely(PyArray_TYPE((PyArrayObject*)obj), NumpyType)) {
+            return NULL;
+        }
+        return obj;
+    }
+    
+    static void construct(PyObject* obj, converter::rvalue_from_python_stage1_data* data) {
+        // no copy is made here if the array is already contiguous and of the right type
+        handle<> array(PyArray_FROMANY(obj, NumpyType, 1, 1, NPY_ARRAY_IN_ARRAY));
+        ValueType* values = (ValueType*)PyArray_DATA((PyArrayObject*)array.get());
+        npy_intp size = PyArray_DIM((PyArrayObject*)array.get(), 0);
+        void* storage = ((converter::rvalue_from_python_storage<std::vector<ValueType> >*)data)->storage.bytes;
+        new (storage) std::vector<ValueType>(values, values + size);
+        data->convertible = storage;
+    }
+};
+
+// Converts two-dimensional NumPy arrays of MCMC samples, one row per draw, to an Armadillo matrix with one column per
+// draw. The C-ordered rows of the array are the columns of the matrix, so the data are copied once without reordering.
+struct MatrixFromNumpy {
+    MatrixFromNumpy() {
+        converter::registry::push_back(&convertible, &construct, type_id<arma::mat>());
+    }
+    
+    static void* convertible(PyObject* obj) {
+        if (!PyArray_Check(obj) || (PyArray_NDIM((PyArrayObject*)obj) != 2) ||
+            !PyArray_CanCastSafely(PyArray_TYPE((PyArrayObject*)obj), NPY_DOUBLE)) {
+            return NULL;
+        }
+        return obj;
+    }
+    
+    static void construct(PyObject* obj, converter::rvalue_from_python_stage1_data* data) {
+        handle<> array(PyArray_FROMANY(obj, NPY_DOUBLE, 2, 2, NPY_ARRAY_IN_ARRAY));
+        const double* values = (const double*)PyArray_DATA((PyArrayObject*)array.get());
+        npy_intp nrows = PyArray_DIM((PyArrayObject*)array.get(), 0);
+        npy_intp ncols = PyArray_DIM((PyArrayObject*)array.get(), 1);
+        void* storage = ((converter::rvalue_from_python_storage<arma::mat>*)data)->storage.bytes;
+        new (storage) arma::mat(values, ncols, nrows);
+        data->convertible = storage;
+    }
+};
+
+// Wrap memory owned by the C++ object held by owner as a read-only NumPy array of doubles
+static object WrapArray(const double* values, int ndim, npy_intp* dims, object owner)
+{
+    PyObject* array = PyArray_SimpleNewFromData(ndim, dims, NPY_DOUBLE, const_cast<double*>(values));
+    if (array == NULL) {
+        throw_error_already_set();
+    }
+    PyArray_CLEARFLAGS((PyArrayObject*)array, NPY_ARRAY_WRITEABLE);
+    Py_INCREF(owner.ptr());
+    PyArray_SetBaseObject((PyArrayObject*)array, owner.ptr());
+    return object(handle<>(array));
+}
+
+// Return the MCMC samples as a (sample_size, nparams) array. Each row is a column of the sample matrix.
+template <class CarmaType>
+object GetSampleArray(object self)
+{
+    CarmaType& carma = extract<CarmaType&>(self);
+    const arma::mat& samples = carma.GetSampleMatrix();
+    npy_intp dims[2] = {(npy_intp)samples.n_cols, (npy_intp)samples.n_rows};
+    return WrapArray(samples.memptr(), 2, dims, self);
+}
+
+// Return the log-posteriors of the MCMC samples
+template <class CarmaType>
+object GetLogLikeArray(object self)
+{
+    CarmaType& carma = extract<CarmaType&>(self);
+    const std::vector<double>& logposts = carma.GetLogLikeVector();
+    npy_intp dims[1] = {(npy_intp)logposts.size()};
+    return WrapArray(logposts.data(), 1, dims, self);
+}
+
+// Return the log-posterior for each row of a (ntheta, nparams) array of parameter values
+template <class CarmaType>
+object GetLogDensityBatch(CarmaType& carma, const arma::mat& thetas)
+{
+    arma::vec logdens;
+    {
+        ScopedGILRelease release;
+        logdens = carma.LogDensityBatch(thetas);
+    }
+    npy_intp dims[1] = {(npy_intp)logdens.n_elem};
+    PyObject* array = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    if (array == NULL) {
+        throw_error_already_set();
+    }
+    std::copy(logdens.begin(), logdens.end(), (double*)PyArray_DATA((PyArrayObject*)array));
+    return object(handle<>(array));
+}
+
+// Return the parameter values of the particles as a (nparticles, nparams) array
+object GetParticleTheta(object self)
+{
+    CarmaParticles& particles = extract<CarmaParticles&>(self);
+    npy_intp dims[2] = {(npy_intp)particles.theta.n_cols, (npy_intp)particles.theta.n_rows};
+    return WrapArray(particles.theta.memptr(), 2, dims, self);
+}
+
+object GetParticleLogPost(object self)
+{
+    CarmaParticles& particles = extract<CarmaParticles&>(self);
+    npy_intp dims[1] = {(npy_intp)particles.logpost.n_elem};
+    return WrapArray(particles.logpost.memptr(), 1, dims, self);
+}
+
+object GetParticleLogWeights(object self)
+{
+    CarmaParticles& particles = extract<CarmaParticles&>(self);
+    npy_intp dims[1] = {(npy_intp)particles.log_weights.n_elem};
+    return WrapArray(particles.log_weights.memptr(), 1, dims, self);
+}
+
+// Return the Kalman Filter mean and variance. These are updated in place by later calls to Filter.
+template <class FilterType>
+object GetKalmanMean(object self)
+{
+    FilterType& kfilter = extract<FilterType&>(self);
+    npy_intp dims[1] = {(npy_intp)kfilter.mean.n_elem};
+    return WrapArray(kfilter.mean.memptr(), 1, dims, self);
+}
+
+template <class FilterType>
+object GetKalmanVar(object self)
+{
+    FilterType& kfilter = extract<FilterType&>(self);
+    npy_intp dims[1] = {(npy_intp)kfilter.var.n_elem};
+    return WrapArray(kfilter.var.memptr(), 1, dims, self);
+}
 
 BOOST_PYTHON_MODULE(_carmcmc){
     import_array();
     //numeric::array::set_module_and_type("numpy", "ndarray");
 
+    VectorFromNumpy<double, NPY_DOUBLE>();
+    VectorFromNumpy<std::complex<double>, NPY_CDOUBLE>();
+    MatrixFromNumpy();
+
     class_<std::vector<double> >("vecD")
         .def(vector_indexing_suite<std::vector<double> >());
 
+    class_<std::vector<int> >("vecI")
+        .def(vector_indexing_suite<std::vector<int> >());
+
     class_<std::vector<std::vector<double > > >("vecvecD")
         .def(vector_indexing_suite<std::vector<std::vector<double> > >());
 
@@ -42,6 +372,14 @@ BOOST_PYTHON_MODULE(_carmcmc){
         .def_readwrite("first", &std::pair<double, double>::first)
         .def_readwrite("second", &std::pair<double, double>::second);
 
+    class_<std::pair<std::vector<double>, std::vector<double> > >("pairVecD")
+        .def_readwrite("first", &std::pair<std::vector<double>, std::vector<double> >::first)
+        .def_readwrite("second", &std::pair<std::vector<double>, std::vector<double> >::second);
+
+    class_<std::pair<double, std::vector<double> > >("pairDVecD")
+        .def_readwrite("first", &std::pair<double, std::vector<double> >::first)
+        .def_readwrite("second", &std::pair<double, std::vector<double> >::second);
+
     // carpack.hpp
     class_<CARMA_Base<double>, boost::noncopyable>("CARMA_Base_double", no_init);
     class_<CARMA_Base<arma::vec>, boost::noncopyable>("CARMA_Base_arma", no_init);
@@ -50,31 +388,84 @@ BOOST_PYTHON_MODULE(_carmcmc){
         .def(init<bool,std::string,std::vector<double>,std::vector<double>,std::vector<double>,optional<double> >())
         .def("getLogPrior", &CAR1::getLogPrior)
         .def("getLogDensity", &CAR1::getLogDensity)
-        .def("getSamples", &CAR1::getSamples)
-        .def("GetLogLikes", &CAR1::GetLogLikes)  // Base class parameters.hpp
+        .def("getLogDensityBatch", &GetLogDensityBatch<CAR1>)
+        .def("getOnlineFilter", &CAR1::getOnlineFilter)
+        .def("getLogDensityGradient", &CAR1::getLogDensityGradient)
+        .def("getSamples", &GetSampleArray<CAR1>)
+        .def("GetLogLikes", &GetLogLikeArray<CAR1>)
+        .def("SetFilterThreads", &CAR1::SetFilterThreads)
     ;
 
     class_<CARp, bases<CARMA_Base<arma::vec> >, std::shared_ptr<CARp> >("CARp", no_init)
         .def(init<bool,std::string,std::vector<double>,std::vector<double>,std::vector<double>,int,optional<double> >())
         .def("getLogPrior", &CARp::getLogPrior)
         .def("getLogDensity", &CARp::getLogDensity)
-        .def("getSamples", &CARp::getSamples)
-        .def("GetLogLikes", &CARp::GetLogLikes)
+        .def("getLogDensityBatch", &GetLogDensityBatch<CARp>)
+        .def("getOnlineFilter", &CARp::getOnlineFilter)
+        .def("getLogDensityGradient", &CARp::getLogDensityGradient)
+        .def("getSamples", &GetSampleArray<CARp>)
+        .def("GetLogLikes", &GetLogLikeArray<CARp>)
         .def("SetMLE", &CARp::SetMLE)
+        .def("SetRealFilter", &CARp::SetRealFilter)
+        .def("SetFilterThreads", &CARp::SetFilterThreads)
     ;
 
     class_<CARMA, bases<CARp>, std::shared_ptr<CARMA> >("CARMA", no_init)
         .def(init<bool,std::string,std::vector<double>,std::vector<double>,std::vector<double>,int,int,optional<double> >())
         .def("getLogPrior", &CARMA::getLogPrior)
         .def("getLogDensity", &CARMA::getLogDensity)
-        .def("getSamples", &CARMA::getSamples)
-        .def("GetLogLikes", &CARMA::GetLogLikes)
+        .def("getLogDensityBatch", &GetLogDensityBatch<CARMA>)
+        .def("getOnlineFilter", &CARMA::getOnlineFilter)
+        .def("getLogDensityGradient", &CARMA::getLogDensityGradient)
+        .def("getSamples", &GetSampleArray<CARMA>)
+        .def("GetLogLikes", &GetLogLikeArray<CARMA>)
         .def("SetMLE", &CARMA::SetMLE)
+        .def("SetRealFilter", &CARMA::SetRealFilter)
+        .def("SetFilterThreads", &CARMA::SetFilterThreads)
     ;
 
     // carmcmc.hpp
-    def("run_mcmc_car1", RunCar1Sampler, car1Overloads());
-    def("run_mcmc_carma", RunCarmaSampler, carmaOverloads());
+    def("run_mcmc_car1", RunCar1SamplerNoGIL, car1Overloads());
+    def("run_mcmc_carma", RunCarmaSamplerNoGIL, carmaOverloads());
+    def("run_survey", RunSurveySamplerNoGIL, surveyOverloads());
+    class_<CarmaMLE>("CarmaMLE")
+        .def_readonly("theta", &CarmaMLE::theta)
+        .def_readonly("logdens", &CarmaMLE::logdens)
+        .def_readonly("hessian", &CarmaMLE::hessian)
+        .def_readonly("niter", &CarmaMLE::niter)
+        .def_readonly("converged", &CarmaMLE::converged)
+    ;
+    def("find_mle", FindMLENoGIL, mleOverloads());
+    class_<CarmaOrderSearch>("CarmaOrderSearch")
+        .def_readonly("p", &CarmaOrderSearch::p)
+        .def_readonly("q", &CarmaOrderSearch::q)
+        .def_readonly("logdens", &CarmaOrderSearch::logdens)
+        .def_readonly("aicc", &CarmaOrderSearch::aicc)
+        .def_readonly("ntrials", &CarmaOrderSearch::ntrials)
+        .def_readonly("best_p", &CarmaOrderSearch::best_p)
+        .def_readonly("best_q", &CarmaOrderSearch::best_q)
+        .def_readonly("best_mle", &CarmaOrderSearch::best_mle)
+    ;
+    def("choose_order", ChooseOrderNoGIL, orderOverloads());
+    class_<CarmaSpectrum>("CarmaSpectrum")
+        .def_readonly("psd", &CarmaSpectrum::psd)
+        .def_readonly("acf", &CarmaSpectrum::acf)
+    ;
+    def("carma_spectrum", CarmaSpectralBandsNoGIL, spectrumOverloads());
+    def("transform_samples", TransformCarmaSamplesNoGIL, transformOverloads());
+    class_<CarmaParticles>("CarmaParticles")
+        .add_property("theta", &GetParticleTheta)
+        .add_property("logpost", &GetParticleLogPost)
+        .add_property("log_weights", &GetParticleLogWeights)
+        .def_readonly("ndata", &CarmaParticles::ndata)
+        .def_readonly("last_time", &CarmaParticles::last_time)
+        .def_readonly("max_stdev", &CarmaParticles::max_stdev)
+        .def_readonly("log_evidence", &CarmaParticles::log_evidence)
+        .def_readonly("ess", &CarmaParticles::ess)
+        .def_readonly("accept_rate", &CarmaParticles::accept_rate)
+    ;
+    def("make_particles", MakeCarmaParticlesNoGIL, particlesOverloads());
+    def("update_particles", UpdateCarmaParticlesNoGIL, updateOverloads());
 
     // kfilter.hpp
     class_<KalmanFilter<double>, boost::noncopyable>("KalmanFilter_double", no_init);
@@ -83,20 +474,49 @@ BOOST_PYTHON_MODULE(_carmcmc){
     class_<KalmanFilter1, bases<KalmanFilter<double> >, std::shared_ptr<KalmanFilter1> >("KalmanFilter1", no_init)
         .def(init<std::vector<double>,std::vector<double>,std::vector<double> >())
         .def(init<std::vector<double>,std::vector<double>,std::vector<double>,double,double>())
-        .def("Simulate", &KalmanFilter1::Simulate)
-        .def("Filter", &KalmanFilter1::Filter)
-        .def("Predict", &KalmanFilter1::Predict)
-        .def("GetMean", &KalmanFilter1::GetMeanSvec)
-        .def("GetVar", &KalmanFilter1::GetVarSvec)
+        .def("Simulate", &SimulateNoGIL<KalmanFilter1>)
+        .def("Simulate", &SimulateBatchNoGIL<KalmanFilter1>)
+        .def("Filter", &FilterNoGIL<KalmanFilter1>)
+        .def("ParallelLogLikelihood", &ParallelLogLikelihoodNoGIL<KalmanFilter1>)
+        .def("Predict", &PredictNoGIL<KalmanFilter1>)
+        .def("PredictBatch", &PredictBatchNoGIL<KalmanFilter1>)
+        .def("MakeOnlineFilter", &MakeOnlineFilterNoGIL<KalmanFilter1>)
+        .def("GetMean", &GetKalmanMean<KalmanFilter1>)
+        .def("GetVar", &GetKalmanVar<KalmanFilter1>)
     ;
     class_<KalmanFilterp, bases<KalmanFilter<arma::cx_vec> >, std::shared_ptr<KalmanFilterp> >("KalmanFilterp", no_init)
         .def(init<std::vector<double>,std::vector<double>,std::vector<double> >())
         .def(init<std::vector<double>,std::vector<double>,std::vector<double>,double,
              std::vector<std::complex<double> >,std::vector<double> >())
-        .def("Simulate", &KalmanFilterp::Simulate)
-        .def("Filter", &KalmanFilterp::Filter)
-        .def("Predict", &KalmanFilterp::Predict)
-        .def("GetMean", &KalmanFilterp::GetMeanSvec)
-        .def("GetVar", &KalmanFilterp::GetVarSvec)
+        .def("Simulate", &SimulateNoGIL<KalmanFilterp>)
+        .def("Simulate", &SimulateBatchNoGIL<KalmanFilterp>)
+        .def("Filter", &FilterNoGIL<KalmanFilterp>)
+        .def("ParallelLogLikelihood", &ParallelLogLikelihoodNoGIL<KalmanFilterp>)
+        .def("Predict", &PredictNoGIL<KalmanFilterp>)
+        .def("PredictBatch", &PredictBatchNoGIL<KalmanFilterp>)
+        .def("MakeOnlineFilter", &MakeOnlineFilterNoGIL<KalmanFilterp>)
+        .def("GetMean", &GetKalmanMean<KalmanFilterp>)
+        .def("GetVar", &GetKalmanVar<KalmanFilterp>)
+    ;
+    class_<OnlineFilterState>("OnlineFilterState")
+        .def_readonly("ndata", &OnlineFilterState::ndata)
+        .def_readonly("time", &OnlineFilterState::time)
+        .def_readonly("loglik", &OnlineFilterState::loglik)
+    ;
+    class_<OnlineFilterUpdate>("OnlineFilterUpdate")
+        .def_readonly("mean", &OnlineFilterUpdate::mean)
+        .def_readonly("var", &OnlineFilterUpdate::var)
+        .def_readonly("loglik", &OnlineFilterUpdate::loglik)
+    ;
+    class_<OnlineKalmanFilter>("OnlineKalmanFilter", no_init)
+        .def("Append", &OnlineKalmanFilter::Append)
+        .def("Predict", &OnlineKalmanFilter::Predict)
+        .def("Reset", &OnlineKalmanFilter::Reset)
+        .def("Checkpoint", &OnlineKalmanFilter::Checkpoint)
+        .def("Restore", &OnlineKalmanFilter::Restore)
+        .def("SetTimeSeriesMean", &OnlineKalmanFilter::SetTimeSeriesMean)
+        .def("SetMeasErrScale", &OnlineKalmanFilter::SetMeasErrScale)
+        .def("GetLogLikelihood", &OnlineKalmanFilter::GetLogLikelihood)
+        .def("__len__", &OnlineKalmanFilter::size)
     ;
 };
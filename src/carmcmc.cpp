@@ -18,6 +18,17 @@
 #include <vector>
 #include <utility>
 #include <numeric>
+#include <sstream>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+#include <functional>
+#include <exception>
+#include <cmath>
+#include <boost/random/seed_seq.hpp>
 // Include the MCMC sampler header files
 #include <random.hpp>
 #include <proposals.hpp>
@@ -29,8 +40,12 @@
 
 std::shared_ptr<CAR1>
 RunCar1Sampler(int sample_size, int burnin, std::vector<double> time, std::vector<double> y, std::vector<double> yerr, 
-	       int thin, const std::vector<double>& init)
+	       int thin, const std::vector<double>& init, std::string trace_file)
 {
+    // The starting values are drawn by Armadillo, so seed its generator from this thread's generator. Otherwise fits
+    // run concurrently from different threads would start from the same values.
+    arma::arma_rng::set_seed(rng());
+    
     int p = 1;    
     double sum = std::accumulate(y.begin(), y.end(), 0.0);
     double mean = sum / y.size();
@@ -64,6 +79,9 @@ RunCar1Sampler(int sample_size, int burnin, std::vector<double> time, std::vecto
 	// Construct the parameter object
     CAR1 Car1Par(true, "CAR(1)", time, y, yerr);
     Car1Par.SetPrior(max_stdev);
+    if (!trace_file.empty()) {
+        Car1Par.SetTraceFile(trace_file);
+    }
 
     // Add Robust Adaptive Metropolis Step
     CarModel.AddStep( new AdaptiveMetro(Car1Par, RAMProp, prop_covar, target_rate, burnin) );
@@ -76,24 +94,124 @@ RunCar1Sampler(int sample_size, int burnin, std::vector<double> time, std::vecto
     return retObject;
 }
 
+// Return a new CAR(p), CARMA(p,q), or ZCARMA(p) parameter object
+static CARp* NewCarmaParameter(bool track, std::shared_ptr<const TimeSeriesData> data, int p, int q, bool do_zcarma,
+                               double temperature=1.0)
+{
+    if (do_zcarma) {
+        return new ZCAR(track, "ZCAR(p) Parameters", data, p, temperature);
+    } else if (q == 0) {
+        return new CARp(track, "CAR(p) Parameters", data, p, temperature);
+    } else {
+        return new CARMA(track, "CARMA(p,q) Parameters", data, p, q, temperature);
+    }
+}
+
+// Sample a CARMA(p,q) model with the affine-invariant ensemble sampler. The walkers are split into two halves, and each
+// half is split into one block per thread. Each block is moved by a StretchStep, which evaluates the proposals for all of
+// its walkers in one pass over the data. Every walker draws its random numbers from its own stream, so the results do
+// not depend on the number of threads.
+static std::shared_ptr<CARp>
+RunCarmaEnsembleSampler(int sample_size, int burnin, std::shared_ptr<const TimeSeriesData> data, double max_stdev,
+                        int p, int q, int nwalkers, bool do_zcarma, int thin, const std::vector<double>& init,
+                        int nthreads, std::string trace_file)
+{
+    int nparams = 3 + p + q;
+    if (do_zcarma) {
+        nparams = 3 + p;
+    }
+    // The stretch move needs at least as many walkers in each half as there are parameters
+    nwalkers = std::max(nwalkers, 2 * nparams);
+    nwalkers += nwalkers % 2;
+    int half = nwalkers / 2;
+    
+    Ensemble<CARp> walkers;
+    for (int k=0; k<nwalkers; k++) {
+        walkers.AddObject(NewCarmaParameter(false, data, p, q, do_zcarma));
+        walkers[k].SetPrior(max_stdev);
+    }
+    // The samples for all of the walkers are collected in a separate parameter object, which is what is returned
+    std::unique_ptr<CARp> collector(NewCarmaParameter(true, data, p, q, do_zcarma));
+    collector->SetPrior(max_stdev);
+    if (!trace_file.empty()) {
+        collector->SetTraceFile(trace_file);
+    }
+    
+    // Each walker proposes a move toward or away from a walker in the other half
+    RandomStreams walker_streams(rng());
+    Ensemble<StretchProposal<CARp> > proposals;
+    for (int k=0; k<nwalkers; k++) {
+        proposals.AddObject(new StretchProposal<CARp>(walkers, k));
+        proposals[k].SetRandomGenerator(walker_streams.Stream(k));
+        if (k < half) {
+            proposals[k].SetComplement(half, half);
+        } else {
+            proposals[k].SetComplement(0, half);
+        }
+    }
+    
+    // Report average acceptance rates at end of sampler
+    int report_iter = burnin + thin * sample_size;
+    
+    // The first half is updated in stage 0 and the second half in stage 1, with the blocks in each stage run
+    // concurrently
+    EnsembleSampler<CARp> CarModel(walkers, *collector, sample_size, burnin, thin, nthreads);
+    int nblocks = std::min(std::max(nthreads, 1), half);
+    for (int stage=0; stage<2; stage++) {
+        for (int b=0; b<nblocks; b++) {
+            int first = stage * half + (b * half) / nblocks;
+            int last = stage * half + ((b + 1) * half) / nblocks;
+            CarModel.AddChainStep(new StretchStep<CARp>(walkers, proposals, first, last, report_iter), stage);
+        }
+    }
+    
+    arma::vec armaInit = arma::conv_to<arma::vec>::from(init);
+    CarModel.Run(armaInit);
+    
+    std::shared_ptr<CARp> retObject;
+    if (do_zcarma) {
+        retObject = std::make_shared<ZCAR>(*(dynamic_cast<ZCAR*>(collector.get())));
+    } else {
+        if (q == 0) {
+            retObject = std::make_shared<CARp>(*collector);
+        } else {
+            retObject = std::make_shared<CARMA>(*(dynamic_cast<CARMA*>(collector.get())));
+        }
+    }
+    
+    return retObject;
+}
+
 std::shared_ptr<CARp>
 RunCarmaSampler(int sample_size, int burnin, std::vector<double> time, std::vector<double> y,
                 std::vector<double> yerr, int p, int q, int nwalkers, bool do_zcarma,
-                int thin, const std::vector<double>& init)
+                int thin, const std::vector<double>& init, int nthreads, std::string trace_file, bool ensemble)
 {
     assert(p > 1);
+    // Seed the Armadillo generator used for the starting values from this thread's generator (see RunCar1Sampler)
+    arma::arma_rng::set_seed(rng());
+    
     double sum = std::accumulate(y.begin(), y.end(), 0.0);
     double mean = sum / y.size();
     double sq_sum = std::inner_product(y.begin(), y.end(), y.begin(), 0.0);
     double var = (sq_sum / y.size() - mean * mean);
     double max_stdev = 10.0 * sqrt(var);
     
+    if (ensemble) {
+        std::shared_ptr<const TimeSeriesData> data = std::make_shared<const TimeSeriesData>(time, y, yerr);
+        return RunCarmaEnsembleSampler(sample_size, burnin, data, max_stdev, p, q, nwalkers, do_zcarma, thin, init,
+                                       nthreads, trace_file);
+    }
+    
     // Set the temperature ladder. The logarithms of the temperatures are on a linear grid
     double max_temperature = 100.0;
     
     arma::vec temp_ladder = arma::linspace<arma::vec>(0.0, log(max_temperature), nwalkers);
     temp_ladder = arma::exp(temp_ladder);
     
+    // The data are sorted and checked once, and shared by all of the walkers and their Kalman Filters
+    std::shared_ptr<const TimeSeriesData> data = std::make_shared<const TimeSeriesData>(time, y, yerr);
+    
     Ensemble<CARp> CarEnsemble;
     // Add the parameters to the ensemble, starting with the coolest chain
 	for (int i=0; i<nwalkers; i++)
@@ -102,14 +220,14 @@ RunCarmaSampler(int sample_size, int burnin, std::vector<double> time, std::vect
         if (!do_zcarma) {
             if (q == 0) {
                 // just doing a CAR(p) model
-                CarEnsemble.AddObject(new CARp(false, "CAR(p) Parameters", time, y, yerr, p, temp_ladder(i)));
+                CarEnsemble.AddObject(new CARp(false, "CAR(p) Parameters", data, p, temp_ladder(i)));
             } else {
                 // doing a CARMA(p,q) model
-                CarEnsemble.AddObject(new CARMA(false, "CARMA(p,q) Parameters", time, y, yerr, p, q, temp_ladder(i)));
+                CarEnsemble.AddObject(new CARMA(false, "CARMA(p,q) Parameters", data, p, q, temp_ladder(i)));
             }
         } else {
             // doing a ZCARMA(p) model
-            CarEnsemble.AddObject(new ZCAR(false, "ZCAR(p) Parameters", time, y, yerr, p, temp_ladder(i)));
+            CarEnsemble.AddObject(new ZCAR(false, "ZCAR(p) Parameters", data, p, temp_ladder(i)));
         }
 		// Set the prior parameters
         CarEnsemble[i].SetPrior(max_stdev);
@@ -135,26 +253,47 @@ RunCarmaSampler(int sample_size, int burnin, std::vector<double> time, std::vect
     prop_covar(0,0) = 2.0 * var * var / y.size();
     prop_covar(2,2) = var / y.size();
     
-	// Instantiate base proposal object
-    StudentProposal RAMProp(8.0, 1.0);
-	//NormalProposal RAMProp(1.0);
     double target_rate = 0.25;
     
-    // Instantiate MCMC Sampler object for CAR process
-    Sampler CarModel(sample_size, burnin, thin);
+    // Each tempered chain draws its random numbers from its own stream, keyed by the chain index, so that the chains
+    // can be advanced concurrently and the results do not depend on the number of threads. The exchange steps share
+    // the last stream. The master seed is drawn from the global generator.
+    RandomStreams chain_streams(rng());
+    boost::ptr_vector<StudentProposal> chain_proposals;
+    for (int i=0; i<nwalkers; i++) {
+        // Instantiate base proposal object
+        chain_proposals.push_back(new StudentProposal(8.0, 1.0));
+        chain_proposals[i].SetRandomGenerator(chain_streams.Stream(i));
+    }
+    
+    // Instantiate MCMC Sampler object for CAR process. The Robust Adaptive Metropolis steps for the tempered chains
+    // are run concurrently, followed by the exchange steps.
+    TemperedSampler CarModel(sample_size, burnin, thin, nthreads);
     
     // Add the steps to the sampler, starting with the hottest chain first
     for (int i=nwalkers-1; i>0; i--) {
-        // First add Robust Adaptive Metropolis Step
-        CarModel.AddStep( new AdaptiveMetro(CarEnsemble[i], RAMProp, prop_covar, target_rate, burnin) );
-        // Now add Exchange steps
-        CarModel.AddStep( new ExchangeStep<arma::vec, CARp>(CarEnsemble[i], i, CarEnsemble, report_iter) );
+        AdaptiveMetro* RAM = new AdaptiveMetro(CarEnsemble[i], chain_proposals[i], prop_covar, target_rate, burnin);
+        RAM->SetRandomGenerator(chain_streams.Stream(i));
+        CarModel.AddChainStep(RAM);
     }
     
     // Make sure we set this parameter to be tracked
     CarEnsemble[0].SetTracking(true);
+    if (!trace_file.empty()) {
+        CarEnsemble[0].SetTraceFile(trace_file);
+    }
     // Add in coolest chain. This is the chain that is actually moving in the posterior.
-    CarModel.AddStep( new AdaptiveMetro(CarEnsemble[0], RAMProp, prop_covar, target_rate, burnin) );
+    AdaptiveMetro* RAM = new AdaptiveMetro(CarEnsemble[0], chain_proposals[0], prop_covar, target_rate, burnin);
+    RAM->SetRandomGenerator(chain_streams.Stream(0));
+    CarModel.AddChainStep(RAM);
+    
+    // Now add Exchange steps
+    for (int i=nwalkers-1; i>0; i--) {
+        ExchangeStep<arma::vec, CARp>* Exchange = new ExchangeStep<arma::vec, CARp>(CarEnsemble[i], i, CarEnsemble,
+                                                                                    report_iter);
+        Exchange->SetRandomGenerator(chain_streams.Stream(nwalkers));
+        CarModel.AddExchangeStep(Exchange);
+    }
     
     // Now run the MCMC sampler. The samples will be dumped in the
     // output file provided by the user.
@@ -175,3 +314,1052 @@ RunCarmaSampler(int sample_size, int burnin, std::vector<double> time, std::vect
     
     return retObject;
 }
+
+// Read the survey manifest
+std::vector<SurveyObject> ReadSurveyManifest(std::string manifest_file)
+{
+    std::ifstream manifest(manifest_file.c_str());
+    if (!manifest.is_open()) {
+        throw std::runtime_error("Cannot read survey manifest " + manifest_file);
+    }
+    std::vector<SurveyObject> objects;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (line.empty() || (line[0] == '#')) {
+            continue;
+        }
+        std::istringstream fields(line);
+        SurveyObject object;
+        if (!(fields >> object.name >> object.data_file >> object.p >> object.q)) {
+            throw std::runtime_error("Cannot parse line in survey manifest: " + line);
+        }
+        if (!(fields >> object.ndata)) {
+            // count the number of data points
+            std::ifstream data(object.data_file.c_str());
+            std::string data_line;
+            object.ndata = 0;
+            while (std::getline(data, data_line)) {
+                if (!data_line.empty()) {
+                    object.ndata++;
+                }
+            }
+        }
+        objects.push_back(object);
+    }
+    return objects;
+}
+
+/*
+ Work-stealing scheduler for the survey objects. The objects are first dealt out to the threads so that each thread
+ has roughly the same total cost, with each thread's queue sorted from the most expensive object to the least
+ expensive. Each thread takes objects from the front of its own queue, and when its queue is empty it steals from the
+ back of the other threads' queues, so the threads stay busy even when the costs of the objects differ by orders of
+ magnitude.
+ */
+class SurveyScheduler {
+public:
+    SurveyScheduler(std::vector<double>& cost, int nthreads) : queues_(nthreads), queue_mutex_(nthreads) {
+        std::vector<int> order(cost.size());
+        for (int i=0; i<order.size(); i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return cost[a] > cost[b]; });
+        std::vector<double> total_cost(nthreads, 0.0);
+        for (int i=0; i<order.size(); i++) {
+            int ithread = std::min_element(total_cost.begin(), total_cost.end()) - total_cost.begin();
+            queues_[ithread].push_back(order[i]);
+            total_cost[ithread] += cost[order[i]];
+        }
+    }
+    
+    // Return the index of the next object for thread ithread to fit, or -1 if there are none left
+    int Next(int ithread) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_[ithread]);
+            if (!queues_[ithread].empty()) {
+                int index = queues_[ithread].front();
+                queues_[ithread].pop_front();
+                return index;
+            }
+        }
+        int nthreads = queues_.size();
+        for (int k=1; k<nthreads; k++) {
+            int victim = (ithread + k) % nthreads;
+            std::lock_guard<std::mutex> lock(queue_mutex_[victim]);
+            if (!queues_[victim].empty()) {
+                int index = queues_[victim].back();
+                queues_[victim].pop_back();
+                return index;
+            }
+        }
+        return -1;
+    }
+    
+private:
+    std::vector<std::deque<int> > queues_;
+    std::vector<std::mutex> queue_mutex_;
+};
+
+// Seed the random number generators for the calling thread from a base seed and a task index, so that the random
+// numbers used by a task do not depend on which thread runs it.
+static void SeedThreadRng(unsigned long seed, unsigned int index)
+{
+    std::vector<boost::uint32_t> seed_values(3);
+    seed_values[0] = (boost::uint32_t)(seed & 0xffffffffUL);
+    seed_values[1] = (boost::uint32_t)((seed >> 16) >> 16);
+    seed_values[2] = index;
+    boost::random::seed_seq seq(seed_values.begin(), seed_values.end());
+    rng.seed(seq);
+    arma::arma_rng::set_seed(rng());
+}
+
+// Fit a CARMA(p,q) model to one survey object and write the samples to disk. The random number generators for the
+// calling thread are seeded from the survey seed and the object index, so the results do not depend on which thread
+// fits the object.
+static void FitSurveyObject(SurveyObject& object, int index, std::string output_dir, int sample_size, int burnin,
+                            int nwalkers, unsigned long seed, int thin)
+{
+    SeedThreadRng(seed, index);
+    
+    arma::mat data;
+    if (!data.load(object.data_file, arma::raw_ascii) || (data.n_cols < 3)) {
+        throw std::runtime_error("Cannot read light curve " + object.data_file);
+    }
+    std::vector<double> time = arma::conv_to<std::vector<double> >::from(data.col(0));
+    std::vector<double> y = arma::conv_to<std::vector<double> >::from(data.col(1));
+    std::vector<double> yerr = arma::conv_to<std::vector<double> >::from(data.col(2));
+    
+    std::vector<arma::vec> samples;
+    std::vector<double> logposts;
+    if (object.p == 1) {
+        std::shared_ptr<CAR1> car1 = RunCar1Sampler(sample_size, burnin, time, y, yerr, thin);
+        samples = car1->GetSamples();
+        logposts = car1->GetLogLikes();
+    } else {
+        std::shared_ptr<CARp> carma = RunCarmaSampler(sample_size, burnin, time, y, yerr, object.p, object.q,
+                                                      nwalkers, false, thin);
+        samples = carma->GetSamples();
+        logposts = carma->GetLogLikes();
+    }
+    
+    if (samples.empty()) {
+        throw std::runtime_error("The sampler returned no samples for " + object.name);
+    }
+    // each row contains the log-posterior followed by the parameter values
+    arma::mat output(samples.size(), samples[0].n_elem + 1);
+    for (int i=0; i<samples.size(); i++) {
+        output(i,0) = logposts[i];
+        output(i,arma::span(1,samples[i].n_elem)) = samples[i].t();
+    }
+    std::string output_file = output_dir + "/" + object.name + "_samples.dat";
+    if (!output.save(output_file, arma::raw_ascii)) {
+        throw std::runtime_error("Cannot write samples to " + output_file);
+    }
+}
+
+// Fit CARMA(p,q) models to all of the light curves in the survey manifest
+int RunSurveySampler(std::string manifest_file, std::string output_dir, int sample_size, int burnin, int nwalkers,
+                     int nthreads, unsigned long seed, int thin)
+{
+    if (sample_size < 1) {
+        throw std::invalid_argument("The sample size must be at least one.");
+    }
+    std::vector<SurveyObject> objects = ReadSurveyManifest(manifest_file);
+    nthreads = std::max(1, std::min(nthreads, (int)objects.size()));
+    
+    // create the output directory before any of the fits are run, so a bad path fails immediately
+    boost::system::error_code error;
+    boost::filesystem::create_directories(output_dir, error);
+    if (!boost::filesystem::is_directory(output_dir)) {
+        throw std::runtime_error("Cannot create output directory " + output_dir);
+    }
+    
+    // The cost of the Kalman filter is O(n p^2), and there are nwalkers tempered chains for p > 1
+    std::vector<double> cost(objects.size());
+    for (int i=0; i<objects.size(); i++) {
+        double p = objects[i].p;
+        cost[i] = objects[i].ndata * p * p * (objects[i].p > 1 ? nwalkers : 1);
+    }
+    SurveyScheduler scheduler(cost, nthreads);
+    
+    std::string summary_file = output_dir + "/survey_summary.txt";
+    std::ofstream summary(summary_file.c_str(), std::ios::app);
+    if (!summary.is_open()) {
+        throw std::runtime_error("Cannot write survey summary to " + summary_file);
+    }
+    std::mutex summary_mutex;
+    int nsuccess = 0;
+    
+    std::vector<std::thread> workers;
+    for (int ithread=0; ithread<nthreads; ithread++) {
+        workers.push_back(std::thread([&, ithread]() {
+            int index;
+            while ((index = scheduler.Next(ithread)) >= 0) {
+                std::string status = "ok";
+                try {
+                    FitSurveyObject(objects[index], index, output_dir, sample_size, burnin, nwalkers, seed, thin);
+                } catch (std::exception& e) {
+                    status = std::string("failed: ") + e.what();
+                }
+                // stream the result for this object to disk as soon as it is done
+                std::lock_guard<std::mutex> lock(summary_mutex);
+                summary << objects[index].name << " " << objects[index].p << " " << objects[index].q << " "
+                    << objects[index].ndata << " " << status << std::endl;
+                if (status == "ok") {
+                    nsuccess++;
+                }
+            }
+        }));
+    }
+    for (int ithread=0; ithread<nthreads; ithread++) {
+        workers[ithread].join();
+    }
+    
+    return nsuccess;
+}
+
+// Project theta onto the box lower <= theta <= upper
+static arma::vec ClampToBounds(arma::vec theta, arma::vec& lower, arma::vec& upper)
+{
+    for (int j=0; j<theta.n_elem; j++) {
+        theta(j) = std::min(std::max(theta(j), lower(j)), upper(j));
+    }
+    return theta;
+}
+
+/*
+ Minimize -log(density) subject to lower <= theta <= upper using a projected quasi-Newton method. Variables that are
+ at a bound with the gradient pointing out of the box are held fixed, a BFGS approximation to the inverse Hessian
+ gives the search direction for the remaining variables, and the step length is found by backtracking along the
+ projected path. Infinite bounds leave a parameter unconstrained. Returns the number of iterations.
+ */
+template <class CarmaType>
+static int MaximizeBounded(CarmaType& carma, arma::vec& theta, arma::vec& lower, arma::vec& upper, double& logdens,
+                           bool& converged, int maxiter=1000)
+{
+    const double pgtol = 1e-5; // tolerance on the projected gradient
+    const double ftol = 1e7 * arma::datum::eps; // tolerance on the relative change in the log-density
+    int nparams = theta.n_elem;
+    converged = false;
+    
+    theta = ClampToBounds(theta, lower, upper);
+    arma::vec grad;
+    logdens = carma.LogDensityGradient(theta, grad);
+    if (!arma::is_finite(logdens)) {
+        return 0;
+    }
+    grad = -grad; // gradient of the objective function, -logdens
+    
+    arma::mat hinv(nparams, nparams, arma::fill::eye); // approximation to the inverse Hessian
+    bool steepest_descent = true;
+    int iter;
+    for (iter=0; iter<maxiter; iter++) {
+        arma::vec projected_grad = theta - ClampToBounds(theta - grad, lower, upper);
+        if (arma::max(arma::abs(projected_grad)) < pgtol) {
+            converged = true;
+            break;
+        }
+        // hold the parameters that are pinned against a bound fixed
+        arma::vec free_params(nparams, arma::fill::ones);
+        for (int j=0; j<nparams; j++) {
+            if ((theta(j) <= lower(j) && grad(j) > 0.0) || (theta(j) >= upper(j) && grad(j) < 0.0)) {
+                free_params(j) = 0.0;
+            }
+        }
+        arma::mat hinv_free = hinv % (free_params * free_params.t());
+        arma::vec direction = -hinv_free * (grad % free_params);
+        if (arma::dot(grad, direction) >= 0.0) {
+            // not a descent direction, so restart from steepest descent
+            hinv.eye();
+            steepest_descent = true;
+            direction = -grad % free_params;
+        }
+        
+        // backtracking line search along the projected path
+        double step = 1.0;
+        arma::vec theta_new, grad_new;
+        double logdens_new = -arma::datum::inf;
+        bool sufficient_decrease = false;
+        for (int k=0; k<40; k++) {
+            theta_new = ClampToBounds(theta + step * direction, lower, upper);
+            logdens_new = carma.LogDensityGradient(theta_new, grad_new);
+            if (arma::is_finite(logdens_new) &&
+                (-logdens_new <= -logdens + 1e-4 * arma::dot(grad, theta_new - theta))) {
+                sufficient_decrease = true;
+                break;
+            }
+            step *= 0.5;
+        }
+        if (!sufficient_decrease) {
+            if (!steepest_descent) {
+                // try again from steepest descent before giving up
+                hinv.eye();
+                steepest_descent = true;
+                continue;
+            }
+            break;
+        }
+        grad_new = -grad_new;
+        
+        // BFGS update of the inverse Hessian, skipped when the curvature condition fails
+        arma::vec s = theta_new - theta;
+        arma::vec yvec = grad_new - grad;
+        double sy = arma::dot(s, yvec);
+        if (sy > 1e-10 * arma::norm(s) * arma::norm(yvec)) {
+            double rho = 1.0 / sy;
+            arma::mat eye_minus = arma::eye(nparams, nparams) - rho * s * yvec.t();
+            hinv = eye_minus * hinv * eye_minus.t() + rho * s * s.t();
+            steepest_descent = false;
+        }
+        
+        double relative_change = (logdens_new - logdens) /
+            std::max(std::max(std::abs(logdens), std::abs(logdens_new)), 1.0);
+        theta = theta_new;
+        grad = grad_new;
+        logdens = logdens_new;
+        if (relative_change <= ftol) {
+            converged = true;
+            break;
+        }
+    }
+    
+    return iter;
+}
+
+// Hessian of the log-density at theta from central differences of its analytic gradient
+template <class CarmaType>
+static arma::mat LogDensityHessian(CarmaType& carma, arma::vec theta)
+{
+    int nparams = theta.n_elem;
+    arma::mat hessian(nparams, nparams);
+    arma::vec grad_plus, grad_minus;
+    for (int j=0; j<nparams; j++) {
+        double h = 1e-5 * std::max(std::abs(theta(j)), 1.0);
+        arma::vec theta_plus = theta;
+        arma::vec theta_minus = theta;
+        theta_plus(j) += h;
+        theta_minus(j) -= h;
+        carma.LogDensityGradient(theta_plus, grad_plus);
+        carma.LogDensityGradient(theta_minus, grad_minus);
+        hessian.col(j) = (grad_plus - grad_minus) / (2.0 * h);
+    }
+    
+    return 0.5 * (hessian + hessian.t());
+}
+
+// Run task(0), ..., task(ntasks-1) over nthreads threads. The tasks are handed out in order from a shared counter. If a
+// task throws, the remaining tasks are not started, and the exception is rethrown on the calling thread after all of the
+// threads have finished.
+static void ParallelFor(int ntasks, int nthreads, std::function<void(int)> task)
+{
+    std::atomic<int> next_task(0);
+    int nworkers = std::max(std::min(nthreads, ntasks), 1);
+    std::vector<std::exception_ptr> errors(nworkers);
+    auto run_tasks = [&](int iworker) {
+        try {
+            int itask;
+            while ((itask = next_task++) < ntasks) {
+                task(itask);
+            }
+        } catch (...) {
+            errors[iworker] = std::current_exception();
+            next_task = ntasks;
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int iworker=1; iworker<nworkers; iworker++) {
+        workers.push_back(std::thread(run_tasks, iworker));
+    }
+    run_tasks(0);
+    for (int ithread=0; ithread<workers.size(); ithread++) {
+        workers[ithread].join();
+    }
+    for (int iworker=0; iworker<nworkers; iworker++) {
+        if (errors[iworker]) {
+            std::rethrow_exception(errors[iworker]);
+        }
+    }
+}
+
+// Save the random number generator of the calling thread, and restore it when the guard goes out of scope. ParallelFor
+// also runs tasks on the calling thread, and tasks that call SeedThreadRng would otherwise leave the caller's generators
+// in a state that depends on which tasks it ran. Armadillo's generator cannot be saved, so it is reseeded from the
+// restored generator instead.
+class ThreadRngGuard {
+public:
+    ThreadRngGuard() : saved_rng_(rng) {}
+    ~ThreadRngGuard() {
+        rng = saved_rng_;
+        arma::arma_rng::set_seed(rng());
+    }
+    
+private:
+    boost::random::mt19937 saved_rng_;
+};
+
+// Run the optimizer from one random starting value. Out-of-bounds starting values are replaced by a uniform draw
+// between the bounds.
+template <class CarmaType>
+static CarmaMLE FindMLESingle(CarmaType& carma, arma::vec& lower, arma::vec& upper)
+{
+    carma.SetMLE(true);
+    arma::vec theta = carma.StartingValue();
+    theta(1) = 1.0; // initial guess for the measurement error scale parameter
+    for (int j=0; j<theta.n_elem; j++) {
+        if (arma::is_finite(lower(j)) && ((theta(j) < lower(j)) || (theta(j) > upper(j)))) {
+            theta(j) = RandGen.uniform(lower(j), upper(j));
+        }
+    }
+    
+    CarmaMLE mle;
+    bool converged;
+    mle.niter = MaximizeBounded(carma, theta, lower, upper, mle.logdens, converged);
+    mle.converged = converged;
+    mle.theta = arma::conv_to<std::vector<double> >::from(theta);
+    
+    return mle;
+}
+
+// Bounds on the parameters for the MLE, the same as those used for the Python L-BFGS-B fit: the standard deviation
+// is within an order of magnitude of the sample standard deviation, the measurement error scale is within 10% of
+// unity, and the AR parameters correspond to frequencies between 1 / (time span) and 0.9 / min(dt). The mean and the
+// MA coefficients are unbounded.
+static void MLEBounds(const TimeSeriesData& data, int p, int q, arma::vec& lower, arma::vec& upper)
+{
+    int nparams = p + q + 3;
+    lower.set_size(nparams);
+    upper.set_size(nparams);
+    lower.fill(-arma::datum::inf);
+    upper.fill(arma::datum::inf);
+    double ysigma = arma::stddev(data.y(), 1);
+    double max_freq = 0.9 / arma::min(data.dt());
+    double min_freq = 1.0 / (data.time()(data.size()-1) - data.time()(0));
+    lower(0) = ysigma / 10.0;
+    upper(0) = 10.0 * ysigma;
+    lower(1) = 0.9;
+    upper(1) = 1.1;
+    if (p == 1) {
+        lower(3) = log(min_freq);
+        upper(3) = log(max_freq);
+    } else {
+        lower.subvec(3, 2+p).fill(log(std::min(min_freq * min_freq, 2.0 * min_freq)));
+        upper.subvec(3, 2+p).fill(log(std::max(max_freq * max_freq, 2.0 * max_freq)));
+    }
+}
+
+// Run one trial of the MLE for a CARMA(p,q) model, seeding the random number generators of the calling thread from
+// seed and the trial index
+static CarmaMLE FindMLETrial(std::shared_ptr<const TimeSeriesData> data, int p, int q, arma::vec& lower,
+                             arma::vec& upper, unsigned long seed, unsigned int itrial)
+{
+    SeedThreadRng(seed, itrial);
+    if (p == 1) {
+        CAR1 car1(false, "CAR(1)", data);
+        return FindMLESingle(car1, lower, upper);
+    } else if (q == 0) {
+        CARp car(false, "CAR(p)", data, p);
+        return FindMLESingle(car, lower, upper);
+    } else {
+        CARMA carma(false, "CARMA(p,q)", data, p, q);
+        return FindMLESingle(carma, lower, upper);
+    }
+}
+
+// Fill in the Hessian matrix of the log-likelihood at the MLE
+static void SetMLEHessian(std::shared_ptr<const TimeSeriesData> data, int p, int q, CarmaMLE& mle)
+{
+    arma::vec theta(mle.theta);
+    arma::mat hessian;
+    if (p == 1) {
+        CAR1 car1(false, "CAR(1)", data);
+        car1.SetMLE(true);
+        hessian = LogDensityHessian(car1, theta);
+    } else if (q == 0) {
+        CARp car(false, "CAR(p)", data, p);
+        car.SetMLE(true);
+        hessian = LogDensityHessian(car, theta);
+    } else {
+        CARMA carma(false, "CARMA(p,q)", data, p, q);
+        carma.SetMLE(true);
+        hessian = LogDensityHessian(carma, theta);
+    }
+    mle.hessian.resize(theta.n_elem);
+    for (int i=0; i<theta.n_elem; i++) {
+        mle.hessian[i] = arma::conv_to<std::vector<double> >::from(hessian.row(i));
+    }
+}
+
+static void CheckCarmaOrder(int p, int q)
+{
+    if ((p < 1) || (q < 0) || (q >= p)) {
+        throw std::invalid_argument("CARMA order must satisfy p >= 1 and 0 <= q < p");
+    }
+}
+
+// Find the maximum-likelihood estimate of a CARMA(p,q) model from ntrials random starts, spread over nthreads threads
+CarmaMLE FindMLE(std::vector<double> time, std::vector<double> y, std::vector<double> yerr, int p, int q,
+                 int ntrials, int nthreads)
+{
+    CheckCarmaOrder(p, q);
+    std::shared_ptr<const TimeSeriesData> data = std::make_shared<const TimeSeriesData>(time, y, yerr);
+    ntrials = std::max(ntrials, 1);
+    nthreads = std::max(1, std::min(nthreads, ntrials));
+    arma::vec lower, upper;
+    MLEBounds(*data, p, q, lower, upper);
+    
+    // each trial seeds the random number generators from its index, so the result does not depend on nthreads
+    unsigned long seed = rng();
+    std::vector<CarmaMLE> trials(ntrials);
+    {
+        ThreadRngGuard rng_guard;
+        ParallelFor(ntrials, nthreads, [&](int itrial) {
+            trials[itrial] = FindMLETrial(data, p, q, lower, upper, seed, itrial);
+        });
+    }
+    
+    int best = 0;
+    for (int itrial=1; itrial<ntrials; itrial++) {
+        if (trials[itrial].logdens > trials[best].logdens) {
+            best = itrial;
+        }
+    }
+    CarmaMLE mle = trials[best];
+    SetMLEHessian(data, p, q, mle);
+    
+    return mle;
+}
+
+// AICc of a CARMA(p,q) model with maximum log-likelihood logdens, computed from ndata data points
+static double CarmaAICc(double logdens, int p, int q, int ndata)
+{
+    double nparams = 2.0 + p + q;
+    return 2.0 * nparams - 2.0 * logdens + 2.0 * nparams * (nparams + 1.0) / (ndata - nparams - 1.0);
+}
+
+/*
+ Choose the order of the CARMA model by minimizing AICc over the (p,q) pairs in plist and qlist. When prune_delta is
+ finite the random starts for all of the orders are run in rounds of a few trials each, and within a round the trials
+ of every order still in the search are spread over the threads, the most expensive first. After each round any order
+ that has had at least min_prune_trials starts and whose best AICc so far exceeds the best AICc of all the orders by
+ more than prune_delta is dropped from the search. The rounds make the pruning, and hence the result, independent of
+ the number of threads. Without pruning there is nothing to decide between rounds, so all of the trials are run as one
+ round and the threads only wait for each other once.
+ */
+CarmaOrderSearch ChooseOrder(std::vector<double> time, std::vector<double> y, std::vector<double> yerr,
+                             std::vector<int> plist, std::vector<int> qlist, int ntrials, int nthreads,
+                             double prune_delta, int min_prune_trials)
+{
+    if (plist.empty() || (plist.size() != qlist.size())) {
+        throw std::invalid_argument("plist and qlist must be non-empty and have the same length");
+    }
+    int norders = plist.size();
+    std::vector<arma::vec> lower(norders), upper(norders);
+    std::shared_ptr<const TimeSeriesData> data = std::make_shared<const TimeSeriesData>(time, y, yerr);
+    for (int k=0; k<norders; k++) {
+        CheckCarmaOrder(plist[k], qlist[k]);
+        MLEBounds(*data, plist[k], qlist[k], lower[k], upper[k]);
+    }
+    ntrials = std::max(ntrials, 1);
+    nthreads = std::max(nthreads, 1);
+    
+    unsigned long seed = rng();
+    std::vector<CarmaMLE> order_mle(norders);
+    std::vector<bool> active(norders, true);
+    CarmaOrderSearch search;
+    search.p = plist;
+    search.q = qlist;
+    search.ntrials.assign(norders, 0);
+    search.aicc.assign(norders, arma::datum::inf);
+    search.logdens.assign(norders, -arma::datum::inf);
+    
+    const int trials_per_round = arma::is_finite(prune_delta) ? 5 : ntrials;
+    ThreadRngGuard rng_guard;
+    for (int first_trial=0; first_trial<ntrials; first_trial+=trials_per_round) {
+        int last_trial = std::min(first_trial + trials_per_round, ntrials);
+        // the cost of the Kalman filter is O(n p^2)
+        std::vector<std::pair<int, int> > tasks; // (order, trial)
+        for (int k=0; k<norders; k++) {
+            if (active[k]) {
+                for (int itrial=first_trial; itrial<last_trial; itrial++) {
+                    tasks.push_back(std::make_pair(k, itrial));
+                }
+            }
+        }
+        std::stable_sort(tasks.begin(), tasks.end(), [&](const std::pair<int, int>& a, const std::pair<int, int>& b)
+                         { return plist[a.first] > plist[b.first]; });
+        
+        std::vector<CarmaMLE> results(tasks.size());
+        ParallelFor(tasks.size(), nthreads, [&](int itask) {
+            int k = tasks[itask].first;
+            results[itask] = FindMLETrial(data, plist[k], qlist[k], lower[k], upper[k], seed,
+                                          k * ntrials + tasks[itask].second);
+        });
+        
+        for (int itask=0; itask<tasks.size(); itask++) {
+            int k = tasks[itask].first;
+            search.ntrials[k]++;
+            if ((search.ntrials[k] == 1) || (results[itask].logdens > search.logdens[k])) {
+                order_mle[k] = results[itask];
+                search.logdens[k] = results[itask].logdens;
+                search.aicc[k] = CarmaAICc(search.logdens[k], plist[k], qlist[k], data->size());
+            }
+        }
+        double best_aicc = *std::min_element(search.aicc.begin(), search.aicc.end());
+        for (int k=0; k<norders; k++) {
+            if ((search.ntrials[k] >= min_prune_trials) && (search.aicc[k] > best_aicc + prune_delta)) {
+                active[k] = false;
+            }
+        }
+    }
+    
+    int best = std::min_element(search.aicc.begin(), search.aicc.end()) - search.aicc.begin();
+    search.best_p = plist[best];
+    search.best_q = qlist[best];
+    search.best_mle = order_mle[best];
+    SetMLEHessian(data, search.best_p, search.best_q, search.best_mle);
+    
+    return search;
+}
+
+// Store the percentiles of values in column icol of bands. The percentiles are interpolated linearly between the
+// order statistics, as in numpy.percentile. The values are reordered.
+static void Percentiles(std::vector<double>& values, std::vector<double>& percentiles,
+                        std::vector<std::vector<double> >& bands, int icol)
+{
+    int nvalues = values.size();
+    for (int j=0; j<percentiles.size(); j++) {
+        double position = percentiles[j] / 100.0 * (nvalues - 1);
+        int lower = std::min(std::max((int)std::floor(position), 0), nvalues - 1);
+        std::nth_element(values.begin(), values.begin() + lower, values.end());
+        double value = values[lower];
+        if (lower < nvalues - 1) {
+            // the next order statistic is the smallest of the values above the lower one
+            double upper_value = *std::min_element(values.begin() + lower + 1, values.end());
+            value += (position - lower) * (upper_value - value);
+        }
+        bands[j][icol] = value;
+    }
+}
+
+/*
+ The PSD of a CARMA(p,q) process is
+ 
+    P(f) = sigma^2 |beta(2 pi i f)|^2 / |alpha(2 pi i f)|^2,
+ 
+ and since beta(0) = 1, |beta(i omega)|^2 = prod_k |i omega - ma_root_k|^2 / prod_k |ma_root_k|^2. Both polynomials are
+ therefore evaluated from their roots with real arithmetic: |i omega - root|^2 = re^2 + (omega - im)^2. The roots are
+ stored in structure-of-arrays form, one column per draw, so the loops over the frequencies in a block are unit stride
+ and can be vectorized by the compiler.
+ */
+CarmaSpectrum CarmaSpectralBands(const arma::mat& samples, int p, int q, std::vector<double> frequency,
+                                 std::vector<double> lags, std::vector<double> percentiles, int nthreads)
+{
+    CheckCarmaOrder(p, q);
+    if (samples.n_rows != 3 + p + q) {
+        throw std::invalid_argument("The number of parameters in the samples does not match the CARMA(p,q) order.");
+    }
+    int ndraws = samples.n_cols;
+    if (ndraws == 0) {
+        throw std::invalid_argument("No MCMC samples were supplied.");
+    }
+    nthreads = std::max(nthreads, 1);
+    
+    // convert each draw once to its AR and MA roots, and the weights of its autocovariance function
+    arma::mat ar_real(p, ndraws), ar_imag(p, ndraws), ma_real(std::max(q, 1), ndraws), ma_imag(std::max(q, 1), ndraws);
+    arma::mat acf_real(p, ndraws), acf_imag(p, ndraws);
+    arma::vec psd_scale(ndraws);
+    const int draws_per_task = 256;
+    int ndraw_tasks = (ndraws + draws_per_task - 1) / draws_per_task;
+    ParallelFor(ndraw_tasks, nthreads, [&](int itask) {
+        int last_draw = std::min((itask + 1) * draws_per_task, ndraws);
+        for (int i=itask*draws_per_task; i<last_draw; i++) {
+            arma::vec theta = samples.col(i);
+            arma::cx_vec ar_roots = QuadraticRoots(theta, 3, p);
+            arma::cx_vec ma_roots = QuadraticRoots(theta, 3 + p, q);
+            arma::cx_vec weights = AutocovarianceWeights(ar_roots, MACoefs(ma_roots, p));
+            // sigma^2 = ysigma^2 / Var(sigma = 1)
+            double sigsqr = theta(0) * theta(0) / arma::sum(arma::real(weights));
+            ar_real.col(i) = arma::real(ar_roots);
+            ar_imag.col(i) = arma::imag(ar_roots);
+            acf_real.col(i) = sigsqr * arma::real(weights);
+            acf_imag.col(i) = sigsqr * arma::imag(weights);
+            double ma_norm = 1.0;
+            for (int k=0; k<q; k++) {
+                ma_real(k,i) = ma_roots(k).real();
+                ma_imag(k,i) = ma_roots(k).imag();
+                ma_norm *= std::norm(ma_roots(k));
+            }
+            psd_scale(i) = sigsqr / ma_norm;
+        }
+    });
+    
+    int nfreq = frequency.size();
+    int nlags = lags.size();
+    CarmaSpectrum spectrum;
+    spectrum.psd.assign(percentiles.size(), std::vector<double>(nfreq));
+    spectrum.acf.assign(percentiles.size(), std::vector<double>(nlags));
+    
+    // The grids are split into blocks. For each block the PSD or autocovariance of every draw is computed, and then the
+    // percentiles are found at each grid point of the block.
+    const int block_size = 64;
+    int nfreq_blocks = (nfreq + block_size - 1) / block_size;
+    int nlag_blocks = (nlags + block_size - 1) / block_size;
+    ParallelFor(nfreq_blocks + nlag_blocks, nthreads, [&](int itask) {
+        bool do_psd = itask < nfreq_blocks;
+        std::vector<double>& grid = do_psd ? frequency : lags;
+        int first = (do_psd ? itask : itask - nfreq_blocks) * block_size;
+        int nblock = std::min(block_size, (int)grid.size() - first);
+        
+        arma::mat block_values(nblock, ndraws); // one column per draw
+        std::vector<double> x(nblock), numer(nblock), denom(nblock);
+        for (int k=0; k<nblock; k++) {
+            x[k] = do_psd ? 2.0 * arma::datum::pi * grid[first + k] : std::abs(grid[first + k]);
+        }
+        for (int i=0; i<ndraws; i++) {
+            double* values = block_values.colptr(i);
+            if (do_psd) {
+                std::fill(numer.begin(), numer.end(), psd_scale(i));
+                std::fill(denom.begin(), denom.end(), 1.0);
+                for (int l=0; l<p; l++) {
+                    double re = ar_real(l,i), im = ar_imag(l,i);
+                    for (int k=0; k<nblock; k++) {
+                        denom[k] *= re * re + (x[k] - im) * (x[k] - im);
+                    }
+                }
+                for (int l=0; l<q; l++) {
+                    double re = ma_real(l,i), im = ma_imag(l,i);
+                    for (int k=0; k<nblock; k++) {
+                        numer[k] *= re * re + (x[k] - im) * (x[k] - im);
+                    }
+                }
+                for (int k=0; k<nblock; k++) {
+                    values[k] = numer[k] / denom[k];
+                }
+            } else {
+                // R(lag) = sum_l exp(re_l |lag|) * (w_re cos(im_l |lag|) - w_im sin(im_l |lag|))
+                std::fill(values, values + nblock, 0.0);
+                for (int l=0; l<p; l++) {
+                    double re = ar_real(l,i), im = ar_imag(l,i);
+                    double w_re = acf_real(l,i), w_im = acf_imag(l,i);
+                    for (int k=0; k<nblock; k++) {
+                        values[k] += std::exp(re * x[k]) * (w_re * std::cos(im * x[k]) - w_im * std::sin(im * x[k]));
+                    }
+                }
+            }
+        }
+        
+        std::vector<std::vector<double> >& bands = do_psd ? spectrum.psd : spectrum.acf;
+        std::vector<double> draws(ndraws);
+        for (int k=0; k<nblock; k++) {
+            for (int i=0; i<ndraws; i++) {
+                draws[i] = block_values(k,i);
+            }
+            Percentiles(draws, percentiles, bands, first + k);
+        }
+    });
+    
+    return spectrum;
+}
+
+// Transform the MCMC samples of a CARMA(p,q) model to the roots and coefficients of its AR and MA polynomials, the
+// standard deviation of the driving noise, and the Lorentzian parameters of its PSD
+CarmaPhysicalSamples TransformCarmaSamples(const arma::mat& samples, int p, int q, int nthreads)
+{
+    CheckCarmaOrder(p, q);
+    if (samples.n_rows != 3 + p + q) {
+        throw std::invalid_argument("The number of parameters in the samples does not match the CARMA(p,q) order.");
+    }
+    int ndraws = samples.n_cols;
+    
+    CarmaPhysicalSamples physical;
+    physical.ar_roots.set_size(p, ndraws);
+    physical.ar_coefs.set_size(p + 1, ndraws);
+    physical.ma_coefs.set_size(q + 1, ndraws);
+    physical.sigma.set_size(ndraws);
+    physical.psd_centroid.set_size(p, ndraws);
+    physical.psd_width.set_size(p, ndraws);
+    
+    const int draws_per_task = 256;
+    int ntasks = (ndraws + draws_per_task - 1) / draws_per_task;
+    ParallelFor(ntasks, std::max(nthreads, 1), [&](int itask) {
+        int last_draw = std::min((itask + 1) * draws_per_task, ndraws);
+        for (int i=itask*draws_per_task; i<last_draw; i++) {
+            arma::vec theta = samples.col(i);
+            arma::cx_vec ar_roots = QuadraticRoots(theta, 3, p);
+            arma::vec ma_coefs = MACoefs(QuadraticRoots(theta, 3 + p, q), p);
+            physical.ar_roots.col(i) = ar_roots;
+            physical.ar_coefs.col(i) = polycoefs(ar_roots);
+            physical.ma_coefs.col(i) = ma_coefs.head(q + 1);
+            // sigma^2 = ysigma^2 / Var(sigma = 1), as in CARMA::ExtractSigsqr
+            double unit_var = arma::sum(arma::real(AutocovarianceWeights(ar_roots, ma_coefs)));
+            physical.sigma(i) = std::abs(theta(0)) / sqrt(unit_var);
+            physical.psd_width.col(i) = -arma::real(ar_roots) / (2.0 * arma::datum::pi);
+            physical.psd_centroid.col(i) = arma::abs(arma::imag(ar_roots)) / (2.0 * arma::datum::pi);
+        }
+    });
+    
+    return physical;
+}
+
+/*
+ Sequential Monte Carlo sampler for updating the posterior of a CARMA(p,q) model as new data points arrive. The
+ posterior given the old data is represented by weighted particles, and the posterior given all of the data is
+ p(theta | y_old, y_new) \propto p(theta | y_old) p(y_new | y_old, theta), so each particle is reweighted by the
+ likelihood of the new data points given the old ones. This likelihood is computed by restarting the online Kalman
+ Filter of the particle from its saved state. When the weights become too uneven the particles are resampled, and the
+ duplicated particles are spread out by Metropolis moves that leave the posterior invariant.
+ 
+ Reference: Sequential Monte Carlo Samplers, P. Del Moral, A. Doucet, & A. Jasra, 2006, JRSS B, 68, 411
+ */
+
+// Compute the log-posterior and the online Kalman Filter state of particle k from the whole time series
+template <class CarmaType>
+static void InitializeParticle(CarmaType& carma, CarmaParticles& particles, int k)
+{
+    arma::vec theta = particles.theta.col(k);
+    particles.logpost(k) = -1.0 * arma::datum::inf;
+    particles.filter_states[k] = OnlineFilterState();
+    if (!carma.CheckPriorBounds(theta)) {
+        return;
+    }
+    try {
+        OnlineKalmanFilter online_filter = carma.OnlineFilter(theta);
+        particles.logpost(k) = online_filter.GetLogLikelihood() + carma.LogPrior(theta);
+        particles.filter_states[k] = online_filter.Checkpoint();
+    } catch (std::runtime_error& e) {
+        // the particle has zero posterior probability, and will not survive resampling
+    }
+}
+
+// Compute the particle states from scratch
+struct ParticleInitializer {
+    CarmaParticles& particles;
+    
+    template <class CarmaType>
+    void operator()(CarmaType& carma, int k) {
+        InitializeParticle(carma, particles, k);
+    }
+};
+
+// Reweight the particles by the likelihood of the new data points, which start at first_new
+struct ParticleReweighter {
+    CarmaParticles& particles;
+    const TimeSeriesData& data;
+    unsigned int first_new;
+    arma::vec& loglik_new;
+    
+    template <class CarmaType>
+    void operator()(CarmaType& carma, int k) {
+        if (!arma::is_finite(particles.logpost(k))) {
+            loglik_new(k) = -1.0 * arma::datum::inf;
+            return;
+        }
+        try {
+            OnlineKalmanFilter online_filter = carma.OnlineFilter(particles.theta.col(k), particles.filter_states[k]);
+            for (unsigned int i=first_new; i<data.size(); i++) {
+                online_filter.Append(data.time()(i), data.y()(i), data.yerr()(i));
+            }
+            loglik_new(k) = online_filter.GetLogLikelihood() - particles.filter_states[k].loglik;
+            particles.filter_states[k] = online_filter.Checkpoint();
+        } catch (std::runtime_error& e) {
+            // the particle has zero posterior probability given the new data, and will not survive resampling
+            loglik_new(k) = -1.0 * arma::datum::inf;
+        }
+    }
+};
+
+// Move the particles with Metropolis steps that use all of the data
+struct ParticleMover {
+    CarmaParticles& particles;
+    arma::mat& proposal_covar;
+    int nmoves;
+    RandomStreams& streams;
+    std::vector<int>& naccept;
+    
+    template <class CarmaType>
+    void operator()(CarmaType& carma, int k) {
+        RandomGenerator& generator = streams.Stream(k);
+        StudentProposal proposal(8.0, 1.0);
+        proposal.SetRandomGenerator(generator);
+        // no adaptation, so the moves leave the posterior invariant, and rejected proposals can stop the Kalman
+        // Filter early
+        AdaptiveMetro RAM(carma, proposal, proposal_covar, 0.25, 0);
+        RAM.SetRandomGenerator(generator);
+        RAM.SetBoundedLikelihood(true);
+        
+        arma::vec theta = particles.theta.col(k);
+        carma.SetValue(theta, particles.logpost(k));
+        for (int m=0; m<nmoves; m++) {
+            RAM.DoStep();
+        }
+        naccept[k] = (int)(RAM.GetAcceptRate() * nmoves + 0.5);
+        if (naccept[k] > 0) {
+            // the particle moved, so its online Kalman Filter state has to be recomputed
+            particles.theta.col(k) = carma.Value();
+            InitializeParticle(carma, particles, k);
+        }
+    }
+};
+
+// Call task(carma, k) for each particle k, with the particles split into blocks spread over nthreads threads. Each
+// block gets its own parameter object for the time series, since these can not be shared between threads.
+template <class ParticleTask>
+static void ForEachParticle(std::shared_ptr<const TimeSeriesData> data, int p, int q, bool do_zcarma, double max_stdev,
+                            int nparticles, int nthreads, ParticleTask& task)
+{
+    const int particles_per_task = 64;
+    int ntasks = (nparticles + particles_per_task - 1) / particles_per_task;
+    ParallelFor(ntasks, std::max(nthreads, 1), [&](int itask) {
+        int last_particle = std::min((itask + 1) * particles_per_task, nparticles);
+        if (p == 1) {
+            CAR1 carma(false, "CAR(1)", data);
+            carma.SetPrior(max_stdev);
+            for (int k=itask*particles_per_task; k<last_particle; k++) {
+                task(carma, k);
+            }
+        } else {
+            std::unique_ptr<CARp> carma(NewCarmaParameter(false, data, p, q, do_zcarma));
+            carma->SetPrior(max_stdev);
+            for (int k=itask*particles_per_task; k<last_particle; k++) {
+                task(*carma, k);
+            }
+        }
+    });
+}
+
+// Return the indices of the particles chosen by systematic resampling with the normalized weights
+static arma::uvec SystematicResample(const arma::vec& weights, double unif)
+{
+    int nparticles = weights.n_elem;
+    arma::uvec indices(nparticles);
+    double cumulative_weight = weights(0);
+    int j = 0;
+    for (int i=0; i<nparticles; i++) {
+        double u = (i + unif) / nparticles;
+        while ((u > cumulative_weight) && (j < nparticles - 1)) {
+            j++;
+            cumulative_weight += weights(j);
+        }
+        indices(i) = j;
+    }
+    return indices;
+}
+
+// Make the particles from the MCMC samples
+CarmaParticles MakeCarmaParticles(const arma::mat& samples, std::vector<double> time, std::vector<double> y,
+                                  std::vector<double> yerr, int p, int q, bool do_zcarma, int nthreads)
+{
+    CheckCarmaOrder(p, q);
+    int nparams = do_zcarma ? 3 + p : 3 + p + q;
+    if (samples.n_rows != nparams) {
+        throw std::invalid_argument("The number of parameters in the samples does not match the CARMA(p,q) order.");
+    }
+    int nparticles = samples.n_cols;
+    if (nparticles == 0) {
+        throw std::invalid_argument("No MCMC samples were supplied.");
+    }
+    std::shared_ptr<const TimeSeriesData> data = std::make_shared<const TimeSeriesData>(time, y, yerr);
+    
+    CarmaParticles particles;
+    particles.theta = samples;
+    particles.logpost.set_size(nparticles);
+    particles.log_weights.set_size(nparticles);
+    particles.log_weights.fill(-log(double(nparticles)));
+    particles.filter_states.resize(nparticles);
+    particles.ndata = data->size();
+    particles.last_time = data->time()(data->size() - 1);
+    // use the same prior as RunCar1Sampler and RunCarmaSampler
+    double mean = arma::mean(data->y());
+    double var = arma::mean(data->y() % data->y()) - mean * mean;
+    particles.max_stdev = 10.0 * sqrt(var);
+    particles.log_evidence = 0.0;
+    particles.ess = nparticles;
+    particles.accept_rate = 0.0;
+    
+    ParticleInitializer initializer = {particles};
+    ForEachParticle(data, p, q, do_zcarma, particles.max_stdev, nparticles, nthreads, initializer);
+    
+    return particles;
+}
+
+// Update the particles with the new data points
+CarmaParticles UpdateCarmaParticles(const CarmaParticles& old_particles, std::vector<double> time,
+                                    std::vector<double> y, std::vector<double> yerr, int p, int q, bool do_zcarma,
+                                    int nthreads, int nmoves, double ess_fraction)
+{
+    CheckCarmaOrder(p, q);
+    int nparams = do_zcarma ? 3 + p : 3 + p + q;
+    int nparticles = old_particles.theta.n_cols;
+    if ((old_particles.theta.n_rows != nparams) || (old_particles.filter_states.size() != nparticles)) {
+        throw std::invalid_argument("The particles do not match the CARMA(p,q) order.");
+    }
+    std::shared_ptr<const TimeSeriesData> data = std::make_shared<const TimeSeriesData>(time, y, yerr);
+    const arma::vec& data_time = data->time();
+    unsigned int first_new = std::upper_bound(data_time.begin(), data_time.end(), old_particles.last_time) -
+        data_time.begin();
+    if (first_new != old_particles.ndata) {
+        throw std::invalid_argument("The new data points must be later than the data the particles are conditioned on.");
+    }
+    
+    CarmaParticles particles = old_particles;
+    if (first_new == data->size()) {
+        // no new data
+        return particles;
+    }
+    particles.ndata = data->size();
+    particles.last_time = data_time(data->size() - 1);
+    
+    // reweight the particles by the likelihood of the new data points given the old ones
+    arma::vec loglik_new(nparticles);
+    ParticleReweighter reweighter = {particles, *data, first_new, loglik_new};
+    ForEachParticle(data, p, q, do_zcarma, particles.max_stdev, nparticles, nthreads, reweighter);
+    particles.logpost += loglik_new;
+    particles.log_weights += loglik_new;
+    double max_log_weight = particles.log_weights.max();
+    if (!arma::is_finite(max_log_weight)) {
+        throw std::runtime_error("All of the particles have zero posterior probability given the new data.");
+    }
+    // the weights were normalized, so their new sum is p(y_new | y_old)
+    double log_weight_sum = max_log_weight + log(arma::sum(arma::exp(particles.log_weights - max_log_weight)));
+    particles.log_weights -= log_weight_sum;
+    particles.log_evidence += log_weight_sum;
+    arma::vec weights = arma::exp(particles.log_weights);
+    particles.ess = 1.0 / arma::sum(weights % weights);
+    particles.accept_rate = 0.0;
+    if (particles.ess >= ess_fraction * nparticles) {
+        return particles;
+    }
+    
+    // each particle draws its random numbers from its own stream, keyed by its index, and the resampling uses the last
+    // stream. The streams are created before the threads start.
+    RandomStreams particle_streams(rng());
+    for (int k=0; k<=nparticles; k++) {
+        particle_streams.Stream(k);
+    }
+    
+    // resample the particles in proportion to their weights
+    arma::uvec indices = SystematicResample(weights, particle_streams.Stream(nparticles).uniform());
+    std::vector<OnlineFilterState> filter_states(nparticles);
+    for (int k=0; k<nparticles; k++) {
+        filter_states[k] = particles.filter_states[indices(k)];
+    }
+    particles.filter_states.swap(filter_states);
+    particles.theta = particles.theta.cols(indices);
+    particles.logpost = particles.logpost.elem(indices);
+    particles.log_weights.fill(-log(double(nparticles)));
+    if (nmoves < 1) {
+        return particles;
+    }
+    
+    // move the particles, using the optimal scaling of the particle covariance matrix for random walk proposals. The
+    // small diagonal term keeps the matrix positive definite when there are only a few distinct particles.
+    arma::mat proposal_covar = 2.38 * 2.38 / nparams * arma::cov(particles.theta.t());
+    arma::vec theta_scale = arma::abs(arma::mean(particles.theta, 1)) + 1.0;
+    proposal_covar.diag() += 1e-10 * theta_scale % theta_scale;
+    std::vector<int> naccept(nparticles);
+    ParticleMover mover = {particles, proposal_covar, nmoves, particle_streams, naccept};
+    ForEachParticle(data, p, q, do_zcarma, particles.max_stdev, nparticles, nthreads, mover);
+    particles.accept_rate = std::accumulate(naccept.begin(), naccept.end(), 0) / double(nparticles * nmoves);
+    
+    return particles;
+}
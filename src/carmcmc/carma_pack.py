@@ -3,7 +3,7 @@ __author__ = 'Brandon C. Kelly'
 import numpy as np
 import matplotlib.pyplot as plt
 from scipy.linalg import solve
-from scipy.optimize import minimize
+from scipy.optimize import OptimizeResult
 from . import samplers
 import multiprocessing
 from . import _carmcmc as carmcmcLib
@@ -34,13 +34,10 @@ class CarmaModel(object):
         t_unique, u_idx = np.unique(time[s_idx], return_index=True)
         u_idx = s_idx[u_idx]
 
-        # convert input to std::vector<double> extension class
-        self._time = carmcmcLib.vecD()
-        self._time.extend(time[u_idx])
-        self._y = carmcmcLib.vecD()
-        self._y.extend(y[u_idx])
-        self._ysig = carmcmcLib.vecD()
-        self._ysig.extend(ysig[u_idx])
+        # contiguous double precision arrays are passed to the C++ code with a single copy
+        self._time = np.ascontiguousarray(time[u_idx], dtype=np.float64)
+        self._y = np.ascontiguousarray(y[u_idx], dtype=np.float64)
+        self._ysig = np.ascontiguousarray(ysig[u_idx], dtype=np.float64)
 
         # save parameters
         self.time = time[u_idx]
@@ -49,8 +46,10 @@ class CarmaModel(object):
         self.p = p
         self.q = q
         self.mcmc_sample = None
+        self.particles = None
 
-    def run_mcmc(self, nsamples, nburnin=None, ntemperatures=None, nthin=1, init=None):
+    def run_mcmc(self, nsamples, nburnin=None, ntemperatures=None, nthin=1, init=None, nthreads=1, trace_file=None,
+                 sampler='tempered', nwalkers=None):
         """
         Run the MCMC sampler. This is actually a wrapper that calls the C++ code that runs the MCMC sampler.
 
@@ -59,40 +58,76 @@ class CarmaModel(object):
             (no tempering) for p = 1 and max(10, p+q) for p > 1.
         :param nburnin: Number of burnin iterations to run. The default is nsamples / 2.
         :param nthin: Thinning interval for the MCMC sampler. Default is 1 (no thinning).
+        :param nthreads: Number of threads used to update the parallel tempering chains or the ensemble walkers for
+            p > 1. The results do not depend on the number of threads. Default is 1.
+        :param trace_file: If supplied, the MCMC samples are streamed to this binary file as they are drawn, and the
+            returned object memory-maps the file instead of copying the samples from the C++ sampler.
+        :param sampler: The MCMC algorithm used for p > 1. Either 'tempered' for Robust Adaptive Metropolis with
+            parallel tempering (the default), or 'ensemble' for the affine-invariant ensemble sampler. The CAR(1)
+            model is always sampled with Robust Adaptive Metropolis.
+        :param nwalkers: Number of walkers used by the ensemble sampler. The default is 4 * (p + q + 3), and it is
+            rounded up to an even number of at least twice the number of parameters. The returned sample contains the
+            draws for all of the walkers, so it has nsamples * nwalkers draws. The draws are stored iteration-major, so
+            a trace of the returned sample can be reshaped to (nsamples, sample.nwalkers, nparams), and the walker k
+            chain is every sample.nwalkers-th draw starting at k. The autocorrelation time scale and effective number of
+            samples are computed from the individual walker chains.
 
         :return: Either a CarmaSample or Car1Sample object, depending on the values of self.p. The CarmaSample object
             will also be stored as a data member of the CarmaModel object.
         """
 
+        if sampler not in ('tempered', 'ensemble'):
+            raise ValueError("sampler must be either 'tempered' or 'ensemble'")
+
         if ntemperatures is None:
             ntemperatures = max(10, self.p + self.q)
 
+        if nwalkers is None:
+            nwalkers = 4 * (self.p + self.q + 3)
+
         if nburnin is None:
             nburnin = nsamples / 2
 
         if init is None:
             init = carmcmcLib.vecD()
-            
+
+        if trace_file is None:
+            trace_file = ''
+
         if self.p == 1:
             # Treat the CAR(1) case separately
             cppSample = carmcmcLib.run_mcmc_car1(nsamples, int(nburnin), self._time, self._y, self._ysig,
-                                                 nthin, init)
+                                                 nthin, init, trace_file)
             # run_mcmc_car1 returns a wrapper around the C++ CAR1 class, convert to python object
-            sample = Car1Sample(self.time, self.y, self.ysig, cppSample)
+            sample = Car1Sample(self.time, self.y, self.ysig, cppSample, trace_file=trace_file)
         else:
+            ensemble = (sampler == 'ensemble')
+            if ensemble:
+                nchains = nwalkers
+            else:
+                nchains = ntemperatures
             cppSample = carmcmcLib.run_mcmc_carma(nsamples, int(nburnin), self._time, self._y, self._ysig,
-                                                  self.p, self.q, ntemperatures, False, nthin, init)
+                                                  self.p, self.q, nchains, False, nthin, init, nthreads,
+                                                  trace_file, ensemble)
+            if ensemble:
+                # the C++ sampler may round up the number of walkers, so get it from the number of draws it saved
+                nchains = len(cppSample.GetLogLikes()) // nsamples
+            else:
+                # only the chain at unit temperature is saved
+                nchains = 1
             # run_mcmc_car returns a wrapper around the C++ CARMA class, convert to a python object
-            sample = CarmaSample(self.time, self.y, self.ysig, cppSample, q=self.q)
+            sample = CarmaSample(self.time, self.y, self.ysig, cppSample, q=self.q, trace_file=trace_file,
+                                 nwalkers=nchains)
 
         self.mcmc_sample = sample
+        self.particles = None
 
         return sample
 
     def get_mle(self, p, q, ntrials=100, njobs=1):
         """
-        Return the maximum likelihood estimate (MLE) of the CARMA model parameters. This is done by using the
-        L-BFGS-B algorithm from scipy.optimize on ntrials randomly distributed starting values of the parameters. This
+        Return the maximum likelihood estimate (MLE) of the CARMA model parameters. This is done by running a bounded
+        quasi-Newton optimizer in the C++ code on ntrials randomly distributed starting values of the parameters. This
         this return NaN for more complex CARMA models, especially if the data are not well-described by a CARMA model.
         In addition, the likelihood space can be highly multi-modal, and there is no guarantee that the global MLE will
         be found using this procedure.
@@ -100,48 +135,41 @@ class CarmaModel(object):
         @param p: The order of the AR polynomial.
         @param q: The order of the MA polynomial. Must be q < p.
         @param ntrials: The number of random starting values for the optimizer. Default is 100.
-        @param njobs: The number of processors to use. If njobs = -1, then all of them are used. Default is njobs = 1.
-        @return: The scipy.optimize.Result object corresponding to the MLE.
+        @param njobs: The number of threads to use. If njobs = -1, then all of the processors are used. Default is
+            njobs = 1.
+        @return: A scipy.optimize.OptimizeResult object corresponding to the MLE. The fun attribute is the negative of
+            the log-likelihood, and hess is its Hessian matrix.
         """
         if njobs == -1:
             njobs = multiprocessing.cpu_count()
 
-        args = [(p, q, self.time, self.y, self.ysig)] * ntrials
-
-        if njobs == 1:
-            MLEs = map(_get_mle_single, args)
-        else:
-            # use multiple processors
-            pool = multiprocessing.Pool(njobs)
-            # warm up the pool
-            pool.map(int, range(multiprocessing.cpu_count()))
-            MLEs = pool.map(_get_mle_single, args)
-            pool.terminate()
-
-        best_MLE = MLEs[0]
-        for MLE in MLEs:
-            if MLE.fun < best_MLE.fun:  # note that MLE.fun is -loglik since we use scipy.optimize.minimize
-                # new MLE found, save this value
-                best_MLE = MLE
+        cppMLE = carmcmcLib.find_mle(self._time, self._y, self._ysig, p, q, ntrials, njobs)
+        best_MLE = _mle_to_result(cppMLE)
 
         print(best_MLE.message)
 
         return best_MLE
 
-    def choose_order(self, pmax, qmax=None, pqlist=None, njobs=1, ntrials=100):
+    def choose_order(self, pmax, qmax=None, pqlist=None, njobs=1, ntrials=100, prune_delta=np.inf, min_prune_trials=10):
         """
-        Choose the order of the CARMA model by minimizing the AICc(p,q). This first computes the maximum likelihood
-        estimate on a grid of (p,q) values using self.get_mle, and then choosing the value of (p,q) that minimizes
-        the AICc. These values of p and q are stored as self.p and self.q.
+        Choose the order of the CARMA model by minimizing the AICc(p,q). This computes the maximum likelihood estimate
+        on a grid of (p,q) values in the C++ code, with the random starts for all of the (p,q) pairs scheduled together
+        over njobs threads, and then chooses the value of (p,q) that minimizes the AICc. These values of p and q are
+        stored as self.p and self.q.
 
         @param pmax: The maximum order of the AR(p) polynomial to search over.
         @param qmax: The maximum order of the MA(q) polynomial to search over. If none, search over all possible values
             of q < p.
         @param pqlist: A list of (p,q) tuples. If supplied, the (p,q) pairs are used instead of being generated from the
             values of pmax and qmax.
-        @param njobs: The number of processors to use for calculating the MLE. A value of njobs = -1 will use all
+        @param njobs: The number of threads to use for calculating the MLE. A value of njobs = -1 will use all
             available processors.
         @param ntrials: The number of random starts to use in the MLE, the default is 100.
+        @param prune_delta: If finite, stop running random starts for a (p,q) pair once it has had at least
+            min_prune_trials starts and its AICc is larger than the best AICc by more than prune_delta. This saves time,
+            but a pruned (p,q) pair could still have won with more starts. The default, np.inf, runs all ntrials starts
+            for every (p,q) pair.
+        @param min_prune_trials: The number of random starts a (p,q) pair gets before it can be pruned.
         @return: A tuple of (MLE, pqlist, AICc). MLE is a scipy.optimize.Result object containing the maximum-likelihood
             estimate. pqlist contains the values of (p,q) used in the search, and AICc contains the values of AICc for
             each (p,q) pair in pqlist.
@@ -162,109 +190,101 @@ class CarmaModel(object):
         if pqlist is None:
             pqlist = []
             for p in range(1, pmax+1):
-                for q in range(p):
+                for q in range(min(p, qmax + 1)):
                     pqlist.append((p, q))
 
-        MLEs = []
-        for pq in pqlist:
-            MLE = self.get_mle(pq[0], pq[1], ntrials=ntrials, njobs=njobs)
-            MLEs.append(MLE)
+        if njobs == -1:
+            njobs = multiprocessing.cpu_count()
+
+        plist = arrayToVec([pq[0] for pq in pqlist], carmcmcLib.vecI)
+        qlist = arrayToVec([pq[1] for pq in pqlist], carmcmcLib.vecI)
+        search = carmcmcLib.choose_order(self._time, self._y, self._ysig, plist, qlist, ntrials, njobs, prune_delta,
+                                         min_prune_trials)
 
-        best_AICc = 1e300
-        AICc = []
-        best_MLE = MLEs[0]
+        AICc = list(search.aicc)
         print('p, q, AICc:')
-        for MLE, pq in zip(MLEs, pqlist):
-            nparams = 2 + pq[0] + pq[1]
-            deviance = 2.0 * MLE.fun
-            this_AICc = 2.0 * nparams + deviance + 2.0 * nparams * (nparams + 1.0) / (self.time.size - nparams - 1.0)
+        for pq, this_AICc in zip(pqlist, AICc):
             print(pq[0], pq[1], this_AICc)
-            AICc.append(this_AICc)
-            if this_AICc < best_AICc:
-                # new optimum found, save values
-                best_MLE = MLE
-                best_AICc = this_AICc
-                self.p = pq[0]
-                self.q = pq[1]
+
+        self.p = search.best_p
+        self.q = search.best_q
+        best_MLE = _mle_to_result(search.best_mle)
 
         print('Model with best AICc has p =', self.p, ' and q = ', self.q)
 
         return best_MLE, pqlist, AICc
 
+    def update_mcmc(self, time, y, ysig, nmoves=10, ess_fraction=0.5, nthreads=1):
+        """
+        Update the posterior of the CARMA(p,q) model with new measurements later than the existing time series, without
+        running the MCMC sampler again. The MCMC samples are used as the particles of a sequential Monte Carlo sampler.
+        Each particle is reweighted by the likelihood of the new measurements, which the C++ code computes by restarting
+        the Kalman Filter of the particle from its state at the end of the old time series. When the weights become too
+        uneven the particles are resampled and moved with Metropolis steps that use all of the data. The new
+        measurements are appended to the time series of this object, so update_mcmc may be called repeatedly as data
+        arrive.
+
+        :param time: The observation times of the new measurements. These must be later than the existing times.
+        :param y: The new measured values of the time series.
+        :param ysig: The standard deviation in the measurement errors of the new measurements.
+        :param nmoves: The number of Metropolis steps used to move each particle after resampling. Default is 10.
+        :param ess_fraction: The particles are resampled and moved when their effective sample size falls below this
+            fraction of the number of particles. Default is 0.5. Reweighting only runs the Kalman Filter over the new
+            measurements, but the moves run it over the whole time series, so each move costs as much as one MCMC
+            iteration. Setting ess_fraction = 1.0 moves the particles after every update.
+        :param nthreads: Number of threads used to update the particles. The results do not depend on the number of
+            threads. Default is 1.
+        :rtype : A carmcmcLib.CarmaParticles object. Its theta attribute is a (nparticles, nparams) array in the same
+            form as the MCMC samples, with weights exp(log_weights).
+        """
+        if self.mcmc_sample is None:
+            raise RuntimeError("run_mcmc must be called before update_mcmc.")
 
-def _get_mle_single(args):
-
-    p, q, time, y, ysig = args
-
-    nsamples = 1
-    nburnin = 25
-    nwalkers = 10
-
-    # get a CARMA process object by running the MCMC sampler for a very short period. This will provide the initial
-    # guess and the function to compute the log-posterior
-    tvec = arrayToVec(time)  # convert to std::vector<double> object for input into C++ wrapper
-    yvec = arrayToVec(y)
-    ysig_vec = arrayToVec(ysig)
-    if p == 1:
-        # Treat the CAR(1) case separately
-        CarmaProcess = carmcmcLib.run_mcmc_car1(nsamples, nburnin, tvec, yvec, ysig_vec, 1)
-    else:
-        CarmaProcess = carmcmcLib.run_mcmc_carma(nsamples, nburnin, tvec, yvec, ysig_vec,
-                                                 p, q, nwalkers, False, 1)
-
-    initial_theta = CarmaProcess.getSamples()
-    initial_theta = np.array(initial_theta[0])
-    initial_theta[1] = 1.0  # initial guess for measurement error scale parameter
-
-    # set bounds on parameters
-    ysigma = y.std()
-    dt = time[1:] - time[:-1]
-    max_freq = 1.0 / dt.min()
-    max_freq = 0.9 * max_freq
-    min_freq = 1.0 / (time.max() - time.min())
-    theta_bnds = [(ysigma / 10.0, 10.0 * ysigma)]
-    theta_bnds.append((0.9, 1.1))
-    theta_bnds.append((None, None))
-
-    if p == 1:
-        theta_bnds.append((np.log(min_freq), np.log(max_freq)))
-    else:
-        # monte carlo estimates of bounds on quadratic term parameterization of AR(p) roots
-        qterm_lbound = min(min_freq ** 2, 2.0 * min_freq)
-        qterm_lbound = np.log(qterm_lbound)
-        qterm_ubound = max(max_freq ** 2, 2.0 * max_freq)
-        qterm_ubound = np.log(qterm_ubound)
-        theta_bnds.extend([(qterm_lbound, qterm_ubound)] * p)
-        # no bounds on MA coefficients
-        if q > 0:
-            theta_bnds.extend([(None, None)] * q)
+        time = np.atleast_1d(time)
+        if time.min() <= self._time[-1]:
+            raise ValueError("The new observation times must be later than the existing ones.")
 
-        CarmaProcess.SetMLE(True)  # ignore the prior bounds when calculating CarmaProcess.getLogDensity in C++ code
+        if self.particles is None:
+            trace = np.ascontiguousarray(self.mcmc_sample._trace, dtype=np.float64)
+            self.particles = carmcmcLib.make_particles(trace, self._time, self._y, self._ysig, self.p, self.q,
+                                                      False, nthreads)
 
-    # make sure initial guess of theta does not violate bounds
-    for j in range(len(initial_theta)):
-        if theta_bnds[j][0] is not None:
-            if (initial_theta[j] < theta_bnds[j][0]) or (initial_theta[j] > theta_bnds[j][1]):
-                initial_theta[j] = np.random.uniform(theta_bnds[j][0], theta_bnds[j][1])
+        # append the new measurements in the same way as the constructor
+        s_idx = np.argsort(time)
+        t_unique, u_idx = np.unique(time[s_idx], return_index=True)
+        u_idx = s_idx[u_idx]
+        self.time = np.append(self.time, time[u_idx])
+        self.y = np.append(self.y, np.atleast_1d(y)[u_idx])
+        self.ysig = np.append(self.ysig, np.atleast_1d(ysig)[u_idx])
+        self._time = np.ascontiguousarray(self.time, dtype=np.float64)
+        self._y = np.ascontiguousarray(self.y, dtype=np.float64)
+        self._ysig = np.ascontiguousarray(self.ysig, dtype=np.float64)
 
-    thisMLE = minimize(_carma_loglik, initial_theta, args=(CarmaProcess,), method="L-BFGS-B", bounds=theta_bnds)
+        self.particles = carmcmcLib.update_particles(self.particles, self._time, self._y, self._ysig, self.p,
+                                                     self.q, False, nthreads, nmoves, ess_fraction)
 
-    return thisMLE
+        return self.particles
 
 
-def _carma_loglik(theta, args):
-    CppCarma = args
-    theta_vec = carmcmcLib.vecD()
-    theta_vec.extend(theta)
-    logdens = CppCarma.getLogDensity(theta_vec)
-    return -logdens
+def _mle_to_result(cppMLE):
+    """
+    Convert the maximum-likelihood estimate returned by the C++ code to a scipy.optimize.OptimizeResult object. The fun
+    attribute is the negative of the log-likelihood, and hess is its Hessian matrix.
+    """
+    if cppMLE.converged:
+        message = 'Optimizer converged.'
+    else:
+        message = 'Optimizer did not converge.'
+    return OptimizeResult(x=np.array(cppMLE.theta), fun=-cppMLE.logdens,
+                          hess=-np.array([list(row) for row in cppMLE.hessian]), nit=cppMLE.niter,
+                          success=cppMLE.converged, message=message)
 
 
 class CarmaSample(samplers.MCMCSample):
     """
     Class for storing and analyzing the MCMC samples of a CARMA(p,q) model.
     """
-    def __init__(self, time, y, ysig, sampler, q=0, filename=None, MLE=None):
+    def __init__(self, time, y, ysig, sampler, q=0, filename=None, MLE=None, trace_file=None, nwalkers=1):
         """
         Constructor for the CarmaSample class. In general a CarmaSample object should never be constructed directly,
         but should be constructed by calling CarmaModel.run_mcmc().
@@ -277,40 +297,36 @@ class CarmaSample(samplers.MCMCSample):
         @param q: The order of the MA polynomial.
         @param filename: A string of the name of the file containing the MCMC samples generated by the C++ carpack.
         @param MLE: The maximum-likelihood estimate, obtained as a scipy.optimize.Result object.
+        @param trace_file: The name of the binary file that the C++ sampler streamed the MCMC samples to. If supplied,
+            the samples are memory-mapped from this file instead of copied from the sampler.
+        @param nwalkers: The number of ensemble walkers whose draws are interleaved in the samples. Default is 1.
         """
         self.time = time  # The time values of the time series
         self.y = y  # The measured values of the time series
         self.ysig = ysig  # The standard deviation of the measurement errors of the time series
         self.q = q  # order of moving average polynomial
 
-        logpost = np.array(sampler.GetLogLikes())
-        trace = np.array(sampler.getSamples())
+        if trace_file:
+            logpost, trace = samplers.read_trace(trace_file)
+        else:
+            # these are read-only views of the samples held by the C++ sampler, not copies
+            logpost = np.asarray(sampler.GetLogLikes())
+            trace = np.asarray(sampler.getSamples())
 
-        super(CarmaSample, self).__init__(filename=filename, logpost=logpost, trace=trace)
+        super(CarmaSample, self).__init__(filename=filename, logpost=logpost, trace=trace, nwalkers=nwalkers)
 
         # now calculate the AR(p) characteristic polynomial roots, coefficients, MA coefficients, and amplitude of
         # driving noise and add them to the MCMC samples
-        print("Calculating PSD Lorentzian parameters...")
-        self._ar_roots()
-        print("Calculating coefficients of AR polynomial...")
-        self._ar_coefs()
-        if self.q > 0:
-            print("Calculating coefficients of MA polynomial...")
-
-        self._ma_coefs(trace)
-
-        print("Calculating sigma...")
-        self._sigma_noise()
+        print("Calculating PSD Lorentzian parameters, polynomial coefficients, and sigma...")
+        self._physical_parameters(trace)
 
         # add the log-likelihoods
         print("Calculating log-likelihoods...")
         loglik = np.empty(logpost.size)
         sampler.SetMLE(True)
         for i in range(logpost.size):
-            std_theta = carmcmcLib.vecD()
-            std_theta.extend(trace[i, :])
-            # loglik[i] = logpost[i] - sampler.getLogPrior(std_theta)
-            loglik[i] = sampler.getLogDensity(std_theta)
+            # loglik[i] = logpost[i] - sampler.getLogPrior(trace[i, :])
+            loglik[i] = sampler.getLogDensity(trace[i, :])
 
         self._samples['loglik'] = loglik
 
@@ -411,6 +427,7 @@ class CarmaSample(samplers.MCMCSample):
         Generate the dictionary of MCMC samples for the CARMA process parameters from the input array.
         @param trace: An array containing the MCMC samples.
         """
+        self._trace = trace  # kept for the C++ PSD and autocovariance engine
         # Figure out how many AR terms we have
         self.p = trace.shape[1] - 3 - self.q
         names = ['var', 'measerr_scale', 'mu', 'quad_coefs']
@@ -436,117 +453,63 @@ class CarmaSample(samplers.MCMCSample):
         self.generate_from_trace(trace[:, 0:-1])
         self.set_logpost(trace[:, -1])
 
-    def _ar_roots(self):
+    def _physical_parameters(self, trace, nthreads=1):
         """
-        Calculate the roots of the CARMA(p,q) characteristic polynomial and add them to the MCMC samples.
+        Calculate the roots and coefficients of the AR(p) polynomial, the PSD Lorentzian parameters, the MA
+        coefficients, and the standard deviation of the driving white noise, and add them to the MCMC samples. The
+        whole trace is transformed by a single call to the C++ code.
         """
-        var = self._samples['var']
-        quad_coefs = self._samples['quad_coefs']
-        self._samples['ar_roots'] = np.empty((var.size, self.p), dtype=complex)
-        self._samples['psd_centroid'] = np.empty((var.size, self.p))
-        self._samples['psd_width'] = np.empty((var.size, self.p))
+        transformed = carmcmcLib.transform_samples(np.ascontiguousarray(trace, dtype=np.float64), self.p, self.q,
+                                                   nthreads)
+        for key in ['ar_roots', 'psd_centroid', 'psd_width', 'ar_coefs', 'ma_coefs']:
+            self._samples[key] = transformed[key]
+        self._samples['sigma'] = transformed['sigma']  # (ndraws, 1), as for the other scalar parameters
 
-        for i in range(int(self.p / 2)):
-            quad1 = quad_coefs[:, 2 * i]
-            quad2 = quad_coefs[:, 2 * i + 1]
-
-            discriminant = quad2 ** 2 - 4.0 * quad1
-            sqrt_disc = np.where(discriminant > 0, np.sqrt(discriminant), 1j * np.sqrt(np.abs(discriminant)))
-            self._samples['ar_roots'][:, 2 * i] = -0.5 * (quad2 + sqrt_disc)
-            self._samples['ar_roots'][:, 2 * i + 1] = -0.5 * (quad2 - sqrt_disc)
-            self._samples['psd_width'][:, 2 * i] = -np.real(self._samples['ar_roots'][:, 2 * i]) / (2.0 * np.pi)
-            self._samples['psd_centroid'][:, 2 * i] = np.abs(np.imag(self._samples['ar_roots'][:, 2 * i])) / \
-                (2.0 * np.pi)
-            self._samples['psd_width'][:, 2 * i + 1] = -np.real(self._samples['ar_roots'][:, 2 * i + 1]) / (2.0 * np.pi)
-            self._samples['psd_centroid'][:, 2 * i + 1] = np.abs(np.imag(self._samples['ar_roots'][:, 2 * i + 1])) / \
-                (2.0 * np.pi)
-
-        if self.p % 2 == 1:
-            # p is odd, so add in root from linear term
-            self._samples['ar_roots'][:, -1] = -quad_coefs[:, -1]
-            self._samples['psd_centroid'][:, -1] = 0.0
-            self._samples['psd_width'][:, -1] = quad_coefs[:, -1] / (2.0 * np.pi)
-
-    def _ma_coefs(self, trace):
-        """
-        Calculate the CARMA(p,q) moving average coefficients and add them to the MCMC samples.
+    def _spectral_bands(self, frequencies, lags, percentiles, nsamples=None, nthreads=1):
         """
-        nsamples = trace.shape[0]
-        if self.q == 0:
-            self._samples['ma_coefs'] = np.ones((nsamples, 1))
-        else:
-            quad_coefs = np.exp(trace[:, 3 + self.p:])
-            roots = np.empty(quad_coefs.shape, dtype=complex)
-            for i in range(int(self.q / 2)):
-                quad1 = quad_coefs[:, 2 * i]
-                quad2 = quad_coefs[:, 2 * i + 1]
-
-                discriminant = quad2 ** 2 - 4.0 * quad1
-                sqrt_disc = np.where(discriminant > 0, np.sqrt(discriminant), 1j * np.sqrt(np.abs(discriminant)))
-                roots[:, 2 * i] = -0.5 * (quad2 + sqrt_disc)
-                roots[:, 2 * i + 1] = -0.5 * (quad2 - sqrt_disc)
-
-            if self.q % 2 == 1:
-                # q is odd, so add in root from linear term
-                roots[:, -1] = -quad_coefs[:, -1]
-
-            coefs = np.empty((nsamples, self.q + 1), dtype=complex)
-            for i in range(nsamples):
-                coefs_i = np.poly(roots[i, :])
-                # normalize so constant in polynomial is unity, and reverse order to be consistent with MA
-                # representation
-                coefs[i, :] = (coefs_i / coefs_i[self.q])[::-1]
-
-            self._samples['ma_coefs'] = coefs.real
-
-    def _ar_coefs(self):
+        Compute the posterior percentiles of the PSD at the input frequencies and of the autocovariance function at the
+        input lags, using the C++ engine. Each MCMC sample is converted once to the roots of its AR and MA polynomials.
+
+        :rtype : A tuple of numpy arrays, (PSD percentiles, autocovariance percentiles). Row j of each array contains
+            percentiles[j] as a function of frequency or lag.
+        :param frequencies: The frequencies at which to compute the PSD.
+        :param lags: The time lags at which to compute the autocovariance function.
+        :param percentiles: The percentiles to compute, between 0 and 100.
+        :param nsamples: The number of MCMC samples to use. The default is all of them.
+        :param nthreads: The number of threads to use.
         """
-        Calculate the CARMA(p,q) autoregressive coefficients and add them to the MCMC samples.
+        trace = self._trace
+        if nsamples is not None and nsamples < trace.shape[0]:
+            index = np.arange(nsamples) * int(trace.shape[0] / nsamples)
+            trace = trace[index]
+
+        spectrum = carmcmcLib.carma_spectrum(np.ascontiguousarray(trace, dtype=np.float64), self.p, self.q,
+                                             np.asarray(frequencies, dtype=np.float64),
+                                             np.asarray(lags, dtype=np.float64),
+                                             np.asarray(percentiles, dtype=np.float64), nthreads)
+        psd = np.array([np.asarray(band) for band in spectrum.psd])
+        acf = np.array([np.asarray(band) for band in spectrum.acf])
+        return psd, acf
+
+    def autocovariance(self, lags, percentile=68.0, nsamples=None, nthreads=1):
         """
-        roots = self._samples['ar_roots']
-        coefs = np.empty((roots.shape[0], self.p + 1), dtype=complex)
-        for i in range(roots.shape[0]):
-            coefs[i, :] = np.poly(roots[i, :])
-
-        self._samples['ar_coefs'] = coefs.real
-
-    def _sigma_noise(self):
+        Return the posterior median and the credibility interval corresponding to percentile of the autocovariance
+        function of the CARMA(p,q) process.
+
+        :rtype : A tuple of numpy arrays, (lower ACF, upper ACF, median ACF).
+        :param lags: The time lags at which to compute the autocovariance function.
+        :param percentile: The percentile of the credibility interval.
+        :param nsamples: The number of MCMC samples to use. The default is all of them.
+        :param nthreads: The number of threads to use.
         """
-        Calculate the MCMC samples of the standard deviation of the white noise driving process and add them to the
-        MCMC samples.
-        """
-        # get the CARMA(p,q) model variance of the time series
-        var = self._samples['var']
-
-        # get the roots of the AR(p) characteristic polynomial
-        ar_roots = self._samples['ar_roots']
-
-        # get the moving average coefficients
-        ma_coefs = self._samples['ma_coefs']
-
-        # calculate the variance of a CAR(p) process, assuming sigma = 1.0
-        sigma1_variance = np.zeros_like(var) + 0j
-        for k in range(self.p):
-            denom = -2.0 * ar_roots[:, k].real + 0j
-            for l in range(self.p):
-                if l != k:
-                    denom *= (ar_roots[:, l] - ar_roots[:, k]) * (np.conjugate(ar_roots[:, l]) + ar_roots[:, k])
-
-            ma_sum1 = np.zeros_like(ar_roots[:, 0])
-            ma_sum2 = ma_sum1.copy()
-            for l in range(ma_coefs.shape[1]):
-                ma_sum1 += ma_coefs[:, l] * ar_roots[:, k] ** l
-                ma_sum2 += ma_coefs[:, l] * (-1.0 * ar_roots[:, k]) ** l
-            numer = ma_sum1 * ma_sum2
-            sigma1_variance += numer / denom
-
-        sigsqr = var / sigma1_variance.real
-
-        # add the white noise sigmas to the MCMC samples
-        self._samples['sigma'] = np.sqrt(sigsqr)
+        lower = (100.0 - percentile) / 2.0
+        upper = 100.0 - lower
+        psd_credint, acf_credint = self._spectral_bands(np.empty(0), np.atleast_1d(lags), [lower, 50.0, upper],
+                                                        nsamples, nthreads)
+        return acf_credint[0], acf_credint[2], acf_credint[1]
 
     def plot_power_spectrum(self, percentile=68.0, nsamples=None, plot_log=True, color="b", alpha=0.5, sp=None,
-                            doShow=True):
+                            doShow=True, nthreads=1):
         """
         Plot the posterior median and the credibility interval corresponding to percentile of the CARMA(p,q) PSD. This
         function returns a tuple containing the lower and upper PSD credibility intervals as a function of frequency,
@@ -563,25 +526,8 @@ class CarmaSample(samplers.MCMCSample):
         :param alpha: The transparency level.
         :param sp: A matplotlib subplot axes object to use.
         :param doShow: If true, call plt.show()
+        :param nthreads: The number of threads used to compute the PSDs.
         """
-        sigmas = self._samples['sigma']
-        ar_coefs = self._samples['ar_coefs']
-        ma_coefs = self._samples['ma_coefs']
-        if nsamples is None:
-            # Use all of the MCMC samples
-            nsamples = sigmas.shape[0]
-        else:
-            try:
-                nsamples <= sigmas.shape[0]
-            except ValueError:
-                "nsamples must be less than the total number of MCMC samples."
-
-            nsamples0 = sigmas.shape[0]
-            index = np.arange(nsamples) * (nsamples0 / nsamples)
-            sigmas = sigmas[index]
-            ar_coefs = ar_coefs[index]
-            ma_coefs = ma_coefs[index]
-
         nfreq = 1000
         dt_min = self.time[1:] - self.time[0:self.time.size - 1]
         dt_min = dt_min.min()
@@ -594,34 +540,14 @@ class CarmaSample(samplers.MCMCSample):
 
         frequencies = np.linspace(np.log(freq_min), np.log(freq_max), num=nfreq)
         frequencies = np.exp(frequencies)
-        psd_credint = np.empty((nfreq, 3))
 
         lower = (100.0 - percentile) / 2.0  # lower and upper intervals for credible region
         upper = 100.0 - lower
 
-        # Compute the PSDs from the MCMC samples
-        omega = 2.0 * np.pi * 1j * frequencies
-        ar_poly = np.zeros((nfreq, nsamples), dtype=complex)
-        ma_poly = np.zeros_like(ar_poly)
-        for k in range(self.p):
-            # Here we compute:
-            #   alpha(omega) = ar_coefs[0] * omega^p + ar_coefs[1] * omega^(p-1) + ... + ar_coefs[p]
-            # Note that ar_coefs[0] = 1.0.
-            argrid, omgrid = np.meshgrid(ar_coefs[:, k], omega)
-            ar_poly += argrid * (omgrid ** (self.p - k))
-        ar_poly += ar_coefs[:, self.p]
-        for k in range(ma_coefs.shape[1]):
-            # Here we compute:
-            #   delta(omega) = ma_coefs[0] + ma_coefs[1] * omega + ... + ma_coefs[q] * omega^q
-            magrid, omgrid = np.meshgrid(ma_coefs[:, k], omega)
-            ma_poly += magrid * (omgrid ** k)
-
-        psd_samples = np.squeeze(sigmas) ** 2 * np.abs(ma_poly) ** 2 / np.abs(ar_poly) ** 2
-
-        # Now compute credibility interval for power spectrum
-        psd_credint[:, 0] = np.percentile(psd_samples, lower, axis=1)
-        psd_credint[:, 2] = np.percentile(psd_samples, upper, axis=1)
-        psd_credint[:, 1] = np.median(psd_samples, axis=1)
+        # Compute the credibility interval for the power spectrum from the MCMC samples
+        psd_credint, acf_credint = self._spectral_bands(frequencies, np.empty(0), [lower, 50.0, upper], nsamples,
+                                                        nthreads)
+        psd_credint = psd_credint.T
 
         # Plot the power spectra
         if sp == None:
@@ -676,12 +602,8 @@ class CarmaSample(samplers.MCMCSample):
             ma_coefs = self._samples['ma_coefs'][random_index]
 
         # expose C++ Kalman filter class to python
-        kfilter = carmcmcLib.KalmanFilterp(arrayToVec(self.time),
-                                           arrayToVec(self.y - mu),
-                                           arrayToVec(self.ysig),
-                                           sigsqr, 
-                                           arrayToVec(ar_roots, carmcmcLib.vecC),
-                                           arrayToVec(ma_coefs))
+        kfilter = carmcmcLib.KalmanFilterp(self.time, self.y - mu, self.ysig, sigsqr,
+                                           np.asarray(ar_roots, dtype=np.complex128), np.asarray(ma_coefs))
         return kfilter, mu
 
     def assess_fit(self, bestfit="map", nplot=256, doShow=True):
@@ -795,18 +717,36 @@ class CarmaSample(samplers.MCMCSample):
             yhat = pred.first
             yhat_var = pred.second
         else:
-            yhat = np.empty(time.size)
-            yhat_var = np.empty(time.size)
-            for i in range(time.size):
-                pred = kfilter.Predict(time[i])
-                yhat[i] = pred.first
-                yhat_var[i] = pred.second
+            # predict all of the time values with a single forward/backward pass of the Kalman Filter
+            pred = kfilter.PredictBatch(np.asarray(time, dtype=np.float64))
+            yhat = np.array(pred.first)
+            yhat_var = np.array(pred.second)
 
         yhat += mu  # add mean back into time series
 
         return yhat, yhat_var
 
-    def simulate(self, time, bestfit='map'):
+    def online_filter(self, bestfit='map'):
+        """
+        Return an online Kalman Filter for the best-fit CARMA(p,q) model that has already ingested the measured time
+        series. New measurements are added with its Append(time, y, yerr) method, which returns the predicted mean and
+        variance of the new measurement and its contribution to the log-likelihood, without running the Kalman Filter
+        over the earlier data again. The filtered state can be saved with Checkpoint() and restored with Restore().
+
+        :param bestfit: A string specifying how to define 'best-fit'. Can be the Maximum Posterior (MAP), the posterior
+            mean ("mean"), the posterior median ("median"), or a random sample from the MCMC sampler ("random").
+        :rtype : A carmcmcLib.OnlineKalmanFilter object.
+        """
+        bestfit = bestfit.lower()
+
+        # the KalmanFilter class is run on the centered time series, so center the new measurements in the same way
+        kfilter, mu = self.makeKalmanFilter(bestfit)
+        online = kfilter.MakeOnlineFilter()
+        online.SetTimeSeriesMean(mu)
+
+        return online
+
+    def simulate(self, time, bestfit='map', nsim=1):
         """
         Simulate a time series at the input time(s) given the best-fit value of the CARMA(p,q) model and the measured
         time series.
@@ -814,7 +754,10 @@ class CarmaSample(samplers.MCMCSample):
         :param time: A scalar or numpy array containing the time values to simulate the time series at.
         :param bestfit: A string specifying how to define 'best-fit'. Can be the Maximum Posterior (MAP), the posterior
             mean ("mean"), the posterior median ("median"), or a random sample from the MCMC sampler ("random").
-        :rtype : The time series values simulated at the input values of time.
+        :param nsim: The number of realizations to simulate. All of the realizations are generated from a single pass
+            of the Kalman Filter.
+        :rtype : The time series values simulated at the input values of time. If nsim > 1 this is a (nsim, ntime)
+            array.
         """
         bestfit = bestfit.lower()
         try:
@@ -825,13 +768,12 @@ class CarmaSample(samplers.MCMCSample):
         # note that KalmanFilter class assumes the time series has zero mean
         kfilter, mu = self.makeKalmanFilter(bestfit)
         kfilter.Filter()
-        vtime = carmcmcLib.vecD()
-        if np.isscalar(time):
-            vtime.append(time)
-        else:
-            vtime.extend(time)
+        vtime = np.atleast_1d(np.asarray(time, dtype=np.float64))
 
-        ysim = np.asarray(kfilter.Simulate(vtime))
+        if nsim > 1:
+            ysim = np.array([np.asarray(y) for y in kfilter.Simulate(vtime, nsim)])
+        else:
+            ysim = np.asarray(kfilter.Simulate(vtime))
         ysim += mu  # add mean back into time series
 
         return ysim
@@ -864,7 +806,7 @@ def arrayToVec(array, arrType=carmcmcLib.vecD):
 
 
 class Car1Sample(CarmaSample):
-    def __init__(self, time, y, ysig, sampler, filename=None):
+    def __init__(self, time, y, ysig, sampler, filename=None, trace_file=None):
         """
         Constructor for a CAR(1) sample. This is a special case of the CarmaSample class for p = 1. As with the
         CarmaSample class, this class should never be constructed directly. Instead, one should obtain a Car1Sample
@@ -875,6 +817,7 @@ class Car1Sample(CarmaSample):
         @param ysig: The standard deviation in the measurement noise for the time series.
         @param sampler: A wrapper for an instantiated C++ Car1 object.
         @param filename: The name of an ascii file containing the MCMC samples.
+        @param trace_file: The name of the binary file that the C++ sampler streamed the MCMC samples to.
         """
         self.time = time  # The time values of the time series
         self.y = y     # The measured values of the time series
@@ -882,8 +825,12 @@ class Car1Sample(CarmaSample):
         self.p = 1     # How many AR terms
         self.q = 0     # How many MA terms
 
-        logpost = np.array(sampler.GetLogLikes())
-        trace = np.array(sampler.getSamples())
+        if trace_file:
+            logpost, trace = samplers.read_trace(trace_file)
+        else:
+            # these are read-only views of the samples held by the C++ sampler, not copies
+            logpost = np.asarray(sampler.GetLogLikes())
+            trace = np.asarray(sampler.getSamples())
 
         super(CarmaSample, self).__init__(filename=filename, logpost=logpost, trace=trace)
 
@@ -894,9 +841,7 @@ class Car1Sample(CarmaSample):
         print("Calculating log-likelihoods...")
         loglik = np.empty(logpost.size)
         for i in range(logpost.size):
-            std_theta = carmcmcLib.vecD()
-            std_theta.extend(trace[i, :])
-            loglik[i] = logpost[i] - sampler.getLogPrior(std_theta)
+            loglik[i] = logpost[i] - sampler.getLogPrior(trace[i, :])
 
         self._samples['loglik'] = loglik
         # make the parameter names (i.e., the keys) public so the use knows how to get them
@@ -904,6 +849,7 @@ class Car1Sample(CarmaSample):
         self.newaxis()
 
     def generate_from_trace(self, trace):
+        self._trace = trace  # kept for the C++ PSD and autocovariance engine
         names = ['sigma', 'measerr_scale', 'mu', 'log_omega']
         if names != self._samples.keys():
             self._samples['var'] = trace[:, 0] ** 2
@@ -911,14 +857,6 @@ class Car1Sample(CarmaSample):
             self._samples['mu'] = trace[:, 2]
             self._samples['log_omega'] = trace[:, 3]
 
-    def _ar_roots(self):
-        print("_ar_roots not supported for CAR1")
-        return
-
-    def _ar_coefs(self):
-        print("_ar_coefs not supported for CAR1")
-        return
-
     def _sigma_noise(self):
         self._samples['sigma'] = np.sqrt(2.0 * self._samples['var'] * np.exp(self._samples['log_omega']))
 
@@ -940,100 +878,9 @@ class Car1Sample(CarmaSample):
             mu = np.mean(self._samples['mu'])
             log_omega = np.mean(self._samples['log_omega'])
 
-        kfilter = carmcmcLib.KalmanFilter1(arrayToVec(self.time),
-                                           arrayToVec(self.y - mu),
-                                           arrayToVec(self.ysig),
-                                           sigsqr, 
-                                           np.exp(log_omega))
+        kfilter = carmcmcLib.KalmanFilter1(self.time, self.y - mu, self.ysig, sigsqr, np.exp(log_omega))
         return kfilter, mu
 
-    def plot_power_spectrum(self, percentile=68.0, nsamples=None, plot_log=True, color="b", alpha=0.5, sp=None,
-                            doShow=True):
-        """
-        Plot the posterior median and the credibility interval corresponding to percentile of the CAR(1) PSD. This
-        function returns a tuple containing the lower and upper PSD credibility intervals as a function of
-        frequency, the median PSD as a function of frequency, and the frequencies.
-
-        :rtype : A tuple of numpy arrays, (lower PSD, upper PSD, median PSD, frequencies). If no subplot axes object
-            is supplied (i.e., if sp = None), then the subplot axes object used will also be returned as the last
-            element of the tuple.
-        :param percentile: The percentile of the PSD credibility interval to plot.
-        :param nsamples: The number of MCMC samples to use to estimate the credibility interval. The default is all
-                         of them. Use less samples for increased speed.
-        :param plot_log: A boolean. If true, then a logarithmic plot is made.
-        :param color: The color of the shaded credibility region.
-        :param alpha: The transparency level.
-        :param sp: A matplotlib subplot axes object to use.
-        :param doShow: If true, call plt.show()
-        """
-        sigmas = self._samples['sigma']
-        log_omegas = self._samples['log_omega']
-        if nsamples is None:
-            # Use all of the MCMC samples
-            nsamples = sigmas.shape[0]
-        else:
-            try:
-                nsamples <= sigmas.shape[0]
-            except ValueError:
-                "nsamples must be less than the total number of MCMC samples."
-
-            nsamples0 = sigmas.shape[0]
-            index = np.arange(nsamples) * int(nsamples0 / nsamples)
-            sigmas = sigmas[index]
-            log_omegas = log_omegas[index]
-
-        nfreq = 1000
-        dt_min = self.time[1:] - self.time[0:self.time.size - 1]
-        dt_min = dt_min.min()
-        dt_max = self.time.max() - self.time.min()
-
-        # Only plot frequencies corresponding to time scales a factor of 2 shorter and longer than the minimum and
-        # maximum time scales probed by the time series.
-        freq_max = 0.5 / dt_min
-        freq_min = 1.0 / dt_max
-
-        frequencies = np.linspace(np.log(freq_min), np.log(freq_max), num=nfreq)
-        frequencies = np.exp(frequencies)
-        psd_credint = np.empty((nfreq, 3))
-
-        lower = (100.0 - percentile) / 2.0  # lower and upper intervals for credible region
-        upper = 100.0 - lower
-
-        numer = sigmas ** 2
-        omegasq = np.exp(log_omegas) ** 2
-        for i in range(nfreq):
-            denom = omegasq + (2. * np.pi * frequencies[i]) ** 2
-            psd_samples = numer / denom
-
-            # Now compute credibility interval for power spectrum
-            psd_credint[i, 0] = np.percentile(psd_samples, lower, axis=0)
-            psd_credint[i, 2] = np.percentile(psd_samples, upper, axis=0)
-            psd_credint[i, 1] = np.median(psd_samples, axis=0)
-
-        # Plot the power spectra
-        if sp == None:
-            fig = plt.figure()
-            sp = fig.add_subplot(111)
-
-        if plot_log:
-            # plot the posterior median first
-            sp.loglog(frequencies, psd_credint[:, 1], color=color)
-        else:
-            sp.plot(frequencies, psd_credint[:, 1], color=color)
-
-        sp.fill_between(frequencies, psd_credint[:, 2], psd_credint[:, 0], facecolor=color, alpha=alpha)
-        sp.set_xlim(frequencies.min(), frequencies.max())
-        sp.set_xlabel('Frequency')
-        sp.set_ylabel('Power Spectrum')
-
-        if doShow:
-            plt.show()
-
-        if sp == None:
-            return (psd_credint[:, 0], psd_credint[:, 2], psd_credint[:, 1], frequencies, fig)
-        else:
-            return (psd_credint[:, 0], psd_credint[:, 2], psd_credint[:, 1], frequencies)
-
 
 def get_ar_roots(qpo_width, qpo_centroid):
     """
@@ -10,6 +10,25 @@ import scipy.stats
 import acor
 
 
+def read_trace(filename):
+    """
+    Read a binary file of MCMC samples streamed by the C++ samplers. The file is memory-mapped instead of parsed, so
+    only the parts of the file that are used are read from disk.
+
+    :param filename: The name of the binary trace file.
+    :return: A tuple of (logpost, trace), where logpost contains the log-posterior values and trace is a read-only
+        array of the parameter values with one row per sample.
+    """
+    with open(filename, 'rb') as trace_file:
+        tag = trace_file.read(8)
+        ncols = int(np.fromfile(trace_file, dtype=np.uint64, count=1)[0])
+    if tag != b'CARTRACE':
+        raise ValueError(filename + " is not a binary trace file written by carma_pack.")
+    rows = np.memmap(filename, dtype=np.float64, mode='r', offset=16)
+    rows = rows.reshape((rows.size // ncols, ncols))
+    return rows[:, 0], rows[:, 1:]
+
+
 class MCMCSample(object):
     """
     Class for parameter samples generated by a yamcmc++ sampler. This class contains a dictionary of samples
@@ -24,7 +43,7 @@ class MCMCSample(object):
     generate_from_file. This is helpful if one has a set of MCMC samples generated by a different program.
     """
 
-    def __init__(self, filename=None, logpost=None, trace=None):
+    def __init__(self, filename=None, logpost=None, trace=None, nwalkers=1):
         """
         Constructor for an MCMCSample object. If no arguments are supplied, then this just creates an empty dictionary
         that will contain the MCMC samples. In this case parameters are added to the dictionary through the addstep
@@ -32,8 +51,11 @@ class MCMCSample(object):
         filename is supplied then the parameter names and MCMC samples are read in from that file.
 
         :param filename: A string giving the name of an asciifile containing the MCMC samples.
+        :param nwalkers: The number of chains that the samples are interleaved from. The samples are stored
+            iteration-major, so the draws for chain k are rows k, k + nwalkers, k + 2 * nwalkers, etc. Default is 1.
         """
         self._samples = dict()  # Empty dictionary. We will place the samples for each tracked parameter here.
+        self.nwalkers = nwalkers
 
         if logpost is not None:
             self.set_logpost(logpost)
@@ -75,17 +97,21 @@ class MCMCSample(object):
         """
         Compute the autocorrelation time scale as estimated by the `acor` module.
 
-        :param trace: The parameter trace, a numpy array.
+        :param trace: The parameter trace, a numpy array. If the samples come from more than one chain, then the
+            time scale is computed separately for each chain and averaged over the chains.
         """
         acors = []
         for i in range(trace.shape[1]):
-            tau, mean, sigma = acor.acor(trace[:, i].real)  # Warning, does not work with numpy.complex
+            # the chains are interleaved, so chain k is every nwalkers-th sample starting at k
+            chains = trace[:, i].real.reshape((-1, self.nwalkers))  # Warning, does not work with numpy.complex
+            tau = np.mean([acor.acor(chains[:, k])[0] for k in range(self.nwalkers)])
             acors.append(tau)
         return np.array(acors)
 
     def effective_samples(self, name):
         """
-        Return the effective number of independent samples of the MCMC sampler.
+        Return the effective number of independent samples of the MCMC sampler. For samples from more than one chain,
+        this is the total number of samples divided by the autocorrelation time scale of the individual chains.
 
         :param name: The name of the parameter to compute the effective number of independent samples for.
         """
@@ -292,9 +318,11 @@ class MCMCSample(object):
             fig = plt.figure()
 
         traces = self._samples[name]  # Get the sampled parameter values
+        acorr  = self.autocorr_timescale(traces)
+        # only plot the autocorrelation function of the first chain, since the chains are independent
+        traces = traces[::self.nwalkers]
         mtrace = np.mean(traces, axis=0)
         ntrace = traces.shape[1]
-        acorr  = self.autocorr_timescale(traces)
 
         for i in range(ntrace):
             sp = plt.subplot(ntrace, 1, i+1)
@@ -356,14 +384,15 @@ class MCMCSample(object):
 
         # Finally, plot the autocorrelation function of the trace
         plt.subplot(212)
-        centered_trace = traces - traces.mean()
-        lags, acf, not_needed1, not_needed2 = plt.acorr(centered_trace, maxlags=traces.size - 1, lw=2)
+        chain = traces[::self.nwalkers]  # the autocorrelation function is only defined along a single chain
+        centered_trace = chain - chain.mean()
+        lags, acf, not_needed1, not_needed2 = plt.acorr(centered_trace, maxlags=chain.size - 1, lw=2)
         plt.ylabel("ACF")
         plt.xlabel("Lag")
 
         # Compute the autocorrelation timescale, and then reset the x-axis limits accordingly
         acf_timescale = self.autocorr_timescale(traces[:, np.newaxis])
-        plt.xlim(0, np.min([5 * acf_timescale[0], len(traces)]))
+        plt.xlim(0, np.min([5 * acf_timescale[0], len(chain)]))
         if doShow:
             plt.show()
 
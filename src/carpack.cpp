@@ -23,10 +23,10 @@
 #include "include/carpack.hpp"
 
 // Global random number generator object, instantiated in random.cpp
-extern boost::random::mt19937 rng;
+extern thread_local boost::random::mt19937 rng;
 
 // Object containing some common random number generators.
-extern RandomGenerator RandGen;
+extern thread_local RandomGenerator RandGen;
 
 /********************************************************************
 						METHODS OF CAR1 CLASS
@@ -41,17 +41,17 @@ arma::vec CAR1::StartingValue()
 
 	// Initialize the standard deviation of the CAR(1) process
 	// by drawing from its prior
-	car1_stdev_start = RandGen.scaled_inverse_chisqr(y_.n_elem-1, arma::var(y_));
+	car1_stdev_start = RandGen.scaled_inverse_chisqr(data_->size()-1, arma::var(data_->y()));
 	car1_stdev_start = sqrt(car1_stdev_start);
     
     // Get initial value of the time series mean
-    double mu = RandGen.normal(arma::mean(y_), car1_stdev_start / y_.n_elem);
+    double mu = RandGen.normal(arma::mean(data_->y()), car1_stdev_start / data_->size());
 
 	// Initialize log(omega) to log( 1 / (a * median(dt)) ), where
 	// a ~ Uniform(1,50) , under the constraint that 
 	// tau = 1 / omega < max(time)
 	
-    arma::vec dt = time_(arma::span(1,time_.n_elem-1)) - time_(arma::span(0,time_.n_elem-2));
+    const arma::vec& dt = data_->dt();
 	log_omega_start = -1.0 * log(arma::median(dt) * RandGen.uniform( 1.0, 50.0 ));
 	log_omega_start = std::min(log_omega_start, max_freq_);
 	
@@ -71,10 +71,8 @@ arma::vec CAR1::StartingValue()
 	// Initialize the Kalman filter
     pKFilter_->SetOmega(exp(log_omega_start));
     pKFilter_->SetSigsqr(sigma * sigma);
-    arma::vec proposed_yerr = sqrt(measerr_scale) * yerr_;
-    pKFilter_->SetTimeSeriesErr(proposed_yerr);
-    arma::vec ycent = y_ - mu;
-    pKFilter_->SetTimeSeries(ycent);
+    pKFilter_->SetMeasErrScale(measerr_scale);
+    pKFilter_->SetTimeSeriesMean(mu);
     pKFilter_->Filter();
 	
 	return theta;
@@ -103,10 +101,8 @@ arma::vec CAR1::SetStartingValue(arma::vec init)
 
    pKFilter_->SetOmega(exp(log_omega_start));
    pKFilter_->SetSigsqr(sigma * sigma);
-   arma::vec proposed_yerr = sqrt(measerr_scale) * yerr_;
-   pKFilter_->SetTimeSeriesErr(proposed_yerr);
-   arma::vec ycent = y_ - mu;
-   pKFilter_->SetTimeSeries(ycent);
+   pKFilter_->SetMeasErrScale(measerr_scale);
+   pKFilter_->SetTimeSeriesMean(mu);
    pKFilter_->Filter();
 
    return init;
@@ -129,6 +125,19 @@ bool CAR1::CheckPriorBounds(arma::vec theta)
     return prior_satisfied;
 }
 
+// Derivatives of the Kalman filter parameters with respect to theta = (sigma, measerr_scale, mu, log(omega))
+KalmanDerivatives CAR1::ExtractDerivs(arma::vec theta)
+{
+    KalmanDerivatives derivs(1, theta.n_elem);
+    double omega = exp(theta(3));
+    derivs.sigsqr(0) = 4.0 * theta(0) * omega;
+    derivs.sigsqr(3) = 2.0 * theta(0) * theta(0) * omega;
+    derivs.omega(0,3) = omega;
+    derivs.ymean(2) = 1.0;
+    derivs.measerr_scale(1) = 1.0;
+    return derivs;
+}
+
 /********************************************************************
                         METHODS OF CARp CLASS
  *******************************************************************/
@@ -136,39 +145,9 @@ bool CAR1::CheckPriorBounds(arma::vec theta)
 // Calculate the roots of the AR(p) polynomial from the parameters
 arma::cx_vec CARp::ARRoots(arma::vec theta)
 {
-    arma::cx_vec ar_roots(p_);
-    
-    // Construct the complex vector of roots of the characteristic polynomial:
-    // alpha(s) = s^p + alpha_1 s^{p-1} + ... + alpha_{p-1} s + alpha_p
-    for (int i=0; i<p_/2; i++) {
-        // alpha(s) decomposed into its quadratic terms:
-        //   alpha(s) = (quad_term1 + quad_term2 * s + s^2) * ...
-        double quad_term1 = exp(theta(3+2*i));
-        double quad_term2 = exp(theta(3+2*i+1));
-
-        double discriminant = quad_term2 * quad_term2 - 4.0 * quad_term1;
-        
-        if (discriminant > 0) {
-            // two real roots
-            double root1 = -0.5 * (quad_term2 + sqrt(discriminant));
-            double root2 = -0.5 * (quad_term2 - sqrt(discriminant));
-            ar_roots(2*i) = std::complex<double> (root1, 0.0);
-            ar_roots(2*i+1) = std::complex<double> (root2, 0.0);
-        } else {
-            double real_part = -0.5 * quad_term2;
-            double imag_part = -0.5 * sqrt(-discriminant);
-            ar_roots(2*i) = std::complex<double> (real_part, imag_part);
-            ar_roots(2*i+1) = std::complex<double> (real_part, -imag_part);
-        }
-    }
-	
-    if ((p_ % 2) == 1) {
-        // p is odd, so add in additional low-frequency component
-        double real_root = -exp(theta(3+p_-1));
-        ar_roots(p_-1) = std::complex<double> (real_root, 0.0);
-    }
-        
-    return ar_roots;
+    // alpha(s) = s^p + alpha_1 s^{p-1} + ... + alpha_{p-1} s + alpha_p is decomposed into its quadratic terms:
+    //   alpha(s) = (quad_term1 + quad_term2 * s + s^2) * ...
+    return QuadraticRoots(theta, 3, p_);
 }
 
 // Return the starting value and set log_posterior_
@@ -188,10 +167,10 @@ arma::vec CARp::StartingValue()
         
         // Initial guess for model standard deviation is randomly distributed
         // around measured standard deviation of the time series
-        double yvar = RandGen.scaled_inverse_chisqr(y_.n_elem-1, arma::var(y_));
+        double yvar = RandGen.scaled_inverse_chisqr(data_->size()-1, arma::var(data_->y()));
         
         // Get initial value of the time series mean
-        double mu = RandGen.normal(arma::mean(y_), sqrt(yvar) / y_.n_elem);
+        double mu = RandGen.normal(arma::mean(data_->y()), sqrt(yvar) / data_->size());
 
         arma::cx_vec alpha_roots = ARRoots(theta);
         double sigsqr = yvar / Variance(alpha_roots, ma_coefs_, 1.0);
@@ -209,10 +188,8 @@ arma::vec CARp::StartingValue()
         // set the Kalman filter parameters
         pKFilter_->SetSigsqr(sigsqr);
         pKFilter_->SetOmega(ExtractAR(theta));
-        arma::vec proposed_yerr = sqrt(measerr_scale) * yerr_;
-        pKFilter_->SetTimeSeriesErr(proposed_yerr);
-        arma::vec ycent = y_ - mu;
-        pKFilter_->SetTimeSeries(ycent);
+        pKFilter_->SetMeasErrScale(measerr_scale);
+        pKFilter_->SetTimeSeriesMean(mu);
         
         // run the kalman filter
         pKFilter_->Filter();
@@ -255,10 +232,8 @@ arma::vec CARp::SetStartingValue(arma::vec init)
    // set the Kalman filter parameters
    pKFilter_->SetSigsqr(sigsqr);
    pKFilter_->SetOmega(ExtractAR(init));
-   arma::vec proposed_yerr = sqrt(measerr_scale) * yerr_;
-   pKFilter_->SetTimeSeriesErr(proposed_yerr);
-   arma::vec ycent = y_ - mu;
-   pKFilter_->SetTimeSeries(ycent);
+   pKFilter_->SetMeasErrScale(measerr_scale);
+   pKFilter_->SetTimeSeriesMean(mu);
    pKFilter_->Filter();
 
    return init;
@@ -266,7 +241,7 @@ arma::vec CARp::SetStartingValue(arma::vec init)
 
 // return the starting values for the autoregressive polynomial paramters
 arma::vec CARp::StartingAR() {
-    double min_freq = 1.0 / (time_.max() - time_.min());
+    double min_freq = 1.0 / (data_->time().max() - data_->time().min());
     
     // Obtain initial values for Lorentzian centroids (= system frequencies) and
     // widths (= break frequencies)
@@ -373,36 +348,60 @@ bool CARp::CheckPriorBounds(arma::vec theta)
     return prior_satisfied;
 }
 
+// Derivatives of the Kalman filter parameters with respect to the CARMA parameter vector
+KalmanDerivatives CARp::ExtractDerivs(arma::vec theta)
+{
+    KalmanDerivatives derivs(p_, theta.n_elem);
+    derivs.ymean(2) = 1.0;
+    derivs.measerr_scale(1) = 1.0;
+    
+    arma::cx_mat dar_roots;
+    arma::cx_vec ar_roots = QuadraticRoots(theta, 3, p_, dar_roots);
+    derivs.omega.cols(3, 3+p_-1) = dar_roots;
+    derivs.ma_coefs = ExtractMADerivs(theta);
+    
+    // sigsqr = ysigma^2 / Variance(ar_roots, ma_coefs, 1.0). The variance of the process is the variance of the
+    // measurements predicted by the rotated state space representation with sigsqr = 1, so its derivatives follow
+    // from the derivatives of the rotated state space representation.
+    arma::rowvec ma_coefs = arma::trans(ExtractMA(theta));
+    arma::rowvec dunit_sigsqr = arma::zeros<arma::rowvec>(theta.n_elem);
+    arma::cx_mat eigen_mat, state_var;
+    arma::cx_rowvec rotated_ma_coefs;
+    std::vector<arma::cx_rowvec> drotated_ma_coefs;
+    std::vector<arma::cx_mat> dstate_var;
+    RotateCarmaModelDerivs(ar_roots, ma_coefs, 1.0, derivs.omega, derivs.ma_coefs, dunit_sigsqr, eigen_mat,
+                           rotated_ma_coefs, state_var, drotated_ma_coefs, dstate_var);
+    arma::cx_vec var_obs = state_var * rotated_ma_coefs.t();
+    double variance = std::real(arma::as_scalar(rotated_ma_coefs * var_obs));
+    arma::rowvec dvariance(theta.n_elem);
+    for (int k=0; k<theta.n_elem; k++) {
+        dvariance(k) = 2.0 * std::real(arma::as_scalar(drotated_ma_coefs[k] * var_obs)) +
+            std::real(arma::as_scalar(rotated_ma_coefs * dstate_var[k] * rotated_ma_coefs.t()));
+    }
+    double sigsqr = theta(0) * theta(0) / variance;
+    derivs.sigsqr = -sigsqr * dvariance / variance;
+    derivs.sigsqr(0) += 2.0 * theta(0) / variance;
+    
+    return derivs;
+}
+
+// Switch between the real-arithmetic and complex Kalman Filters, keeping the moving average coefficients
+void CARp::SetRealFilter(bool real_filter)
+{
+    arma::vec ma_coefs = std::static_pointer_cast<KalmanFilterp>(pKFilter_)->GetMA();
+    if (real_filter) {
+        pKFilter_ = std::make_shared<KalmanFilterpReal>(data_);
+    } else {
+        pKFilter_ = MakeKalmanFilterp(data_, p_);
+    }
+    pKFilter_->SetMA(ma_coefs);
+}
+
 // Calculate the variance of the CAR(p) process
 double CARp::Variance(arma::cx_vec alpha_roots, arma::vec ma_coefs, double sigma, double dt)
 {
-    std::complex<double> car_var(0.0,0.0);
-    std::complex<double> denom(0.0,0.0);
-    std::complex<double> numer(0.0,0.0);
-    
-	// Calculate the variance of a CAR(p) process
-	for (int k=0; k<alpha_roots.n_elem; k++) {
-		std::complex<double> denom_product(1.0,0.0);
-		
-		for (int l=0; l<alpha_roots.n_elem; l++) {
-			if (l != k) {
-				denom_product *= (alpha_roots(l) - alpha_roots(k)) * 
-                (std::conj(alpha_roots(l)) + alpha_roots(k));
-			}
-		}
-        denom = -2.0 * std::real(alpha_roots(k)) * denom_product;
-        
-        int q = ma_coefs.n_elem;
-        std::complex<double> ma_sum1(0.0,0.0);
-        std::complex<double> ma_sum2(0.0,0.0);
-        for (int l=0; l<q; l++) {
-            ma_sum1 += ma_coefs(l) * std::pow(alpha_roots(k),l);
-            ma_sum2 += ma_coefs(l) * std::pow(-alpha_roots(k),l);
-        }
-        numer = ma_sum1 * ma_sum2 * std::exp(alpha_roots(k) * dt);
-        
-        car_var += numer / denom;
-	}
+    arma::cx_vec weights = AutocovarianceWeights(alpha_roots, ma_coefs);
+    std::complex<double> car_var = arma::sum(weights % arma::exp(alpha_roots * dt));
 	
 	// Variance is real-valued, so only return the real part of CARMA_var.
     return sigma * sigma * car_var.real();
@@ -434,10 +433,10 @@ arma::vec CARMA::StartingValue()
 
         // Initial guess for model standard deviation is randomly distributed
         // around measured standard deviation of the time series
-        double yvar = RandGen.scaled_inverse_chisqr(y_.n_elem-1, arma::var(y_));
+        double yvar = RandGen.scaled_inverse_chisqr(data_->size()-1, arma::var(data_->y()));
         
         // Get initial value of the time series mean
-        double mu = RandGen.normal(arma::mean(y_), sqrt(yvar) / y_.n_elem);
+        double mu = RandGen.normal(arma::mean(data_->y()), sqrt(yvar) / data_->size());
         
         arma::cx_vec alpha_roots = ARRoots(theta);
         double sigsqr = yvar / Variance(alpha_roots, ma_coefs, 1.0);
@@ -460,10 +459,8 @@ arma::vec CARMA::StartingValue()
             pKFilter_->SetSigsqr(sigsqr);
             pKFilter_->SetOmega(ExtractAR(theta));
             pKFilter_->SetMA(ExtractMA(theta));
-            arma::vec proposed_yerr = sqrt(measerr_scale) * yerr_;
-            pKFilter_->SetTimeSeriesErr(proposed_yerr);
-            arma::vec ycent = y_ - mu;
-            pKFilter_->SetTimeSeries(ycent);
+            pKFilter_->SetMeasErrScale(measerr_scale);
+            pKFilter_->SetTimeSeriesMean(mu);
         
             // run the kalman filter
             pKFilter_->Filter();
@@ -502,10 +499,8 @@ arma::vec CARMA::SetStartingValue(arma::vec init)
    pKFilter_->SetSigsqr(sigsqr);
    pKFilter_->SetOmega(ExtractAR(init));
    pKFilter_->SetMA(ExtractMA(init));
-   arma::vec proposed_yerr = sqrt(measerr_scale) * yerr_;
-   pKFilter_->SetTimeSeriesErr(proposed_yerr);
-   arma::vec ycent = y_ - mu;
-   pKFilter_->SetTimeSeries(ycent);
+   pKFilter_->SetMeasErrScale(measerr_scale);
+   pKFilter_->SetTimeSeriesMean(mu);
    pKFilter_->Filter();
    
    return init;
@@ -521,62 +516,44 @@ arma::vec CARMA::StartingMA() {
 // extract the moving-average coefficients from the CARMA parameter vector
 arma::vec CARMA::ExtractMA(arma::vec theta)
 {
-    arma::cx_vec ma_roots(q_);
+    // the MA polynomial is parameterized by its quadratic terms in the same way as the AR polynomial
+    arma::cx_vec ma_roots = QuadraticRoots(theta, 3+p_, q_);
+    return MACoefs(ma_roots, p_);
+}
+
+// Derivatives of the moving-average coefficients with respect to the CARMA parameter vector
+arma::mat CARMA::ExtractMADerivs(arma::vec theta)
+{
+    arma::mat dma_coefs = arma::zeros<arma::mat>(p_, theta.n_elem);
+    arma::cx_mat dma_roots;
+    arma::cx_vec ma_roots = QuadraticRoots(theta, 3+p_, q_, dma_roots);
     
-    // Construct the complex vector of roots of the characteristic polynomial:
-    // alpha(s) = s^p + alpha_1 s^{p-1} + ... + alpha_{p-1} s + alpha_p
-    for (int i=0; i<q_/2; i++) {
-        // alpha(s) decomposed into its quadratic terms:
-        //   alpha(s) = (quad_term1 + quad_term2 * s + s^2) * ...
-        double quad_term1 = exp(theta(3+p_+2*i));
-        double quad_term2 = exp(theta(3+p_+2*i+1));
-        
-        double discriminant = quad_term2 * quad_term2 - 4.0 * quad_term1;
-        
-        if (discriminant > 0) {
-            // two real roots
-            double root1 = -0.5 * (quad_term2 + sqrt(discriminant));
-            double root2 = -0.5 * (quad_term2 - sqrt(discriminant));
-            ma_roots(2*i) = std::complex<double> (root1, 0.0);
-            ma_roots(2*i+1) = std::complex<double> (root2, 0.0);
-        } else {
-            double real_part = -0.5 * quad_term2;
-            double imag_part = -0.5 * sqrt(-discriminant);
-            ma_roots(2*i) = std::complex<double> (real_part, imag_part);
-            ma_roots(2*i+1) = std::complex<double> (real_part, -imag_part);
+    // The derivative of the polynomial prod_l (x - r_l) with respect to r_k is -prod_{l != k} (x - r_l)
+    arma::cx_mat dpoly_droots = arma::zeros<arma::cx_mat>(q_+1, q_);
+    for (int k=0; k<q_; k++) {
+        arma::cx_vec coefs = arma::zeros<arma::cx_vec>(q_);
+        coefs(0) = 1.0;
+        int nroots = 0;
+        for (int l=0; l<q_; l++) {
+            if (l != k) {
+                coefs(arma::span(1,nroots+1)) = coefs(arma::span(1,nroots+1)) - ma_roots(l) * coefs(arma::span(0,nroots));
+                nroots++;
+            }
         }
+        dpoly_droots(arma::span(1,q_), k) = -coefs;
     }
-	
-    if ((q_ % 2) == 1) {
-        // p is odd, so add in additional low-frequency component
-        double real_root = -exp(theta(3+p_+q_-1));
-        ma_roots(q_-1) = std::complex<double> (real_root, 0.0);
-    }
-
-    // calculate the coefficients of the polynomial
-    //
-    //    p(x) = x^q + c_1 * x^{q-1} + ... + c_{q-1} * x + c_q
-    //
-    // from it roots. note that poly_coefs[0] = 1.0 = c_0.
-    arma::vec poly_coefs = polycoefs(ma_roots);
-
-    // convert coefficients to MA polynomial representation:
-    //
-    //   beta(s) = beta_q * x^q + beta_{q-1} * x^{q-1} + ... + beta_1 x + beta_0,
-    //
-    // where beta_0 = 1.0.
-    //
-    poly_coefs = poly_coefs / poly_coefs(q_); // standardize so c_q = 1 instead of c_0;
-    arma::vec ma_coefs = arma::zeros(p_);
+    arma::mat dpoly = arma::real(dpoly_droots * dma_roots);
     
-    // poly_coefs[0]   poly_coefs[1]   ...   poly_coefs[q] = 1.0
-    //    ||                ||                     ||
-    // ma_coefs[q]    ma_coefs[q-1]    ...    ma_coefs[0]
+    // ma_coefs(i) = poly_coefs(q-i) / poly_coefs(q)
+    arma::vec poly_coefs = polycoefs(ma_roots);
     for (int i=0; i<q_+1; i++) {
-        ma_coefs(i) = poly_coefs(q_-i);
+        double ma_coef = poly_coefs(q_-i) / poly_coefs(q_);
+        for (int j=0; j<q_; j++) {
+            dma_coefs(i, 3+p_+j) = (dpoly(q_-i, j) - ma_coef * dpoly(q_, j)) / poly_coefs(q_);
+        }
     }
-
-    return ma_coefs;
+    
+    return dma_coefs;
 }
 
 /*******************************************************************
@@ -605,10 +582,10 @@ arma::vec ZCARMA::StartingValue()
         
         // Initial guess for model standard deviation is randomly distributed
         // around measured standard deviation of the time series
-        double yvar = RandGen.scaled_inverse_chisqr(y_.n_elem-1, arma::var(y_));
+        double yvar = RandGen.scaled_inverse_chisqr(data_->size()-1, arma::var(data_->y()));
         
         // Get initial value of the time series mean
-        double mu = RandGen.normal(arma::mean(y_), sqrt(yvar) / y_.n_elem);
+        double mu = RandGen.normal(arma::mean(data_->y()), sqrt(yvar) / data_->size());
         
         arma::cx_vec alpha_roots = ARRoots(theta);
         double sigsqr = yvar / Variance(alpha_roots, ma_coefs, 1.0);
@@ -628,10 +605,8 @@ arma::vec ZCARMA::StartingValue()
         pKFilter_->SetSigsqr(sigsqr);
         pKFilter_->SetOmega(ExtractAR(theta));
         pKFilter_->SetMA(ma_coefs);
-        arma::vec proposed_yerr = sqrt(measerr_scale) * yerr_;
-        pKFilter_->SetTimeSeriesErr(proposed_yerr);
-        arma::vec ycent = y_ - mu;
-        pKFilter_->SetTimeSeries(ycent);
+        pKFilter_->SetMeasErrScale(measerr_scale);
+        pKFilter_->SetTimeSeriesMean(mu);
         
         // run the kalman filter
         pKFilter_->Filter();
@@ -668,10 +643,8 @@ arma::vec ZCARMA::SetStartingValue(arma::vec init)
    pKFilter_->SetSigsqr(sigsqr);
    pKFilter_->SetOmega(ExtractAR(init));
    pKFilter_->SetMA(ma_coefs);
-   arma::vec proposed_yerr = sqrt(measerr_scale) * yerr_;
-   pKFilter_->SetTimeSeriesErr(proposed_yerr);
-   arma::vec ycent = y_ - mu;
-   pKFilter_->SetTimeSeries(ycent);
+   pKFilter_->SetMeasErrScale(measerr_scale);
+   pKFilter_->SetTimeSeriesMean(mu);
    pKFilter_->Filter();
 
    return init;
@@ -697,6 +670,19 @@ arma::vec ZCARMA::ExtractMA(arma::vec theta)
     return ma_coefs;
 }
 
+// Derivatives of the moving-average coefficients with respect to the ZCARMA parameter vector
+arma::mat ZCARMA::ExtractMADerivs(arma::vec theta)
+{
+    double kappa_normed = inv_logit(theta(3 + p_));
+    double kappa = (kappa_high_ - kappa_low_) * kappa_normed + kappa_low_;
+    double dkappa = (kappa_high_ - kappa_low_) * kappa_normed * (1.0 - kappa_normed);
+    arma::mat dma_coefs = arma::zeros<arma::mat>(p_, theta.n_elem);
+	for (int i=1; i<p_; i++) {
+		dma_coefs(i, 3 + p_) = -i * boost::math::binomial_coefficient<double>(p_-1, i) / pow(kappa,i+1) * dkappa;
+	}
+    return dma_coefs;
+}
+
 /*********************************************************************
                                 FUNCTIONS
  ********************************************************************/
@@ -754,3 +740,145 @@ arma::vec polycoefs(arma::cx_vec roots)
     // The coefficients must be real, so only return the real part
     return arma::real(coefs);
 }
+
+// Return the coefficients of the moving average polynomial
+//
+//   beta(s) = beta_q * s^q + beta_{q-1} * s^{q-1} + ... + beta_1 s + beta_0,
+//
+// given its roots, standardized so that beta_0 = 1.0. The p-element vector (beta_0, ..., beta_q, 0, ..., 0) is
+// returned.
+arma::vec MACoefs(arma::cx_vec ma_roots, unsigned int p)
+{
+    unsigned int q = ma_roots.n_elem;
+    // calculate the coefficients of the polynomial
+    //
+    //    p(x) = x^q + c_1 * x^{q-1} + ... + c_{q-1} * x + c_q
+    //
+    // from it roots. note that poly_coefs[0] = 1.0 = c_0.
+    arma::vec poly_coefs = polycoefs(ma_roots);
+    poly_coefs = poly_coefs / poly_coefs(q); // standardize so c_q = 1 instead of c_0;
+    arma::vec ma_coefs = arma::zeros(p);
+    
+    // poly_coefs[0]   poly_coefs[1]   ...   poly_coefs[q] = 1.0
+    //    ||                ||                     ||
+    // ma_coefs[q]    ma_coefs[q-1]    ...    ma_coefs[0]
+    for (int i=0; i<q+1; i++) {
+        ma_coefs(i) = poly_coefs(q-i);
+    }
+    
+    return ma_coefs;
+}
+
+// Return the weights w_k such that the autocovariance function of a CARMA(p,q) process with unit driving noise
+// variance is R(dt) = Re(sum_k w_k * exp(alpha_roots(k) * |dt|)).
+arma::cx_vec AutocovarianceWeights(arma::cx_vec alpha_roots, arma::vec ma_coefs)
+{
+    arma::cx_vec weights(alpha_roots.n_elem);
+	for (int k=0; k<alpha_roots.n_elem; k++) {
+		std::complex<double> denom_product(1.0,0.0);
+		
+		for (int l=0; l<alpha_roots.n_elem; l++) {
+			if (l != k) {
+				denom_product *= (alpha_roots(l) - alpha_roots(k)) * 
+                (std::conj(alpha_roots(l)) + alpha_roots(k));
+			}
+		}
+        std::complex<double> denom = -2.0 * std::real(alpha_roots(k)) * denom_product;
+        
+        int q = ma_coefs.n_elem;
+        std::complex<double> ma_sum1(0.0,0.0);
+        std::complex<double> ma_sum2(0.0,0.0);
+        for (int l=0; l<q; l++) {
+            ma_sum1 += ma_coefs(l) * std::pow(alpha_roots(k),l);
+            ma_sum2 += ma_coefs(l) * std::pow(-alpha_roots(k),l);
+        }
+        weights(k) = ma_sum1 * ma_sum2 / denom;
+	}
+    return weights;
+}
+
+// Return the roots of the polynomial parameterized by theta(offset), ..., theta(offset+n-1). The polynomial is the
+// product of quadratic terms (exp(theta(offset+2i)) + exp(theta(offset+2i+1)) * s + s^2), times
+// (s + exp(theta(offset+n-1))) if n is odd. Complex roots come in conjugate pairs, with the negative imaginary part
+// first.
+arma::cx_vec QuadraticRoots(const arma::vec& theta, unsigned int offset, unsigned int n)
+{
+    arma::cx_vec roots(n);
+    for (int i=0; i<n/2; i++) {
+        double quad_term1 = exp(theta(offset+2*i));
+        double quad_term2 = exp(theta(offset+2*i+1));
+
+        double discriminant = quad_term2 * quad_term2 - 4.0 * quad_term1;
+        
+        if (discriminant > 0) {
+            // two real roots
+            double root1 = -0.5 * (quad_term2 + sqrt(discriminant));
+            double root2 = -0.5 * (quad_term2 - sqrt(discriminant));
+            roots(2*i) = std::complex<double> (root1, 0.0);
+            roots(2*i+1) = std::complex<double> (root2, 0.0);
+        } else {
+            double real_part = -0.5 * quad_term2;
+            double imag_part = -0.5 * sqrt(-discriminant);
+            roots(2*i) = std::complex<double> (real_part, imag_part);
+            roots(2*i+1) = std::complex<double> (real_part, -imag_part);
+        }
+    }
+	
+    if ((n % 2) == 1) {
+        // n is odd, so add in additional low-frequency component
+        double real_root = -exp(theta(offset+n-1));
+        roots(n-1) = std::complex<double> (real_root, 0.0);
+    }
+    
+    return roots;
+}
+
+// Return the roots of the polynomial parameterized by theta(offset), ..., theta(offset+n-1), and their derivatives.
+// The polynomial is the product of quadratic terms (exp(theta(offset+2i)) + exp(theta(offset+2i+1)) * s + s^2),
+// times (s + exp(theta(offset+n-1))) if n is odd.
+arma::cx_vec QuadraticRoots(arma::vec& theta, unsigned int offset, unsigned int n, arma::cx_mat& droots)
+{
+    arma::cx_vec roots(n);
+    droots.zeros(n, n);
+    
+    for (int i=0; i<n/2; i++) {
+        double quad_term1 = exp(theta(offset+2*i));
+        double quad_term2 = exp(theta(offset+2*i+1));
+        
+        double discriminant = quad_term2 * quad_term2 - 4.0 * quad_term1;
+        // The derivatives of a repeated root (discriminant = 0) are infinite, so bound sqrt(|discriminant|) away from
+        // zero in their denominators. This keeps the gradient finite for gradient-based steps, while the roots
+        // themselves are unchanged.
+        double min_sqrt_disc = sqrt(arma::datum::eps) * quad_term2;
+        
+        if (discriminant > 0) {
+            // two real roots
+            double sqrt_disc = sqrt(discriminant);
+            roots(2*i) = std::complex<double> (-0.5 * (quad_term2 + sqrt_disc), 0.0);
+            roots(2*i+1) = std::complex<double> (-0.5 * (quad_term2 - sqrt_disc), 0.0);
+            sqrt_disc = std::max(sqrt_disc, min_sqrt_disc);
+            droots(2*i,2*i) = quad_term1 / sqrt_disc;
+            droots(2*i+1,2*i) = -quad_term1 / sqrt_disc;
+            droots(2*i,2*i+1) = -0.5 * quad_term2 * (1.0 + quad_term2 / sqrt_disc);
+            droots(2*i+1,2*i+1) = -0.5 * quad_term2 * (1.0 - quad_term2 / sqrt_disc);
+        } else {
+            double sqrt_disc = sqrt(-discriminant);
+            roots(2*i) = std::complex<double> (-0.5 * quad_term2, -0.5 * sqrt_disc);
+            roots(2*i+1) = std::complex<double> (-0.5 * quad_term2, 0.5 * sqrt_disc);
+            sqrt_disc = std::max(sqrt_disc, min_sqrt_disc);
+            droots(2*i,2*i) = std::complex<double> (0.0, -quad_term1 / sqrt_disc);
+            droots(2*i+1,2*i) = std::complex<double> (0.0, quad_term1 / sqrt_disc);
+            droots(2*i,2*i+1) = std::complex<double> (-0.5 * quad_term2, 0.5 * quad_term2 * quad_term2 / sqrt_disc);
+            droots(2*i+1,2*i+1) = std::complex<double> (-0.5 * quad_term2, -0.5 * quad_term2 * quad_term2 / sqrt_disc);
+        }
+    }
+    
+    if ((n % 2) == 1) {
+        // n is odd, so add in the additional real root
+        double real_root = -exp(theta(offset+n-1));
+        roots(n-1) = std::complex<double> (real_root, 0.0);
+        droots(n-1,n-1) = real_root;
+    }
+    
+    return roots;
+}
@@ -1,12 +1,143 @@
 #include <vector>
+#include <string>
 #include <memory>
 #include "carpack.hpp"
 
+// If trace_file is not empty, the samples are also streamed to this binary file as they are drawn (see
+// CARMA_Base::SetTraceFile). By default the CARMA(p,q) models are sampled with Robust Adaptive Metropolis steps and
+// parallel tempering over nwalkers temperatures. If ensemble is true they are instead sampled with the affine-invariant
+// ensemble sampler using nwalkers walkers (rounded up to an even number of at least twice the number of parameters),
+// and the returned object holds sample_size * nwalkers draws.
 std::shared_ptr<CAR1>
 RunCar1Sampler(int sample_size, int burnin, std::vector<double> time, std::vector<double> y,
-               std::vector<double> yerr, int thin=1, const std::vector<double>& init = std::vector<double>());
+               std::vector<double> yerr, int thin=1, const std::vector<double>& init = std::vector<double>(),
+               std::string trace_file="");
 
 std::shared_ptr<CARp>
 RunCarmaSampler(int sample_size, int burnin, std::vector<double> time, std::vector<double> y,
                 std::vector<double> yerr, int p, int q, int nwalkers, bool do_zcarma=false,
-                int thin=1, const std::vector<double>& init = std::vector<double>());
+                int thin=1, const std::vector<double>& init = std::vector<double>(), int nthreads=1,
+                std::string trace_file="", bool ensemble=false);
+
+// A light curve in a survey, and the order of the CARMA(p,q) model to fit to it
+struct SurveyObject {
+    std::string name; // used to name the output file
+    std::string data_file; // three columns: time, y, yerr
+    int p;
+    int q;
+    unsigned int ndata; // number of data points, used to balance the work among the threads
+};
+
+// Read the survey manifest. Each line contains the object name, the data file, p, q, and optionally the number of
+// data points. If the number of data points is not given it is found by counting the lines in the data file.
+std::vector<SurveyObject> ReadSurveyManifest(std::string manifest_file);
+
+// Fit CARMA(p,q) models to all of the light curves in the manifest, scheduling them over a work-stealing pool of
+// nthreads threads. output_dir is created if it does not exist. The samples for each object are written to
+// output_dir/<name>_samples.dat as soon as it finishes, and a line is appended to output_dir/survey_summary.txt.
+// Returns the number of objects that were fit successfully.
+int RunSurveySampler(std::string manifest_file, std::string output_dir, int sample_size, int burnin, int nwalkers,
+                     int nthreads, unsigned long seed, int thin=1);
+
+// Maximum-likelihood estimate of the parameters of a CARMA(p,q) model
+struct CarmaMLE {
+    std::vector<double> theta; // (sigma, measerr_scale, mu, AR parameters, MA coefficients) at the maximum
+    double logdens; // log-likelihood at theta, including the prior on the measurement error scale parameter
+    std::vector<std::vector<double> > hessian; // Hessian matrix of logdens at theta
+    int niter; // number of iterations taken by the optimizer
+    bool converged; // did the optimizer converge?
+};
+
+// Find the maximum-likelihood estimate of a CARMA(p,q) model by running a bounded quasi-Newton optimizer from ntrials
+// random starting values drawn by StartingValue(). The trials are spread over nthreads threads that share the time
+// series data, and the trial with the highest likelihood is returned. The bounds are the same as those used by the
+// L-BFGS-B fit in carma_pack.py.
+CarmaMLE FindMLE(std::vector<double> time, std::vector<double> y, std::vector<double> yerr, int p, int q,
+                 int ntrials=100, int nthreads=1);
+
+// Result of a search over the order of a CARMA(p,q) model
+struct CarmaOrderSearch {
+    std::vector<int> p;
+    std::vector<int> q;
+    std::vector<double> logdens; // maximum log-likelihood found for each (p,q)
+    std::vector<double> aicc;
+    std::vector<int> ntrials; // number of random starts run for each (p,q), fewer than requested if it was pruned
+    int best_p;
+    int best_q;
+    CarmaMLE best_mle; // MLE for the (p,q) with the lowest AICc, including the Hessian
+};
+
+// Choose the order of a CARMA model by finding the MLE for each (p,q) = (plist[k], qlist[k]) and minimizing AICc. The
+// random starts for all of the orders share one copy of the time series data and are scheduled together over nthreads
+// threads. By default every order gets all ntrials random starts. If prune_delta is finite, an order that has had at
+// least min_prune_trials starts is dropped from the search once its best AICc exceeds the lowest AICc by more than
+// prune_delta. This saves time on clearly disfavoured orders, but a pruned order could still have won with more starts,
+// so pruning can change the chosen order.
+CarmaOrderSearch ChooseOrder(std::vector<double> time, std::vector<double> y, std::vector<double> yerr,
+                             std::vector<int> plist, std::vector<int> qlist, int ntrials=100, int nthreads=1,
+                             double prune_delta=arma::datum::inf, int min_prune_trials=10);
+
+// Posterior percentiles of the power spectrum and autocovariance function of a CARMA(p,q) model
+struct CarmaSpectrum {
+    std::vector<std::vector<double> > psd; // psd[j][k] is the percentiles[j] percentile of the PSD at frequency[k]
+    std::vector<std::vector<double> > acf; // acf[j][k] is the percentiles[j] percentile of the autocovariance at lags[k]
+};
+
+// Compute the posterior percentiles of the power spectrum on the frequency grid and of the autocovariance function on
+// the lag grid. Each column of samples is a CARMA(p,q) parameter vector (ysigma, measerr_scale, mu, AR parameters, MA
+// parameters), as in CARMA_Base::GetSampleMatrix; CAR(1) samples are handled by setting p = 1 and q = 0. Each draw is
+// converted once to the roots of its AR and MA polynomials, and the grids are split into blocks spread over nthreads
+// threads. The percentiles are interpolated between the order statistics in the same way as numpy.percentile.
+CarmaSpectrum CarmaSpectralBands(const arma::mat& samples, int p, int q, std::vector<double> frequency,
+                                 std::vector<double> lags, std::vector<double> percentiles, int nthreads=1);
+
+// Physical parameters of a CARMA(p,q) model computed from the MCMC samples, one column per draw
+struct CarmaPhysicalSamples {
+    arma::cx_mat ar_roots; // roots of the AR polynomial, as in CARp::ARRoots
+    arma::mat ar_coefs; // (1.0, alpha_1, ..., alpha_p) for alpha(s) = s^p + alpha_1 s^{p-1} + ... + alpha_p
+    arma::mat ma_coefs; // (1.0, beta_1, ..., beta_q), as in CARMA::ExtractMA
+    arma::rowvec sigma; // standard deviation of the driving white noise, one column per draw like the other members
+    arma::mat psd_centroid; // centroids of the Lorentzian functions that make up the PSD
+    arma::mat psd_width; // widths of the Lorentzian functions that make up the PSD
+};
+
+// Transform the MCMC samples of a CARMA(p,q) model to its physical parameters. The samples are in the same form as for
+// CarmaSpectralBands. The draws are split into chunks spread over nthreads threads, and each draw is transformed with
+// the same functions used by the CARMA classes, so the two can not disagree.
+CarmaPhysicalSamples TransformCarmaSamples(const arma::mat& samples, int p, int q, int nthreads=1);
+
+// Weighted particles approximating the posterior of a CARMA(p,q) model, updated by the sequential Monte Carlo sampler
+struct CarmaParticles {
+    arma::mat theta; // parameter vector of each particle, one column per particle, as in CARMA_Base::GetSampleMatrix
+    arma::vec logpost; // log-posterior of each particle given the data so far
+    arma::vec log_weights; // normalized logarithms of the particle weights
+    std::vector<OnlineFilterState> filter_states; // online Kalman Filter state of each particle after the last data point
+    unsigned int ndata; // number of data points the particles are conditioned on
+    double last_time; // time of the last of these data points
+    double max_stdev; // upper bound of the prior on the standard deviation of the process, fixed when the particles are made
+    double log_evidence; // sum of log p(y_new | y_old) over the updates since the particles were made
+    double ess; // effective sample size after the most recent update, before resampling
+    double accept_rate; // acceptance rate of the most recent rejuvenation moves
+};
+
+// Make equally-weighted particles from the MCMC samples of a CARMA(p,q) model fit to the time series, one column per
+// draw as in CARMA_Base::GetSampleMatrix. CAR(1) samples are handled by setting p = 1 and q = 0. The Kalman Filter is run
+// once over the time series for each particle, spread over nthreads threads, to find the filtered state needed by
+// UpdateCarmaParticles.
+CarmaParticles MakeCarmaParticles(const arma::mat& samples, std::vector<double> time, std::vector<double> y,
+                                  std::vector<double> yerr, int p, int q, bool do_zcarma=false, int nthreads=1);
+
+// Update the particles approximating the posterior of a CARMA(p,q) model when new data points are added to the time
+// series, instead of running the MCMC sampler again. time, y, and yerr contain all of the data, and the data points
+// later than particles.last_time are the new ones. Each particle is reweighted by the likelihood of the new data points
+// given the old ones, which is computed by restarting its online Kalman Filter from the saved state, so the cost of the
+// reweighting scales with the number of new data points. If the effective sample size falls below ess_fraction times the
+// number of particles, the particles are resampled and then each is moved by nmoves Metropolis steps with the same
+// Student's t proposals as the Robust Adaptive Metropolis sampler, scaled by the covariance matrix of the particles.
+// These moves use the likelihood of all of the data, so each one costs O(n) for n data points, and the default
+// ess_fraction only moves the particles once the weights have degenerated. The particles are updated concurrently over
+// nthreads threads, and each particle draws its random numbers from its own stream, so the results do not depend on
+// nthreads.
+CarmaParticles UpdateCarmaParticles(const CarmaParticles& particles, std::vector<double> time, std::vector<double> y,
+                                    std::vector<double> yerr, int p, int q, bool do_zcarma=false, int nthreads=1,
+                                    int nmoves=10, double ess_fraction=0.5);
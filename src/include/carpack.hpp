@@ -16,6 +16,8 @@
 #include <stdexcept>
 #include <string>
 #include <memory>
+#include <fstream>
+#include <cstdint>
 #include <random.hpp>
 #include <proposals.hpp>
 #include <samplers.hpp>
@@ -54,7 +56,11 @@ public:
     // Constructors
     CARMA_Base() {}
     CARMA_Base(bool track, std::string name, std::vector<double> time, std::vector<double> y, std::vector<double> yerr,
-               double temperature=1.0) : Parameter<arma::vec>(track, name, temperature)
+               double temperature=1.0) :
+        CARMA_Base(track, name, std::make_shared<const TimeSeriesData>(time, y, yerr), temperature) {}
+    // The time series data are shared with the Kalman Filter and any other objects holding a pointer to them
+    CARMA_Base(bool track, std::string name, std::shared_ptr<const TimeSeriesData> data, double temperature=1.0) :
+        Parameter<arma::vec>(track, name, temperature), data_(data)
     {
         // default is to do Bayesian inference
         ignore_prior_ = false;
@@ -62,13 +68,18 @@ public:
         // Set the degrees of freedom for the prior on the measurement error scaling parameter
         measerr_dof_ = 50;
         
-        // convert input data to armadillo vectors
-        y_  = arma::conv_to<arma::vec>::from(y);
-        time_ = arma::conv_to<arma::vec>::from(time);
-        yerr_ = arma::conv_to<arma::vec>::from(yerr);
-        
         // default prior bounds on the standard deviation of the time series
-        SetPrior(10.0 * sqrt(arma::var(y_)));
+        SetPrior(10.0 * sqrt(arma::var(data_->y())));
+        
+        // The Kalman variance of each data point is at least its measurement error variance, so the log-likelihood
+        // of the data points after i is at most loglik_max_remaining_(i) - 0.5 * log(measerr_scale) * nremaining_(i).
+        int ndata = data_->size();
+        loglik_max_remaining_.zeros(ndata);
+        nremaining_.zeros(ndata);
+        for (int i=ndata-2; i>=0; i--) {
+            loglik_max_remaining_(i) = loglik_max_remaining_(i+1) - log(data_->yerr()(i+1));
+            nremaining_(i) = nremaining_(i+1) + 1.0;
+        }
     }
     
     virtual arma::vec StartingValue() = 0;
@@ -87,22 +98,23 @@ public:
     }
 
     
-    void Save(arma::vec& new_value)
+    void Save(arma::vec new_value)
     {
         // new carma value ---> value_
         value_ = new_value;
         
-        // Update the log-posterior using this new value of theta.
-        //
-        // IMPORTANT: This assumes that the Kalman filter was calculated
-        // using the value of new_value.
-        //
-        log_posterior_ = 0.0;
-        double mu = new_value(2);
-        for (int i=0; i<time_.n_elem; i++) {
-            double ycent = y_(i) - pKFilter_->mean(i) - mu;
-            log_posterior_ += -0.5 * log(pKFilter_->var(i)) - 0.5 * ycent * ycent / pKFilter_->var(i);
+        // Update the log-posterior using this new value of theta. The log-likelihood is usually cached from the call
+        // to LogDensity(new_value) or LogDensityGradient(new_value) made when new_value was proposed, so the Kalman
+        // filter only needs to be rerun if it was last computed for a different parameter value. This overrides
+        // Parameter::Save, so the steps, which only see a Parameter, also use the cached value.
+        if (!CheckPriorBounds(new_value)) {
+            log_posterior_ = -1.0 * arma::datum::inf;
+            return;
+        }
+        if ((kalman_theta_.n_elem != new_value.n_elem) || arma::any(kalman_theta_ != new_value)) {
+            KalmanLogLikelihood(new_value);
         }
+        log_posterior_ = kalman_loglik_;
         log_posterior_ += LogPrior(new_value);
 
     }
@@ -113,6 +125,8 @@ public:
     virtual arma::vec ExtractMA(arma::vec theta) = 0;
     // extract the variance in the driving noise from the CARMA parameter vector
     virtual double ExtractSigsqr(arma::vec theta) = 0;
+    // compute the derivatives of the Kalman filter parameters with respect to the CARMA parameter vector
+    virtual KalmanDerivatives ExtractDerivs(arma::vec theta) = 0;
         
     // compute the log-prior of the CARMA parameters
     virtual double LogPrior(arma::vec theta)
@@ -125,10 +139,25 @@ public:
         return logprior;
     }
     
+    // compute the gradient of the log-prior of the CARMA parameters
+    virtual arma::vec LogPriorGradient(arma::vec theta)
+    {
+        double measerr_scale = theta(1);
+        arma::vec grad = arma::zeros<arma::vec>(theta.n_elem);
+        grad(1) = 0.5 * measerr_dof_ / (measerr_scale * measerr_scale) - (1.0 + measerr_dof_ / 2.0) / measerr_scale;
+        return grad;
+    }
+    
     virtual void PrintOmega(OmegaType omega) {};
     
     // compute the log-posterior
     double LogDensity(arma::vec theta)
+    {
+        return BoundedLogDensity(theta, -1.0 * arma::datum::inf);
+    }
+    
+    // compute the log-posterior, but stop running the Kalman filter once it is known to be less than logdens_min
+    double BoundedLogDensity(arma::vec theta, double logdens_min)
     {
         // Prior bounds satisfied?
         bool prior_satisfied = CheckPriorBounds(theta);
@@ -136,45 +165,145 @@ public:
             double logpost = -1.0 * arma::datum::inf;
             return logpost;
         }
+        double logprior = LogPrior(theta);
         
-        OmegaType omega = ExtractAR(theta);
-        arma::vec ma_coefs = ExtractMA(theta);
-        double sigsqr = ExtractSigsqr(theta);
-        double measerr_scale = theta(1);
-        double mu = theta(2);
-        
-        // Run the Kalman filter
-        pKFilter_->SetSigsqr(sigsqr);
-        pKFilter_->SetOmega(omega);
-        pKFilter_->SetMA(ma_coefs);
-        arma::vec proposed_yerr = sqrt(measerr_scale) * yerr_;
-        pKFilter_->SetTimeSeriesErr(proposed_yerr);
-        arma::vec ycent = y_ - mu;
-        pKFilter_->SetTimeSeries(ycent);
+        // Run the Kalman filter and calculate the log-likelihood
+        double logpost;
         try {
-            pKFilter_->Filter();
+            logpost = KalmanLogLikelihood(theta, logdens_min - logprior);
         } catch (std::runtime_error& e) {
             std::cout << "Caught a runtime error when trying to run the Kalman Filter: " << e.what() << std::endl;
             std::cout << "Rejecting this proposal..." << std::endl;
-            PrintOmega(omega);
+            PrintOmega(ExtractAR(theta));
             bool prior_satisfied = CheckPriorBounds(theta);
             std::cout << "Prior satisfied: " << prior_satisfied << std::endl;
-            double logpost = -1.0 * arma::datum::inf;
+            logpost = -1.0 * arma::datum::inf;
             return logpost;
         }
-        
-        // calculate the log-likelihood
-        double logpost = 0.0;
-        for (int i=0; i<time_.n_elem; i++) {
-            double ycent = y_(i) - pKFilter_->mean(i) - mu;
-            logpost += -0.5 * log(pKFilter_->var(i)) - 0.5 * ycent * ycent / pKFilter_->var(i);
-        }
 
-        logpost += LogPrior(theta);
+        logpost += logprior;
         
         return logpost;
     }
     
+    // Return an online Kalman Filter for the model with parameters theta that has already ingested the time series,
+    // so that the likelihood can be updated as new data points arrive without running over the old data again
+    OnlineKalmanFilter OnlineFilter(arma::vec theta)
+    {
+        SetKalmanFilter(theta);
+        return pKFilter_->MakeOnlineFilter();
+    }
+    
+    // Return an online Kalman Filter for the model with parameters theta, restored to a state checkpointed from an
+    // earlier online Kalman Filter for the same theta, so that only the data points after that state need to be added
+    OnlineKalmanFilter OnlineFilter(arma::vec theta, const OnlineFilterState& state)
+    {
+        SetKalmanFilter(theta);
+        return pKFilter_->MakeOnlineFilter(state);
+    }
+    
+    /*
+     Compute the log-posterior for each column of thetas. The Kalman Filters for all of the parameter values that
+     satisfy the prior bounds are run together in a single pass over the time series by KalmanFilterBatch, instead of
+     one pass per parameter value. This is meant for samplers that propose several parameter values at once, such as
+     ensemble and multiple-try moves. The cached log-likelihood and the stored Kalman mean and variance are not
+     changed, and the Kalman Filter is set back to the current parameter value afterwards.
+     */
+    arma::vec LogDensityBatch(const arma::mat& thetas)
+    {
+        unsigned int ntheta = thetas.n_cols;
+        arma::vec logdens(ntheta);
+        logdens.fill(-1.0 * arma::datum::inf);
+        
+        // get the rotated state space representation of the parameter values with non-zero prior density
+        std::vector<unsigned int> valid;
+        std::vector<arma::cx_vec> roots;
+        std::vector<arma::cx_rowvec> obs_coefs;
+        std::vector<arma::cx_mat> state_var;
+        for (int k=0; k<ntheta; k++) {
+            arma::vec theta = thetas.col(k);
+            if (!CheckPriorBounds(theta)) {
+                continue;
+            }
+            arma::cx_vec theta_roots;
+            arma::cx_mat eigen_mat;
+            arma::cx_rowvec theta_obs_coefs;
+            arma::cx_mat theta_state_var;
+            try {
+                SetKalmanFilter(theta);
+                pKFilter_->StateSpace(theta_roots, eigen_mat, theta_obs_coefs, theta_state_var);
+            } catch (std::runtime_error& e) {
+                std::cout << "Caught a runtime error when trying to run the Kalman Filter: " << e.what() << std::endl;
+                std::cout << "Rejecting this proposal..." << std::endl;
+                continue;
+            }
+            valid.push_back(k);
+            roots.push_back(theta_roots);
+            obs_coefs.push_back(theta_obs_coefs);
+            state_var.push_back(theta_state_var);
+        }
+        if (value_.n_elem == thetas.n_rows) {
+            // SetKalmanFilter was called for each parameter value, so restore the filter for the current value
+            try {
+                SetKalmanFilter(value_);
+            } catch (std::runtime_error& e) {
+                // the current value has zero posterior probability, so the filter is never used for it
+            }
+        }
+        if (valid.size() == 0) {
+            return logdens;
+        }
+        
+        unsigned int nvalid = valid.size();
+        unsigned int p = roots[0].n_elem;
+        arma::cx_mat batch_roots(p, nvalid), batch_obs_coefs(p, nvalid);
+        arma::cx_cube batch_state_var(p, p, nvalid);
+        arma::vec ymean(nvalid), measerr_scale(nvalid);
+        for (int j=0; j<nvalid; j++) {
+            batch_roots.col(j) = roots[j];
+            batch_obs_coefs.col(j) = obs_coefs[j].st();
+            batch_state_var.slice(j) = state_var[j];
+            measerr_scale(j) = thetas(1, valid[j]);
+            ymean(j) = thetas(2, valid[j]);
+        }
+        
+        KalmanFilterBatch batch_filter(data_);
+        arma::vec loglik = batch_filter.LogLikelihood(batch_roots, batch_obs_coefs, batch_state_var, ymean,
+                                                      measerr_scale);
+        for (int j=0; j<nvalid; j++) {
+            logdens(valid[j]) = loglik(j) + LogPrior(thetas.col(valid[j]));
+        }
+        
+        return logdens;
+    }
+    
+    // compute the log-posterior and its gradient with respect to theta. The gradient of the log-likelihood is
+    // computed in the same pass of the Kalman filter as the log-likelihood.
+    double LogDensityGradient(arma::vec theta, arma::vec& grad)
+    {
+        grad.zeros(theta.n_elem);
+        if (!CheckPriorBounds(theta)) {
+            return -1.0 * arma::datum::inf;
+        }
+        
+        double loglik;
+        try {
+            SetKalmanFilter(theta);
+            KalmanDerivatives derivs = ExtractDerivs(theta);
+            loglik = pKFilter_->LogLikelihoodGradient(derivs, grad);
+            // cache the log-likelihood, so saving theta after an accepted NUTS trajectory does not rerun the filter
+            kalman_loglik_ = loglik;
+            kalman_theta_ = theta;
+        } catch (std::runtime_error& e) {
+            std::cout << "Caught a runtime error when trying to run the Kalman Filter: " << e.what() << std::endl;
+            grad.zeros();
+            return -1.0 * arma::datum::inf;
+        }
+        grad += LogPriorGradient(theta);
+        
+        return loglik + LogPrior(theta);
+    }
+    
     bool virtual CheckPriorBounds(arma::vec theta)
     {
         if (ignore_prior_) {return true;}
@@ -191,31 +320,98 @@ public:
     }
     
     // Setters and Getters
-    arma::vec GetTime() { return time_; }
-    arma::vec GetTimeSeries() { return y_; }
-    arma::vec GetTimeSeriesErr() { return yerr_; }
-    arma::vec GetKalmanMean() { return value_(2) + pKFilter_->mean; }
-    arma::vec GetKalmanVar() { return pKFilter_->var; }
+    arma::vec GetTime() { return data_->time(); }
+    arma::vec GetTimeSeries() { return data_->y(); }
+    arma::vec GetTimeSeriesErr() { return data_->yerr(); }
+    std::shared_ptr<const TimeSeriesData> GetData() { return data_; }
+    // the Kalman mean and variance are only stored on demand, since LogDensity does not need them
+    arma::vec GetKalmanMean() {
+        FilterValue();
+        return value_(2) + pKFilter_->mean;
+    }
+    arma::vec GetKalmanVar() {
+        FilterValue();
+        return pKFilter_->var;
+    }
     std::shared_ptr<KalmanFilter<OmegaType> > GetKalmanPtr() { return pKFilter_; }
     
     virtual void SetPrior(double max_stdev) // set the bounds on the uniform prior
     {
         max_stdev_ = max_stdev;
-        arma::vec dt = time_(arma::span(1,time_.n_elem-1)) - time_(arma::span(0,time_.n_elem-2));
+        const arma::vec& dt = data_->dt();
         max_freq_ = 1.0 / dt.min();
-        min_freq_ = 1.0 / (time_.max() - time_.min());
+        min_freq_ = 1.0 / (data_->time().max() - data_->time().min());
+    }
+    
+    // The MCMC samples are stored in a single matrix that is allocated once, with one column per draw, instead of
+    // one heap-allocated vector per draw. The Parameter::samples_ vector is not used, and the methods that access
+    // the samples are overridden, so they also read the matrix when called through a Parameter.
+    void SetSampleSize(int sample_size) {
+        sample_matrix_.set_size(value_.n_elem, sample_size);
+        logposts_.resize(sample_size);
+    }
+    
+    // Add the current value to the MCMC samples, and stream it to the trace file if there is one
+    void AddToSample(int current_iter) {
+        if (sample_matrix_.n_rows != value_.n_elem) {
+            // the sample size was set before the parameter had a value
+            sample_matrix_.set_size(value_.n_elem, sample_matrix_.n_cols);
+        }
+        sample_matrix_.col(current_iter) = value_;
+        logposts_[current_iter] = log_posterior_;
+        if (trace_file_) {
+            WriteTrace(current_iter);
+        }
+    }
+    
+    // Add a value and its log-posterior to the MCMC samples
+    void AddToSample(int current_iter, arma::vec value, double logpost) {
+        value_ = value;
+        log_posterior_ = logpost;
+        AddToSample(current_iter);
+    }
+    
+    // Return the matrix of MCMC samples, with one column per draw
+    const arma::mat& GetSampleMatrix() {
+        return sample_matrix_;
+    }
+    
+    // Return the log-posteriors of the MCMC samples without copying them
+    const std::vector<double>& GetLogLikeVector() {
+        return logposts_;
+    }
+    
+    // Return a copy of the MCMC samples
+    std::vector<arma::vec> GetSamples() {
+        std::vector<arma::vec> samples(sample_matrix_.n_cols);
+        for (int i=0; i<sample_matrix_.n_cols; i++) {
+            samples[i] = sample_matrix_.col(i);
+        }
+        return samples;
     }
     
     // Return a copy of the MCMC samples
     std::vector<std::vector<double> > getSamples() {
-        int nx = samples_.size();
-        int ny = samples_[0].n_elem;
-        std::vector<std::vector<double> > samples(nx,std::vector<double>(ny));
+        int nx = sample_matrix_.n_cols;
+        std::vector<std::vector<double> > samples(nx);
         for (int i = 0; i < nx; i++) {
-            samples[i] = arma::conv_to<std::vector<double> >::from(samples_[i]);
+            samples[i].assign(sample_matrix_.colptr(i), sample_matrix_.colptr(i) + sample_matrix_.n_rows);
         }
         return samples;
     }
+    
+    /*
+     Stream the MCMC samples to a binary file as they are drawn. The file starts with the 8 character tag
+     "CARTRACE" and the number of columns as a 64-bit unsigned integer, followed by one row of native doubles per
+     draw containing the log-posterior and then the parameter values. The rows can be read with numpy.memmap using an
+     offset of 16 bytes.
+     */
+    void SetTraceFile(std::string trace_file) {
+        trace_file_ = std::make_shared<std::ofstream>(trace_file.c_str(), std::ios::out | std::ios::binary);
+        if (!trace_file_->is_open()) {
+            throw std::runtime_error("Cannot write MCMC samples to " + trace_file);
+        }
+    }
 
     // grab the log-prior and log-posterior for a std::vector input
     double getLogPrior(std::vector<double> theta)
@@ -228,15 +424,76 @@ public:
         arma::vec armaVec = arma::conv_to<arma::vec>::from(theta);
         return LogDensity(armaVec);
     }
+    OnlineKalmanFilter getOnlineFilter(std::vector<double> theta)
+    {
+        arma::vec armaVec = arma::conv_to<arma::vec>::from(theta);
+        return OnlineFilter(armaVec);
+    }
+    std::pair<double, std::vector<double> > getLogDensityGradient(std::vector<double> theta)
+    {
+        arma::vec armaVec = arma::conv_to<arma::vec>::from(theta);
+        arma::vec grad;
+        double logdens = LogDensityGradient(armaVec, grad);
+        return std::make_pair(logdens, arma::conv_to<std::vector<double> >::from(grad));
+    }
     
     // set flag for maximum-likelihood estimation
     void SetMLE(bool ignore_prior) {ignore_prior_ = ignore_prior;}
     
+    // use the real-arithmetic Kalman Filter to compute the likelihood. This only applies to models with complex
+    // AR roots; the CAR(1) Kalman Filter is already real.
+    virtual void SetRealFilter(bool real_filter) {}
+    
+    // compute the likelihood with the parallel-in-time Kalman Filter over nthreads threads. This only pays off for
+    // long time series, and the Kalman Filter no longer stops early for proposals that will be rejected. Time series
+    // too short to split over the threads still use the serial Kalman Filter.
+    void SetFilterThreads(unsigned int nthreads) {filter_threads_ = std::max(nthreads, 1u);}
+    
 protected:
-    // time series data
-    arma::vec time_;
-    arma::vec y_;
-    arma::vec yerr_;
+    // set the parameters of the Kalman filter and the centered time series from the CARMA parameter vector
+    void SetKalmanFilter(arma::vec& theta)
+    {
+        double measerr_scale = theta(1);
+        double mu = theta(2);
+        pKFilter_->SetSigsqr(ExtractSigsqr(theta));
+        pKFilter_->SetOmega(ExtractAR(theta));
+        pKFilter_->SetMA(ExtractMA(theta));
+        pKFilter_->SetMeasErrScale(measerr_scale);
+        pKFilter_->SetTimeSeriesMean(mu);
+    }
+    
+    // compute the log-likelihood in a single pass of the Kalman filter, and remember the value of theta it was
+    // computed for. If loglik_min is finite then the Kalman filter stops once the log-likelihood is known to be
+    // less than loglik_min, in which case an upper bound on the log-likelihood is returned and nothing is cached.
+    double KalmanLogLikelihood(arma::vec& theta, double loglik_min=-1.0 * arma::datum::inf)
+    {
+        SetKalmanFilter(theta);
+        double loglik;
+        if (pKFilter_->ParallelChunks(filter_threads_) > 1) {
+            loglik = pKFilter_->ParallelLogLikelihood(filter_threads_);
+        } else if (loglik_min > -1.0 * arma::datum::inf) {
+            arma::vec loglik_max_remaining = loglik_max_remaining_ - 0.5 * log(theta(1)) * nremaining_;
+            loglik = pKFilter_->LogLikelihood(loglik_min, loglik_max_remaining);
+            if (loglik < loglik_min) {
+                return loglik;
+            }
+        } else {
+            loglik = pKFilter_->LogLikelihood();
+        }
+        kalman_loglik_ = loglik;
+        kalman_theta_ = theta;
+        return kalman_loglik_;
+    }
+    
+    // run the Kalman filter for the current parameter value, storing the Kalman mean and variance
+    void FilterValue()
+    {
+        SetKalmanFilter(value_);
+        pKFilter_->Filter();
+    }
+    
+    // time series data, shared with the Kalman Filter
+    std::shared_ptr<const TimeSeriesData> data_;
     // pointer to Kalman Filter object. The Kalman filter is the workhorse behind the likelihood calculations.
     std::shared_ptr<KalmanFilter<OmegaType> > pKFilter_;
     // prior parameters
@@ -245,6 +502,33 @@ protected:
 	double min_freq_; // Minimum value of omega = 1 / tau
 	int measerr_dof_; // Degrees of freedom for prior on measurement error scaling parameter
     bool ignore_prior_; // If true, then do maximum-likelihood estimation
+    unsigned int filter_threads_ = 1; // number of threads used by the Kalman Filter to compute the likelihood
+    // most recent value of the log-likelihood, and the value of theta it was computed for
+    double kalman_loglik_;
+    arma::vec kalman_theta_;
+    // upper bounds on the log-likelihood of the data points after each data point, used for BoundedLogDensity
+    arma::vec loglik_max_remaining_;
+    arma::vec nremaining_;
+    // MCMC samples, one column per draw, and the binary file they are streamed to
+    arma::mat sample_matrix_;
+    std::shared_ptr<std::ofstream> trace_file_;
+    
+    void WriteTrace(int current_iter) {
+        if (current_iter == 0) {
+            std::uint64_t ncols = value_.n_elem + 1;
+            trace_file_->write("CARTRACE", 8);
+            trace_file_->write(reinterpret_cast<const char*>(&ncols), sizeof(ncols));
+        }
+        trace_file_->write(reinterpret_cast<const char*>(&log_posterior_), sizeof(double));
+        trace_file_->write(reinterpret_cast<const char*>(value_.memptr()), value_.n_elem * sizeof(double));
+        if (current_iter == sample_matrix_.n_cols - 1) {
+            // last draw, so make sure the file is complete before anyone reads it
+            trace_file_->flush();
+        }
+        if (!trace_file_->good()) {
+            throw std::runtime_error("Error writing MCMC samples to the trace file");
+        }
+    }
 };
 
 // class for a CAR(1) process
@@ -254,9 +538,12 @@ public:
 	// Constructors //
     CAR1() {}
 	CAR1(bool track, std::string name, std::vector<double> time, std::vector<double> y, std::vector<double> yerr,
-         double temperature=1.0) : CARMA_Base<double>(track, name, time, y, yerr, temperature)
+         double temperature=1.0) :
+        CAR1(track, name, std::make_shared<const TimeSeriesData>(time, y, yerr), temperature) {}
+    CAR1(bool track, std::string name, std::shared_ptr<const TimeSeriesData> data, double temperature=1.0) :
+        CARMA_Base<double>(track, name, data, temperature)
     {
-        pKFilter_ = std::make_shared<KalmanFilter1>(time_, y_, yerr_);
+        pKFilter_ = std::make_shared<KalmanFilter1>(data_);
         // Set the size of the parameter vector theta=(mu,sigma,measerr_scale,log(omega))
         value_.set_size(4);
     }
@@ -264,6 +551,7 @@ public:
     // extract the AR parameters from the parameter vector
     double ExtractAR(arma::vec theta) { return exp(theta(3)); }
     arma::vec ExtractMA(arma::vec theta) { return arma::zeros<arma::vec>(1); }
+    KalmanDerivatives ExtractDerivs(arma::vec theta);
     
     // generate starting values of the CAR(1) parameters
 	arma::vec StartingValue();
@@ -287,9 +575,13 @@ public:
     // Constructor
     CARp() {}
     CARp(bool track, std::string name, std::vector<double> time, std::vector<double> y, std::vector<double> yerr, int p,
-         double temperature=1.0): CARMA_Base<arma::cx_vec>(track, name, time, y, yerr, temperature), p_(p)
+         double temperature=1.0) :
+        CARp(track, name, std::make_shared<const TimeSeriesData>(time, y, yerr), p, temperature) {}
+    CARp(bool track, std::string name, std::shared_ptr<const TimeSeriesData> data, int p, double temperature=1.0) :
+        CARMA_Base<arma::cx_vec>(track, name, data, temperature), p_(p)
 	{
-        pKFilter_ = std::make_shared<KalmanFilterp>(time_, y_, yerr_);
+        // use the fixed-size Kalman Filter for the common orders
+        pKFilter_ = MakeKalmanFilterp(data_, p_);
 		value_.set_size(p_+3);
         ma_coefs_ = arma::zeros(p);
         ma_coefs_(0) = 1.0;
@@ -312,6 +604,10 @@ public:
     }
     // extract the moving-average parameters from the CARMA parameter vector
     arma::vec ExtractMA(arma::vec theta) { return ma_coefs_; }
+    // derivatives of the moving-average parameters with respect to the CARMA parameter vector
+    virtual arma::mat ExtractMADerivs(arma::vec theta) { return arma::zeros<arma::mat>(p_, theta.n_elem); }
+    
+    KalmanDerivatives ExtractDerivs(arma::vec theta);
     
     double ExtractSigsqr(arma::vec theta) {
         arma::cx_vec ar_roots = ARRoots(theta);
@@ -328,6 +624,9 @@ public:
         omega.print("AR Roots:");
     }
     
+    // switch between the real-arithmetic and complex Kalman Filters
+    void SetRealFilter(bool real_filter);
+    
 protected:
     int p_; // Order of the CAR(p) process
     bool order_lorentzians_; // force the lorentzian centroids to be in order?
@@ -344,10 +643,13 @@ public:
     // constructor //
     ZCAR() {}
     ZCAR(bool track, std::string name, std::vector<double> time, std::vector<double> y, std::vector<double> yerr, int p,
-         double temperature=1.0) : CARp(track, name, time, y, yerr, p, temperature)
+         double temperature=1.0) :
+        ZCAR(track, name, std::make_shared<const TimeSeriesData>(time, y, yerr), p, temperature) {}
+    ZCAR(bool track, std::string name, std::shared_ptr<const TimeSeriesData> data, int p, double temperature=1.0) :
+        CARp(track, name, data, p, temperature)
     {
         // set value of kappa
-        arma::vec dt = time_(arma::span(1,time_.n_elem-1)) - time_(arma::span(0,time_.n_elem-2));
+        const arma::vec& dt = data_->dt();
         kappa_ = 1.0 / dt.min();
         // set the moving average coefficients
         ma_coefs_ = arma::zeros(p_);
@@ -372,7 +674,10 @@ public:
 	// Constructor //
     CARMA() {}
 	CARMA(bool track, std::string name, std::vector<double> time, std::vector<double> y, std::vector<double> yerr, int p, int q,
-          double temperature=1.0) : CARp(track, name, time, y, yerr, p, temperature), q_(q)
+          double temperature=1.0) :
+        CARMA(track, name, std::make_shared<const TimeSeriesData>(time, y, yerr), p, q, temperature) {}
+    CARMA(bool track, std::string name, std::shared_ptr<const TimeSeriesData> data, int p, int q,
+          double temperature=1.0) : CARp(track, name, data, p, temperature), q_(q)
     {
         BOOST_ASSERT_MSG(q < p, "Order of moving average polynomial must be less than order of autoregressive polynomial");
         value_.set_size(p_+q_+3);
@@ -387,6 +692,7 @@ public:
     
     // extract the moving-average parameters from the CARMA parameter vector
     arma::vec ExtractMA(arma::vec theta);
+    arma::mat ExtractMADerivs(arma::vec theta);
     
     double ExtractSigsqr(arma::vec theta) {
         arma::cx_vec ar_roots = ARRoots(theta);
@@ -408,15 +714,18 @@ class ZCARMA : public CARp
 public:
     ZCARMA() {}
     ZCARMA(bool track, std::string name, std::vector<double> time, std::vector<double> y, std::vector<double> yerr, int p,
-           double temperature=1.0) : CARp(track, name, time, y, yerr, p, temperature)
+           double temperature=1.0) :
+        ZCARMA(track, name, std::make_shared<const TimeSeriesData>(time, y, yerr), p, temperature) {}
+    ZCARMA(bool track, std::string name, std::shared_ptr<const TimeSeriesData> data, int p, double temperature=1.0) :
+        CARp(track, name, data, p, temperature)
     {
         value_.set_size(p_+4);
         // set default boundaries on kappa
-        arma::vec dt = time_(arma::span(1,time_.n_elem-1)) - time_(arma::span(0,time_.n_elem-2));
+        const arma::vec& dt = data_->dt();
         kappa_high_ = 1.0 / dt.min();
         // kappa_low_ = 0.9 / dt.min();
-        // kappa_low_ = 1.0 / (time_.max() - time_.min());
-        kappa_low_ = std::max(1.0 / (time_.max() - time_.min()), 1.0 / (10.0 * arma::median(dt)));
+        // kappa_low_ = 1.0 / (data_->time().max() - data_->time().min());
+        kappa_low_ = std::max(1.0 / (data_->time().max() - data_->time().min()), 1.0 / (10.0 * arma::median(dt)));
     }
     
     // Return the starting value and set log_posterior_
@@ -427,6 +736,7 @@ public:
     
     // extract the moving-average parameters from the CARMA parameter vector
     arma::vec ExtractMA(arma::vec theta);
+    arma::mat ExtractMADerivs(arma::vec theta);
     
     double ExtractSigsqr(arma::vec theta) {
         arma::cx_vec ar_roots = ARRoots(theta);
@@ -454,7 +764,15 @@ public:
                 
         return logprior;
     }
-
+    
+    // compute the gradient of the log-prior of the ZCARMA parameters
+    arma::vec LogPriorGradient(arma::vec theta)
+    {
+        arma::vec grad = CARp::LogPriorGradient(theta);
+        double logit_kappa = theta(p_+3);
+        grad(p_+3) = -1.0 + 2.0 * exp(-logit_kappa) / (1.0 + exp(-logit_kappa));
+        return grad;
+    }
     
 private:
     double kappa_low_, kappa_high_; // prior bounds on the kappa parameter
@@ -473,4 +791,20 @@ bool unique_roots(arma::cx_vec roots, double tolerance);
 // Return the coefficients of a polynomial given its roots.
 arma::vec polycoefs(arma::cx_vec roots);
 
+// Return the moving average coefficients (1.0, beta_1, ..., beta_q), padded with zeros to p elements, given the roots
+// of the MA polynomial.
+arma::vec MACoefs(arma::cx_vec ma_roots, unsigned int p);
+
+// Return the weights of the exponentials in the autocovariance function of a CARMA(p,q) process with unit driving
+// noise variance, R(dt) = Re(sum_k w_k * exp(alpha_roots(k) * |dt|)).
+arma::cx_vec AutocovarianceWeights(arma::cx_vec alpha_roots, arma::vec ma_coefs);
+
+// Return the roots of the polynomial parameterized by theta(offset), ..., theta(offset+n-1), as in CARp::ARRoots.
+arma::cx_vec QuadraticRoots(const arma::vec& theta, unsigned int offset, unsigned int n);
+
+// Return the roots of the polynomial parameterized by theta(offset), ..., theta(offset+n-1) as in CARp::ARRoots, and
+// the derivatives of the roots with respect to these parameters. Column j of droots contains the derivatives with
+// respect to theta(offset+j).
+arma::cx_vec QuadraticRoots(arma::vec& theta, unsigned int offset, unsigned int n, arma::cx_mat& droots);
+
 #endif
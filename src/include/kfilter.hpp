@@ -11,17 +11,175 @@
 
 #include <armadillo>
 #include <utility>
+#include <vector>
+#include <memory>
+#include <complex>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <algorithm>
 #include <boost/assert.hpp>
 
 // Global random number generator object, instantiated in random.cpp
-extern boost::random::mt19937 rng;
+extern thread_local boost::random::mt19937 rng;
 
 // Object containing some common random number generators.
-extern RandomGenerator RandGen;
+extern thread_local RandomGenerator RandGen;
 
+// Compute the rotated state space representation of a CARMA(p,q) process. In the space spanned by the
+// eigenvectors of the state transition matrix the transition is diagonal with elements exp(omega * dt).
+void RotateCarmaModel(arma::cx_vec& omega, arma::rowvec& ma_coefs, double sigsqr, arma::cx_mat& eigen_mat,
+                      arma::cx_rowvec& rotated_ma_coefs, arma::cx_mat& state_var);
+
+// Compute the rotated state space representation of a CARMA(p,q) process, together with its derivatives. Column k of
+// domega and dma_coefs and element k of dsigsqr contain the derivatives of the AR roots, the moving average
+// coefficients, and the driving noise variance along the k-th direction. On output drotated_ma_coefs[k] and
+// dstate_var[k] contain the derivatives of rotated_ma_coefs and state_var along the k-th direction.
+void RotateCarmaModelDerivs(arma::cx_vec& omega, arma::rowvec& ma_coefs, double sigsqr, arma::cx_mat& domega,
+                            arma::mat& dma_coefs, arma::rowvec& dsigsqr, arma::cx_mat& eigen_mat,
+                            arma::cx_rowvec& rotated_ma_coefs, arma::cx_mat& state_var,
+                            std::vector<arma::cx_rowvec>& drotated_ma_coefs, std::vector<arma::cx_mat>& dstate_var);
+
+// Return a matrix square root of a symmetric positive semi-definite matrix, robust to singular matrices
+arma::mat SymmetricSqrt(arma::mat covar);
+
+// Return a matrix of independent standard normal random variables
+arma::mat StandardNormals(unsigned int nrows, unsigned int ncols);
+
+/*
+ Derivatives of the parameters of the Kalman Filter with respect to the parameters of a CARMA model. Column k of each
+ member contains the derivatives with respect to the k-th model parameter. For the CAR(1) Kalman Filter omega is a
+ 1 x nparams matrix containing the derivatives of the (real) damping rate.
+ */
+
+struct KalmanDerivatives {
+    KalmanDerivatives(unsigned int p, unsigned int nparams) :
+    sigsqr(arma::zeros<arma::rowvec>(nparams)), omega(arma::zeros<arma::cx_mat>(p, nparams)),
+    ma_coefs(arma::zeros<arma::mat>(p, nparams)), ymean(arma::zeros<arma::rowvec>(nparams)),
+    measerr_scale(arma::zeros<arma::rowvec>(nparams)) {}
+    
+    arma::rowvec sigsqr; // variance of the driving noise
+    arma::cx_mat omega; // roots of the AR polynomial
+    arma::mat ma_coefs; // moving average coefficients
+    arma::rowvec ymean; // mean of the time series
+    arma::rowvec measerr_scale; // measurement error scaling parameter
+};
 
 /*
- Abstract base class for the Kalman Filter of a CARMA(p,q) process.
+ Class containing a measured time series. The data are sorted in time, any duplicate values of time are removed,
+ and the time steps and the measurement error variances are computed once when the object is constructed. The
+ object is never modified afterward, so a single copy can be shared through a std::shared_ptr<const TimeSeriesData>
+ by all of the parameter objects and Kalman Filters in a sampler, and by all of the threads running them.
+ */
+
+class TimeSeriesData {
+public:
+    // Constructors. Throws std::invalid_argument if the data vectors are not valid.
+    TimeSeriesData(arma::vec time, arma::vec y, arma::vec yerr);
+    TimeSeriesData(std::vector<double> time, std::vector<double> y, std::vector<double> yerr);
+    
+    unsigned int size() const { return time_.n_elem; }
+    
+    const arma::vec& time() const { return time_; }
+    const arma::vec& dt() const { return dt_; } // dt(i) = time(i+1) - time(i)
+    const arma::vec& y() const { return y_; }
+    const arma::vec& yerr() const { return yerr_; }
+    const arma::vec& yerr_sqr() const { return yerr_sqr_; }
+    
+private:
+    // check the data vectors, then sort them and remove the duplicate values of time
+    void init();
+    
+    arma::vec time_;
+    arma::vec dt_;
+    arma::vec y_;
+    arma::vec yerr_;
+    arma::vec yerr_sqr_;
+};
+
+/*
+ Kalman Filter for a CARMA(p,q) process that ingests the measurements one at a time, for monitoring a time series as new
+ data arrive. The filter works in the rotated state space returned by KalmanFilter::StateSpace, and each call to
+ Append advances the filtered state from the previous data point to the new one in O(p^2) operations, without storing
+ or revisiting the earlier data. The filtered state is a small OnlineFilterState object that can be copied out with
+ Checkpoint and copied back in with Restore, so a large number of time series can be monitored by keeping one state per
+ time series and one OnlineKalmanFilter per model.
+ */
+
+// Filtered state of an OnlineKalmanFilter after the data points ingested so far
+struct OnlineFilterState {
+    unsigned long ndata; // number of data points ingested
+    double time; // time of the last data point
+    double loglik; // log-likelihood of the data points, up to an additive constant
+    arma::cx_vec state; // filtered rotated state vector at time
+    arma::cx_mat state_var; // covariance matrix of the filtered rotated state vector
+};
+
+// One-step prediction of a new data point made by OnlineKalmanFilter::Append, before the data point is ingested
+struct OnlineFilterUpdate {
+    double mean; // predicted value of the time series, including the mean of the time series
+    double var; // variance of the prediction, including the measurement error variance
+    double loglik; // contribution of the data point to the log-likelihood
+};
+
+class OnlineKalmanFilter {
+public:
+    // Constructor. roots, obs_coefs, and stationary_var are the rotated state space representation of the process, as
+    // returned by KalmanFilter::StateSpace. The filter starts with no data.
+    OnlineKalmanFilter(const arma::cx_vec& roots, const arma::cx_rowvec& obs_coefs, const arma::cx_mat& stationary_var,
+                       double ymean=0.0, double measerr_scale=1.0);
+    
+    // The measured values are centered by subtracting ymean, and the measurement error variances are yerr^2 *
+    // measerr_scale
+    void SetTimeSeriesMean(double ymean) {
+        ymean_ = ymean;
+    }
+    void SetMeasErrScale(double measerr_scale) {
+        measerr_scale_ = measerr_scale;
+    }
+    
+    // Ingest the measurement y with error yerr at time, which must be later than the time of the previous data point.
+    // Returns the prediction of y from the earlier data and the contribution of y to the log-likelihood. Throws
+    // std::invalid_argument if the data point is not valid, in which case the filtered state is not changed.
+    OnlineFilterUpdate Append(double time, double y, double yerr);
+    
+    // Return the mean and variance of the time series at a time later than the last data point, given the data so far
+    std::pair<double, double> Predict(double time);
+    
+    // Forget all of the data
+    void Reset();
+    
+    // Return a copy of the filtered state, and restore the filter to a copied state
+    OnlineFilterState Checkpoint() const {
+        return state_;
+    }
+    void Restore(const OnlineFilterState& state);
+    
+    // Log-likelihood of the data so far, up to an additive constant, and the number of data points
+    double GetLogLikelihood() const {
+        return state_.loglik;
+    }
+    unsigned long size() const {
+        return state_.ndata;
+    }
+    
+private:
+    // propagate the filtered state vector and its covariance matrix forward by dt
+    void PropagateState(double dt, arma::cx_vec& state, arma::cx_mat& state_var);
+    
+    arma::cx_vec roots_;
+    arma::cx_rowvec obs_coefs_;
+    arma::cx_mat stationary_var_;
+    double ymean_;
+    double measerr_scale_;
+    OnlineFilterState state_;
+};
+
+/*
+ Abstract base class for the Kalman Filter of a CARMA(p,q) process. The measured time series is held in a shared
+ TimeSeriesData object. The Kalman Filter is run on the centered time series y - ymean, with measurement error
+ variances yerr^2 * measerr_scale, where ymean and measerr_scale are set by SetTimeSeriesMean and SetMeasErrScale.
+ These are applied as the filter runs, so changing them does not copy the data.
  */
 
 template <class OmegaType>
@@ -32,67 +190,60 @@ public:
     arma::vec var;
 
     // Constructor
-    KalmanFilter() {};
+    KalmanFilter() : ymean_(0.0), measerr_scale_(1.0) {};
     KalmanFilter(arma::vec& time, arma::vec& y, arma::vec& yerr) :
-    time_(time), y_(y), yerr_(yerr)
+    data_(std::make_shared<const TimeSeriesData>(time, y, yerr)), ymean_(0.0), measerr_scale_(1.0)
+    {
+        init();
+    }
+    KalmanFilter(std::shared_ptr<const TimeSeriesData> data) : data_(data), ymean_(0.0), measerr_scale_(1.0)
     {
         init();
     }
 
     // Initialize arrays
     void init() {
-        int ndata = time_.n_elem;
-        dt_ = time_(arma::span(1,ndata-1)) - time_(arma::span(0,ndata-2));
-
-        // Make sure the time vector is strictly increasing
-        if (dt_.min() < 0) {
-            std::cout << "Time vector is not sorted in increasing order. Sorting the data vectors..."
-            << std::endl;
-            // Sort the time values such that dt > 0
-            arma::uvec sorted_indices = arma::sort_index(time_);
-            time_ = time_.elem(sorted_indices);
-            y_ = y_.elem(sorted_indices);
-            yerr_ = yerr_.elem(sorted_indices);
-            dt_ = time_.rows(1,ndata-1) - time_.rows(0,ndata-2);
-        }
-        // Make sure there are no duplicate values of time
-        if (dt_.min() == 0) {
-            std::cout << "Found duplicate values of time, removing them..." << std::endl;
-            // Find the unique values of time
-            arma::uvec unique_values = 1 + arma::find(dt_ != 0);
-            // Add extra row in to keep time(0), y(0), yerr(0)
-            unique_values.insert_rows(0, arma::zeros<arma::uvec>(1));
-            time_ = time_.elem(unique_values);
-            y_ = y_.elem(unique_values);
-            yerr_ = yerr_.elem(unique_values);
-            ndata = time_.n_elem;
-            dt_.set_size(ndata-1);
-            dt_ = time_.rows(1,time_.n_elem-1) - time_.rows(0,time_.n_elem-2);
-        }
-        
         // Set the size of the Kalman Filter mean and variance vectors
-        mean.zeros(time_.n_elem);
-        var.zeros(time_.n_elem);
+        mean.zeros(data_->size());
+        var.zeros(data_->size());
     }
     
-    // Methods to set and get the data
-    void SetTime(arma::vec& time) {
-        time_ = time;
+    // Methods to set and get the data. The time series and its errors are returned after centering and scaling.
+    void SetData(std::shared_ptr<const TimeSeriesData> data) {
+        data_ = data;
+        init();
     }
-    arma::vec GetTime() {
-        return time_;
+    std::shared_ptr<const TimeSeriesData> GetData() {
+        return data_;
     }
-    void SetTimeSeries(arma::vec& y) {
-        y_ = y;
+    void SetTimeSeriesMean(double ymean) {
+        ymean_ = ymean;
     }
-    arma::vec GetTimeSeries() {
-        return y_;
+    void SetMeasErrScale(double measerr_scale) {
+        measerr_scale_ = measerr_scale;
     }
-    void SetTimeSeriesErr(arma::vec& yerr) {
-        yerr_ = yerr;
+    arma::vec GetTime() {
+        return data_->time();
+    }
+    arma::vec GetTimeSeries() {
+        return data_->y() - ymean_;
     }
     arma::vec GetTimeSeriesErr() {
-        return yerr_;
+        return sqrt(measerr_scale_) * data_->yerr();
+    }
+    // Replace the data values. These copy the data into a new TimeSeriesData object, so the Kalman Filter no
+    // longer shares its data with other objects. The input vectors must be in the same order as GetTime().
+    void SetTime(arma::vec& time) {
+        data_ = std::make_shared<const TimeSeriesData>(time, data_->y(), data_->yerr());
+        init();
+    }
+    void SetTimeSeries(arma::vec& y) {
+        data_ = std::make_shared<const TimeSeriesData>(data_->time(), y, data_->yerr());
+        ymean_ = 0.0;
+    }
+    void SetTimeSeriesErr(arma::vec& yerr) {
+        data_ = std::make_shared<const TimeSeriesData>(data_->time(), data_->y(), yerr);
+        measerr_scale_ = 1.0;
     }
     
     // Methods to set and get the parameter values
@@ -119,68 +270,272 @@ public:
     /*
      Methods to perform the Kalman Filter operations 
      */
-    virtual void Reset() = 0;
-    virtual void Update() = 0;
+    // Reset the Kalman Filter and store the Kalman mean and variance of the first data point
+    void Reset() {
+        ResetState();
+        mean(0) = kalman_mean_;
+        var(0) = kalman_var_;
+    }
+    // Perform one iteration of the Kalman Filter and store the Kalman mean and variance of the new data point
+    void Update() {
+        UpdateState();
+        mean(current_index_-1) = kalman_mean_;
+        var(current_index_-1) = kalman_var_;
+    }
+    // Same as Reset() and Update(), but the Kalman mean and variance of the newest data point are only kept in
+    // kalman_mean_ and kalman_var_, so a pass over the data does not touch the mean and var arrays
+    virtual void ResetState() = 0;
+    virtual void UpdateState() = 0;
     virtual std::pair<double, double> Predict(double time) = 0;
 
+    // Return the rotated state space representation of the process: the roots defining the diagonal state
+    // transition matrix, the matrix of eigenvectors, the measurement coefficients, and the stationary
+    // covariance matrix of the rotated state vector.
+    virtual void StateSpace(arma::cx_vec& roots, arma::cx_mat& eigen_mat, arma::cx_rowvec& obs_coefs,
+                            arma::cx_mat& state_var) = 0;
+
     void Filter() {
         // Run the Kalman Filter
         Reset();
-        for (int i=1; i<time_.n_elem; i++) {
+        for (int i=1; i<data_->size(); i++) {
             Update();
         }
     }
+
+    // Run the Kalman Filter and return the log-likelihood of the time series, up to an additive constant. The
+    // log-likelihood is accumulated in the same pass over the data as the Kalman Filter recursion, and the Kalman
+    // mean and variance are carried in scalars, so the pass uses a constant amount of memory.
+    double LogLikelihood() {
+        ResetState();
+        double loglik = LogLikelihoodTerm(0);
+        for (int i=1; i<data_->size(); i++) {
+            UpdateState();
+            loglik += LogLikelihoodTerm(i);
+        }
+        return loglik;
+    }
+
+    // Same as LogLikelihood(), but stop the Kalman Filter early once the log-likelihood is known to be less than
+    // loglik_min. loglik_max_remaining(i) must be an upper bound on the sum of the log-likelihood terms for the data
+    // points after i. If the filter stops early then the returned value is an upper bound on the log-likelihood that
+    // is less than loglik_min.
+    double LogLikelihood(double loglik_min, arma::vec& loglik_max_remaining) {
+        ResetState();
+        double loglik = LogLikelihoodTerm(0);
+        if (loglik + loglik_max_remaining(0) < loglik_min) {
+            return loglik + loglik_max_remaining(0);
+        }
+        for (int i=1; i<data_->size(); i++) {
+            UpdateState();
+            loglik += LogLikelihoodTerm(i);
+            if (loglik + loglik_max_remaining(i) < loglik_min) {
+                return loglik + loglik_max_remaining(i);
+            }
+        }
+        return loglik;
+    }
+
+    /*
+     Same as LogLikelihood(), but with the Kalman Filter run in parallel over nthreads threads, using the
+     parallel-in-time formulation of Sarkka & Garcia-Fernandez (2021, IEEE Trans. Automatic Control, 66, 299). The
+     time series is split into one contiguous chunk per thread. Because the Kalman Filter is linear, the filtered
+     state at the end of a chunk is an affine function of the filtered state at the end of the previous chunk, and
+     the likelihood of the data in the chunk is a Gaussian function of it. Each thread first computes these functions
+     for its chunk, without knowing the state at the start of the chunk. They are then combined in order, once per
+     chunk, to give the filtered state at the start of each chunk, and finally each thread runs the usual Kalman
+     Filter recursion over its chunk to compute the log-likelihood. The total work is about twice that of
+     LogLikelihood(), so the time series is filtered serially unless each thread gets at least min_parallel_chunk_
+     data points. As for LogLikelihood(), the Kalman mean and variance are not stored.
+     */
+    double ParallelLogLikelihood(unsigned int nthreads) {
+        unsigned int ndata = data_->size();
+        unsigned int nchunks = ParallelChunks(nthreads);
+        if (nchunks < 2) {
+            return LogLikelihood();
+        }
+        
+        arma::cx_vec roots;
+        arma::cx_mat eigen_mat;
+        arma::cx_rowvec obs_coefs;
+        arma::cx_mat state_var;
+        StateSpace(roots, eigen_mat, obs_coefs, state_var);
+        
+        std::vector<unsigned int> chunk_start(nchunks + 1);
+        for (int c=0; c<=nchunks; c++) {
+            chunk_start[c] = (unsigned int)((unsigned long)c * ndata / nchunks);
+        }
+        
+        // first pass: filter the first chunk directly, and compute the affine elements of the others
+        std::vector<FilterElement> elements(nchunks);
+        std::vector<arma::cx_vec> filtered_mean(nchunks);
+        std::vector<arma::cx_mat> filtered_var(nchunks);
+        std::vector<double> chunk_loglik(nchunks);
+        RunInThreads(nchunks, [&](int c) {
+            if (c == 0) {
+                chunk_loglik[0] = FilterChunk(0, chunk_start[1], roots, obs_coefs, state_var, filtered_mean[0],
+                                              filtered_var[0]);
+            } else {
+                ChunkElement(chunk_start[c], chunk_start[c+1], roots, obs_coefs, state_var, elements[c]);
+            }
+        });
+        
+        // combine the elements in order to get the filtered state at the end of each chunk
+        for (int c=1; c<nchunks-1; c++) {
+            filtered_mean[c] = filtered_mean[c-1];
+            filtered_var[c] = filtered_var[c-1];
+            CombineElement(elements[c], filtered_mean[c], filtered_var[c]);
+        }
+        
+        // second pass: run the Kalman Filter over the remaining chunks, starting from the end of the previous chunk
+        RunInThreads(nchunks - 1, [&](int c) {
+            chunk_loglik[c+1] = FilterChunk(chunk_start[c+1], chunk_start[c+2], roots, obs_coefs, state_var,
+                                            filtered_mean[c], filtered_var[c]);
+        });
+        
+        current_index_ = ndata;
+        double loglik = 0.0;
+        for (int c=0; c<nchunks; c++) {
+            loglik += chunk_loglik[c];
+        }
+        return loglik;
+    }
+    
+    // Return an online Kalman Filter for this process that has already ingested the time series, so that new data
+    // points can be added with OnlineKalmanFilter::Append without running the Kalman Filter over the old data again
+    OnlineKalmanFilter MakeOnlineFilter() {
+        OnlineKalmanFilter online_filter = EmptyOnlineFilter();
+        for (unsigned int i=0; i<data_->size(); i++) {
+            online_filter.Append(Time(i), data_->y()(i), data_->yerr()(i));
+        }
+        return online_filter;
+    }
+    
+    // Return an online Kalman Filter for this process restored to a state checkpointed from an earlier online Kalman
+    // Filter for the same process. The time series held by this object is not used.
+    OnlineKalmanFilter MakeOnlineFilter(const OnlineFilterState& state) {
+        OnlineKalmanFilter online_filter = EmptyOnlineFilter();
+        online_filter.Restore(state);
+        return online_filter;
+    }
+    
+    // Set the minimum number of data points per thread for ParallelLogLikelihood to run in parallel
+    void SetMinParallelChunk(unsigned int min_chunk) {
+        min_parallel_chunk_ = std::max(min_chunk, 1u);
+    }
     
+    // Return the number of chunks that ParallelLogLikelihood(nthreads) splits the time series into. The time series
+    // is filtered serially if this is less than two.
+    unsigned int ParallelChunks(unsigned int nthreads) {
+        return std::min(nthreads, (unsigned int)data_->size() / min_parallel_chunk_);
+    }
+
+    // Run the Kalman Filter and return the log-likelihood, and compute its gradient with respect to the model
+    // parameters. The derivatives of the Kalman mean and variance are propagated forward alongside the Kalman Filter
+    // recursion, so the gradient is computed in the same pass over the data as the log-likelihood.
+    virtual double LogLikelihoodGradient(KalmanDerivatives& derivs, arma::vec& grad) = 0;
+
     // simulate a CARMA process, conditional on the measured time series
     std::vector<double> Simulate(arma::vec time) {
-        // first save old values since we will overwrite them later
-        arma::vec time0 = time_;
-        arma::vec y0 = y_;
-        arma::vec yerr0 = yerr_;
+        arma::mat ysimulated = Simulate(time, 1);
+        return arma::conv_to<std::vector<double> >::from(ysimulated.col(0));
+    }
+    
+    /*
+     Simulate nsim realizations of the process at the input times, conditional on the measured time series. Each
+     column of the output contains one realization. This uses the simulation smoother of Durbin & Koopman (2002):
+     an unconditional realization of the process and of the measurements is drawn by a single forward pass over
+     the merged time grid, and the conditional realization is obtained by adding the smoothed values of the
+     residuals between the measured time series and the simulated measurements. All of the realizations share a
+     single forward filtering pass and a single backward smoothing pass, and the stored data are not modified.
+     */
+    arma::mat Simulate(arma::vec time, unsigned int nsim) {
+        arma::uvec sorted_indices = arma::sort_index(time);
+        arma::vec sorted_time = time.elem(sorted_indices);
+        
+        std::vector<int> grid;
+        arma::vec tgrid;
+        MergeTimes(sorted_time, grid, tgrid);
+        
+        arma::cx_vec roots;
+        arma::cx_mat eigen_mat;
+        arma::cx_rowvec obs_coefs;
+        arma::cx_mat state_var;
+        StateSpace(roots, eigen_mat, obs_coefs, state_var);
+        unsigned int p = roots.n_elem;
         
-        arma::vec ysimulated(time.n_elem);
+        // The unconditional realizations are generated in the original (real) state space, where the state vector
+        // is real-valued. State transition matrix is eigen_mat * diag(exp(roots * dt)) * inv(eigen_mat).
+        arma::cx_mat eigen_inv = arma::inv(eigen_mat);
+        arma::rowvec measure_coefs = arma::real(obs_coefs * eigen_inv);
+        arma::mat stationary_var = arma::real(eigen_mat * state_var * eigen_mat.t());
         
-        time = arma::sort(time);
-        unsigned int insert_idx = 0;
-        arma::vec tinsert(1);
-        arma::vec dt_insert(1);
-        arma::vec yinsert(1);
-        arma::vec yerr_insert(1);
-        yerr_insert(0) = 0.0;
-        for (int i=0; i<time.n_elem; i++) {
-            insert_idx = 0;
-            // first simulate the value at time(i)
-            std::pair<double, double> ypredict = this->Predict(time(i));
-            ysimulated(i) = RandGen.normal(ypredict.first, sqrt(ypredict.second));
-            // find the index where time_[insert_idx-1] < time(i) < time_[insert_idx]
-            while (time_(insert_idx) < time(i)) {
-                insert_idx++;
-                if (insert_idx == (time_.n_elem)) {
-                    break;
+        arma::mat state = SymmetricSqrt(stationary_var) * StandardNormals(p, nsim);
+        arma::mat ydata_sim(data_->size(), nsim);
+        arma::mat ysimulated(time.n_elem, nsim);
+        
+        arma::mat transition(p,p), innovation_sqrt(p,p);
+        double dt_previous = -1.0;
+        for (int k=0; k<grid.size(); k++) {
+            if (k > 0) {
+                double dt = tgrid(k) - tgrid(k-1);
+                if (dt != dt_previous) {
+                    // only need to recompute the transition matrix when the time spacing changes
+                    arma::cx_vec rho = arma::exp(roots * dt);
+                    transition = arma::real(eigen_mat * arma::diagmat(rho) * eigen_inv);
+                    innovation_sqrt = SymmetricSqrt(stationary_var - transition * stationary_var * transition.t());
+                    dt_previous = dt;
                 }
+                state = transition * state + innovation_sqrt * StandardNormals(p, nsim);
+            }
+            if (grid[k] >= 0) {
+                int i = grid[k];
+                ydata_sim.row(i) = measure_coefs * state + sqrt(YerrSqr(i)) * StandardNormals(1, nsim);
+            } else {
+                ysimulated.row(-1 - grid[k]) = measure_coefs * state;
             }
-            // insert the simulated value into the measured time series array. these values are used in subsequent
-            // calls to Predict(time(i)).
-            tinsert(0) = time(i);
-            time_.insert_rows(insert_idx, tinsert);
-            dt_ = time_(arma::span(1,time_.n_elem-1)) - time_(arma::span(0,time_.n_elem-2));
-            yinsert(0) = ysimulated(i);
-            y_.insert_rows(insert_idx, yinsert);
-            yerr_.insert_rows(insert_idx, yerr_insert);
-            mean.zeros(time_.n_elem);
-            var.zeros(time_.n_elem);
         }
         
-        // restore values of measured time series
-        time_ = time0;
-        dt_ = time_(arma::span(1,time_.n_elem-1)) - time_(arma::span(0,time_.n_elem-2));
-        y_ = y0;
-        yerr_ = yerr0;
-        // restore the original sizes of the kalman mean and variance arrays
-        mean.zeros(time_.n_elem);
-        var.zeros(time_.n_elem);
+        // condition on the measured time series by smoothing the residuals
+        arma::mat yresidual = -ydata_sim;
+        yresidual.each_col() += GetTimeSeries();
+        arma::mat smoothed_residual;
+        arma::vec smoothed_var;
+        Smooth(sorted_time, yresidual, smoothed_residual, smoothed_var);
+        ysimulated += smoothed_residual;
+        
+        // put the simulated values back into the input order
+        arma::mat ysimulated_out(time.n_elem, nsim);
+        for (int j=0; j<time.n_elem; j++) {
+            ysimulated_out.row(sorted_indices(j)) = ysimulated.row(j);
+        }
+        
+        return ysimulated_out;
+    }
+    
+    // Predict the time series at each of the input times, given the measured time series. This is equivalent
+    // to calling Predict(time(i)) for each element of time, but only requires a single forward pass of the
+    // Kalman Filter and a single backward smoothing pass, so the cost is linear in the number of data points
+    // and prediction times. The first element of the output contains the conditional means and the second
+    // element contains the conditional variances.
+    std::pair<arma::vec, arma::vec> PredictBatch(arma::vec time) {
+        arma::uvec sorted_indices = arma::sort_index(time);
+        arma::vec sorted_time = time.elem(sorted_indices);
+        
+        arma::mat ydata = GetTimeSeries();
+        arma::mat smoothed_mean;
+        arma::vec smoothed_var;
+        Smooth(sorted_time, ydata, smoothed_mean, smoothed_var);
         
-        return arma::conv_to<std::vector<double> >::from(ysimulated);
+        // put the predictions back into the input order
+        arma::vec ypredict_mean(time.n_elem);
+        arma::vec ypredict_var(time.n_elem);
+        for (int j=0; j<time.n_elem; j++) {
+            ypredict_mean(sorted_indices(j)) = smoothed_mean(j,0);
+            ypredict_var(sorted_indices(j)) = smoothed_var(j);
+        }
+        
+        std::pair<arma::vec, arma::vec> ypredict(ypredict_mean, ypredict_var);
+        return ypredict;
     }
     
     // Methods needed for interpolation and backcasting
@@ -188,17 +543,312 @@ public:
     virtual void UpdateCoefs() = 0;
 
 protected:
+    /*
+     Affine representation of the Kalman Filter over a chunk of the time series, given the rotated state vector x at
+     the data point before the chunk. The filtered state at the end of the chunk is normally distributed with mean
+     transition * x + offset and covariance matrix covar, and the likelihood of the data in the chunk is proportional
+     to exp(-x^H * precision * x / 2 + Re(info^H * x)).
+     */
+    struct FilterElement {
+        arma::cx_mat transition;
+        arma::cx_vec offset;
+        arma::cx_mat covar;
+        arma::cx_vec info;
+        arma::cx_mat precision;
+    };
+    
+    // Workspace for the Kalman Filter recursion over a chunk, allocated once per chunk. The state transition rho of
+    // the rotated state vector and its outer product rho * rho^H are only recomputed when the time step changes.
+    struct ChunkWorkspace {
+        ChunkWorkspace(unsigned int p) : rho(p), rho_outer(p, p), gain(p), obs_col(p), dt(arma::datum::nan) {}
+        arma::cx_vec rho;
+        arma::cx_mat rho_outer;
+        arma::cx_vec gain;
+        arma::cx_vec obs_col;
+        double dt;
+    };
+    
+    // Set the state transition in the workspace for the time step dt
+    static void SetChunkTransition(double dt, arma::cx_vec& roots, ChunkWorkspace& work) {
+        if (dt == work.dt) {
+            return;
+        }
+        unsigned int p = roots.n_elem;
+        for (unsigned int k=0; k<p; k++) {
+            work.rho(k) = std::exp(roots(k) * dt);
+        }
+        for (unsigned int j=0; j<p; j++) {
+            for (unsigned int k=0; k<p; k++) {
+                work.rho_outer(k,j) = work.rho(k) * std::conj(work.rho(j));
+            }
+        }
+        work.dt = dt;
+    }
+    
+    // Add scale * u * w^H to the matrix a in place, without forming the outer product
+    static void RankOneUpdate(arma::cx_mat& a, double scale, arma::cx_vec& u, arma::cx_vec& w) {
+        for (unsigned int j=0; j<a.n_cols; j++) {
+            std::complex<double> wj = scale * std::conj(w(j));
+            for (unsigned int k=0; k<a.n_rows; k++) {
+                a(k,j) += u(k) * wj;
+            }
+        }
+    }
+    
+    // Run the Kalman Filter recursion over the data points start <= i < end in the rotated state space, returning the
+    // sum of the log-likelihood terms. On input state and state_var are the filtered rotated state vector and its
+    // covariance matrix at start - 1, and are ignored if start = 0. On output they are the filtered values at end - 1.
+    double FilterChunk(unsigned int start, unsigned int end, arma::cx_vec& roots, arma::cx_rowvec& obs_coefs,
+                       arma::cx_mat& stationary_var, arma::cx_vec& state, arma::cx_mat& state_var) {
+        ChunkWorkspace work(roots.n_elem);
+        double loglik = 0.0;
+        for (unsigned int i=start; i<end; i++) {
+            if (i == 0) {
+                state.zeros(roots.n_elem);
+                state_var = stationary_var;
+            } else {
+                SetChunkTransition(Dt(i-1), roots, work);
+                state %= work.rho;
+                state_var -= stationary_var;
+                state_var %= work.rho_outer;
+                state_var += stationary_var;
+            }
+            work.gain = state_var * obs_coefs.t();
+            double ypredict = std::real(arma::as_scalar(obs_coefs * state));
+            double yvar = std::real(arma::as_scalar(obs_coefs * work.gain)) + YerrSqr(i);
+            double innovation = Y(i) - ypredict;
+            loglik += -0.5 * log(yvar) - 0.5 * innovation * innovation / yvar;
+            work.gain /= yvar;
+            state += innovation * work.gain;
+            RankOneUpdate(state_var, -yvar, work.gain, work.gain);
+        }
+        return loglik;
+    }
+    
+    // Compute the affine element of the Kalman Filter for the data points start <= i < end, where start > 0. This is
+    // the Kalman Filter recursion started from a known state, with the dependence of the filtered state vector and of
+    // the innovations on that state carried along.
+    void ChunkElement(unsigned int start, unsigned int end, arma::cx_vec& roots, arma::cx_rowvec& obs_coefs,
+                      arma::cx_mat& stationary_var, FilterElement& element) {
+        unsigned int p = roots.n_elem;
+        ChunkWorkspace work(p);
+        element.transition.eye(p, p);
+        element.offset.zeros(p);
+        element.covar.zeros(p, p);
+        element.info.zeros(p);
+        element.precision.zeros(p, p);
+        for (unsigned int i=start; i<end; i++) {
+            SetChunkTransition(Dt(i-1), roots, work);
+            element.transition.each_col() %= work.rho;
+            element.offset %= work.rho;
+            element.covar -= stationary_var;
+            element.covar %= work.rho_outer;
+            element.covar += stationary_var;
+            // the predicted measurement is obs_col^H * x + ypredict, with variance yvar
+            work.obs_col = element.transition.t() * obs_coefs.t();
+            work.gain = element.covar * obs_coefs.t();
+            double ypredict = std::real(arma::as_scalar(obs_coefs * element.offset));
+            double yvar = std::real(arma::as_scalar(obs_coefs * work.gain)) + YerrSqr(i);
+            double innovation = Y(i) - ypredict;
+            RankOneUpdate(element.precision, 1.0 / yvar, work.obs_col, work.obs_col);
+            element.info += (innovation / yvar) * work.obs_col;
+            work.gain /= yvar;
+            RankOneUpdate(element.transition, -1.0, work.gain, work.obs_col);
+            element.offset += innovation * work.gain;
+            RankOneUpdate(element.covar, -yvar, work.gain, work.gain);
+        }
+    }
+    
+    // Condition the filtered state at the end of the previous chunk on the data in the chunk described by element,
+    // and propagate it to the end of the chunk
+    void CombineElement(FilterElement& element, arma::cx_vec& state, arma::cx_mat& state_var) {
+        arma::cx_mat factor = arma::eye<arma::cx_mat>(state.n_elem, state.n_elem) + state_var * element.precision;
+        arma::cx_vec conditional_state = arma::solve(factor, state + state_var * element.info);
+        arma::cx_mat conditional_var = arma::solve(factor, state_var);
+        state = element.transition * conditional_state + element.offset;
+        state_var = element.transition * conditional_var * element.transition.t() + element.covar;
+        state_var = 0.5 * (state_var + state_var.t()); // make sure the covariance matrix stays Hermitian
+    }
+    
+    // Return an online Kalman Filter for this process that has not ingested any data
+    OnlineKalmanFilter EmptyOnlineFilter() {
+        arma::cx_vec roots;
+        arma::cx_mat eigen_mat;
+        arma::cx_rowvec obs_coefs;
+        arma::cx_mat state_var;
+        StateSpace(roots, eigen_mat, obs_coefs, state_var);
+        return OnlineKalmanFilter(roots, obs_coefs, state_var, ymean_, measerr_scale_);
+    }
+    
+    // Run task(c) for c = 0, ..., ntasks - 1, each in its own thread. If a task throws, the exception is rethrown on
+    // the calling thread after all of the threads have finished.
+    static void RunInThreads(int ntasks, const std::function<void(int)>& task) {
+        std::vector<std::exception_ptr> errors(ntasks);
+        auto run_task = [&](int c) {
+            try {
+                task(c);
+            } catch (...) {
+                errors[c] = std::current_exception();
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int c=1; c<ntasks; c++) {
+            workers.push_back(std::thread(run_task, c));
+        }
+        run_task(0);
+        for (int c=0; c<workers.size(); c++) {
+            workers[c].join();
+        }
+        for (int c=0; c<ntasks; c++) {
+            if (errors[c]) {
+                std::rethrow_exception(errors[c]);
+            }
+        }
+    }
+    
+    // Contribution of the i-th data point to the log-likelihood, given its Kalman mean and variance
+    double LogLikelihoodTerm(unsigned int i) {
+        double innovation = Y(i) - kalman_mean_;
+        return -0.5 * log(kalman_var_) - 0.5 * innovation * innovation / kalman_var_;
+    }
+    
+    // Add the derivatives of the i-th log-likelihood term to grad, given the derivatives of the Kalman mean and
+    // variance and of the mean of the time series
+    void LogLikelihoodTermGradient(unsigned int i, arma::rowvec& dmean, arma::rowvec& dvar, arma::rowvec& dymean,
+                                   arma::vec& grad) {
+        double innovation = Y(i) - kalman_mean_;
+        arma::rowvec dinnovation = -dymean - dmean;
+        grad += arma::trans(-0.5 * dvar / kalman_var_ - innovation * dinnovation / kalman_var_ +
+                            0.5 * innovation * innovation * dvar / (kalman_var_ * kalman_var_));
+    }
+
+    // Merge the measured time values with the sorted input times. On output non-negative values of grid refer to
+    // the index of a measured value, and negative values refer to the index (-1 - grid[k]) of an input time. Ties
+    // are ordered with the measured value first.
+    void MergeTimes(arma::vec& tpredict, std::vector<int>& grid, arma::vec& tgrid) {
+        unsigned int ndata = data_->size();
+        unsigned int npredict = tpredict.n_elem;
+        grid.clear();
+        grid.reserve(ndata + npredict);
+        unsigned int idata = 0, ipredict = 0;
+        while ((idata < ndata) || (ipredict < npredict)) {
+            if ((ipredict == npredict) || ((idata < ndata) && (Time(idata) <= tpredict(ipredict)))) {
+                grid.push_back(idata++);
+            } else {
+                grid.push_back(-1 - (int)(ipredict++));
+            }
+        }
+        tgrid.set_size(grid.size());
+        for (int k=0; k<grid.size(); k++) {
+            tgrid(k) = grid[k] >= 0 ? Time(grid[k]) : tpredict(-1 - grid[k]);
+        }
+    }
+    
+    /*
+     Run the Kalman Filter over the grid formed by merging the measured time values with the sorted input
+     times, followed by a backward pass of the modified Bryson-Frazier smoother. Each column of ydata is treated
+     as a separate time series measured at the data times with the scaled measurement errors; the Kalman gains and variances do not depend
+     on the data, so they are shared among the columns. On output smoothed_mean(j,k) contains the conditional
+     mean of the process at tpredict(j) given column k of ydata, and smoothed_var(j) contains its conditional
+     variance. Only O(p) values are stored for each grid point.
+     */
+    void Smooth(arma::vec& tpredict, arma::mat& ydata, arma::mat& smoothed_mean, arma::vec& smoothed_var) {
+        arma::cx_vec roots;
+        arma::cx_mat eigen_mat;
+        arma::cx_rowvec obs_coefs;
+        arma::cx_mat state_var;
+        StateSpace(roots, eigen_mat, obs_coefs, state_var);
+        
+        unsigned int ndata = data_->size();
+        unsigned int npredict = tpredict.n_elem;
+        unsigned int nseries = ydata.n_cols;
+        unsigned int p = roots.n_elem;
+        
+        std::vector<int> grid;
+        arma::vec tgrid;
+        MergeTimes(tpredict, grid, tgrid);
+        
+        smoothed_mean.set_size(npredict, nseries);
+        smoothed_var.set_size(npredict);
+        arma::cx_mat kalman_gain(p, ndata);
+        arma::vec innovation_var(ndata);
+        arma::mat innovation(ndata, nseries);
+        arma::cx_mat predicted_cov(p, npredict); // covariance between the state and the process at tpredict
+        
+        // forward pass: the Kalman Filter, skipping the measurement update at the prediction times
+        arma::cx_mat state = arma::zeros<arma::cx_mat>(p, nseries);
+        arma::cx_mat prediction_var = state_var;
+        arma::cx_vec rho(p);
+        for (int k=0; k<grid.size(); k++) {
+            if (k > 0) {
+                // predict the state at tgrid(k) given the state at tgrid(k-1)
+                rho = arma::exp(roots * (tgrid(k) - tgrid(k-1)));
+                state.each_col() %= rho;
+                prediction_var = (rho * rho.t()) % (prediction_var - state_var) + state_var;
+            }
+            arma::cx_vec var_obs = prediction_var * obs_coefs.t();
+            if (grid[k] >= 0) {
+                int i = grid[k];
+                innovation_var(i) = std::real(arma::as_scalar(obs_coefs * var_obs)) + YerrSqr(i);
+                innovation.row(i) = ydata.row(i) - arma::real(obs_coefs * state);
+                kalman_gain.col(i) = var_obs / innovation_var(i);
+                state += kalman_gain.col(i) * innovation.row(i);
+                prediction_var -= innovation_var(i) * (kalman_gain.col(i) * kalman_gain.col(i).t());
+            } else {
+                int j = -1 - grid[k];
+                predicted_cov.col(j) = var_obs;
+                smoothed_mean.row(j) = arma::real(obs_coefs * state);
+                smoothed_var(j) = std::real(arma::as_scalar(obs_coefs * var_obs));
+            }
+        }
+        
+        // backward pass: accumulate the adjoint variables and correct the predictions at tpredict
+        arma::cx_mat adjoint = arma::zeros<arma::cx_mat>(p, nseries);
+        arma::cx_mat adjoint_var = arma::zeros<arma::cx_mat>(p, p);
+        for (int k=grid.size()-1; k>=0; k--) {
+            if (k < grid.size() - 1) {
+                rho = arma::exp(roots * (tgrid(k+1) - tgrid(k)));
+                adjoint.each_col() %= arma::conj(rho);
+                adjoint_var %= arma::conj(rho * rho.t());
+            }
+            if (grid[k] >= 0) {
+                int i = grid[k];
+                arma::cx_vec gain = kalman_gain.col(i);
+                arma::cx_rowvec gain_adjoint = gain.t() * adjoint_var;
+                arma::cx_vec adjoint_gain = adjoint_var * gain;
+                std::complex<double> gain_quad = arma::as_scalar(gain_adjoint * gain) + 1.0 / innovation_var(i);
+                adjoint -= obs_coefs.t() * (gain.t() * adjoint + innovation.row(i) / innovation_var(i));
+                adjoint_var += gain_quad * (obs_coefs.t() * obs_coefs) - obs_coefs.t() * gain_adjoint
+                    - adjoint_gain * obs_coefs;
+            } else {
+                int j = -1 - grid[k];
+                smoothed_mean.row(j) -= arma::real(predicted_cov.col(j).t() * adjoint);
+                smoothed_var(j) -= std::real(arma::as_scalar(predicted_cov.col(j).t() * adjoint_var *
+                                                             predicted_cov.col(j)));
+            }
+        }
+    }
+    
+    // Data values seen by the Kalman Filter, after centering the time series and scaling the measurement errors
+    double Time(unsigned int i) { return data_->time()(i); }
+    double Dt(unsigned int i) { return data_->dt()(i); }
+    double Y(unsigned int i) { return data_->y()(i) - ymean_; }
+    double YerrSqr(unsigned int i) { return measerr_scale_ * data_->yerr_sqr()(i); }
+    
     // Data
-    arma::vec time_;
-    arma::vec dt_;
-    arma::vec y_;
-    arma::vec yerr_;
+    std::shared_ptr<const TimeSeriesData> data_;
+    double ymean_; // mean of the time series, subtracted from the measured values
+    double measerr_scale_; // scaling factor for the measurement error variances
     // The Kalman Filter parameters
     double sigsqr_;
     OmegaType omega_;
     unsigned int current_index_;
+    // Kalman mean and variance of the data point at current_index_-1
+    double kalman_mean_, kalman_var_;
     // linear coefficients needed for doing interpolation or backcasting
     double yconst_, yslope_;
+    // minimum number of data points per thread for ParallelLogLikelihood to run in parallel
+    unsigned int min_parallel_chunk_ = 256;
 };
 
 /*
@@ -213,6 +863,7 @@ public:
     // Constructors
     KalmanFilter1() : KalmanFilter<double>() {}
     KalmanFilter1(arma::vec& time, arma::vec& y, arma::vec& yerr) : KalmanFilter<double>(time, y, yerr) {}
+    KalmanFilter1(std::shared_ptr<const TimeSeriesData> data) : KalmanFilter<double>(data) {}
     KalmanFilter1(arma::vec& time, arma::vec& y, arma::vec& yerr, double sigsqr, double omega) :
         KalmanFilter<double>(time, y, yerr)
     {
@@ -222,34 +873,26 @@ public:
     KalmanFilter1(std::vector<double> time, std::vector<double> y, std::vector<double> yerr) : 
         KalmanFilter<double>() 
     {
-        arma::vec armatime = arma::conv_to<arma::vec>::from(time);
-        arma::vec armay    = arma::conv_to<arma::vec>::from(y);
-        arma::vec armady   = arma::conv_to<arma::vec>::from(yerr);
-        time_ = armatime;
-        y_ = armay;
-        yerr_ = armady;
+        data_ = std::make_shared<const TimeSeriesData>(time, y, yerr);
         init();
     }
     KalmanFilter1(std::vector<double> time, std::vector<double> y, std::vector<double> yerr, double sigsqr, double omega) :
         KalmanFilter<double>()
     {
-        arma::vec armatime = arma::conv_to<arma::vec>::from(time);
-        arma::vec armay    = arma::conv_to<arma::vec>::from(y);
-        arma::vec armady   = arma::conv_to<arma::vec>::from(yerr);
-        time_ = armatime;
-        y_ = armay;
-        yerr_ = armady;
+        data_ = std::make_shared<const TimeSeriesData>(time, y, yerr);
         sigsqr_ = sigsqr;
         omega_ = omega;
         init();
     }
 
     // Methods to perform the Kalman Filter operations
-    void Reset();
-    void Update();
+    void ResetState();
+    void UpdateState();
     std::pair<double, double> Predict(double time);
     void InitializeCoefs(double time, unsigned int itime, double ymean, double yvar);
     void UpdateCoefs();
+    void StateSpace(arma::cx_vec& roots, arma::cx_mat& eigen_mat, arma::cx_rowvec& obs_coefs, arma::cx_mat& state_var);
+    double LogLikelihoodGradient(KalmanDerivatives& derivs, arma::vec& grad);
 
     std::vector<double> Simulate(std::vector<double> time) {
         arma::vec armatime = arma::conv_to<arma::vec>::from(time);
@@ -257,10 +900,36 @@ public:
         std::vector<double> vecsimulate = arma::conv_to<std::vector<double> >::from(armasimulate);
         return vecsimulate;
     }
+    
+    // simulate nsim realizations, returned as a vector of realizations
+    std::vector<std::vector<double> > Simulate(std::vector<double> time, int nsim) {
+        arma::vec armatime = arma::conv_to<arma::vec>::from(time);
+        arma::mat armasimulate = KalmanFilter<double>::Simulate(armatime, nsim);
+        std::vector<std::vector<double> > vecsimulate(nsim);
+        for (int k=0; k<nsim; k++) {
+            vecsimulate[k] = arma::conv_to<std::vector<double> >::from(armasimulate.col(k));
+        }
+        return vecsimulate;
+    }
+    
+    std::pair<std::vector<double>, std::vector<double> > PredictBatch(std::vector<double> time) {
+        arma::vec armatime = arma::conv_to<arma::vec>::from(time);
+        std::pair<arma::vec, arma::vec> armapredict = KalmanFilter<double>::PredictBatch(armatime);
+        std::pair<std::vector<double>, std::vector<double> >
+            vecpredict(arma::conv_to<std::vector<double> >::from(armapredict.first),
+                       arma::conv_to<std::vector<double> >::from(armapredict.second));
+        return vecpredict;
+    }
 };
 
 /*
- Same as KalmanFilter1 but for a CARMA(p,q) process
+ Same as KalmanFilter1 but for a CARMA(p,q) process.
+ 
+ Over a run of equal time steps and measurement error variances the one-step prediction variance of the state
+ converges to the solution of the algebraic Riccati equation. Once the Kalman gain and the variance of the predicted
+ observation change by less than a fractional tolerance from one step to the next, they are held fixed until the time
+ step or the measurement error changes, and each step only propagates the state vector. This costs O(p) per step
+ instead of O(p^2), which matters for long, regularly sampled light curves.
  */
 
 class KalmanFilterp : public KalmanFilter<arma::cx_vec> {
@@ -268,6 +937,7 @@ public:
     // Constructors
     KalmanFilterp() : KalmanFilter<arma::cx_vec>() {}
     KalmanFilterp(arma::vec& time, arma::vec& y, arma::vec& yerr) : KalmanFilter<arma::cx_vec>(time, y, yerr) {init();}
+    KalmanFilterp(std::shared_ptr<const TimeSeriesData> data) : KalmanFilter<arma::cx_vec>(data) {}
     KalmanFilterp(arma::vec& time, arma::vec& y, arma::vec& yerr, double sigsqr, arma::cx_vec& omega, arma::vec& ma_coefs) :
         KalmanFilter<arma::cx_vec>(time, y, yerr)
     {
@@ -292,26 +962,16 @@ public:
     KalmanFilterp(std::vector<double> time, std::vector<double> y, std::vector<double> yerr) :
         KalmanFilter<arma::cx_vec>()
     {
-        arma::vec armatime = arma::conv_to<arma::vec>::from(time);
-        arma::vec armay    = arma::conv_to<arma::vec>::from(y);
-        arma::vec armady   = arma::conv_to<arma::vec>::from(yerr);
-        time_ = armatime;
-        y_ = armay;
-        yerr_ = armady;
+        data_ = std::make_shared<const TimeSeriesData>(time, y, yerr);
         init();
     }
    KalmanFilterp(std::vector<double> time, std::vector<double> y, std::vector<double> yerr, double sigsqr, 
                  std::vector<std::complex<double> > omega, std::vector<double> ma_coefs) :
         KalmanFilter<arma::cx_vec>()
     {
-        arma::vec armatime  = arma::conv_to<arma::vec>::from(time);
-        arma::vec armay     = arma::conv_to<arma::vec>::from(y);
-        arma::vec armady    = arma::conv_to<arma::vec>::from(yerr);
         arma::cx_vec armaomega = arma::conv_to<arma::cx_vec>::from(omega);
         arma::vec armacoefs = arma::conv_to<arma::vec>::from(ma_coefs);
-        time_ = armatime;
-        y_ = armay;
-        yerr_ = armady;
+        data_ = std::make_shared<const TimeSeriesData>(time, y, yerr);
         sigsqr_ = sigsqr;
         omega_ = armaomega;
         p_ = omega_.n_elem;
@@ -357,12 +1017,25 @@ public:
     }
 
     
+    // Set the fractional tolerance used to decide that the Kalman Filter has reached its steady state over a run of
+    // equal time steps. A tolerance of zero turns off the steady-state updates.
+    void SetSteadyStateTolerance(double tolerance) {
+        steady_state_tol_ = tolerance;
+    }
+    
+    // Return the number of steady-state updates, which only propagate the state vector, since the last Reset()
+    unsigned int GetSteadyStateUpdates() {
+        return nsteady_updates_;
+    }
+    
     // Methods to perform the Kalman Filter operations
-    void Reset();
-    void Update();
+    void ResetState();
+    void UpdateState();
     std::pair<double, double> Predict(double time);
     void InitializeCoefs(double time, unsigned int itime, double ymean, double yvar);
     void UpdateCoefs();
+    void StateSpace(arma::cx_vec& roots, arma::cx_mat& eigen_mat, arma::cx_rowvec& obs_coefs, arma::cx_mat& state_var);
+    double LogLikelihoodGradient(KalmanDerivatives& derivs, arma::vec& grad);
     
     std::vector<double> Simulate(std::vector<double> time) {
         arma::vec armatime = arma::conv_to<arma::vec>::from(time);
@@ -371,7 +1044,27 @@ public:
         return vecsimulate;
     }
     
-private:
+    // simulate nsim realizations, returned as a vector of realizations
+    std::vector<std::vector<double> > Simulate(std::vector<double> time, int nsim) {
+        arma::vec armatime = arma::conv_to<arma::vec>::from(time);
+        arma::mat armasimulate = KalmanFilter<arma::cx_vec>::Simulate(armatime, nsim);
+        std::vector<std::vector<double> > vecsimulate(nsim);
+        for (int k=0; k<nsim; k++) {
+            vecsimulate[k] = arma::conv_to<std::vector<double> >::from(armasimulate.col(k));
+        }
+        return vecsimulate;
+    }
+    
+    std::pair<std::vector<double>, std::vector<double> > PredictBatch(std::vector<double> time) {
+        arma::vec armatime = arma::conv_to<arma::vec>::from(time);
+        std::pair<arma::vec, arma::vec> armapredict = KalmanFilter<arma::cx_vec>::PredictBatch(armatime);
+        std::pair<std::vector<double>, std::vector<double> >
+            vecpredict(arma::conv_to<std::vector<double> >::from(armapredict.first),
+                       arma::conv_to<std::vector<double> >::from(armapredict.second));
+        return vecpredict;
+    }
+    
+protected:
     // parameters
     arma::rowvec ma_coefs_; // moving average terms
     unsigned int p_; // the orders of the CARMA process
@@ -386,7 +1079,238 @@ private:
     // linear coefficients needed for doing interpolation or backcasting
     arma::cx_vec state_const_;
     arma::cx_vec state_slope_;    
+    
+    // Does the step to current_index_ use the same time step and measurement error variances as the previous step? If
+    // so, it maps the prediction variance of the state in the same way. The comparisons allow for a relative difference
+    // of 1e-10. Time steps computed from large time stamps, such as barycentric Julian dates, also carry the rounding
+    // error of the time stamps, which can be larger than this for a regular cadence, so that is allowed for as well.
+    bool SameStepAsPrevious() {
+        const double tol = 1e-10;
+        unsigned int i = current_index_;
+        if (i < 2) {
+            return false;
+        }
+        double dt_tol = tol * Dt(i-1) + 4.0 * arma::datum::eps * std::abs(Time(i));
+        return (std::abs(Dt(i-1) - Dt(i-2)) <= dt_tol) &&
+            (std::abs(YerrSqr(i) - YerrSqr(i-1)) <= tol * YerrSqr(i)) &&
+            (std::abs(YerrSqr(i-1) - YerrSqr(i-2)) <= tol * YerrSqr(i-1));
+    }
+    
+    // Has the Kalman Filter converged to its steady state, given the change in the Kalman gain and the variance of the
+    // predicted observation in the step to current_index_? Called at the end of a full update.
+    bool SteadyStateConverged(double previous_var, double gain_change, double gain_norm) {
+        return (steady_state_tol_ > 0.0) && SameStepAsPrevious() &&
+            (std::abs(kalman_var_ - previous_var) <= steady_state_tol_ * kalman_var_) &&
+            (gain_change <= steady_state_tol_ * gain_norm);
+    }
+    
+    bool steady_state_ = false; // are the Kalman gain and prediction variance held fixed?
+    double steady_state_tol_ = 1e-12; // fractional tolerance for convergence to the steady state
+    unsigned int nsteady_updates_ = 0; // number of steady-state updates since the last Reset()
+private:
+    arma::cx_vec previous_gain_;
+};
+
+/*
+ Same as KalmanFilterp, but with the order of the autoregressive polynomial fixed at compile time. The rotated
+ state vector and its covariance matrix are held in fixed-size arrays and the updates are written out as explicit
+ loops that exploit the Hermitian symmetry of the covariance matrices, so the Kalman Filter recursion does not
+ perform any heap allocations. Interpolation, backcasting, and simulation use the methods of KalmanFilterp.
+ */
+
+template <unsigned int P>
+class KalmanFilterP : public KalmanFilterp {
+public:
+    // Constructors
+    KalmanFilterP() : KalmanFilterp() {}
+    KalmanFilterP(arma::vec& time, arma::vec& y, arma::vec& yerr) : KalmanFilterp(time, y, yerr) {}
+    KalmanFilterP(std::shared_ptr<const TimeSeriesData> data) : KalmanFilterp(data) {}
+    KalmanFilterP(arma::vec& time, arma::vec& y, arma::vec& yerr, double sigsqr, arma::cx_vec& omega, arma::vec& ma_coefs) :
+        KalmanFilterp(time, y, yerr, sigsqr, omega, ma_coefs)
+    {
+        BOOST_ASSERT_MSG(omega.n_elem == P, "Number of AR roots must equal the order of the Kalman Filter");
+    }
+    
+    // set the AR parameters
+    void SetOmega(arma::cx_vec omega) {
+        BOOST_ASSERT_MSG(omega.n_elem == P, "Number of AR roots must equal the order of the Kalman Filter");
+        KalmanFilterp::SetOmega(omega);
+    }
+    
+    // Reset the Kalman Filter
+    void ResetState() {
+        arma::cx_mat EigenMat;
+        RotateCarmaModel(omega_, ma_coefs_, sigsqr_, EigenMat, rotated_ma_coefs_, StateVar_);
+        for (int i=0; i<P; i++) {
+            omega_fixed_[i] = omega_(i);
+            rotated_ma_fixed_[i] = rotated_ma_coefs_(i);
+            state_fixed_[i] = 0.0; // Initial state is set to zero
+            gain_fixed_[i] = 0.0;
+            for (int j=0; j<P; j++) {
+                state_var_fixed_[i][j] = StateVar_(i,j);
+                prediction_var_fixed_[i][j] = StateVar_(i,j);
+            }
+        }
+        kalman_mean_ = 0.0;
+        kalman_var_ = PredictionVariance() + YerrSqr(0);
+        innovation_ = Y(0);
+        current_index_ = 1;
+        steady_state_ = false;
+        nsteady_updates_ = 0;
+    }
+    
+    // Perform one iteration of the Kalman Filter
+    void UpdateState() {
+        if (steady_state_) {
+            if (SameStepAsPrevious()) {
+                // the Kalman gain, state transition, and prediction variance are fixed, so only update the state
+                std::complex<double> ypredict = 0.0;
+                for (int i=0; i<P; i++) {
+                    state_fixed_[i] = rho_fixed_[i] * (state_fixed_[i] + gain_fixed_[i] * innovation_);
+                    ypredict += rotated_ma_fixed_[i] * state_fixed_[i];
+                }
+                kalman_mean_ = std::real(ypredict); // kalman_var_ is unchanged
+                innovation_ = Y(current_index_) - kalman_mean_;
+                current_index_++;
+                nsteady_updates_++;
+                return;
+            }
+            // the time step or measurement error changed, so go back to the full update
+            steady_state_ = false;
+        }
+        double previous_var = kalman_var_;
+        double dt = Dt(current_index_-1);
+        // compute the Kalman gain, update the state vector, and predict the next state
+        double gain_change = 0.0, gain_norm = 0.0;
+        for (int i=0; i<P; i++) {
+            std::complex<double> gain = 0.0;
+            for (int j=0; j<P; j++) {
+                gain += prediction_var_fixed_[i][j] * std::conj(rotated_ma_fixed_[j]);
+            }
+            gain /= previous_var;
+            gain_change = std::max(gain_change, std::abs(gain - gain_fixed_[i]));
+            gain_norm = std::max(gain_norm, std::abs(gain));
+            gain_fixed_[i] = gain;
+            rho_fixed_[i] = std::exp(omega_fixed_[i] * dt);
+            state_fixed_[i] = rho_fixed_[i] * (state_fixed_[i] + gain_fixed_[i] * innovation_);
+        }
+        // update the state one-step prediction error variance and propagate it to the next time
+        for (int i=0; i<P; i++) {
+            for (int j=i; j<P; j++) {
+                std::complex<double> filtered_var = prediction_var_fixed_[i][j] -
+                    previous_var * gain_fixed_[i] * std::conj(gain_fixed_[j]);
+                prediction_var_fixed_[i][j] = rho_fixed_[i] * std::conj(rho_fixed_[j]) *
+                    (filtered_var - state_var_fixed_[i][j]) + state_var_fixed_[i][j];
+                prediction_var_fixed_[j][i] = std::conj(prediction_var_fixed_[i][j]);
+            }
+        }
+        // Now predict the observation and its variance
+        std::complex<double> ypredict = 0.0;
+        for (int i=0; i<P; i++) {
+            ypredict += rotated_ma_fixed_[i] * state_fixed_[i];
+        }
+        kalman_mean_ = std::real(ypredict);
+        kalman_var_ = PredictionVariance() + YerrSqr(current_index_);
+        steady_state_ = SteadyStateConverged(previous_var, gain_change, gain_norm);
+        
+        // Finally, update the innovation
+        innovation_ = Y(current_index_) - kalman_mean_;
+        current_index_++;
+    }
+    
+private:
+    // return the variance in the predicted time series value, excluding the measurement errors
+    double PredictionVariance() {
+        double yvar = 0.0;
+        for (int i=0; i<P; i++) {
+            yvar += std::norm(rotated_ma_fixed_[i]) * std::real(prediction_var_fixed_[i][i]);
+            for (int j=i+1; j<P; j++) {
+                yvar += 2.0 * std::real(rotated_ma_fixed_[i] * prediction_var_fixed_[i][j] *
+                                        std::conj(rotated_ma_fixed_[j]));
+            }
+        }
+        return yvar;
+    }
+    
+    std::complex<double> omega_fixed_[P];
+    std::complex<double> rotated_ma_fixed_[P];
+    std::complex<double> state_fixed_[P];
+    std::complex<double> gain_fixed_[P];
+    std::complex<double> rho_fixed_[P];
+    std::complex<double> state_var_fixed_[P][P];
+    std::complex<double> prediction_var_fixed_[P][P];
+};
+
+/*
+ Same as KalmanFilterp, but the Kalman Filter recursion is done in real arithmetic. The AR roots of a CARMA(p,q) process
+ are either real or come in complex conjugate pairs, so the rotated state vector can be replaced by a real state vector
+ containing the real and imaginary parts of one member of each conjugate pair. In this representation the state
+ transition matrix is block diagonal, with a 2x2 rotation block for each conjugate pair and a scalar for each real
+ root. Interpolation, backcasting, and simulation use the methods of KalmanFilterp.
+ */
+
+class KalmanFilterpReal : public KalmanFilterp {
+public:
+    // Constructors
+    KalmanFilterpReal() : KalmanFilterp() {}
+    KalmanFilterpReal(arma::vec& time, arma::vec& y, arma::vec& yerr) : KalmanFilterp(time, y, yerr) {}
+    KalmanFilterpReal(std::shared_ptr<const TimeSeriesData> data) : KalmanFilterp(data) {}
+    KalmanFilterpReal(arma::vec& time, arma::vec& y, arma::vec& yerr, double sigsqr, arma::cx_vec& omega,
+                      arma::vec& ma_coefs) : KalmanFilterp(time, y, yerr, sigsqr, omega, ma_coefs) {}
+    
+    // Methods to perform the Kalman Filter operations
+    void ResetState();
+    void UpdateState();
+    
+private:
+    // find the conjugate pairs of AR roots and construct the real state space representation
+    void RealStateSpace();
+    // multiply the real state vector by the state transition matrix
+    void PropagateState();
+    
+    unsigned int nblocks_; // number of diagonal blocks in the state transition matrix
+    std::vector<unsigned int> block_start_; // index of the first element of each block in the state vector
+    std::vector<unsigned int> block_size_; // 1 for real roots, 2 for complex conjugate pairs
+    std::vector<double> block_decay_; // real part of the AR root for each block
+    std::vector<double> block_freq_; // imaginary part of the AR root for each block
+    std::vector<double> real_state_; // current value of the real state vector
+    std::vector<double> real_gain_; // kalman gain
+    std::vector<double> real_obs_; // measurement coefficients for the real state vector
+    std::vector<double> real_state_var_; // stationary covariance matrix of the real state vector, row-major
+    std::vector<double> real_prediction_var_; // covariance matrix of the predicted real state vector, row-major
+    std::vector<double> transition_; // 2x2 state transition matrix for each block, row-major
 };
 
+/*
+ Kalman Filter for a batch of CARMA(p,q) models of the same order, evaluated for the same time series. The filters
+ for all of the models are run in lockstep, so each data point is read once for the whole batch. The rotated state
+ vectors and covariance matrices are stored as a structure of arrays, with the real and imaginary parts held
+ separately and the model index varying fastest. The innermost loops therefore run over the models with unit stride
+ and no branches, and are vectorized by the compiler. Where supported, the kernel is also compiled for AVX2 and
+ AVX-512 and the version for the CPU is chosen at run time (see kfilter.cpp). Only the upper triangle of the Hermitian
+ covariance matrices is stored and updated.
+ */
+
+class KalmanFilterBatch {
+public:
+    // Constructor
+    KalmanFilterBatch(std::shared_ptr<const TimeSeriesData> data) : data_(data) {}
+    
+    // Return the log-likelihood of the time series under each model, up to an additive constant. Column k of roots
+    // and obs_coefs and slice k of state_var contain the rotated state space representation of model k, as returned
+    // by KalmanFilter::StateSpace. ymean(k) and measerr_scale(k) are the mean of the time series and the scaling
+    // factor for the measurement error variances under model k.
+    arma::vec LogLikelihood(const arma::cx_mat& roots, const arma::cx_mat& obs_coefs, const arma::cx_cube& state_var,
+                            const arma::vec& ymean, const arma::vec& measerr_scale);
+    
+private:
+    std::shared_ptr<const TimeSeriesData> data_;
+};
+
+// Return a pointer to a Kalman Filter for a CARMA(p,q) process. A KalmanFilterP<p> object is used for p <= 10, and
+// a KalmanFilterp object is used otherwise.
+std::shared_ptr<KalmanFilterp> MakeKalmanFilterp(arma::vec& time, arma::vec& y, arma::vec& yerr, unsigned int p);
+std::shared_ptr<KalmanFilterp> MakeKalmanFilterp(std::shared_ptr<const TimeSeriesData> data, unsigned int p);
+
 
 #endif /* defined(__carma_pack__kfilter__) */
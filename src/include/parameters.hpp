@@ -12,17 +12,18 @@
 // Standard includes
 #include <iostream>
 #include <string>
+#include <stdexcept>
 // Boost includes
 #include <boost/ptr_container/ptr_vector.hpp>
 // Local includes
 #include "random.hpp"
 
 // Global random number generator object, instantiated in random.cpp
-extern boost::random::mt19937 rng;
+extern thread_local boost::random::mt19937 rng;
 
 // Global object for generating random variables from various distributions,
 // instantiated in steps.cpp
-extern RandomGenerator RandGen;
+extern thread_local RandomGenerator RandGen;
 
 // This is the base Parameter class. It is abstract, so it should
 // never be instantiated directly. Users should subclass the Parameter class,
@@ -113,6 +114,21 @@ public:
 		return 0.0;
     }
 
+    // Method to return the log of the probability density when we only need to know it if it is at least
+    // logdens_min, as in a Metropolis-Hastings step where the acceptance threshold is drawn first. Subclasses may
+    // stop computing the log-density early and return any upper bound on it that is less than logdens_min. By
+    // default the full log-density is computed.
+    virtual double BoundedLogDensity(ParValueType value, double logdens_min) {
+        return LogDensity(value);
+    }
+
+    // Method to return the log of the probability density (plus constant) and its gradient with respect to the
+    // parameter value, needed by gradient-based steps such as NUTS. Subclasses that support these steps must override
+    // this method.
+    virtual double LogDensityGradient(ParValueType value, ParValueType& grad) {
+        throw std::runtime_error("Parameter " + label_ + " does not provide the gradient of its log-density.");
+    }
+
 	// Return a random draw from the posterior.
 	// Random draw from posterior is called by GibbsStep.
 	virtual ParValueType RandomPosterior() {
@@ -132,6 +148,13 @@ public:
         log_posterior_ = LogDensity(new_value);
     }
 
+    // Save a new value of the parameter whose log-density has already been computed, for example by a step that
+    // evaluates several proposals at once.
+    void SetValue(ParValueType new_value, double logdens) {
+        value_ = new_value;
+        log_posterior_ = logdens;
+    }
+
     // Set the size of the vector containing the MCMC samples
     void SetSampleSize(int sample_size) {
         samples_.resize(sample_size);
@@ -146,14 +169,15 @@ public:
         logposts_[current_iter] = log_posterior_;
     }
     
-    // Add a value and its log-posterior to the MCMC samples
-    void AddToSample(int current_iter, ParValueType value, double logpost) {
+    // Add a value and its log-posterior to the MCMC samples. Subclasses that store their samples differently must
+    // override this along with SetSampleSize, AddToSample(current_iter), and GetSamples.
+    virtual void AddToSample(int current_iter, ParValueType value, double logpost) {
         samples_[current_iter] = value;
         logposts_[current_iter] = logpost;
     }
     
     // Return a copy of the MCMC samples
-    std::vector<ParValueType> GetSamples() {
+    virtual std::vector<ParValueType> GetSamples() {
         return samples_;
     }
 
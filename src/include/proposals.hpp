@@ -15,18 +15,36 @@
 #include "parameters.hpp"
 
 // Global random number generator object, instantiated in random.cpp
-extern boost::random::mt19937 rng;
+extern thread_local boost::random::mt19937 rng;
 
 // Object containing some common random number generators.
-extern RandomGenerator RandGen;
+extern thread_local RandomGenerator RandGen;
 
 // Abstract proposal class for Metropolis-Hastings sampler.
 template <typename ProposalType>
 class Proposal {
 public:
-    Proposal() {}
+    Proposal() : random_generator_(NULL) {}
 	virtual ProposalType Draw(ProposalType starting_value) = 0;
 	virtual double LogDensity(ProposalType new_value, ProposalType starting_value) = 0;
+    
+    // Set the random number generator used to draw the proposals. If none is set, the RandGen object of the thread
+    // that draws the proposal is used, so a proposal is never tied to the generator of the thread that constructed it.
+    void SetRandomGenerator(RandomGenerator& random_generator) {
+        random_generator_ = &random_generator;
+    }
+    
+    // Return the random number generator used to draw the proposals
+    RandomGenerator& GetRandomGenerator() {
+        return Generator();
+    }
+    
+protected:
+    RandomGenerator& Generator() {
+        return (random_generator_ == NULL) ? RandGen : *random_generator_;
+    }
+    
+    RandomGenerator* random_generator_; // Generates the random numbers needed for the proposals, or NULL for RandGen
 };
 
 //	Normal proposal for Metropolis-Hastings. Normal proposal draws from
@@ -167,7 +185,9 @@ protected:
  
  g(z) \propto 1 / sqrt(z), 1/a < z < a, a > 1.
  
- By default a = 2.
+ By default a = 2. The other walker X_j is drawn from the whole ensemble, or from the complementary half of the
+ ensemble set by SetComplement, as needed for the parallel version of the move where the two halves of the ensemble
+ are updated in turn.
  */
 
 // Currently Only valid for real vector types
@@ -178,12 +198,10 @@ public:
     StretchProposal(Ensemble<ParameterType>& ensemble, int walker_index, double scaling_support=2.0) :
     EnsembleProposal<arma::vec, ParameterType>(ensemble, walker_index), scaling_support_(scaling_support)
     {
-        // Set the bounds on the uniform distribution object
-        int lowbound = 0;
-        int upbound = this->ensemble_.size() - 1;
-        boost::random::uniform_int_distribution<>::param_type unif_params(lowbound, upbound);
-        uniform_.param(unif_params);
         other_parameter_index_ = -1;
+        complement_start_ = 0;
+        complement_size_ = 0;
+        scale_ = 1.0;
     }
     
     // Set the support of the scaling parameter
@@ -191,14 +209,25 @@ public:
         scaling_support_ = scaling_support; // scaling_support = a in notation above.
     }
     
+    // Only choose the other walker from the walkers complement_start, ..., complement_start + complement_size - 1.
+    // These must not include this walker.
+    void SetComplement(int complement_start, int complement_size) {
+        complement_start_ = complement_start;
+        complement_size_ = complement_size;
+    }
+    
     // Method to return the parameter value for a walker randomly chosen from the
     // complementary ensemble
     arma::vec GrabParameter()
     {
-        do {
-            // Randomly pick another walker from the complementary ensemble
-            other_parameter_index_ = uniform_(rng);
-        } while (other_parameter_index_ == this->parameter_index_);
+        if (complement_size_ > 0) {
+            other_parameter_index_ = complement_start_ + this->Generator().uniform(0, complement_size_ - 1);
+        } else {
+            do {
+                // Randomly pick another walker from the rest of the ensemble
+                other_parameter_index_ = this->Generator().uniform(0, this->ensemble_.size() - 1);
+            } while (other_parameter_index_ == this->parameter_index_);
+        }
         
         // Return the value of the parameter
         return this->ensemble_[other_parameter_index_].Value();
@@ -211,9 +240,10 @@ public:
         arma::vec other_walker = GrabParameter();
         
         // Now randomly draw the scale parameter
-        scale_ = RandGen.powerlaw(1.0 / scaling_support_, scaling_support_, -0.5);
+        scale_ = this->Generator().powerlaw(1.0 / scaling_support_, scaling_support_, -0.5);
         
         // Proposed value is along the line connecting the two parameters
+        start_value_ = walker;
         arma::vec new_value;
         new_value = other_walker + scale_ * (walker - other_walker);
         
@@ -223,40 +253,34 @@ public:
     // Method to return the log-density of the transition kernel
     // starting_value -> new_value. This actually returns the logarithm
 	// of the ratio of transition densities, since this is easier to compute
-	// than the individual values of the densities of the transition kernels,
-	// which would otherwise require the computation of an (nwalker - 1)-norm.
+	// than the individual values of the densities of the transition kernels.
+    // For the most recent draw, the ratio of the density of the proposed -> starting
+    // transition to that of the starting -> proposed transition is scale^(d-1), where
+    // d is the dimension of the parameter, so LogDensity(starting, proposed) returns
+    // (d-1) * log(scale) and LogDensity(proposed, starting) returns zero.
     double LogDensity(arma::vec new_value, arma::vec starting_value)
     {
-		double logdens = 0.0; // Default value of the log-density
-		
-		// Get the current value of the parameter.
-		arma::vec current_value = this->ensemble_[this->parameter_index_].Value();
-		
-		// Does the proposed parameter value = current parameter value?
-        arma::vec etol(new_value.n_elem);
-        etol.fill(1e-10);
-		arma::uvec equal_vector = (arma::abs(current_value - new_value) < etol);
-		
-		if (arma::sum(equal_vector) == equal_vector.size()) {
-			// We are calculating the density of the proposed -> current transition kernel,
-			// so make this equal to scale^(nwalker-1).
-			logdens = (new_value.size() - 1.0) * log(scale_);
-		}
-		// When proposed value != current value, then we are calculating the
-		// density of the current -> proposed transition kernel. Force this to
-		// be equal to zero so that the value of logdens computed above corresponds
-		// to the logarithm of the ratio of the transition kernels.
-        
-        return logdens;
+        if ((new_value.n_elem == start_value_.n_elem) && arma::all(new_value == start_value_)) {
+            return (new_value.n_elem - 1.0) * log(scale_);
+        }
+        return 0.0;
+    }
+    
+    // Return the most recent value of the scale parameter
+    double GetScale() {
+        return scale_;
     }
     
 private:
     double scaling_support_; // Support of the distribution of the scaling parameter (= a above)
 	double scale_; // The most recent value of the scale parameter
-	// Object to generate a random integer uniformly distributed over some range
-	boost::random::uniform_int_distribution<> uniform_;
 	// Current index for parameter in complementary ensemble used in the proposal
 	int other_parameter_index_;
+    // The other walker is drawn from the walkers complement_start_, ..., complement_start_ + complement_size_ - 1, or
+    // from the whole ensemble if complement_size_ = 0
+    int complement_start_;
+    int complement_size_;
+    arma::vec start_value_; // Value of the walker for the most recent draw
 };
 
 
@@ -23,6 +23,7 @@
 // Standard includes
 #include <string>
 #include <vector>
+#include <map>
 // Boost includes
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/exponential_distribution.hpp>
@@ -33,15 +34,23 @@
 #include <boost/random/chi_squared_distribution.hpp>
 #include <boost/random/gamma_distribution.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
+#include <boost/noncopyable.hpp>
 
 // Other includes
 #include <armadillo>
 
+// Global random number generator object, instantiated in random.cpp
+extern thread_local boost::random::mt19937 rng;
+
 // Class containing methods to generate random numbers from various
 // distributions. These should be self-explanatory, but see
-// random.cpp for more details.
+// random.cpp for more details. By default the global random number
+// generator is used, but a separate generator may be supplied so that
+// independent chains can draw their random numbers concurrently.
 class RandomGenerator {
 public:
+    RandomGenerator() : engine_(&rng) {}
+    RandomGenerator(boost::random::mt19937& engine) : engine_(&engine) {}
     void SetSeed(unsigned long seed) const; // Set the random number generator seed. Be Careful with this!
     void SaveSeed(std::string seed_filename = "seed.txt") const; // Save the random number generator seed to a file.
     void RecoverSeed(std::string seed_filename = "seed.txt") const;
@@ -63,6 +72,7 @@ public:
     double beta();
     double weibull();
 private:
+    boost::random::mt19937* engine_; // The underlying random number generator
     // Private functors for the various distributions.
     boost::random::exponential_distribution<> exp_;
     boost::random::normal_distribution<> normal_;
@@ -74,4 +84,27 @@ private:
     boost::random::gamma_distribution<> gamma_;
 };
 
+// Class containing a set of independent random number generators, or streams. Each stream is identified by an
+// integer, such as the index of a chain or walker, and is seeded from both the master seed and its identifier, so
+// the random numbers drawn from a stream do not depend on how many other streams there are or on the order in which
+// they are used. Each stream may only be used by one thread at a time. Streams should be created before the threads
+// that use them are started.
+class RandomStreams : boost::noncopyable {
+public:
+    RandomStreams(unsigned long seed) : seed_(seed) {}
+    // Return the random number generator for stream stream_id, creating it if it does not already exist.
+    RandomGenerator& Stream(unsigned int stream_id);
+    // Return the number of streams
+    unsigned int size() const { return engines_.size(); }
+    void SetSeed(unsigned long seed); // Reseed all of the streams from a new master seed.
+    void SaveSeed(std::string seed_filename = "seeds.txt") const; // Save the state of every stream to a file.
+    void RecoverSeed(std::string seed_filename = "seeds.txt"); // Recover the state of every stream from a file.
+private:
+    // Seed the underlying generator for stream stream_id using the master seed
+    void SeedStream(unsigned int stream_id);
+    unsigned long seed_; // The master seed
+    std::map<unsigned int, boost::random::mt19937> engines_; // The underlying generator for each stream
+    std::map<unsigned int, RandomGenerator> generators_;
+};
+
 #endif /* defined(__yamcmc____random__) */
@@ -19,11 +19,15 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <ctime>
 #include <fstream>
 #include <limits>
 #include <map>
 #include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 // Boost includes
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/ptr_container/ptr_map.hpp>
@@ -104,10 +108,14 @@ public:
    void AddStep(Step* step);
 	
     // Run sampler for a specific number of iterations.
-    void Iterate(int number_of_iterations, bool progress = false);
+    virtual void Iterate(int number_of_iterations, bool progress = false);
 	
 	// Run MCMC sampler.
    void Run(arma::vec init);
+    
+    // Set the starting values of the parameters, using init if it has the right length and otherwise drawing them
+    // with Parameter::StartingValue.
+    virtual void SetStartingValues(arma::vec init);
 	
     // Return number of steps in one sampler iteration.
     int NumberOfSteps() {
@@ -142,4 +150,119 @@ protected:
     std::set<std::string> tracked_names_;
 };
 
+// Parallel tempering sampler. The steps for each tempered chain are added using TemperedSampler::AddChainStep, and
+// the steps that exchange values between the chains are added using TemperedSampler::AddExchangeStep. During each
+// iteration the chain steps are performed concurrently on a pool of nthreads threads, and then the exchange steps are
+// performed one after another in the order they were added. The chain steps must only modify their own parameter and
+// draw their random numbers from their own random number generator, in which case the results do not depend on the
+// number of threads. The chain steps may also be split into stages, where all of the steps in one stage are finished
+// before any of the steps in the next stage are started. This is needed when the steps in one stage read the values
+// of the parameters updated in another stage, as in the EnsembleSampler.
+class TemperedSampler : public Sampler {
+public:
+    // Constructor. The extra threads are not started until the first call to TemperedSampler::Iterate.
+    TemperedSampler(int sample_size, int burnin, int thin=1, int nthreads=1) :
+    Sampler(sample_size, burnin, thin), current_stage_(0), nthreads_(std::max(nthreads, 1)), generation_(0), nbusy_(0),
+    shutdown_(false) {};
+    
+    // Destructor. Stops the worker threads.
+    ~TemperedSampler();
+    
+    // Method to add a step for one of the tempered chains. The stages are performed in increasing order.
+    void AddChainStep(Step* step, int stage=0);
+    
+    // Method to add a step that is performed after all of the chain steps, such as an ExchangeStep.
+    void AddExchangeStep(Step* step);
+    
+    // Run sampler for a specific number of iterations.
+    void Iterate(int number_of_iterations, bool progress = false);
+    
+protected:
+    // Perform the chain steps assigned to thread_id for one iteration
+    void DoChainSteps(int thread_id);
+    // Main loop for the worker threads
+    void WorkerLoop(int thread_id);
+    
+    std::vector<std::vector<int> > chain_steps_; // indices of the chain steps in steps_ for each stage
+    int current_stage_; // the stage of chain steps currently being performed
+    std::vector<int> exchange_steps_; // indices of the exchange steps in steps_
+    int nthreads_; // number of threads used to perform the chain steps, including the calling thread
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_cond_; // signals the workers to start an iteration
+    std::condition_variable done_cond_; // signals that the workers have finished an iteration
+    unsigned long generation_; // number of iterations the workers have been signaled to perform
+    int nbusy_; // number of workers still performing the current iteration
+    bool shutdown_;
+};
+
+// Affine-invariant ensemble sampler. The walkers are split into two halves, and the StretchStep objects for the first
+// half are added with TemperedSampler::AddChainStep(step, 0) and those for the second half with
+// TemperedSampler::AddChainStep(step, 1), so each half is updated concurrently while the other half is held fixed.
+// After each thinning interval the values of all of the walkers are added to the samples of the collector parameter,
+// so that it holds sample_size * nwalkers draws, with the walkers for one iteration stored next to each other.
+template <class ParameterType>
+class EnsembleSampler : public TemperedSampler {
+public:
+    // Constructor. If a starting value is supplied to Run, then the walkers start from a small cloud around it with a
+    // fractional scatter of init_scatter.
+    EnsembleSampler(Ensemble<ParameterType>& walkers, ParameterType& collector, int sample_size, int burnin,
+                    int thin=1, int nthreads=1, double init_scatter=1e-3) :
+    TemperedSampler(sample_size, burnin, thin, nthreads), walkers_(walkers), collector_(collector),
+    init_scatter_(init_scatter) {};
+    
+    // Set the starting values of the walkers and allocate the memory for the samples of the collector
+    void SetStartingValues(arma::vec init) {
+        int nwalkers = walkers_.size();
+        int npar = walkers_[0].Value().n_elem;
+        bool useInit = (init.n_elem == npar);
+        if (useInit) {
+            std::cout << " Scattered about user-provided values" << std::endl;
+            init = walkers_[0].SetStartingValue(init);
+        } else {
+            std::cout << " Drawn from priors" << std::endl;
+        }
+        
+        for (int k=0; k<nwalkers; k++) {
+            if (!useInit) {
+                arma::vec theta = walkers_[k].StartingValue();
+                walkers_[k].Save(theta);
+                continue;
+            }
+            // scatter the walkers about init, since they can not move off of the subspace spanned by their
+            // starting values
+            arma::vec scale = arma::abs(init);
+            scale.elem(arma::find(scale == 0.0)).ones();
+            arma::vec theta;
+            double logdens = -1.0 * arma::datum::inf;
+            for (int ntry=0; (ntry < 100) && !arma::is_finite(logdens); ntry++) {
+                theta = init + init_scatter_ * scale % arma::randn<arma::vec>(npar);
+                logdens = walkers_[k].LogDensity(theta);
+            }
+            if (!arma::is_finite(logdens)) {
+                theta = walkers_[k].StartingValue();
+            }
+            walkers_[k].Save(theta);
+        }
+        std::cout << " ...Initializing " << walkers_[0].Value() << std::endl;
+        
+        collector_.SetSampleSize(sample_size_ * nwalkers);
+    }
+    
+    // Add the current values of the walkers to the samples of the collector. The samples are stored iteration-major,
+    // in the same order as the trace file is streamed, so walker k is every nwalkers-th sample starting at k. The
+    // walkers are separate chains, so autocorrelation diagnostics must be computed for each walker separately.
+    void SaveValues() {
+        int nwalkers = walkers_.size();
+        for (int k=0; k<nwalkers; k++) {
+            collector_.AddToSample(current_iter_ * nwalkers + k, walkers_[k].Value(), walkers_[k].GetLogDensity());
+        }
+    }
+    
+protected:
+    Ensemble<ParameterType>& walkers_; // The ensemble of walkers
+    ParameterType& collector_; // Holds the samples for all of the walkers
+    double init_scatter_; // fractional scatter of the walkers about the user-provided starting value
+};
+
 #endif /* defined(__yamcmc____samplers__) */
@@ -20,11 +20,11 @@
 #include "proposals.hpp"
 
 // Global random number generator object, instantiated in random.cpp
-extern boost::random::mt19937 rng;
+extern thread_local boost::random::mt19937 rng;
 
 // Global object for generating random variables from various distributions,
 // instantiated in steps.cpp
-extern RandomGenerator RandGen;
+extern thread_local RandomGenerator RandGen;
 
 ////////// FUNCTION DEFINITIONS AND TEMPLATE FUNCTIONS /////////////
 
@@ -47,7 +47,16 @@ std::string to_string (const T& t) {
 // The Step class will never be instantiated directly.
 class Step {
 public:
+    Step() : random_generator_(NULL) {}
+    
 	virtual void DoStep() = 0;
+    
+    // Set the random number generator used by the step. If none is set, the RandGen object of the thread running the
+    // step is used, so a step built on one thread never shares that thread's generator with another. Steps that are
+    // run concurrently and must not depend on the number of threads should each be given their own stream.
+    void SetRandomGenerator(RandomGenerator& random_generator) {
+        random_generator_ = &random_generator;
+    }
 	
 	// Should return the label of the parameter associated with the step instance.
 	virtual std::string ParameterLabel() {
@@ -65,6 +74,13 @@ public:
     
     // Return a pointer to the parameter
     virtual BaseParameter* GetParPointer() = 0;
+    
+protected:
+    RandomGenerator& Generator() {
+        return (random_generator_ == NULL) ? RandGen : *random_generator_;
+    }
+    
+    RandomGenerator* random_generator_; // Generates the random numbers needed by the step, or NULL for RandGen
 };
 
 
@@ -125,6 +141,7 @@ public:
 	{
 		naccept_ = 0;
 		niter_ = 0;
+        bounded_ = false;
 	}
 	
 	std::string ParameterLabel() {
@@ -135,10 +152,30 @@ public:
 		return parameter_.StringValue();
 	}
 	
+    // Method to turn on or off the bounded likelihood mode. In this mode the uniform random variable is drawn
+    // before the log-posterior of the proposal is computed, and Parameter::BoundedLogDensity is used so that the
+    // calculation can stop early once the proposal is known to be rejected.
+    void SetBoundedLikelihood(bool bounded) {
+        bounded_ = bounded;
+    }
+    
     // Method to perform the accept/reject part of the Metropolis-Hastings step. Returns a boolean indicating whether
     // the proposal was acceptec (True) or rejected (False).
 	bool Accept(ParValueType new_value, ParValueType old_value) {
         double par_temp = parameter_.GetTemperature();
+        if (bounded_) {
+            // Accept if log(unif) < alpha, so the proposal is rejected if its log-posterior is below logdens_min
+            double unif = Generator().uniform();
+            double log_qratio = proposal_.LogDensity(old_value, new_value) - proposal_.LogDensity(new_value, old_value);
+            double logdens_min = par_temp * (log(unif) - log_qratio) + parameter_.GetLogDensity();
+            double logdens_new = parameter_.BoundedLogDensity(new_value, logdens_min);
+            alpha_ = logdens_new / par_temp - parameter_.GetLogDensity() / par_temp + log_qratio;
+            if (!arma::is_finite(alpha_)) {
+                return false;
+            }
+            alpha_ = std::min(exp(alpha_), 1.0);
+            return (logdens_new >= logdens_min);
+        }
 		// MH accept/reject criteria
 		alpha_ = parameter_.LogDensity(new_value) / par_temp - parameter_.GetLogDensity() / par_temp
 		+ proposal_.LogDensity(old_value, new_value) - proposal_.LogDensity(new_value, old_value);
@@ -149,7 +186,7 @@ public:
 			return false;
 		}
 		
-		double unif = uniform_(rng);
+		double unif = Generator().uniform();
 		alpha_ = std::min(exp(alpha_), 1.0);
 		if (unif < alpha_) {
 			return true;
@@ -203,11 +240,11 @@ private:
 	// References to parameter and proposal associated with step instance.
 	Parameter<ParValueType>& parameter_;
 	Proposal<ParValueType>& proposal_;
-	boost::random::uniform_real_distribution<> uniform_;
 	double alpha_; // Acceptance probability
 	int naccept_; // The number of accepted steps
 	int niter_; // The number of iterations performed
 	int report_iter_; // The number of iterations until we print out the average acceptance rate
+    bool bounded_; // Stop computing the log-posterior once we know the proposal will be rejected?
 };
 
 // Robust Adaptive Multivariate proposal for Metropolis-Hastings (RAM).
@@ -240,6 +277,14 @@ public:
 		gamma_ = gamma;
 	}
 	
+    // Method to turn on or off the bounded likelihood mode, where the uniform random variable is drawn first and
+    // Parameter::BoundedLogDensity is used so that the log-posterior calculation can stop early for rejected
+    // proposals. The acceptance probability is needed to update the proposal scale matrix, so the bounded mode is
+    // only used once the adaptive stage is over.
+    void SetBoundedLikelihood(bool bounded) {
+        bounded_ = bounded;
+    }
+    
 	// Method to determine whether a proposal is accepted
 	bool Accept(arma::vec new_value, arma::vec old_value);
 	
@@ -277,7 +322,6 @@ private:
 	/// References to parameter and proposal associated with step instance.
 	Parameter<arma::vec>& parameter_;
 	Proposal<double>& proposal_;
-	boost::random::uniform_real_distribution<> uniform_;
 	arma::mat chol_factor_; // Cholesky factor of proposal scale matrix
 	double gamma_; // Rate of decay for step size update
 	double target_rate_; // Target acceptance rate
@@ -285,6 +329,131 @@ private:
 	int naccept_; // Number of MHA proposals accepted
 	int maxiter_; // Maximum number of iterations to update proposal scale matrix
 	double alpha_; // Acceptance probability
+    bool bounded_; // Stop computing the log-posterior once we know the proposal will be rejected?
+};
+
+// No-U-Turn Sampler (NUTS), a Hamiltonian Monte Carlo step that chooses the number of leapfrog steps by building a
+// trajectory until it starts to turn back on itself. The parameter must provide Parameter::LogDensityGradient. During
+// the first maxiter iterations the leapfrog step size is tuned by dual averaging to give the target value of the
+// average acceptance probability, and the metric is tuned by estimating the covariance matrix of the parameter in a
+// series of doubling windows, so that strongly correlated parameters are sampled efficiently.
+//
+// References: The No-U-Turn Sampler: Adaptively Setting Path Lengths in Hamiltonian Monte Carlo,
+//             M. D. Hoffman & A. Gelman, 2014, Journal of Machine Learning Research, 15, 1593-1623
+//             Stan Reference Manual, Section on HMC algorithm parameters (adaptation windows)
+
+class NUTS : public Step
+{
+public:
+    // Constructor. The covariance matrix is the initial guess for the posterior covariance matrix, used as the
+    // inverse of the metric until it is adapted.
+    NUTS(Parameter<arma::vec>& parameter, arma::mat covar, int maxiter, double target_rate=0.8, int max_depth=10);
+    
+	std::string ParameterLabel() {
+		return parameter_.Label();
+	}
+	
+	std::string ParameterValue() {
+		return parameter_.StringValue();
+	}
+    
+    // Method to set the target average acceptance probability
+    void SetTargetRate(double target_rate) {
+        target_rate_ = target_rate;
+    }
+    
+    // Method to set the maximum depth of the trajectory tree, i.e., at most 2^max_depth leapfrog steps are taken
+    void SetMaxDepth(int max_depth) {
+        max_depth_ = max_depth;
+    }
+    
+    // Method to perform the NUTS step
+    void DoStep();
+    
+    // Return the leapfrog step size
+    double GetStepSize() {
+        return step_size_;
+    }
+    
+    // Return the average acceptance probability thus far
+    double GetAcceptRate() {
+        return accept_sum_ / niter_;
+    }
+    
+    // Return the average number of leapfrog steps per iteration thus far
+    double GetAverageLeapfrogs() {
+        return ((double)(nleapfrog_)) / niter_;
+    }
+    
+    // Return the covariance matrix used as the inverse of the metric
+    arma::mat GetCovariance() {
+        return metric_chol_ * metric_chol_.t();
+    }
+    
+    // Return if parameter is tracked.
+    bool ParameterTrack() {
+        return parameter_.Track();
+    }
+    
+    // Return a pointer to the parameter
+    BaseParameter* GetParPointer() {
+        return &parameter_;
+    }
+    
+private:
+    // A point in phase space. The momentum is in the coordinates where the metric is the identity matrix.
+    struct PhasePoint {
+        arma::vec theta;
+        arma::vec momentum;
+        arma::vec grad; // gradient of the log-density with respect to the whitened coordinates
+        double logdens;
+    };
+    // Summary of a subtree of the trajectory
+    struct Subtree {
+        PhasePoint minus; // leftmost point
+        PhasePoint plus; // rightmost point
+        PhasePoint proposal; // point drawn uniformly from the points in the slice
+        int nvalid; // number of points in the slice
+        bool keep_going; // false if the subtree made a U-turn or diverged
+        double accept_sum; // sum of the acceptance probabilities of the points
+        int nsteps; // number of leapfrog steps
+    };
+    
+    // Compute the tempered log-density and its gradient with respect to the whitened coordinates
+    void Evaluate(PhasePoint& point);
+    // Take one leapfrog step of size step_size
+    void Leapfrog(PhasePoint& point, double step_size);
+    // Build a subtree of depth depth in the direction direction, starting from the point
+    void BuildTree(PhasePoint& point, double log_slice, int direction, int depth, double step_size,
+                   double joint0, Subtree& tree);
+    // Has the trajectory between minus and plus started to turn back on itself?
+    bool IsUTurn(PhasePoint& minus, PhasePoint& plus);
+    // Find a step size for which the acceptance probability of one leapfrog step is about 1/2
+    double FindStepSize(arma::vec theta);
+    // Restart the dual averaging of the step size from the current step size
+    void RestartStepSize();
+    
+	Parameter<arma::vec>& parameter_; // Reference to the parameter associated with the step
+    arma::mat metric_chol_; // Lower triangular Cholesky factor of the inverse metric
+    double step_size_; // Current leapfrog step size
+    double target_rate_; // Target average acceptance probability
+    int max_depth_; // Maximum depth of the trajectory tree
+    int maxiter_; // Number of iterations to adapt the step size and metric for
+    int niter_; // Number of iterations performed
+    double accept_sum_; // Sum of the average acceptance probabilities over the iterations
+    long nleapfrog_; // Total number of leapfrog steps taken
+    // Dual averaging of the log of the step size
+    double log_step_center_; // The log step size is shrunk towards this value
+    double log_step_bar_; // Averaged log step size, used once the adaptation is finished
+    double hbar_; // Averaged difference between the target rate and the acceptance probabilities
+    int nadapt_; // Number of iterations since the dual averaging was restarted
+    // Estimation of the covariance matrix for the metric
+    int window_start_; // First iteration of the current covariance window
+    int window_end_; // Last iteration of the current covariance window
+    int window_stop_; // The covariance windows end before this iteration, leaving a final buffer to tune the step size
+    int nwindow_; // Number of samples in the current covariance window
+    arma::vec window_mean_;
+    arma::mat window_scatter_;
 };
 
 // Class performing the exchange step used in Parallel Tempering
@@ -331,7 +500,7 @@ public:
         1.0 / other_temperature * (this_logpost - other_logpost);
         
         // Perform metropolis-hastings update
-		double unif = uniform_(rng);
+		double unif = Generator().uniform();
 		alpha = std::min(exp(alpha), 1.0);
         if (!arma::is_finite(alpha)) {
             alpha = 0.0;
@@ -389,10 +558,119 @@ private:
     int parameter_index_; // The index of parameter_ in the ensemble
     Ensemble<ParameterType>& ensemble_; // The parameter ensemble
     int report_iter_; // Report on acceptance rates after this many iterations
-    boost::random::uniform_real_distribution<> uniform_;
     int niter_; // The number of iterations performed since last report
     int naccept_; // The number of accepted exchanges since last report
     double alpha_; // Metropolis-hastings ratio
 };
 
+/*
+ Affine-invariant stretch move for a block of walkers in one half of an ensemble. The walkers are split into two
+ halves, and the walkers in one half are moved using StretchProposal objects whose complementary ensemble is the other
+ half, so that all of the walkers in one half can be updated at the same time. The proposals for all of the walkers in
+ the block are evaluated with a single call to ParameterType::LogDensityBatch, which returns the log-posterior for
+ each column of its input matrix, and each proposal is accepted with probability
+ 
+    min(1, z^(d-1) p(Y) / p(X)),
+ 
+ where z is the scale drawn by the StretchProposal and d is the dimension of the parameter. Each walker draws all of its
+ random numbers from the random number generator of its proposal, so the results do not depend on how the walkers are
+ divided into blocks.
+ 
+ References: Ensemble Samplers with Affine Invariance, J. Goodman & J. Weare, 2010, Comm. App. Math. Comp. Sci., 5, 65
+             emcee: The MCMC Hammer, D. Foreman-Mackey et al., 2013, PASP, 125, 306
+ */
+
+template <class ParameterType>
+class StretchStep : public Step
+{
+public:
+    // Constructor. The step updates the walkers first_walker, ..., last_walker - 1. Their proposals must have their
+    // complementary ensemble set to the other half of the walkers using StretchProposal::SetComplement.
+    StretchStep(Ensemble<ParameterType>& ensemble, Ensemble<StretchProposal<ParameterType> >& proposals,
+                int first_walker, int last_walker, int report_iter=-1) :
+    ensemble_(ensemble), proposals_(proposals), first_walker_(first_walker), last_walker_(last_walker),
+    report_iter_(report_iter)
+    {
+        BOOST_ASSERT(last_walker_ > first_walker_);
+        naccept_ = 0;
+        niter_ = 0;
+    }
+    
+	// Return string of parameter label
+	std::string ParameterLabel() {
+		return ensemble_[first_walker_].Label();
+	}
+	
+	// Return string representation of parameter value
+	std::string ParameterValue() {
+		return ensemble_[first_walker_].StringValue();
+	}
+	
+    // Do the stretch move for each walker in the block
+    void DoStep() {
+        int nblock = last_walker_ - first_walker_;
+        int ndim = ensemble_[first_walker_].Value().n_elem;
+        
+        // Draw the proposals and compute their log-posteriors in one pass over the data
+        arma::mat new_values(ndim, nblock);
+        for (int j=0; j<nblock; j++) {
+            int k = first_walker_ + j;
+            new_values.col(j) = proposals_[k].Draw(ensemble_[k].Value());
+        }
+        arma::vec logdens_new = ensemble_[first_walker_].LogDensityBatch(new_values);
+        
+        for (int j=0; j<nblock; j++) {
+            int k = first_walker_ + j;
+            ParameterType& walker = ensemble_[k];
+            arma::vec old_value = walker.Value();
+            arma::vec new_value = new_values.col(j);
+            double par_temp = walker.GetTemperature();
+            
+            // MH accept/reject criteria, including the z^(d-1) factor from the proposal
+            double alpha = logdens_new(j) / par_temp - walker.GetLogDensity() / par_temp
+            + proposals_[k].LogDensity(old_value, new_value) - proposals_[k].LogDensity(new_value, old_value);
+            
+            // always draw the uniform so that each walker uses the same number of random numbers per iteration
+            double unif = proposals_[k].GetRandomGenerator().uniform();
+            if (arma::is_finite(alpha) && (log(unif) < alpha)) {
+                walker.SetValue(new_value, logdens_new(j));
+                naccept_++;
+            }
+            niter_++;
+        }
+        
+        if (niter_ == report_iter_ * nblock) {
+			// Give report on average acceptance rate
+			Report();
+		}
+    }
+    
+	// Report on acceptance rates since last report
+	void Report() {
+		double arate = ((double)(naccept_)) / ((double)(niter_));
+		std::cout << "Average Stretch Move Acceptance Rate Since Last Report: " << arate << std::endl;
+		niter_ = 0;
+		naccept_ = 0;
+	}
+    
+    // The walkers are saved by the EnsembleSampler, not individually
+    bool ParameterTrack() {
+        return false;
+    }
+    
+    // Return a pointer to the first walker in the block
+    BaseParameter* GetParPointer() {
+        return &ensemble_[first_walker_];
+    }
+    
+private:
+    Ensemble<ParameterType>& ensemble_; // The walkers
+    Ensemble<StretchProposal<ParameterType> >& proposals_; // The proposal for each walker
+    int first_walker_; // The first walker updated by this step
+    int last_walker_; // One past the last walker updated by this step
+    int report_iter_; // Report on acceptance rates after this many iterations
+    int niter_; // The number of walker updates performed since last report
+    int naccept_; // The number of accepted walker updates since last report
+};
+
 #endif /* defined(__yamcmc____steps__) */
@@ -6,65 +6,180 @@
 //  Copyright (c) 2013 Brandon Kelly. All rights reserved.
 //
 
+#include <stdexcept>
 #include <random.hpp>
 #include "include/kfilter.hpp"
 
 // Global random number generator object, instantiated in random.cpp
-extern boost::random::mt19937 rng;
+extern thread_local boost::random::mt19937 rng;
 
 // Object containing some common random number generators.
-extern RandomGenerator RandGen;
+extern thread_local RandomGenerator RandGen;
+
+/********************************************************************
+                    METHODS OF TIMESERIESDATA CLASS
+ *******************************************************************/
+
+TimeSeriesData::TimeSeriesData(arma::vec time, arma::vec y, arma::vec yerr) : time_(time), y_(y), yerr_(yerr)
+{
+    init();
+}
+
+TimeSeriesData::TimeSeriesData(std::vector<double> time, std::vector<double> y, std::vector<double> yerr)
+{
+    time_ = arma::conv_to<arma::vec>::from(time);
+    y_ = arma::conv_to<arma::vec>::from(y);
+    yerr_ = arma::conv_to<arma::vec>::from(yerr);
+    init();
+}
+
+void TimeSeriesData::init()
+{
+    if ((y_.n_elem != time_.n_elem) || (yerr_.n_elem != time_.n_elem)) {
+        throw std::invalid_argument("Time, time series, and measurement error vectors must have the same length.");
+    }
+    if (time_.n_elem < 2) {
+        throw std::invalid_argument("Time series must contain at least two data points.");
+    }
+    if (!time_.is_finite() || !y_.is_finite() || !yerr_.is_finite()) {
+        throw std::invalid_argument("Time series data must be finite.");
+    }
+    if (yerr_.min() < 0.0) {
+        throw std::invalid_argument("Measurement errors must be non-negative.");
+    }
+    
+    int ndata = time_.n_elem;
+    dt_ = time_.rows(1,ndata-1) - time_.rows(0,ndata-2);
+    
+    // Make sure the time vector is strictly increasing
+    if (dt_.min() < 0) {
+        std::cout << "Time vector is not sorted in increasing order. Sorting the data vectors..." << std::endl;
+        // Sort the time values such that dt > 0
+        arma::uvec sorted_indices = arma::sort_index(time_);
+        time_ = time_.elem(sorted_indices);
+        y_ = y_.elem(sorted_indices);
+        yerr_ = yerr_.elem(sorted_indices);
+        dt_ = time_.rows(1,ndata-1) - time_.rows(0,ndata-2);
+    }
+    // Make sure there are no duplicate values of time
+    if (dt_.min() == 0) {
+        std::cout << "Found duplicate values of time, removing them..." << std::endl;
+        // Find the unique values of time
+        arma::uvec unique_values = 1 + arma::find(dt_ != 0);
+        // Add extra row in to keep time(0), y(0), yerr(0)
+        unique_values.insert_rows(0, arma::zeros<arma::uvec>(1));
+        time_ = time_.elem(unique_values);
+        y_ = y_.elem(unique_values);
+        yerr_ = yerr_.elem(unique_values);
+        ndata = time_.n_elem;
+        dt_ = time_.rows(1,ndata-1) - time_.rows(0,ndata-2);
+    }
+    
+    yerr_sqr_ = yerr_ % yerr_;
+}
+
+/********************************************************************
+                    METHODS OF KALMANFILTER CLASSES
+ *******************************************************************/
 
 // Reset the Kalman Filter for a CAR(1) process
-void KalmanFilter1::Reset() {
+void KalmanFilter1::ResetState() {
     
-    mean(0) = 0.0;
-    var(0) = sigsqr_ / (2.0 * omega_) + yerr_(0) * yerr_(0);
+    kalman_mean_ = 0.0;
+    kalman_var_ = sigsqr_ / (2.0 * omega_) + YerrSqr(0);
     yconst_ = 0.0;
     yslope_ = 0.0;
     current_index_ = 1;
 }
 
 // Perform one iteration of the Kalman Filter for a CAR(1) process to update it
-void KalmanFilter1::Update() {
+void KalmanFilter1::UpdateState() {
     
     double rho, var_ratio, previous_var;
-    rho = exp(-1.0 * omega_ * dt_(current_index_-1));
-    previous_var = var(current_index_-1) - yerr_(current_index_-1) * yerr_(current_index_-1);
-    var_ratio = previous_var / var(current_index_-1);
+    rho = exp(-1.0 * omega_ * Dt(current_index_-1));
+    previous_var = kalman_var_ - YerrSqr(current_index_-1);
+    var_ratio = previous_var / kalman_var_;
 		
     // Update the Kalman filter mean
-    mean(current_index_) = rho * mean(current_index_-1) +
-        rho * var_ratio * (y_(current_index_-1) - mean(current_index_-1));
+    kalman_mean_ = rho * kalman_mean_ + rho * var_ratio * (Y(current_index_-1) - kalman_mean_);
 		
     // Update the Kalman filter variance
-    var(current_index_) = sigsqr_ / (2.0 * omega_) * (1.0 - rho * rho) +
+    kalman_var_ = sigsqr_ / (2.0 * omega_) * (1.0 - rho * rho) +
         rho * rho * previous_var * (1.0 - var_ratio);
     
     // add in contribution to variance from measurement errors
-    var(current_index_) += yerr_(current_index_) * yerr_(current_index_);
+    kalman_var_ += YerrSqr(current_index_);
     
     current_index_++;
 }
 
+// Run the Kalman Filter for a CAR(1) process, and compute the gradient of the log-likelihood
+double KalmanFilter1::LogLikelihoodGradient(KalmanDerivatives& derivs, arma::vec& grad)
+{
+    unsigned int ndata = data_->size();
+    unsigned int nparams = derivs.sigsqr.n_elem;
+    arma::rowvec domega = arma::real(derivs.omega.row(0));
+    
+    // stationary variance of the CAR(1) process and its derivatives
+    double stationary_var = sigsqr_ / (2.0 * omega_);
+    arma::rowvec dstationary_var = derivs.sigsqr / (2.0 * omega_) - stationary_var * domega / omega_;
+    
+    grad.zeros(nparams);
+    kalman_mean_ = 0.0;
+    kalman_var_ = stationary_var + YerrSqr(0);
+    arma::rowvec dmean = arma::zeros<arma::rowvec>(nparams);
+    arma::rowvec dvar = dstationary_var + derivs.measerr_scale * data_->yerr_sqr()(0);
+    double loglik = LogLikelihoodTerm(0);
+    LogLikelihoodTermGradient(0, dmean, dvar, derivs.ymean, grad);
+    
+    for (int i=1; i<ndata; i++) {
+        double dt = Dt(i-1);
+        double rho = exp(-1.0 * omega_ * dt);
+        arma::rowvec drho = -dt * rho * domega;
+        double previous_var = kalman_var_ - YerrSqr(i-1);
+        arma::rowvec dprevious_var = dvar - derivs.measerr_scale * data_->yerr_sqr()(i-1);
+        double var_ratio = previous_var / kalman_var_;
+        arma::rowvec dvar_ratio = (dprevious_var - var_ratio * dvar) / kalman_var_;
+        double innovation = Y(i-1) - kalman_mean_;
+        arma::rowvec dinnovation = -derivs.ymean - dmean;
+        
+        // Update the Kalman filter mean and variance, and their derivatives
+        double filtered_mean = kalman_mean_ + var_ratio * innovation;
+        kalman_mean_ = rho * filtered_mean;
+        dmean = drho * filtered_mean + rho * (dmean + dvar_ratio * innovation + var_ratio * dinnovation);
+        
+        kalman_var_ = stationary_var * (1.0 - rho * rho) + rho * rho * previous_var * (1.0 - var_ratio) + YerrSqr(i);
+        dvar = dstationary_var * (1.0 - rho * rho) - 2.0 * stationary_var * rho * drho +
+            2.0 * rho * previous_var * (1.0 - var_ratio) * drho +
+            rho * rho * (dprevious_var * (1.0 - var_ratio) - previous_var * dvar_ratio) +
+            derivs.measerr_scale * data_->yerr_sqr()(i);
+        
+        loglik += LogLikelihoodTerm(i);
+        LogLikelihoodTermGradient(i, dmean, dvar, derivs.ymean, grad);
+    }
+    current_index_ = ndata;
+    
+    return loglik;
+}
+
 // Initialize the coefficients used for interpolation and backcasting assuming a CAR(1) process
 void KalmanFilter1::InitializeCoefs(double time, unsigned int itime, double ymean, double yvar) {
     yconst_ = 0.0;
-    yslope_ = exp(-std::abs(time_(itime) - time) * omega_);
-    var[itime] = sigsqr_ / (2.0 * omega_) * (1.0 - yslope_ * yslope_) + yerr_(itime) * yerr_(itime);
+    yslope_ = exp(-std::abs(Time(itime) - time) * omega_);
+    var[itime] = sigsqr_ / (2.0 * omega_) * (1.0 - yslope_ * yslope_) + YerrSqr(itime);
     current_index_ = itime + 1;
 }
 
 // Update the coefficients used for interpolation and backcasting, assuming a CAR(1) process
 void KalmanFilter1::UpdateCoefs() {
-    double rho = exp(-1.0 * dt_(current_index_-1) * omega_);
-    double previous_var = var(current_index_-1) - yerr_(current_index_-1) * yerr_(current_index_-1);
+    double rho = exp(-1.0 * Dt(current_index_-1) * omega_);
+    double previous_var = var(current_index_-1) - YerrSqr(current_index_-1);
     double var_ratio = previous_var / var(current_index_-1);
     
     yslope_ *= rho * (1.0 - var_ratio);
-    yconst_ = yconst_ * rho * (1.0 - var_ratio) + rho * var_ratio * y_[current_index_-1];
+    yconst_ = yconst_ * rho * (1.0 - var_ratio) + rho * var_ratio * Y(current_index_-1);
     var(current_index_) = sigsqr_ / (2.0 * omega_) * (1.0 - rho * rho) +
-        rho * rho * previous_var * (1.0 - var_ratio) + yerr_(current_index_) * yerr_(current_index_);
+        rho * rho * previous_var * (1.0 - var_ratio) + YerrSqr(current_index_);
     current_index_++;
 }
 
@@ -74,16 +189,16 @@ std::pair<double, double> KalmanFilter1::Predict(double time) {
     double ypredict_mean, ypredict_var, yprecision;
     
     unsigned int ipredict = 0;
-    while (time > time_(ipredict)) {
+    while (time > Time(ipredict)) {
         // find the index where time_ > time for the first time
         ipredict++;
-        if (ipredict == time_.n_elem) {
+        if (ipredict == data_->size()) {
             // time is greater than last element of time_, so do forecasting
             break;
         }
     }
         
-    // Run the Kalman filter up to the point time_[ipredict-1]
+    // Run the Kalman filter up to the point Time(ipredict-1)
     Reset();
     for (int i=1; i<ipredict; i++) {
         Update();
@@ -95,16 +210,16 @@ std::pair<double, double> KalmanFilter1::Predict(double time) {
         ypredict_var = sigsqr_ / (2.0 * omega_);
     } else {
         // predict the value of the time series at time, given the earlier values
-        double dt = time - time_[ipredict-1];
+        double dt = time - Time(ipredict-1);
         rho = exp(-dt * omega_);
-        previous_var = var(ipredict-1) - yerr_(ipredict-1) * yerr_(ipredict-1);
+        previous_var = var(ipredict-1) - YerrSqr(ipredict-1);
         var_ratio = previous_var / var(ipredict-1);
         // initialize the conditional mean and variance
-        ypredict_mean = rho * mean(ipredict-1) + rho * var_ratio * (y_(ipredict-1) - mean(ipredict-1));
+        ypredict_mean = rho * mean(ipredict-1) + rho * var_ratio * (Y(ipredict-1) - mean(ipredict-1));
         ypredict_var = sigsqr_ / (2.0 * omega_) * (1.0 - rho * rho) + rho * rho * previous_var * (1.0 - var_ratio);
     }
     
-    if (ipredict == time_.n_elem) {
+    if (ipredict == data_->size()) {
         // Forecasting, so we're done: no need to run interpolation steps
         std::pair<double, double> ypredict(ypredict_mean, ypredict_var);
         return ypredict;
@@ -119,12 +234,12 @@ std::pair<double, double> KalmanFilter1::Predict(double time) {
     
     InitializeCoefs(time, ipredict, 0.0, 0.0);
     yprecision += yslope_ * yslope_ / var(ipredict);
-    ypredict_mean += yslope_ * (y_(ipredict) - yconst_) / var(ipredict);
+    ypredict_mean += yslope_ * (Y(ipredict) - yconst_) / var(ipredict);
     
-    for (int i=ipredict+1; i<time_.n_elem; i++) {
+    for (int i=ipredict+1; i<data_->size(); i++) {
         UpdateCoefs();
         yprecision += yslope_ * yslope_ / var(i);
-        ypredict_mean += yslope_ * (y_(i) - yconst_) / var(i);
+        ypredict_mean += yslope_ * (Y(i) - yconst_) / var(i);
     }
     
     ypredict_var = 1.0 / yprecision;
@@ -134,42 +249,129 @@ std::pair<double, double> KalmanFilter1::Predict(double time) {
     return ypredict;
 }
 
-// Reset the Kalman Filter for a CARMA(p,q) process
-void KalmanFilterp::Reset() {
-    
+// Compute the rotated state space representation of a CARMA(p,q) process
+void RotateCarmaModel(arma::cx_vec& omega, arma::rowvec& ma_coefs, double sigsqr, arma::cx_mat& eigen_mat,
+                      arma::cx_rowvec& rotated_ma_coefs, arma::cx_mat& state_var)
+{
+    unsigned int p = omega.n_elem;
     // Initialize the matrix of Eigenvectors. We will work with the state vector
 	// in the space spanned by the Eigenvectors because in this space the state
 	// transition matrix is diagonal, so the calculation of the matrix exponential
 	// is fast.
-    arma::cx_mat EigenMat(p_,p_);
-	EigenMat.row(0) = arma::ones<arma::cx_rowvec>(p_);
-	EigenMat.row(1) = omega_.st();
-	for (int i=2; i<p_; i++) {
-		EigenMat.row(i) = strans(arma::pow(omega_, i));
+    eigen_mat.set_size(p,p);
+	eigen_mat.row(0) = arma::ones<arma::cx_rowvec>(p);
+	for (int i=1; i<p; i++) {
+		eigen_mat.row(i) = strans(arma::pow(omega, i));
 	}
     
 	// Input vector under original state space representation
-	arma::cx_vec Rvector = arma::zeros<arma::cx_vec>(p_);
-	Rvector(p_-1) = 1.0;
+	arma::cx_vec Rvector = arma::zeros<arma::cx_vec>(p);
+	Rvector(p-1) = 1.0;
     
 	// Transform the input vector to the rotated state space representation.
 	// The notation R and J comes from Belcher et al. (1994).
-	arma::cx_vec Jvector(p_);
-	Jvector = arma::solve(EigenMat, Rvector);
+	arma::cx_vec Jvector(p);
+	Jvector = arma::solve(eigen_mat, Rvector);
 	
 	// Transform the moving average coefficients to the space spanned by EigenMat.
-
-    rotated_ma_coefs_ = ma_coefs_ * EigenMat;
+    rotated_ma_coefs = ma_coefs * eigen_mat;
 	
 	// Calculate the stationary covariance matrix of the state vector.
-	for (int i=0; i<p_; i++) {
-		for (int j=i; j<p_; j++) {
-			// Only fill in upper triangle of StateVar because of symmetry
-			StateVar_(i,j) = -sigsqr_ * Jvector(i) * std::conj(Jvector(j)) /
-            (omega_(i) + std::conj(omega_(j)));
+    state_var.set_size(p,p);
+	for (int i=0; i<p; i++) {
+		for (int j=i; j<p; j++) {
+			// StateVar is Hermitian, so only compute the upper triangle
+			state_var(i,j) = -sigsqr * Jvector(i) * std::conj(Jvector(j)) / (omega(i) + std::conj(omega(j)));
+            state_var(j,i) = std::conj(state_var(i,j));
 		}
 	}
-	StateVar_ = arma::symmatu(StateVar_); // StateVar is symmetric
+}
+
+// Compute the rotated state space representation of a CARMA(p,q) process and its derivatives
+void RotateCarmaModelDerivs(arma::cx_vec& omega, arma::rowvec& ma_coefs, double sigsqr, arma::cx_mat& domega,
+                            arma::mat& dma_coefs, arma::rowvec& dsigsqr, arma::cx_mat& eigen_mat,
+                            arma::cx_rowvec& rotated_ma_coefs, arma::cx_mat& state_var,
+                            std::vector<arma::cx_rowvec>& drotated_ma_coefs, std::vector<arma::cx_mat>& dstate_var)
+{
+    unsigned int p = omega.n_elem;
+    unsigned int nparams = dsigsqr.n_elem;
+    RotateCarmaModel(omega, ma_coefs, sigsqr, eigen_mat, rotated_ma_coefs, state_var);
+    
+    arma::cx_vec Rvector = arma::zeros<arma::cx_vec>(p);
+    Rvector(p-1) = 1.0;
+    arma::cx_vec Jvector = arma::solve(eigen_mat, Rvector);
+    
+    // Derivative of each column of the matrix of eigenvectors with respect to its root: d omega(k)^i / d omega(k)
+    arma::cx_mat deigen_mat = arma::zeros<arma::cx_mat>(p,p);
+    for (int i=1; i<p; i++) {
+        deigen_mat.row(i) = (double)i * strans(arma::pow(omega, i-1));
+    }
+    
+    drotated_ma_coefs.resize(nparams);
+    dstate_var.resize(nparams);
+    for (int k=0; k<nparams; k++) {
+        arma::cx_mat deigen_k = deigen_mat * arma::diagmat(domega.col(k));
+        arma::rowvec dma_k = arma::trans(dma_coefs.col(k));
+        drotated_ma_coefs[k] = dma_k * eigen_mat + ma_coefs * deigen_k;
+        
+        // Jvector solves eigen_mat * Jvector = Rvector
+        arma::cx_vec dJvector = -arma::solve(eigen_mat, deigen_k * Jvector);
+        
+        dstate_var[k].set_size(p,p);
+        for (int i=0; i<p; i++) {
+            for (int j=i; j<p; j++) {
+                std::complex<double> denom = omega(i) + std::conj(omega(j));
+                std::complex<double> ddenom = domega(i,k) + std::conj(domega(j,k));
+                dstate_var[k](i,j) = -(dsigsqr(k) * Jvector(i) * std::conj(Jvector(j)) +
+                                       sigsqr * (dJvector(i) * std::conj(Jvector(j)) +
+                                                 Jvector(i) * std::conj(dJvector(j)))) / denom -
+                    state_var(i,j) * ddenom / denom;
+                dstate_var[k](j,i) = std::conj(dstate_var[k](i,j));
+            }
+        }
+    }
+}
+
+// Return a matrix square root of a symmetric positive semi-definite matrix. The eigendecomposition is used instead
+// of the Cholesky factorization because the innovation covariance matrices become singular as dt --> 0.
+arma::mat SymmetricSqrt(arma::mat covar)
+{
+    arma::vec eigval;
+    arma::mat eigvec;
+    arma::eig_sym(eigval, eigvec, arma::symmatu(covar));
+    eigval.elem(arma::find(eigval < 0.0)).zeros(); // remove negative eigenvalues caused by round-off error
+    return eigvec * arma::diagmat(arma::sqrt(eigval));
+}
+
+// Return a matrix of independent standard normal random variables
+arma::mat StandardNormals(unsigned int nrows, unsigned int ncols)
+{
+    arma::mat snorm(nrows, ncols);
+    for (int j=0; j<ncols; j++) {
+        for (int i=0; i<nrows; i++) {
+            snorm(i,j) = RandGen.normal(0.0, 1.0);
+        }
+    }
+    return snorm;
+}
+
+// Rotated state space representation of a CAR(1) process: the state is the process itself
+void KalmanFilter1::StateSpace(arma::cx_vec& roots, arma::cx_mat& eigen_mat, arma::cx_rowvec& obs_coefs,
+                               arma::cx_mat& state_var)
+{
+    roots.set_size(1);
+    roots(0) = -omega_;
+    eigen_mat.ones(1,1);
+    obs_coefs.ones(1);
+    state_var.set_size(1,1);
+    state_var(0,0) = sigsqr_ / (2.0 * omega_);
+}
+
+// Reset the Kalman Filter for a CARMA(p,q) process
+void KalmanFilterp::ResetState() {
+    
+    arma::cx_mat EigenMat;
+    RotateCarmaModel(omega_, ma_coefs_, sigsqr_, EigenMat, rotated_ma_coefs_, StateVar_);
 	PredictionVar_ = StateVar_; // One-step state prediction error
 	
 	state_vector_.zeros(); // Initial state is set to zero
@@ -177,60 +379,173 @@ void KalmanFilterp::Reset() {
 	// Initialize the Kalman mean and variance. These are the forecasted value
 	// for the measured time series values and its variance, conditional on the
 	// previous measurements
-	mean(0) = 0.0;
-    var(0) = std::real( arma::as_scalar(rotated_ma_coefs_ * StateVar_ * rotated_ma_coefs_.t()) );
-    var(0) += yerr_(0) * yerr_(0); // Add in measurement error contribution
+	kalman_mean_ = 0.0;
+    kalman_var_ = std::real( arma::as_scalar(rotated_ma_coefs_ * StateVar_ * rotated_ma_coefs_.t()) );
+    kalman_var_ += YerrSqr(0); // Add in measurement error contribution
 
-	innovation_ = y_(0); // The innovation
+	innovation_ = Y(0); // The innovation
     current_index_ = 1;
+    steady_state_ = false;
+    nsteady_updates_ = 0;
+}
+
+// Rotated state space representation of a CARMA(p,q) process
+void KalmanFilterp::StateSpace(arma::cx_vec& roots, arma::cx_mat& eigen_mat, arma::cx_rowvec& obs_coefs,
+                               arma::cx_mat& state_var)
+{
+    roots = omega_;
+    RotateCarmaModel(omega_, ma_coefs_, sigsqr_, eigen_mat, obs_coefs, state_var);
 }
 
 // Perform one iteration of the Kalman Filter for a CARMA(p,q) process to update it
-void KalmanFilterp::Update() {
+void KalmanFilterp::UpdateState() {
+    if (steady_state_) {
+        if (SameStepAsPrevious()) {
+            // the Kalman gain, state transition, and prediction variance are fixed, so only update the state vector
+            state_vector_ = rho_ % (state_vector_ + kalman_gain_ * innovation_);
+            kalman_mean_ = std::real( arma::as_scalar(rotated_ma_coefs_ * state_vector_) ); // kalman_var_ is unchanged
+            innovation_ = Y(current_index_) - kalman_mean_;
+            current_index_++;
+            nsteady_updates_++;
+            return;
+        }
+        // the time step or measurement error changed, so go back to the full update
+        steady_state_ = false;
+    }
+    previous_gain_ = kalman_gain_;
+    double previous_var = kalman_var_;
+    
     // First compute the Kalman Gain
-    kalman_gain_ = PredictionVar_ * rotated_ma_coefs_.t() / var(current_index_-1);
+    kalman_gain_ = PredictionVar_ * rotated_ma_coefs_.t() / kalman_var_;
     
     // Now update the state vector
     state_vector_ += kalman_gain_ * innovation_;
     
     // Update the state one-step prediction error variance
-    PredictionVar_ -= var(current_index_-1) * (kalman_gain_ * kalman_gain_.t());
+    PredictionVar_ -= kalman_var_ * (kalman_gain_ * kalman_gain_.t());
     
     // Predict the next state
-    rho_ = arma::exp(omega_ * dt_(current_index_-1));
+    rho_ = arma::exp(omega_ * Dt(current_index_-1));
     state_vector_ = rho_ % state_vector_;
     
     // Update the predicted state variance matrix
     PredictionVar_ = (rho_ * rho_.t()) % (PredictionVar_ - StateVar_) + StateVar_;
     
     // Now predict the observation and its variance.
-    mean(current_index_) = std::real( arma::as_scalar(rotated_ma_coefs_ * state_vector_) );
+    kalman_mean_ = std::real( arma::as_scalar(rotated_ma_coefs_ * state_vector_) );
     
-    var(current_index_) = std::real( arma::as_scalar(rotated_ma_coefs_ * PredictionVar_ * rotated_ma_coefs_.t()) );
-    var(current_index_) += yerr_(current_index_) * yerr_(current_index_); // Add in measurement error contribution
+    kalman_var_ = std::real( arma::as_scalar(rotated_ma_coefs_ * PredictionVar_ * rotated_ma_coefs_.t()) );
+    kalman_var_ += YerrSqr(current_index_); // Add in measurement error contribution
+    if (previous_gain_.n_elem == p_) {
+        steady_state_ = SteadyStateConverged(previous_var, arma::max(arma::abs(kalman_gain_ - previous_gain_)),
+                                             arma::max(arma::abs(kalman_gain_)));
+    }
     
     // Finally, update the innovation
-    innovation_ = y_(current_index_) - mean(current_index_);
+    innovation_ = Y(current_index_) - kalman_mean_;
     current_index_++;
 }
 
+// Run the Kalman Filter for a CARMA(p,q) process, and compute the gradient of the log-likelihood. The derivatives of
+// the rotated state vector and its covariance matrix with respect to each model parameter are propagated through the
+// same recursion as the Kalman Filter in Update().
+double KalmanFilterp::LogLikelihoodGradient(KalmanDerivatives& derivs, arma::vec& grad)
+{
+    unsigned int ndata = data_->size();
+    unsigned int nparams = derivs.sigsqr.n_elem;
+    
+    arma::cx_mat EigenMat;
+    std::vector<arma::cx_rowvec> drotated_ma_coefs;
+    std::vector<arma::cx_mat> dstate_var;
+    RotateCarmaModelDerivs(omega_, ma_coefs_, sigsqr_, derivs.omega, derivs.ma_coefs, derivs.sigsqr, EigenMat,
+                           rotated_ma_coefs_, StateVar_, drotated_ma_coefs, dstate_var);
+    
+    // derivatives of the state vector and its one-step prediction error variance
+    arma::cx_mat dstate = arma::zeros<arma::cx_mat>(p_, nparams);
+    std::vector<arma::cx_mat> dprediction_var = dstate_var;
+    arma::rowvec dmean = arma::zeros<arma::rowvec>(nparams);
+    arma::rowvec dvar(nparams);
+    
+    grad.zeros(nparams);
+    state_vector_.zeros();
+    PredictionVar_ = StateVar_;
+    kalman_mean_ = 0.0;
+    arma::cx_vec var_obs = PredictionVar_ * rotated_ma_coefs_.t();
+    kalman_var_ = std::real(arma::as_scalar(rotated_ma_coefs_ * var_obs)) + YerrSqr(0);
+    for (int k=0; k<nparams; k++) {
+        dvar(k) = 2.0 * std::real(arma::as_scalar(drotated_ma_coefs[k] * var_obs)) +
+            std::real(arma::as_scalar(rotated_ma_coefs_ * dprediction_var[k] * rotated_ma_coefs_.t())) +
+            derivs.measerr_scale(k) * data_->yerr_sqr()(0);
+    }
+    double loglik = LogLikelihoodTerm(0);
+    LogLikelihoodTermGradient(0, dmean, dvar, derivs.ymean, grad);
+    
+    for (int i=1; i<ndata; i++) {
+        double previous_var = kalman_var_;
+        double innovation = Y(i-1) - kalman_mean_;
+        arma::rowvec dinnovation = -derivs.ymean - dmean;
+        
+        // Kalman gain, and the filtered state vector and variance
+        kalman_gain_ = PredictionVar_ * rotated_ma_coefs_.t() / previous_var;
+        arma::cx_vec filtered_state = state_vector_ + kalman_gain_ * innovation;
+        arma::cx_mat filtered_var = PredictionVar_ - previous_var * (kalman_gain_ * kalman_gain_.t());
+        
+        double dt = Dt(i-1);
+        rho_ = arma::exp(omega_ * dt);
+        arma::cx_mat rho_outer = rho_ * rho_.t();
+        for (int k=0; k<nparams; k++) {
+            arma::cx_vec dgain = (dprediction_var[k] * rotated_ma_coefs_.t() + PredictionVar_ * drotated_ma_coefs[k].t() -
+                                  dvar(k) * kalman_gain_) / previous_var;
+            arma::cx_vec dfiltered_state = dstate.col(k) + dgain * innovation + kalman_gain_ * dinnovation(k);
+            arma::cx_mat dfiltered_var = dprediction_var[k] - dvar(k) * (kalman_gain_ * kalman_gain_.t()) -
+                previous_var * (dgain * kalman_gain_.t() + kalman_gain_ * dgain.t());
+            // predict the next state
+            arma::cx_vec drho = dt * (derivs.omega.col(k) % rho_);
+            dstate.col(k) = drho % filtered_state + rho_ % dfiltered_state;
+            dprediction_var[k] = (drho * rho_.t() + rho_ * drho.t()) % (filtered_var - StateVar_) +
+                rho_outer % (dfiltered_var - dstate_var[k]) + dstate_var[k];
+        }
+        state_vector_ = rho_ % filtered_state;
+        PredictionVar_ = rho_outer % (filtered_var - StateVar_) + StateVar_;
+        
+        // predict the observation and its variance, and their derivatives
+        kalman_mean_ = std::real(arma::as_scalar(rotated_ma_coefs_ * state_vector_));
+        var_obs = PredictionVar_ * rotated_ma_coefs_.t();
+        kalman_var_ = std::real(arma::as_scalar(rotated_ma_coefs_ * var_obs)) + YerrSqr(i);
+        for (int k=0; k<nparams; k++) {
+            dmean(k) = std::real(arma::as_scalar(drotated_ma_coefs[k] * state_vector_ + rotated_ma_coefs_ * dstate.col(k)));
+            dvar(k) = 2.0 * std::real(arma::as_scalar(drotated_ma_coefs[k] * var_obs)) +
+                std::real(arma::as_scalar(rotated_ma_coefs_ * dprediction_var[k] * rotated_ma_coefs_.t())) +
+                derivs.measerr_scale(k) * data_->yerr_sqr()(i);
+        }
+        
+        loglik += LogLikelihoodTerm(i);
+        LogLikelihoodTermGradient(i, dmean, dvar, derivs.ymean, grad);
+    }
+    innovation_ = Y(ndata-1) - kalman_mean_;
+    current_index_ = ndata;
+    
+    return loglik;
+}
+
 // Predict the time series at the input time given the measured time series, assuming a CARMA(p,q) process
 std::pair<double, double> KalmanFilterp::Predict(double time) {
     
     unsigned int ipredict = 0;
-    while (time > time_(ipredict)) {
+    while (time > Time(ipredict)) {
         // find the index where time_ > time for the first time
         ipredict++;
-        if (ipredict == time_.n_elem) {
+        if (ipredict == data_->size()) {
             // time is greater than last element of time_, so do forecasting
             break;
         }
     }
     
-    // Run the Kalman filter up to the point time_[ipredict-1]
-    Reset();
+    // Run the Kalman filter up to the point Time(ipredict-1). Call the KalmanFilterp versions explicitly because
+    // the interpolation steps below use the state held in the KalmanFilterp data members.
+    KalmanFilterp::ResetState();
     for (int i=1; i<ipredict; i++) {
-        Update();
+        KalmanFilterp::UpdateState();
     }
     
     double ypredict_mean, ypredict_var, yprecision;
@@ -241,10 +556,10 @@ std::pair<double, double> KalmanFilterp::Predict(double time) {
         ypredict_var = std::real( arma::as_scalar(rotated_ma_coefs_ * StateVar_ * rotated_ma_coefs_.t()) );
     } else {
         // predict the value of the time series at time, given the earlier values
-        kalman_gain_ = PredictionVar_ * rotated_ma_coefs_.t() / var(ipredict-1);
+        kalman_gain_ = PredictionVar_ * rotated_ma_coefs_.t() / kalman_var_;
         state_vector_ += kalman_gain_ * innovation_;
-        PredictionVar_ -= var(ipredict-1) * (kalman_gain_ * kalman_gain_.t());
-        double dt = std::abs(time - time_(ipredict-1));
+        PredictionVar_ -= kalman_var_ * (kalman_gain_ * kalman_gain_.t());
+        double dt = std::abs(time - Time(ipredict-1));
         rho_ = arma::exp(omega_ * dt);
         state_vector_ = rho_ % state_vector_;
         PredictionVar_ = (rho_ * rho_.t()) % (PredictionVar_ - StateVar_) + StateVar_;
@@ -254,7 +569,7 @@ std::pair<double, double> KalmanFilterp::Predict(double time) {
         ypredict_var = std::real( arma::as_scalar(rotated_ma_coefs_ * PredictionVar_ * rotated_ma_coefs_.t()) );
     }
 
-    if (ipredict == time_.n_elem) {
+    if (ipredict == data_->size()) {
         // Forecasting, so we're done: no need to run interpolation steps
         std::pair<double, double> ypredict(ypredict_mean, ypredict_var);
         return ypredict;
@@ -270,12 +585,12 @@ std::pair<double, double> KalmanFilterp::Predict(double time) {
     InitializeCoefs(time, ipredict, ypredict_mean / yprecision, ypredict_var);
 
     yprecision += yslope_ * yslope_ / var(ipredict);
-    ypredict_mean += yslope_ * (y_(ipredict) - yconst_) / var(ipredict);
+    ypredict_mean += yslope_ * (Y(ipredict) - yconst_) / var(ipredict);
     
-    for (int i=ipredict+1; i<time_.n_elem; i++) {
+    for (int i=ipredict+1; i<data_->size(); i++) {
         UpdateCoefs();
         yprecision += yslope_ * yslope_ / var(i);
-        ypredict_mean += yslope_ * (y_(i) - yconst_) / var(i);
+        ypredict_mean += yslope_ * (Y(i) - yconst_) / var(i);
     }
     
     ypredict_var = 1.0 / yprecision;
@@ -286,7 +601,7 @@ std::pair<double, double> KalmanFilterp::Predict(double time) {
 }
 
 // Initialize the coefficients needed for computing the Kalman Filter at future times as a function of
-// the time series at time, where time_(itime-1) < time < time_(itime)
+// the time series at time, where Time(itime-1) < time < Time(itime)
 void KalmanFilterp::InitializeCoefs(double time, unsigned int itime, double ymean, double yvar) {
     
     kalman_gain_ = PredictionVar_ * rotated_ma_coefs_.t() / yvar;
@@ -296,7 +611,7 @@ void KalmanFilterp::InitializeCoefs(double time, unsigned int itime, double ymea
     // update the state one-step prediction error variance
     PredictionVar_ -= yvar * (kalman_gain_ * kalman_gain_.t());
     // coefs(time_predict|time_predict) --> coefs(time[i+1]|time_predict)
-    double dt = std::abs(time_(itime) - time);
+    double dt = std::abs(Time(itime) - time);
     rho_ = arma::exp(omega_ * dt);
     state_const_ = rho_ % state_const_;
     state_slope_ = rho_ % state_slope_;
@@ -307,7 +622,7 @@ void KalmanFilterp::InitializeCoefs(double time, unsigned int itime, double ymea
     yconst_ = std::real( arma::as_scalar(rotated_ma_coefs_ * state_const_) );
     yslope_ = std::real( arma::as_scalar(rotated_ma_coefs_ * state_slope_) );
     var(itime) = std::real( arma::as_scalar(rotated_ma_coefs_ * PredictionVar_ * rotated_ma_coefs_.t()) )
-        + yerr_(itime) * yerr_(itime);
+        + YerrSqr(itime);
     current_index_ = itime + 1;
 }
 
@@ -317,12 +632,12 @@ void KalmanFilterp::UpdateCoefs() {
     
     kalman_gain_ = PredictionVar_ * rotated_ma_coefs_.t() / var(current_index_-1);
     // update the coefficients for predicting the state vector at coefs(i|i-1) --> coefs(i|i)
-    state_const_ += kalman_gain_ * (y_(current_index_-1) - yconst_);
+    state_const_ += kalman_gain_ * (Y(current_index_-1) - yconst_);
     state_slope_ -= kalman_gain_ * yslope_;
     // update the state one-step prediction error variance
     PredictionVar_ -= var(current_index_-1) * (kalman_gain_ * kalman_gain_.t());
     // compute the one-step state prediction coefficients: coefs(i|i) --> coefs(i+1|i)
-    rho_ = arma::exp(omega_ * dt_(current_index_-1));
+    rho_ = arma::exp(omega_ * Dt(current_index_-1));
     state_const_ = rho_ % state_const_;
     state_slope_ = rho_ % state_slope_;
     // update the predicted state covariance matrix
@@ -332,6 +647,549 @@ void KalmanFilterp::UpdateCoefs() {
     yconst_ = std::real( arma::as_scalar(rotated_ma_coefs_ * state_const_) );
     yslope_ = std::real( arma::as_scalar(rotated_ma_coefs_ * state_slope_) );
     var(current_index_) = std::real( arma::as_scalar(rotated_ma_coefs_ * PredictionVar_ * rotated_ma_coefs_.t()) )
-        + yerr_(current_index_) * yerr_(current_index_);
+        + YerrSqr(current_index_);
+    current_index_++;
+}
+
+// Construct the real representation of the rotated state space model. Each complex conjugate pair of AR roots
+// (omega, conj(omega)) is replaced by the real and imaginary parts of the corresponding rotated state vector element.
+void KalmanFilterpReal::RealStateSpace()
+{
+    double tolerance = 1e-10;
+    std::vector<bool> assigned(p_, false);
+    arma::cx_mat Transform = arma::zeros<arma::cx_mat>(p_,p_); // real state = Transform * rotated state
+    arma::cx_mat InvTransform = arma::zeros<arma::cx_mat>(p_,p_); // rotated state = InvTransform * real state
+    const std::complex<double> iunit(0.0, 1.0);
+    
+    block_start_.clear();
+    block_size_.clear();
+    block_decay_.clear();
+    block_freq_.clear();
+    unsigned int istate = 0;
+    for (int i=0; i<p_; i++) {
+        if (assigned[i]) {
+            continue;
+        }
+        assigned[i] = true;
+        block_start_.push_back(istate);
+        block_decay_.push_back(omega_(i).real());
+        if (std::abs(omega_(i).imag()) <= tolerance * std::abs(omega_(i))) {
+            // real root, so the rotated state vector element is real
+            block_size_.push_back(1);
+            block_freq_.push_back(0.0);
+            Transform(istate,i) = 1.0;
+            InvTransform(i,istate) = 1.0;
+            istate++;
+            continue;
+        }
+        // find the complex conjugate of this root
+        int j = i + 1;
+        while ((j < p_) && (assigned[j] || std::abs(omega_(j) - std::conj(omega_(i))) > tolerance * std::abs(omega_(i)))) {
+            j++;
+        }
+        if (j == p_) {
+            throw std::runtime_error("AR roots do not come in complex conjugate pairs.");
+        }
+        assigned[j] = true;
+        block_size_.push_back(2);
+        block_freq_.push_back(omega_(i).imag());
+        // (u,v) = (real(x_i), imag(x_i)), where x_j = conj(x_i)
+        Transform(istate,i) = 0.5;
+        Transform(istate,j) = 0.5;
+        Transform(istate+1,i) = -0.5 * iunit;
+        Transform(istate+1,j) = 0.5 * iunit;
+        InvTransform(i,istate) = 1.0;
+        InvTransform(i,istate+1) = iunit;
+        InvTransform(j,istate) = 1.0;
+        InvTransform(j,istate+1) = -iunit;
+        istate += 2;
+    }
+    nblocks_ = block_start_.size();
+    
+    arma::mat RealStateVar = arma::real(Transform * StateVar_ * Transform.t());
+    arma::rowvec real_obs = arma::real(rotated_ma_coefs_ * InvTransform);
+    
+    real_state_.assign(p_, 0.0);
+    real_gain_.assign(p_, 0.0);
+    real_obs_.resize(p_);
+    real_state_var_.resize(p_ * p_);
+    real_prediction_var_.resize(p_ * p_);
+    transition_.resize(4 * nblocks_);
+    for (int i=0; i<p_; i++) {
+        real_obs_[i] = real_obs(i);
+        for (int j=0; j<p_; j++) {
+            // make sure the covariance matrix is exactly symmetric
+            real_state_var_[i * p_ + j] = 0.5 * (RealStateVar(i,j) + RealStateVar(j,i));
+        }
+    }
+}
+
+// Reset the real-arithmetic Kalman Filter for a CARMA(p,q) process
+void KalmanFilterpReal::ResetState()
+{
+    arma::cx_mat EigenMat;
+    RotateCarmaModel(omega_, ma_coefs_, sigsqr_, EigenMat, rotated_ma_coefs_, StateVar_);
+    RealStateSpace();
+    
+    real_prediction_var_ = real_state_var_;
+    double yvar = 0.0;
+    for (int i=0; i<p_; i++) {
+        for (int j=0; j<p_; j++) {
+            yvar += real_obs_[i] * real_state_var_[i * p_ + j] * real_obs_[j];
+        }
+    }
+    kalman_mean_ = 0.0;
+    kalman_var_ = yvar + YerrSqr(0);
+    innovation_ = Y(0);
+    current_index_ = 1;
+    steady_state_ = false;
+    nsteady_updates_ = 0;
+}
+
+// Perform one iteration of the real-arithmetic Kalman Filter for a CARMA(p,q) process
+void KalmanFilterpReal::UpdateState()
+{
+    if (steady_state_) {
+        if (SameStepAsPrevious()) {
+            // the Kalman gain, state transition, and prediction variance are fixed, so only update the state vector
+            for (int i=0; i<p_; i++) {
+                real_state_[i] += real_gain_[i] * innovation_;
+            }
+            PropagateState();
+            double ypredict = 0.0;
+            for (int i=0; i<p_; i++) {
+                ypredict += real_obs_[i] * real_state_[i];
+            }
+            kalman_mean_ = ypredict; // kalman_var_ is unchanged
+            innovation_ = Y(current_index_) - kalman_mean_;
+            current_index_++;
+            nsteady_updates_++;
+            return;
+        }
+        // the time step or measurement error changed, so go back to the full update
+        steady_state_ = false;
+    }
+    double previous_var = kalman_var_;
+    double dt = Dt(current_index_-1);
+    
+    // compute the Kalman gain and update the state vector
+    double gain_change = 0.0, gain_norm = 0.0;
+    for (int i=0; i<p_; i++) {
+        double gain = 0.0;
+        for (int j=0; j<p_; j++) {
+            gain += real_prediction_var_[i * p_ + j] * real_obs_[j];
+        }
+        gain /= previous_var;
+        gain_change = std::max(gain_change, std::abs(gain - real_gain_[i]));
+        gain_norm = std::max(gain_norm, std::abs(gain));
+        real_gain_[i] = gain;
+        real_state_[i] += real_gain_[i] * innovation_;
+    }
+    // update the state one-step prediction error variance, and subtract the stationary covariance matrix
+    for (int i=0; i<p_; i++) {
+        for (int j=i; j<p_; j++) {
+            double filtered_var = real_prediction_var_[i * p_ + j] - previous_var * real_gain_[i] * real_gain_[j];
+            real_prediction_var_[i * p_ + j] = filtered_var - real_state_var_[i * p_ + j];
+            real_prediction_var_[j * p_ + i] = real_prediction_var_[i * p_ + j];
+        }
+    }
+    
+    // compute the state transition matrix blocks
+    for (int b=0; b<nblocks_; b++) {
+        double decay = exp(block_decay_[b] * dt);
+        if (block_size_[b] == 1) {
+            transition_[4 * b] = decay;
+        } else {
+            double cosine = decay * cos(block_freq_[b] * dt);
+            double sine = decay * sin(block_freq_[b] * dt);
+            transition_[4 * b] = cosine;
+            transition_[4 * b + 1] = -sine;
+            transition_[4 * b + 2] = sine;
+            transition_[4 * b + 3] = cosine;
+        }
+    }
+    
+    // Predict the next state. First multiply the state and the rows of the covariance matrix by the transition matrix,
+    // then multiply the columns of the covariance matrix.
+    PropagateState();
+    for (int b=0; b<nblocks_; b++) {
+        unsigned int k = block_start_[b];
+        const double* phi = &transition_[4 * b];
+        if (block_size_[b] == 1) {
+            for (int j=0; j<p_; j++) {
+                real_prediction_var_[k * p_ + j] *= phi[0];
+            }
+        } else {
+            for (int j=0; j<p_; j++) {
+                double pu = real_prediction_var_[k * p_ + j], pv = real_prediction_var_[(k+1) * p_ + j];
+                real_prediction_var_[k * p_ + j] = phi[0] * pu + phi[1] * pv;
+                real_prediction_var_[(k+1) * p_ + j] = phi[2] * pu + phi[3] * pv;
+            }
+        }
+    }
+    for (int b=0; b<nblocks_; b++) {
+        unsigned int k = block_start_[b];
+        const double* phi = &transition_[4 * b];
+        if (block_size_[b] == 1) {
+            for (int i=0; i<p_; i++) {
+                real_prediction_var_[i * p_ + k] *= phi[0];
+            }
+        } else {
+            for (int i=0; i<p_; i++) {
+                double pu = real_prediction_var_[i * p_ + k], pv = real_prediction_var_[i * p_ + k + 1];
+                real_prediction_var_[i * p_ + k] = phi[0] * pu + phi[1] * pv;
+                real_prediction_var_[i * p_ + k + 1] = phi[2] * pu + phi[3] * pv;
+            }
+        }
+    }
+    
+    // add the stationary covariance back in, and predict the observation and its variance
+    double ypredict = 0.0, yvar = 0.0;
+    for (int i=0; i<p_; i++) {
+        ypredict += real_obs_[i] * real_state_[i];
+        double var_obs = 0.0;
+        for (int j=0; j<p_; j++) {
+            if (j >= i) {
+                real_prediction_var_[i * p_ + j] += real_state_var_[i * p_ + j];
+            } else {
+                real_prediction_var_[i * p_ + j] = real_prediction_var_[j * p_ + i];
+            }
+            var_obs += real_prediction_var_[i * p_ + j] * real_obs_[j];
+        }
+        yvar += real_obs_[i] * var_obs;
+    }
+    kalman_mean_ = ypredict;
+    kalman_var_ = yvar + YerrSqr(current_index_);
+    steady_state_ = SteadyStateConverged(previous_var, gain_change, gain_norm);
+    
+    // Finally, update the innovation
+    innovation_ = Y(current_index_) - kalman_mean_;
     current_index_++;
 }
+
+// Multiply the real state vector by the block diagonal state transition matrix
+void KalmanFilterpReal::PropagateState()
+{
+    for (int b=0; b<nblocks_; b++) {
+        unsigned int k = block_start_[b];
+        const double* phi = &transition_[4 * b];
+        if (block_size_[b] == 1) {
+            real_state_[k] *= phi[0];
+        } else {
+            double u = real_state_[k], v = real_state_[k+1];
+            real_state_[k] = phi[0] * u + phi[1] * v;
+            real_state_[k+1] = phi[2] * u + phi[3] * v;
+        }
+    }
+}
+
+/********************************************************************
+                METHODS OF ONLINEKALMANFILTER CLASS
+ *******************************************************************/
+
+OnlineKalmanFilter::OnlineKalmanFilter(const arma::cx_vec& roots, const arma::cx_rowvec& obs_coefs,
+                                       const arma::cx_mat& stationary_var, double ymean, double measerr_scale) :
+roots_(roots), obs_coefs_(obs_coefs), stationary_var_(stationary_var), ymean_(ymean), measerr_scale_(measerr_scale)
+{
+    Reset();
+}
+
+// Forget all of the data, so the next data point is predicted from the stationary distribution
+void OnlineKalmanFilter::Reset()
+{
+    state_.ndata = 0;
+    state_.time = -1.0 * arma::datum::inf;
+    state_.loglik = 0.0;
+    state_.state.zeros(roots_.n_elem);
+    state_.state_var = stationary_var_;
+}
+
+// Restore the filtered state from a checkpoint
+void OnlineKalmanFilter::Restore(const OnlineFilterState& state)
+{
+    if ((state.state.n_elem != roots_.n_elem) || (state.state_var.n_rows != roots_.n_elem) ||
+        (state.state_var.n_cols != roots_.n_elem)) {
+        throw std::invalid_argument("Online Kalman Filter state does not have the same order as the filter.");
+    }
+    state_ = state;
+}
+
+// Propagate the filtered state forward by dt. The transition matrix is diagonal in the rotated state space, so this
+// takes O(p^2) operations.
+void OnlineKalmanFilter::PropagateState(double dt, arma::cx_vec& state, arma::cx_mat& state_var)
+{
+    arma::cx_vec rho = arma::exp(roots_ * dt);
+    state = rho % state;
+    state_var = (rho * rho.t()) % (state_var - stationary_var_) + stationary_var_;
+}
+
+// Ingest a new data point
+OnlineFilterUpdate OnlineKalmanFilter::Append(double time, double y, double yerr)
+{
+    if (!std::isfinite(time) || !std::isfinite(y) || !std::isfinite(yerr)) {
+        throw std::invalid_argument("Time series data must be finite.");
+    }
+    if (yerr < 0.0) {
+        throw std::invalid_argument("Measurement errors must be non-negative.");
+    }
+    if (time <= state_.time) {
+        throw std::invalid_argument("New data points must be later than the previous data point.");
+    }
+    
+    // predict the new data point from the earlier ones
+    if (state_.ndata > 0) {
+        PropagateState(time - state_.time, state_.state, state_.state_var);
+    }
+    OnlineFilterUpdate update;
+    double ypredict = std::real(arma::as_scalar(obs_coefs_ * state_.state));
+    update.var = std::real(arma::as_scalar(obs_coefs_ * state_.state_var * obs_coefs_.t())) +
+        measerr_scale_ * yerr * yerr;
+    update.mean = ypredict + ymean_;
+    double innovation = y - ymean_ - ypredict;
+    update.loglik = -0.5 * log(update.var) - 0.5 * innovation * innovation / update.var;
+    
+    // condition the state on the new data point
+    arma::cx_vec gain = state_.state_var * obs_coefs_.t() / update.var;
+    state_.state += gain * innovation;
+    state_.state_var -= update.var * (gain * gain.t());
+    state_.time = time;
+    state_.loglik += update.loglik;
+    state_.ndata++;
+    
+    return update;
+}
+
+// Predict the time series at a later time, without changing the filtered state
+std::pair<double, double> OnlineKalmanFilter::Predict(double time)
+{
+    if (time < state_.time) {
+        throw std::invalid_argument("Online Kalman Filter can only predict later than the last data point.");
+    }
+    arma::cx_vec state = state_.state;
+    arma::cx_mat state_var = state_.state_var;
+    if (state_.ndata > 0) {
+        PropagateState(time - state_.time, state, state_var);
+    }
+    double ypredict = std::real(arma::as_scalar(obs_coefs_ * state)) + ymean_;
+    double yvar = std::real(arma::as_scalar(obs_coefs_ * state_var * obs_coefs_.t()));
+    return std::make_pair(ypredict, yvar);
+}
+
+/********************************************************************
+                METHODS OF KALMANFILTERBATCH CLASS
+ *******************************************************************/
+
+/*
+ The time loop of KalmanFilterBatch::LogLikelihood. The innermost loops run over the models with unit stride, so this
+ is where the batch spends its time. With GCC on x86-64 Linux the function is compiled for AVX-512 and AVX2 (with
+ FMA) as well as for the baseline instruction set, and the version for the widest vector unit of the CPU is chosen
+ when the library is loaded. Other compilers and platforms build the baseline version only.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+__attribute__((target_clones("arch=skylake-avx512", "arch=haswell", "default")))
+#endif
+static void BatchFilterKernel(unsigned int p, unsigned int nmodels, unsigned int ndata,
+                              const std::vector<unsigned int>& pair_index, const double* time_series,
+                              const double* yerr_sqr, const double* dt, const double* ymean,
+                              const double* measerr_scale, const std::vector<double>& root_re,
+                              const std::vector<double>& root_im, const std::vector<double>& obs_re,
+                              const std::vector<double>& obs_im, const std::vector<double>& svar_re,
+                              const std::vector<double>& svar_im, std::vector<double>& pvar_re,
+                              std::vector<double>& pvar_im, std::vector<double>& loglik)
+{
+    std::vector<double> state_re(p * nmodels, 0.0), state_im(p * nmodels, 0.0);
+    std::vector<double> gain_re(p * nmodels), gain_im(p * nmodels), rho_re(p * nmodels), rho_im(p * nmodels);
+    std::vector<double> ypredict(nmodels), yvar(nmodels), innovation(nmodels);
+    for (int i=0; i<ndata; i++) {
+        // predicted measurement and its variance, y = Re(obs * state) and var = Re(obs * pvar * obs^H) + yerr^2
+        for (int k=0; k<nmodels; k++) {
+            ypredict[k] = 0.0;
+            yvar[k] = measerr_scale[k] * yerr_sqr[i];
+        }
+        for (int a=0; a<p; a++) {
+            const double* hr = &obs_re[a * nmodels];
+            const double* hi = &obs_im[a * nmodels];
+            const double* sr = &state_re[a * nmodels];
+            const double* si = &state_im[a * nmodels];
+            for (int k=0; k<nmodels; k++) {
+                ypredict[k] += hr[k] * sr[k] - hi[k] * si[k];
+            }
+            for (int b=a; b<p; b++) {
+                // the off-diagonal terms appear twice, as complex conjugates
+                double weight = (a == b) ? 1.0 : 2.0;
+                const double* pr = &pvar_re[pair_index[a * p + b] * nmodels];
+                const double* pi = &pvar_im[pair_index[a * p + b] * nmodels];
+                const double* br = &obs_re[b * nmodels];
+                const double* bi = &obs_im[b * nmodels];
+                for (int k=0; k<nmodels; k++) {
+                    double ur = hr[k] * pr[k] - hi[k] * pi[k];
+                    double ui = hr[k] * pi[k] + hi[k] * pr[k];
+                    yvar[k] += weight * (ur * br[k] + ui * bi[k]);
+                }
+            }
+        }
+        for (int k=0; k<nmodels; k++) {
+            innovation[k] = time_series[i] - ymean[k] - ypredict[k];
+            loglik[k] += -0.5 * log(yvar[k]) - 0.5 * innovation[k] * innovation[k] / yvar[k];
+        }
+        if (i == ndata - 1) {
+            break;
+        }
+        
+        // Kalman gain, gain = pvar * obs^H / var, using pvar(b,a) = conj(pvar(a,b)) for b < a
+        for (int a=0; a<p; a++) {
+            double* gr = &gain_re[a * nmodels];
+            double* gi = &gain_im[a * nmodels];
+            for (int k=0; k<nmodels; k++) {
+                gr[k] = 0.0;
+                gi[k] = 0.0;
+            }
+            for (int b=0; b<p; b++) {
+                double conj_sign = (b >= a) ? 1.0 : -1.0;
+                unsigned int ab = (b >= a) ? pair_index[a * p + b] : pair_index[b * p + a];
+                const double* pr = &pvar_re[ab * nmodels];
+                const double* pi = &pvar_im[ab * nmodels];
+                const double* br = &obs_re[b * nmodels];
+                const double* bi = &obs_im[b * nmodels];
+                for (int k=0; k<nmodels; k++) {
+                    double pik = conj_sign * pi[k];
+                    gr[k] += pr[k] * br[k] + pik * bi[k];
+                    gi[k] += pik * br[k] - pr[k] * bi[k];
+                }
+            }
+            for (int k=0; k<nmodels; k++) {
+                gr[k] /= yvar[k];
+                gi[k] /= yvar[k];
+            }
+        }
+        
+        // state transition over the time step, rho = exp(roots * dt)
+        for (int a=0; a<p * nmodels; a++) {
+            double decay = exp(root_re[a] * dt[i]);
+            rho_re[a] = decay * cos(root_im[a] * dt[i]);
+            rho_im[a] = decay * sin(root_im[a] * dt[i]);
+        }
+        
+        // update the state vector with the innovation and predict the next state
+        for (int a=0; a<p; a++) {
+            double* sr = &state_re[a * nmodels];
+            double* si = &state_im[a * nmodels];
+            const double* gr = &gain_re[a * nmodels];
+            const double* gi = &gain_im[a * nmodels];
+            const double* rr = &rho_re[a * nmodels];
+            const double* ri = &rho_im[a * nmodels];
+            for (int k=0; k<nmodels; k++) {
+                double ur = sr[k] + gr[k] * innovation[k];
+                double ui = si[k] + gi[k] * innovation[k];
+                sr[k] = rr[k] * ur - ri[k] * ui;
+                si[k] = rr[k] * ui + ri[k] * ur;
+            }
+        }
+        
+        // update the covariance matrix, pvar = rho_a conj(rho_b) (pvar - var gain_a conj(gain_b) - svar) + svar
+        for (int a=0; a<p; a++) {
+            for (int b=a; b<p; b++) {
+                unsigned int ab = pair_index[a * p + b] * nmodels;
+                double* pr = &pvar_re[ab];
+                double* pi = &pvar_im[ab];
+                const double* sr = &svar_re[ab];
+                const double* si = &svar_im[ab];
+                const double* gar = &gain_re[a * nmodels];
+                const double* gai = &gain_im[a * nmodels];
+                const double* gbr = &gain_re[b * nmodels];
+                const double* gbi = &gain_im[b * nmodels];
+                const double* rar = &rho_re[a * nmodels];
+                const double* rai = &rho_im[a * nmodels];
+                const double* rbr = &rho_re[b * nmodels];
+                const double* rbi = &rho_im[b * nmodels];
+                for (int k=0; k<nmodels; k++) {
+                    double fr = pr[k] - yvar[k] * (gar[k] * gbr[k] + gai[k] * gbi[k]) - sr[k];
+                    double fi = pi[k] - yvar[k] * (gai[k] * gbr[k] - gar[k] * gbi[k]) - si[k];
+                    double rr = rar[k] * rbr[k] + rai[k] * rbi[k];
+                    double ri = rai[k] * rbr[k] - rar[k] * rbi[k];
+                    pr[k] = rr * fr - ri * fi + sr[k];
+                    pi[k] = rr * fi + ri * fr + si[k];
+                }
+            }
+        }
+    }
+}
+
+// Run the Kalman Filters for all of the models in lockstep. Element a of the vectors for model k is stored at
+// [a * nmodels + k], and element (a,b) of the covariance matrices, a <= b, at [pair_index[a * p + b] * nmodels + k].
+arma::vec KalmanFilterBatch::LogLikelihood(const arma::cx_mat& roots, const arma::cx_mat& obs_coefs,
+                                           const arma::cx_cube& state_var, const arma::vec& ymean,
+                                           const arma::vec& measerr_scale)
+{
+    unsigned int p = roots.n_rows;
+    unsigned int nmodels = roots.n_cols;
+    unsigned int ndata = data_->size();
+    
+    std::vector<unsigned int> pair_index(p * p);
+    unsigned int npairs = 0;
+    for (int a=0; a<p; a++) {
+        for (int b=a; b<p; b++) {
+            pair_index[a * p + b] = npairs++;
+        }
+    }
+    
+    std::vector<double> root_re(p * nmodels), root_im(p * nmodels), obs_re(p * nmodels), obs_im(p * nmodels);
+    std::vector<double> svar_re(npairs * nmodels), svar_im(npairs * nmodels);
+    std::vector<double> pvar_re(npairs * nmodels), pvar_im(npairs * nmodels);
+    std::vector<double> loglik(nmodels, 0.0);
+    for (int k=0; k<nmodels; k++) {
+        for (int a=0; a<p; a++) {
+            root_re[a * nmodels + k] = roots(a,k).real();
+            root_im[a * nmodels + k] = roots(a,k).imag();
+            obs_re[a * nmodels + k] = obs_coefs(a,k).real();
+            obs_im[a * nmodels + k] = obs_coefs(a,k).imag();
+            for (int b=a; b<p; b++) {
+                unsigned int ab = pair_index[a * p + b] * nmodels + k;
+                svar_re[ab] = state_var(a,b,k).real();
+                svar_im[ab] = state_var(a,b,k).imag();
+            }
+        }
+    }
+    pvar_re = svar_re; // the initial state is drawn from the stationary distribution
+    pvar_im = svar_im;
+    
+    BatchFilterKernel(p, nmodels, ndata, pair_index, data_->y().memptr(), data_->yerr_sqr().memptr(),
+                      data_->dt().memptr(), ymean.memptr(), measerr_scale.memptr(), root_re, root_im, obs_re, obs_im,
+                      svar_re, svar_im, pvar_re, pvar_im, loglik);
+    
+    return arma::conv_to<arma::vec>::from(loglik);
+}
+
+// Return a pointer to a Kalman Filter for a CARMA(p,q) process, using the fixed-size implementation when possible
+std::shared_ptr<KalmanFilterp> MakeKalmanFilterp(arma::vec& time, arma::vec& y, arma::vec& yerr, unsigned int p)
+{
+    return MakeKalmanFilterp(std::make_shared<const TimeSeriesData>(time, y, yerr), p);
+}
+
+std::shared_ptr<KalmanFilterp> MakeKalmanFilterp(std::shared_ptr<const TimeSeriesData> data, unsigned int p)
+{
+    switch (p) {
+        case 1:
+            return std::make_shared<KalmanFilterP<1> >(data);
+        case 2:
+            return std::make_shared<KalmanFilterP<2> >(data);
+        case 3:
+            return std::make_shared<KalmanFilterP<3> >(data);
+        case 4:
+            return std::make_shared<KalmanFilterP<4> >(data);
+        case 5:
+            return std::make_shared<KalmanFilterP<5> >(data);
+        case 6:
+            return std::make_shared<KalmanFilterP<6> >(data);
+        case 7:
+            return std::make_shared<KalmanFilterP<7> >(data);
+        case 8:
+            return std::make_shared<KalmanFilterP<8> >(data);
+        case 9:
+            return std::make_shared<KalmanFilterP<9> >(data);
+        case 10:
+            return std::make_shared<KalmanFilterP<10> >(data);
+        default:
+            return std::make_shared<KalmanFilterp>(data);
+    }
+}
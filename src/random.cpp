@@ -10,29 +10,49 @@
 // Standard includes
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <ctime>
+// Boost includes
+#include <boost/random/seed_seq.hpp>
 // Local include
 #include "include/random.hpp"
 
 // Global random number generator. This same generator should be used for
 // generating all random variates for a MCMC sampler. The default random
 // number generator is the Mersenne Twister mt19937 from the BOOST library.
+// Each thread has its own copy, so that independent samplers may be run
+// concurrently on different threads.
 
-boost::random::mt19937 rng(time(NULL));
+// Seed the generator for a new thread from the clock and a count of the threads
+// that have been started, so that threads started within the same second, e.g.,
+// by several Python threads fitting different light curves, do not produce
+// identical random number streams.
+static boost::random::mt19937 NewThreadEngine()
+{
+    static std::atomic<unsigned int> nthreads_started(0);
+    std::vector<boost::uint32_t> seed_values(2);
+    seed_values[0] = (boost::uint32_t)time(NULL);
+    seed_values[1] = nthreads_started++;
+    boost::random::seed_seq seq(seed_values.begin(), seed_values.end());
+    return boost::random::mt19937(seq);
+}
 
+thread_local boost::random::mt19937 rng(NewThreadEngine());
 
-// Method to set the seed of the global random number generator.
+
+// Method to set the seed of the random number generator.
 void RandomGenerator::SetSeed(unsigned long seed) const
 {
-    rng.seed(seed);
+    engine_->seed(seed);
 }
 
-// Method to save the seed of the global random number generator to a file.
+// Method to save the seed of the random number generator to a file.
 // The default filename is "seed.txt"
 void RandomGenerator::SaveSeed(std::string seed_filename) const
 {
     std::ofstream seed_file(seed_filename.c_str());
 	if (seed_file.is_open()) {
-		seed_file << rng;
+		seed_file << *engine_;
 	} else {
 		std::cout << "Cannot write random number generator seed to file "
         << seed_filename << ".\n";
@@ -40,13 +60,13 @@ void RandomGenerator::SaveSeed(std::string seed_filename) const
 	seed_file.close();
 }
 
-// Method to recover the seed of the global random number generator from a file.
+// Method to recover the seed of the random number generator from a file.
 // The default filename is "seed.txt"
 void RandomGenerator::RecoverSeed(std::string seed_filename) const
 {
 	std::ifstream seed_file(seed_filename.c_str());
 	if (seed_file.is_open()) {
-		seed_file >> rng;
+		seed_file >> *engine_;
 	} else {
 		std::cout << "Cannot read random number generator seed from file "
 		<< seed_filename <<	".\n";
@@ -66,8 +86,8 @@ double RandomGenerator::exp(double lambda)
 	// the new parameter object with scale parameter lambda.
 	exp_.param(exp_params);
 	// Generate and return a exponentially-distribution random deviate. Note
-	// that rng is the global random number generator defined in the header file.
-    return exp_(rng);
+	// that engine_ points to the global random number generator unless another one was supplied.
+    return exp_(*engine_);
 }
 
 // Method to return a normally distributed random variate. The parameters are
@@ -77,7 +97,7 @@ double RandomGenerator::normal(double mu, double sigma)
 {
 	boost::random::normal_distribution<>::param_type normal_params(mu, sigma);
 	normal_.param(normal_params);
-	return normal_(rng);
+	return normal_(*engine_);
 }
 
 // Over-loaded Method to return a random vector drawn from a multivariate normal distribution
@@ -97,7 +117,7 @@ arma::vec RandomGenerator::normal(arma::mat covar)
 	// Vector of random variate independently drawn from a standard normal
 	arma::vec z(covar.n_rows);
 	for (int i=0; i<z.n_elem; i++) {
-		z(i) = normal_(rng);
+		z(i) = normal_(*engine_);
 	}
 	
 	arma::vec x = R.t() * z;
@@ -114,7 +134,7 @@ double RandomGenerator::lognormal(double logmean, double frac_sigma)
 {
 	boost::random::lognormal_distribution<>::param_type lognormal_params(logmean, frac_sigma);
 	lognormal_.param(lognormal_params);
-	return lognormal_(rng);
+	return lognormal_(*engine_);
 }
 
 // Method to return a uniformaly distributed random variate between lowbound and upbound.
@@ -122,7 +142,7 @@ double RandomGenerator::uniform(double lowbound, double upbound)
 {
 	boost::random::uniform_real_distribution<>::param_type unif_params(lowbound, upbound);
 	uniform_.param(unif_params);
-	return uniform_(rng);
+	return uniform_(*engine_);
 }
 
 // Overloaded method to return a uniformaly distributed integer between lowbound and upbound.
@@ -130,7 +150,7 @@ int RandomGenerator::uniform(int lowbound, int upbound)
 {
 	boost::random::uniform_int_distribution<>::param_type unif_params(lowbound, upbound);
 	uniform_integer_.param(unif_params);
-	return uniform_integer_(rng);
+	return uniform_integer_(*engine_);
 }
 
 // Method to return a random variate drawn from a bounded power-law distribution. The
@@ -159,7 +179,7 @@ double RandomGenerator::tdist(double dof, double mean, double scale)
 {
 	boost::random::student_t_distribution<>::param_type t_param(dof);
 	tdist_.param(t_param);
-	double zdraw = tdist_(rng);
+	double zdraw = tdist_(*engine_);
 	return mean + scale * zdraw;
 }
 
@@ -169,7 +189,7 @@ double RandomGenerator::chisqr(int dof)
 {
 	boost::random::chi_squared_distribution<>::param_type chisqr_param(dof);
 	chisqr_.param(chisqr_param);
-	return chisqr_(rng);
+	return chisqr_(*engine_);
 }
 
 // Method to return a random variate drawn from a scaled inverse chi-square distribution. The
@@ -181,7 +201,7 @@ double RandomGenerator::scaled_inverse_chisqr(int dof, double ssqr)
 {
 	boost::random::chi_squared_distribution<>::param_type chisqr_param(dof);
 	chisqr_.param(chisqr_param);
-	double chi2 = chisqr_(rng);
+	double chi2 = chisqr_(*engine_);
     return ssqr / chi2 * ((double)(dof));
 }
 
@@ -194,7 +214,7 @@ double RandomGenerator::gamma(double alpha, double beta)
 {
 	boost::random::gamma_distribution<>::param_type gamma_params(alpha,beta);
 	gamma_.param(gamma_params);
-	return gamma_(rng);
+	return gamma_(*engine_);
 }
 
 // Method to return a random variate drawn from an inverse gamma distribution
@@ -206,7 +226,7 @@ double RandomGenerator::invgamma(double alpha, double beta)
 {
 	boost::random::gamma_distribution<>::param_type gamma_params(alpha, 1.0 / beta);
 	gamma_.param(gamma_params);
-	return 1.0 / gamma_(rng);
+	return 1.0 / gamma_(*engine_);
 }
 
 // Method to return a random vector drawn from a multivariate Student's t-distribution.
@@ -228,3 +248,76 @@ double RandomGenerator::weibull()
 {
 	return 0.0;
 }
+
+/* ****** Methods of RandomStreams class ********* */
+
+// Method to return the random number generator for a stream, creating it if it does not already exist.
+RandomGenerator& RandomStreams::Stream(unsigned int stream_id)
+{
+    std::map<unsigned int, RandomGenerator>::iterator it = generators_.find(stream_id);
+    if (it != generators_.end()) {
+        return it->second;
+    }
+    SeedStream(stream_id);
+    it = generators_.insert(std::make_pair(stream_id, RandomGenerator(engines_[stream_id]))).first;
+    return it->second;
+}
+
+// Method to seed a stream. The seed sequence is formed from the master seed and the stream identifier, so that
+// different streams are statistically independent.
+void RandomStreams::SeedStream(unsigned int stream_id)
+{
+    std::vector<boost::uint32_t> seed_values(3);
+    seed_values[0] = (boost::uint32_t)(seed_ & 0xffffffffUL);
+    seed_values[1] = (boost::uint32_t)((seed_ >> 16) >> 16);
+    seed_values[2] = stream_id;
+    boost::random::seed_seq seq(seed_values.begin(), seed_values.end());
+    engines_[stream_id].seed(seq);
+}
+
+// Method to reseed all of the streams from a new master seed.
+void RandomStreams::SetSeed(unsigned long seed)
+{
+    seed_ = seed;
+    for (std::map<unsigned int, boost::random::mt19937>::iterator it=engines_.begin(); it!=engines_.end(); ++it) {
+        SeedStream(it->first);
+    }
+}
+
+// Method to save the master seed and the state of every stream to a file. The default filename is "seeds.txt"
+void RandomStreams::SaveSeed(std::string seed_filename) const
+{
+    std::ofstream seed_file(seed_filename.c_str());
+	if (seed_file.is_open()) {
+        seed_file << seed_ << " " << engines_.size() << "\n";
+        std::map<unsigned int, boost::random::mt19937>::const_iterator it;
+        for (it=engines_.begin(); it!=engines_.end(); ++it) {
+            seed_file << it->first << " " << it->second << "\n";
+        }
+	} else {
+		std::cout << "Cannot write random number generator seeds to file "
+        << seed_filename << ".\n";
+	}
+	seed_file.close();
+}
+
+// Method to recover the master seed and the state of every stream from a file, creating any streams that do not
+// already exist. The default filename is "seeds.txt"
+void RandomStreams::RecoverSeed(std::string seed_filename)
+{
+	std::ifstream seed_file(seed_filename.c_str());
+	if (seed_file.is_open()) {
+        unsigned int nstreams;
+        seed_file >> seed_ >> nstreams;
+        for (int i=0; i<nstreams; i++) {
+            unsigned int stream_id;
+            seed_file >> stream_id;
+            Stream(stream_id);
+            seed_file >> engines_[stream_id];
+        }
+	} else {
+		std::cout << "Cannot read random number generator seeds from file "
+		<< seed_filename <<	".\n";
+	}
+	seed_file.close();
+}
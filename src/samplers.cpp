@@ -15,10 +15,10 @@
 #include "include/samplers.hpp"
 
 // Global random number generator object, instantiated in random.cpp
-extern boost::random::mt19937 rng;
+extern thread_local boost::random::mt19937 rng;
 
 // Object containing some common random number generators.
-extern RandomGenerator RandGen;
+extern thread_local RandomGenerator RandGen;
 
 // Add Step to Sampler stack.
 void Sampler::AddStep(Step* step) {
@@ -59,12 +59,6 @@ void Sampler::Run(arma::vec init) {
 	boost::timer timer;
 	current_iter_ = 0;
     
-    // Allocate memory for MCMC samples
-    for (std::set<std::string>::iterator it=tracked_names_.begin(); it!=tracked_names_.end(); ++it) {
-        std::string parameter_label = *it;
-        p_tracked_parameters_[parameter_label]->SetSampleSize(sample_size_);
-    }
-    
 	// Status of sampler...
 	std::cout << "Running sampler..." << std::endl;
 	std::cout << "Number of steps added: " << NumberOfSteps() << std::endl;
@@ -72,26 +66,14 @@ void Sampler::Run(arma::vec init) {
 			
 	// Setting starting value:
 	std::cout << "Setting starting values..." << std::endl;
-	int npar = static_cast<Parameter<arma::vec> *>(steps_[0].GetParPointer())->Value().n_elem;
-	bool useInit = (init.n_elem == npar);
-	if (useInit) 
-	   std::cout << " Using user-provided values" << std::endl;
-	else
-	   std::cout << " Drawn from priors" << std::endl;
-	   
-	for (unsigned int i = 0; i < steps_.size(); ++i) {
-	   Parameter<arma::vec> *par = static_cast<Parameter<arma::vec> *>(steps_[i].GetParPointer());
-	   if (useInit) 
-	      par->Save(par->SetStartingValue(init));
-	   else 
-	      par->Save(par->StartingValue());
-
-	   // Just print out first set of parameter values
-	   if (i == 0) {
-	      std::cout << " ...Initializing " << par->Value() << std::endl;
-	   }
-	}
+    SetStartingValues(init);
 	
+    // Allocate memory for MCMC samples, now that the parameters have values
+    for (std::set<std::string>::iterator it=tracked_names_.begin(); it!=tracked_names_.end(); ++it) {
+        std::string parameter_label = *it;
+        p_tracked_parameters_[parameter_label]->SetSampleSize(sample_size_);
+    }
+    
 	// Burn in
 	std::cout << "Burning in... (" << burnin_ << " iterations)" << std::endl;
 	Iterate(burnin_, true);
@@ -114,6 +96,30 @@ void Sampler::Run(arma::vec init) {
 	// std::cout << "Total elapsed time: " << timer.elapsed() << " seconds" << std::endl;
 }
 
+// Set the starting values of the parameters for each step.
+void Sampler::SetStartingValues(arma::vec init)
+{
+	int npar = static_cast<Parameter<arma::vec> *>(steps_[0].GetParPointer())->Value().n_elem;
+	bool useInit = (init.n_elem == npar);
+	if (useInit) 
+	   std::cout << " Using user-provided values" << std::endl;
+	else
+	   std::cout << " Drawn from priors" << std::endl;
+	   
+	for (unsigned int i = 0; i < steps_.size(); ++i) {
+	   Parameter<arma::vec> *par = static_cast<Parameter<arma::vec> *>(steps_[i].GetParPointer());
+	   if (useInit) 
+	      par->Save(par->SetStartingValue(init));
+	   else 
+	      par->Save(par->StartingValue());
+
+	   // Just print out first set of parameter values
+	   if (i == 0) {
+	      std::cout << " ...Initializing " << par->Value() << std::endl;
+	   }
+	}
+}
+
 // Method to save the current values of the parameters to a file.
 void Sampler::SaveValues()
 {
@@ -123,6 +129,117 @@ void Sampler::SaveValues()
     }
 }
 
+/* ****** Methods of TemperedSampler class ********* */
+
+// Stop the worker threads
+TemperedSampler::~TemperedSampler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        shutdown_ = true;
+    }
+    start_cond_.notify_all();
+    for (int i=0; i<workers_.size(); i++) {
+        workers_[i].join();
+    }
+}
+
+// Add a step for one of the tempered chains to the Sampler stack.
+void TemperedSampler::AddChainStep(Step* step, int stage)
+{
+    AddStep(step);
+    if (chain_steps_.size() <= stage) {
+        chain_steps_.resize(stage + 1);
+    }
+    chain_steps_[stage].push_back(steps_.size() - 1);
+}
+
+// Add a step that is done after the chain steps to the Sampler stack.
+void TemperedSampler::AddExchangeStep(Step* step)
+{
+    AddStep(step);
+    exchange_steps_.push_back(steps_.size() - 1);
+}
+
+// Perform the chain steps in the current stage. The chain steps are assigned to the threads in a round-robin fashion.
+void TemperedSampler::DoChainSteps(int thread_id)
+{
+    int nactive = workers_.size() + 1;
+    std::vector<int>& stage_steps = chain_steps_[current_stage_];
+    for (int i=thread_id; i<stage_steps.size(); i+=nactive) {
+        steps_[stage_steps[i]].DoStep();
+    }
+}
+
+// Wait until signaled to perform an iteration, then do the chain steps assigned to this thread.
+void TemperedSampler::WorkerLoop(int thread_id)
+{
+    unsigned long generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_cond_.wait(lock, [&]{ return shutdown_ || (generation_ != generation); });
+            if (shutdown_) {
+                return;
+            }
+            generation = generation_;
+        }
+        DoChainSteps(thread_id);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nbusy_--;
+            if (nbusy_ == 0) {
+                done_cond_.notify_one();
+            }
+        }
+    }
+}
+
+// Run sampler for a specific number of iterations. The calling thread does its share of the chain steps in each stage,
+// and then performs the exchange steps once the other threads have finished the last stage.
+void TemperedSampler::Iterate(int number_of_iterations, bool progress)
+{
+    int max_stage_size = 0;
+    for (int stage = 0; stage < chain_steps_.size(); ++stage) {
+        max_stage_size = std::max(max_stage_size, (int)chain_steps_[stage].size());
+    }
+    int nworkers = std::min(nthreads_, max_stage_size) - 1;
+    while (workers_.size() < nworkers) {
+        workers_.push_back(std::thread(&TemperedSampler::WorkerLoop, this, workers_.size() + 1));
+    }
+    
+    boost::progress_display* show_progress = NULL;
+    if (progress) {
+        show_progress = new boost::progress_display(number_of_iterations);
+    }
+    for (int iter = 0; iter < number_of_iterations; ++iter) {
+        for (int stage = 0; stage < chain_steps_.size(); ++stage) {
+            if (chain_steps_[stage].empty()) {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                current_stage_ = stage;
+                nbusy_ = workers_.size();
+                generation_++;
+            }
+            start_cond_.notify_all();
+            DoChainSteps(0);
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                done_cond_.wait(lock, [&]{ return nbusy_ == 0; });
+            }
+        }
+        for (int i = 0; i < exchange_steps_.size(); ++i) {
+            steps_[exchange_steps_[i]].DoStep();
+        }
+        if (progress) {
+            ++(*show_progress);
+        }
+    }
+    delete show_progress;
+}
+
 // Function to return the working directory (the directory that the executable
 // was called from). Returns a string object.
 std::string get_initial_directory()
@@ -29,6 +29,12 @@ if system_name == 'Darwin':
     compiler_args.append("-stdlib=libc++")
 else:
     compiler_args.append("-std=c++0x")
+    compiler_args.append("-pthread")
+
+# the parallel tempering sampler uses std::thread, which needs pthreads on Linux
+thread_libraries = []
+if system_name != 'Darwin':
+    thread_libraries.append("pthread")
 
 if os.path.exists(os.path.join(BOOST_DIR, "lib", "libboost_filesystem-mt.dylib")):
     boost_suffix = "-mt"
@@ -50,7 +56,7 @@ def configuration(parent_package='', top_path=None):
         include_dirs=include_dirs,
         library_dirs=library_dirs,
         libraries=["boost_python{}{}".format(BOOST_PYTHON_SUFFIX, boost_suffix), "boost_filesystem%s"%boost_suffix, "boost_system%s"%boost_suffix, 
-                   "armadillo"],
+                   "armadillo"] + thread_libraries,
         extra_compiler_args=compiler_args
     )
     config.add_extension(
@@ -59,7 +65,7 @@ def configuration(parent_package='', top_path=None):
         include_dirs=include_dirs,
         library_dirs=library_dirs,
         libraries=["boost_python{}{}".format(BOOST_PYTHON_SUFFIX, boost_suffix), "boost_filesystem%s"%boost_suffix, "boost_system%s"%boost_suffix, 
-                   "armadillo", "carmcmc"],
+                   "armadillo", "carmcmc"] + thread_libraries,
         extra_compile_args=compiler_args
     )
     config.add_data_dir(("../../../../include", "include"))
@@ -11,10 +11,10 @@
 #include "include/steps.hpp"
 
 // Global random number generator object, instantiated in random.cpp
-extern boost::random::mt19937 rng;
+extern thread_local boost::random::mt19937 rng;
 
 // Object containing some common random number generators.
-RandomGenerator RandGen;
+thread_local RandomGenerator RandGen;
 
 /* ****** Methods of AdaptiveMetro class ********* */
 
@@ -29,6 +29,7 @@ target_rate_(target_rate), maxiter_(maxiter)
 	gamma_ = 2.0 / 3.0;
 	niter_ = 0;
 	naccept_ = 0;
+    bounded_ = false;
 	chol_factor_ = arma::chol(proposal_covar);
 }
 
@@ -36,6 +37,25 @@ target_rate_(target_rate), maxiter_(maxiter)
 bool AdaptiveMetro::Accept(arma::vec new_value, arma::vec old_value) {
 	
 	// MH accept/reject criteria: Proposal must be symmetric!!
+    if (bounded_ && (niter_ >= maxiter_)) {
+        // Draw the uniform first, and reject if the log-posterior of the proposal is below the threshold
+        double unif = Generator().uniform();
+        double logdens_min = log(unif) * parameter_.GetTemperature() + parameter_.GetLogDensity();
+        double logdens_new = parameter_.BoundedLogDensity(new_value, logdens_min);
+        alpha_ = (logdens_new - parameter_.GetLogDensity()) / parameter_.GetTemperature();
+        if (!arma::is_finite(alpha_)) {
+            alpha_ = 0.0;
+            return false;
+        }
+        alpha_ = std::min(exp(alpha_), 1.0);
+        if (logdens_new >= logdens_min) {
+            naccept_++;
+            return true;
+        } else {
+            return false;
+        }
+    }
+    
 	alpha_ = (parameter_.LogDensity(new_value) - parameter_.GetLogDensity()) / parameter_.GetTemperature();
     
 	if (!arma::is_finite(alpha_)) {
@@ -45,7 +65,7 @@ bool AdaptiveMetro::Accept(arma::vec new_value, arma::vec old_value) {
 		return false;
 	}
 	
-	double unif = uniform_(rng);
+	double unif = Generator().uniform();
 	alpha_ = std::min(exp(alpha_), 1.0);
 	if (unif < alpha_) {
 		naccept_++;
@@ -106,6 +126,268 @@ void AdaptiveMetro::DoStep()
 	}
 }
 
+/* ****** Methods of NUTS class ********* */
+
+// Constructor, requires a parameter object, an initial guess for the covariance matrix of the parameter, the number
+// of iterations to adapt the step size and metric for, the target average acceptance probability, and the maximum
+// depth of the trajectory tree.
+NUTS::NUTS(Parameter<arma::vec>& parameter, arma::mat covar, int maxiter, double target_rate, int max_depth) :
+parameter_(parameter), target_rate_(target_rate), max_depth_(max_depth), maxiter_(maxiter)
+{
+    metric_chol_ = arma::chol(covar).t();
+    step_size_ = 1.0;
+    niter_ = 0;
+    accept_sum_ = 0.0;
+    nleapfrog_ = 0;
+    RestartStepSize();
+    
+    // The covariance matrix is estimated in windows that double in length, after an initial buffer where only the
+    // step size is tuned, and before a final buffer where the step size is tuned for the final metric. These are the
+    // default buffer and window lengths used by Stan, shrunk in proportion for short adaptation periods.
+    int init_buffer = 75;
+    int term_buffer = 50;
+    int base_window = 25;
+    if (maxiter < init_buffer + term_buffer + base_window) {
+        init_buffer = (int)(0.15 * maxiter);
+        term_buffer = (int)(0.1 * maxiter);
+        base_window = maxiter - init_buffer - term_buffer;
+    }
+    window_start_ = init_buffer;
+    window_end_ = init_buffer + base_window - 1;
+    window_stop_ = maxiter - term_buffer;
+    nwindow_ = 0;
+}
+
+// Method to compute the tempered log-density and its gradient with respect to the whitened coordinates z, where
+// theta = metric_chol_ * z
+void NUTS::Evaluate(PhasePoint& point)
+{
+    arma::vec grad;
+    double temperature = parameter_.GetTemperature();
+    point.logdens = parameter_.LogDensityGradient(point.theta, grad) / temperature;
+    point.grad = metric_chol_.t() * grad / temperature;
+}
+
+// Method to take one leapfrog step. The gradient at the starting point must already be stored in the point.
+void NUTS::Leapfrog(PhasePoint& point, double step_size)
+{
+    point.momentum += 0.5 * step_size * point.grad;
+    point.theta += step_size * (metric_chol_ * point.momentum);
+    Evaluate(point);
+    point.momentum += 0.5 * step_size * point.grad;
+}
+
+// Method to check whether the trajectory has started to turn back on itself, measured in the whitened coordinates
+bool NUTS::IsUTurn(PhasePoint& minus, PhasePoint& plus)
+{
+    arma::vec dz = arma::solve(arma::trimatl(metric_chol_), plus.theta - minus.theta);
+    return (arma::dot(dz, minus.momentum) < 0.0) || (arma::dot(dz, plus.momentum) < 0.0);
+}
+
+// Method to recursively build a subtree of 2^depth leapfrog steps, following Algorithm 6 of Hoffman & Gelman (2014)
+void NUTS::BuildTree(PhasePoint& point, double log_slice, int direction, int depth, double step_size,
+                     double joint0, Subtree& tree)
+{
+    if (depth == 0) {
+        // Base case: take one leapfrog step in the direction of the trajectory
+        PhasePoint next = point;
+        Leapfrog(next, direction * step_size);
+        double joint = next.logdens - 0.5 * arma::dot(next.momentum, next.momentum);
+        tree.minus = next;
+        tree.plus = next;
+        tree.proposal = next;
+        tree.nvalid = (log_slice <= joint) ? 1 : 0;
+        // Stop if the error in the Hamiltonian is huge, since the leapfrog integrator has diverged
+        tree.keep_going = (log_slice < joint + 1000.0);
+        tree.accept_sum = arma::is_finite(joint) ? std::min(1.0, exp(joint - joint0)) : 0.0;
+        tree.nsteps = 1;
+        return;
+    }
+    
+    // Build the first half of the subtree, and then the second half from its outermost point
+    BuildTree(point, log_slice, direction, depth - 1, step_size, joint0, tree);
+    if (!tree.keep_going) {
+        return;
+    }
+    Subtree outer;
+    if (direction == -1) {
+        BuildTree(tree.minus, log_slice, direction, depth - 1, step_size, joint0, outer);
+        tree.minus = outer.minus;
+    } else {
+        BuildTree(tree.plus, log_slice, direction, depth - 1, step_size, joint0, outer);
+        tree.plus = outer.plus;
+    }
+    if ((outer.nvalid > 0) &&
+        (Generator().uniform() < ((double)(outer.nvalid)) / (tree.nvalid + outer.nvalid))) {
+        tree.proposal = outer.proposal;
+    }
+    tree.nvalid += outer.nvalid;
+    tree.accept_sum += outer.accept_sum;
+    tree.nsteps += outer.nsteps;
+    tree.keep_going = outer.keep_going && !IsUTurn(tree.minus, tree.plus);
+}
+
+// Method to find a step size for which the acceptance probability of a single leapfrog step is about 1/2, by doubling
+// or halving the current step size
+double NUTS::FindStepSize(arma::vec theta)
+{
+    PhasePoint point;
+    point.theta = theta;
+    Evaluate(point);
+    point.momentum.set_size(theta.n_elem);
+    for (int i=0; i<theta.n_elem; i++) {
+        point.momentum(i) = Generator().normal();
+    }
+    double joint0 = point.logdens - 0.5 * arma::dot(point.momentum, point.momentum);
+    
+    double step_size = step_size_;
+    int direction = 0;
+    for (int k=0; k<100; k++) {
+        PhasePoint trial = point;
+        Leapfrog(trial, step_size);
+        double log_ratio = trial.logdens - 0.5 * arma::dot(trial.momentum, trial.momentum) - joint0;
+        if (k == 0) {
+            direction = (log_ratio > log(0.5)) ? 1 : -1;
+        }
+        if (!(direction * log_ratio > -direction * log(2.0))) {
+            break;
+        }
+        step_size *= pow(2.0, direction);
+    }
+    
+    return step_size;
+}
+
+// Method to restart the dual averaging of the log step size, shrinking it towards ten times the current step size
+void NUTS::RestartStepSize()
+{
+    log_step_center_ = log(10.0 * step_size_);
+    log_step_bar_ = 0.0;
+    hbar_ = 0.0;
+    nadapt_ = 0;
+}
+
+// Method to perform the NUTS step. This involves drawing a new momentum, building the trajectory, and drawing the new
+// parameter value from it, followed by an update to the step size and the metric so long as niter < maxiter.
+void NUTS::DoStep()
+{
+    if (niter_ == 0) {
+        step_size_ = FindStepSize(parameter_.Value());
+        RestartStepSize();
+    }
+    
+    PhasePoint current;
+    current.theta = parameter_.Value();
+    Evaluate(current);
+    current.momentum.set_size(current.theta.n_elem);
+    for (int i=0; i<current.theta.n_elem; i++) {
+        current.momentum(i) = Generator().normal();
+    }
+    double joint0 = current.logdens - 0.5 * arma::dot(current.momentum, current.momentum);
+    // log of the slice variable, drawn uniformly between zero and exp(joint0)
+    double log_slice = joint0 + log(Generator().uniform());
+    
+    Subtree trajectory;
+    trajectory.minus = current;
+    trajectory.plus = current;
+    trajectory.proposal = current;
+    trajectory.nvalid = 1;
+    trajectory.keep_going = true;
+    trajectory.accept_sum = 0.0;
+    trajectory.nsteps = 0;
+    for (int depth=0; (depth<max_depth_) && trajectory.keep_going; depth++) {
+        // Double the length of the trajectory in a random direction
+        int direction = (Generator().uniform() < 0.5) ? -1 : 1;
+        Subtree subtree;
+        if (direction == -1) {
+            BuildTree(trajectory.minus, log_slice, direction, depth, step_size_, joint0, subtree);
+            trajectory.minus = subtree.minus;
+        } else {
+            BuildTree(trajectory.plus, log_slice, direction, depth, step_size_, joint0, subtree);
+            trajectory.plus = subtree.plus;
+        }
+        if (subtree.keep_going &&
+            (Generator().uniform() < ((double)(subtree.nvalid)) / trajectory.nvalid)) {
+            trajectory.proposal = subtree.proposal;
+        }
+        trajectory.nvalid += subtree.nvalid;
+        trajectory.accept_sum += subtree.accept_sum;
+        trajectory.nsteps += subtree.nsteps;
+        trajectory.keep_going = subtree.keep_going && !IsUTurn(trajectory.minus, trajectory.plus);
+    }
+    
+    if (arma::any(trajectory.proposal.theta != current.theta)) {
+        // the log-posterior of the proposal was computed when the trajectory was built, so don't run the Kalman
+        // filter over the data again to save it
+        parameter_.SetValue(trajectory.proposal.theta, trajectory.proposal.logdens * parameter_.GetTemperature());
+    }
+    double accept_rate = trajectory.accept_sum / trajectory.nsteps;
+    
+    if (niter_ < maxiter_) {
+        // Still in the adaptive stage, so update the step size by dual averaging
+        const double t0 = 10.0;
+        const double gamma = 0.05;
+        const double kappa = 0.75;
+        nadapt_++;
+        double eta = 1.0 / (nadapt_ + t0);
+        hbar_ = (1.0 - eta) * hbar_ + eta * (target_rate_ - accept_rate);
+        double log_step = log_step_center_ - sqrt((double)nadapt_) / gamma * hbar_;
+        double weight = pow((double)nadapt_, -kappa);
+        log_step_bar_ = weight * log_step + (1.0 - weight) * log_step_bar_;
+        step_size_ = exp(log_step);
+        
+        // Accumulate the mean and scatter matrix of the parameter for the metric
+        if ((niter_ >= window_start_) && (niter_ <= window_end_) && (window_end_ < window_stop_)) {
+            arma::vec theta = parameter_.Value();
+            if (niter_ == window_start_) {
+                nwindow_ = 0;
+                window_mean_.zeros(theta.n_elem);
+                window_scatter_.zeros(theta.n_elem, theta.n_elem);
+            }
+            nwindow_++;
+            arma::vec delta = theta - window_mean_;
+            window_mean_ += delta / nwindow_;
+            window_scatter_ += delta * (theta - window_mean_).t();
+            
+            if (niter_ == window_end_) {
+                // End of the window, so update the metric, regularizing the covariance matrix towards a small
+                // multiple of the identity matrix
+                double n = nwindow_;
+                arma::mat covar = (n / (n + 5.0)) * window_scatter_ / (n - 1.0) +
+                    1e-3 * (5.0 / (n + 5.0)) * arma::eye(theta.n_elem, theta.n_elem);
+                arma::mat chol_upper;
+                if ((nwindow_ > 1) && arma::chol(chol_upper, covar)) {
+                    metric_chol_ = chol_upper.t();
+                }
+                step_size_ = FindStepSize(theta);
+                RestartStepSize();
+                
+                // The next window is twice as long, and is stretched to the final buffer if there is not enough
+                // room for the window after it
+                int window_size = 2 * (window_end_ - window_start_ + 1);
+                window_start_ = window_end_ + 1;
+                window_end_ = window_start_ + window_size - 1;
+                if (window_start_ + 3 * window_size > window_stop_) {
+                    window_end_ = window_stop_ - 1;
+                }
+            }
+        }
+        if (niter_ == maxiter_ - 1) {
+            // Adaptation is finished, so use the averaged step size from now on
+            step_size_ = exp(log_step_bar_);
+        }
+    }
+    
+	niter_++;
+    accept_sum_ += accept_rate;
+    nleapfrog_ += trajectory.nsteps;
+	
+	if (niter_ == maxiter_) {
+		std::cout << "Average NUTS Acceptance Probability is " << GetAcceptRate() << " with a step size of "
+            << step_size_ << std::endl;
+	}
+}
+
 // Function to perform the rank-1 Cholesky update, needed for updating the
 // proposal covariance matrix
 void CholUpdateR1(arma::mat& L, arma::vec& v, bool downdate)
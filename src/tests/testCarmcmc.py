@@ -99,6 +99,26 @@ class TestCarpackOrder(unittest.TestCase):
         # OK, this is where I truly test that sampler is of class CARp and not CAR1
         self.assertAlmostEqual(ploglikes[0], loglike0)
 
+    def testPhysicalParameters(self, pModel=3, qModel=1):
+        sampler = carmcmc.run_mcmc_carma(self.nSample, self.nBurnin,
+                                         self.xdata, self.ydata, self.dydata,
+                                         pModel, qModel, self.nWalkers, False, self.nThin)
+        psampler = carmcmc.CarmaSample(np.array(self.xdata), np.array(self.ydata), np.array(self.dydata), sampler,
+                                       q=qModel)
+        nsamples = len(sampler.GetLogLikes())
+        sigma = psampler._samples['sigma']
+        self.assertEqual(sigma.shape, (nsamples, 1))
+        self.assertEqual(psampler._samples['ar_roots'].shape, (nsamples, pModel))
+        self.assertEqual(psampler._samples['ma_coefs'].shape, (nsamples, qModel + 1))
+
+        # compare with sigma computed from the variance of a CARMA process with unit driving noise, as the python code
+        # did before the transform was done in C++
+        for i in range(nsamples):
+            unit_var = carmcmc.carma_variance(1.0, psampler._samples['ar_roots'][i],
+                                              psampler._samples['ma_coefs'][i])
+            sigma_i = np.sqrt(psampler._samples['var'][i, 0] / unit_var.real)
+            self.assertAlmostEqual(sigma[i, 0] / sigma_i, 1.0)
+
     def testKalman1(self):
         sigma = 1.0
         omega = 1.0
@@ -163,6 +183,15 @@ class TestCarpackOrder(unittest.TestCase):
         carmapqe = carmcmc.CarmaModel(xv, yv, dyv, pModel+1, qModel)
         postpqe = carmapqe.run_mcmc(nSample, nburnin=nBurnin, nthin=nThin)
 
+        # the ensemble walkers are interleaved in the samples, and the diagnostics are computed per walker
+        poste = carmap.run_mcmc(nSample, nburnin=nBurnin, nthin=nThin, sampler='ensemble')
+        self.assertEqual(poste.nwalkers, 4 * (pModel + 3))
+        self.assertEqual(poste.get_samples("mu").shape[0], nSample * poste.nwalkers)
+        self.assertEqual(poste.effective_samples("ar_roots").size, pModel)
+        # too few walkers are rounded up by the C++ sampler to an even number of at least two per parameter
+        poste = carmap.run_mcmc(nSample, nburnin=nBurnin, nthin=nThin, sampler='ensemble', nwalkers=5)
+        self.assertEqual(poste.nwalkers, 2 * (pModel + 3))
+
         # cpp_tests of yamcmcpp samplers.py
         
         post1.effective_samples("sigma")